@@ -0,0 +1,245 @@
+/** @file
+  Touchpad of the controller as EFI_ABSOLUTE_POINTER_PROTOCOL.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "AbsolutePointer.h"
+
+/**
+  Reset the pointer device.
+
+  @param  This                  The EFI_ABSOLUTE_POINTER_PROTOCOL instance.
+  @param  ExtendedVerification  Ignored, there is no separate pointer hardware to test.
+
+  @retval EFI_SUCCESS           The device was reset.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+AbsolutePointerReset (
+  IN EFI_ABSOLUTE_POINTER_PROTOCOL  *This,
+  IN BOOLEAN                        ExtendedVerification
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+  EFI_TPL     OldTpl;
+
+  UsbKeyboardDevice = POINTER_USB_KB_DEV_FROM_THIS (This);
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  ZeroMem (&UsbKeyboardDevice->Pointer.State, sizeof (UsbKeyboardDevice->Pointer.State));
+  UsbKeyboardDevice->Pointer.StateChanged = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Retrieve the current state of the pointer device.
+
+  @param  This                  The EFI_ABSOLUTE_POINTER_PROTOCOL instance.
+  @param  State                 Receives the state.
+
+  @retval EFI_SUCCESS           The state was returned.
+  @retval EFI_NOT_READY         The state did not change since the last call.
+  @retval EFI_INVALID_PARAMETER State is NULL.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+AbsolutePointerGetState (
+  IN     EFI_ABSOLUTE_POINTER_PROTOCOL  *This,
+  OUT    EFI_ABSOLUTE_POINTER_STATE     *State
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+
+  if (State == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  UsbKeyboardDevice = POINTER_USB_KB_DEV_FROM_THIS (This);
+
+  //
+  // The state is written by KeyboardHandler() at TPL_NOTIFY.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (UsbKeyboardDevice->Pointer.StateChanged) {
+    CopyMem (State, &UsbKeyboardDevice->Pointer.State, sizeof (*State));
+    UsbKeyboardDevice->Pointer.StateChanged = FALSE;
+    Status                                  = EFI_SUCCESS;
+  } else {
+    Status = EFI_NOT_READY;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+  Event notification function for EFI_ABSOLUTE_POINTER_PROTOCOL.WaitForInput.
+
+  @param  Event        Event to be signaled when the state changed.
+  @param  Context      Points to USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+EFIAPI
+AbsolutePointerWaitForInput (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+
+  if (UsbKeyboardDevice->Pointer.StateChanged) {
+    gBS->SignalEvent (Event);
+  }
+}
+
+/**
+  Install EFI_ABSOLUTE_POINTER_PROTOCOL on the controller if its backend has a
+  touchpad.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The protocol is installed, or there is no touchpad.
+  @retval Others                The protocol could not be installed.
+
+**/
+EFI_STATUS
+AbsolutePointerInstall (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS      Status;
+  USB_KB_POINTER  *Pointer;
+
+  if (UsbKeyboardDevice->Backend->TouchpadMaxX == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Pointer = &UsbKeyboardDevice->Pointer;
+
+  Pointer->Mode.AbsoluteMaxX = UsbKeyboardDevice->Backend->TouchpadMaxX;
+  Pointer->Mode.AbsoluteMaxY = UsbKeyboardDevice->Backend->TouchpadMaxY;
+
+  Pointer->Protocol.Reset    = AbsolutePointerReset;
+  Pointer->Protocol.GetState = AbsolutePointerGetState;
+  Pointer->Protocol.Mode     = &Pointer->Mode;
+
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_WAIT,
+                  TPL_NOTIFY,
+                  AbsolutePointerWaitForInput,
+                  UsbKeyboardDevice,
+                  &Pointer->Protocol.WaitForInput
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &UsbKeyboardDevice->ControllerHandle,
+                  &gEfiAbsolutePointerProtocolGuid,
+                  &Pointer->Protocol,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->CloseEvent (Pointer->Protocol.WaitForInput);
+    Pointer->Protocol.WaitForInput = NULL;
+    return Status;
+  }
+
+  Pointer->Installed = TRUE;
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Uninstall EFI_ABSOLUTE_POINTER_PROTOCOL if it was installed.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+AbsolutePointerUninstall (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_POINTER  *Pointer;
+
+  Pointer = &UsbKeyboardDevice->Pointer;
+  if (!Pointer->Installed) {
+    return;
+  }
+
+  gBS->UninstallMultipleProtocolInterfaces (
+         UsbKeyboardDevice->ControllerHandle,
+         &gEfiAbsolutePointerProtocolGuid,
+         &Pointer->Protocol,
+         NULL
+         );
+  gBS->CloseEvent (Pointer->Protocol.WaitForInput);
+
+  Pointer->Protocol.WaitForInput = NULL;
+  Pointer->Installed             = FALSE;
+}
+
+/**
+  Update the pointer state from a touchpad report.
+
+  The position follows the contact while there is one. The touchpad click is
+  reported as EFI_ABSP_TouchActive.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Contact               TRUE if a finger is on the touchpad.
+  @param  X                     X coordinate of the contact.
+  @param  Y                     Y coordinate of the contact.
+  @param  Click                 TRUE if the touchpad is clicked.
+
+**/
+VOID
+AbsolutePointerReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     BOOLEAN     Contact,
+  IN     UINT16      X,
+  IN     UINT16      Y,
+  IN     BOOLEAN     Click
+  )
+{
+  EFI_ABSOLUTE_POINTER_STATE  *State;
+  UINT32                      ActiveButtons;
+
+  State         = &UsbKeyboardDevice->Pointer.State;
+  ActiveButtons = Click ? EFI_ABSP_TouchActive : 0;
+
+  if (Contact) {
+    X = (UINT16)MIN (X, UsbKeyboardDevice->Pointer.Mode.AbsoluteMaxX);
+    Y = (UINT16)MIN (Y, UsbKeyboardDevice->Pointer.Mode.AbsoluteMaxY);
+  } else {
+    X = (UINT16)State->CurrentX;
+    Y = (UINT16)State->CurrentY;
+  }
+
+  if ((State->CurrentX == X) && (State->CurrentY == Y) && (State->ActiveButtons == ActiveButtons)) {
+    return;
+  }
+
+  State->CurrentX                         = X;
+  State->CurrentY                         = Y;
+  State->ActiveButtons                    = ActiveButtons;
+  UsbKeyboardDevice->Pointer.StateChanged = TRUE;
+}
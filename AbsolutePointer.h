@@ -0,0 +1,62 @@
+/** @file
+  Touchpad of the controller as EFI_ABSOLUTE_POINTER_PROTOCOL.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_ABSOLUTE_POINTER_H_
+#define _USB_KB_ABSOLUTE_POINTER_H_
+
+#include "EfiKey.h"
+
+/**
+  Install EFI_ABSOLUTE_POINTER_PROTOCOL on the controller if its backend has a
+  touchpad.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The protocol is installed, or there is no touchpad.
+  @retval Others                The protocol could not be installed.
+
+**/
+EFI_STATUS
+AbsolutePointerInstall (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Uninstall EFI_ABSOLUTE_POINTER_PROTOCOL if it was installed.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+AbsolutePointerUninstall (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Update the pointer state from a touchpad report.
+
+  The position follows the contact while there is one. The touchpad click is
+  reported as EFI_ABSP_TouchActive.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Contact               TRUE if a finger is on the touchpad.
+  @param  X                     X coordinate of the contact.
+  @param  Y                     Y coordinate of the contact.
+  @param  Click                 TRUE if the touchpad is clicked.
+
+**/
+VOID
+AbsolutePointerReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     BOOLEAN     Contact,
+  IN     UINT16      X,
+  IN     UINT16      Y,
+  IN     BOOLEAN     Click
+  );
+
+#endif
@@ -0,0 +1,308 @@
+/** @file
+  Xbox 360 Chatpad support of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Chatpad.h"
+#include "Output.h"
+
+//
+// USB keycodes of the Chatpad keys. A Chatpad key code has the row in its
+// high nibble and the column, 0 to 7, in its low nibble.
+//
+STATIC CONST UINT8  mChatpadKeyCode[8][8] = {
+  { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // 0x00
+  { 0x00, 0x24, 0x23, 0x22, 0x21, 0x20, 0x1F, 0x1E },  // 0x10: 7 6 5 4 3 2 1
+  { 0x00, 0x18, 0x1C, 0x17, 0x15, 0x08, 0x1A, 0x14 },  // 0x20: U Y T R E W Q
+  { 0x00, 0x0D, 0x0B, 0x0A, 0x09, 0x07, 0x16, 0x04 },  // 0x30: J H G F D S A
+  { 0x00, 0x11, 0x05, 0x19, 0x06, 0x1B, 0x1D, 0x00 },  // 0x40: N B V C X Z
+  { 0x00, 0x4F, 0x10, 0x37, 0x2C, 0x50, 0x00, 0x00 },  // 0x50: Right M . Space Left
+  { 0x00, 0x00, 0x36, 0x28, 0x13, 0x27, 0x26, 0x25 },  // 0x60: , Enter P 0 9 8
+  { 0x00, 0x2A, 0x0F, 0x00, 0x00, 0x12, 0x0C, 0x0E },  // 0x70: Backspace L O I K
+};
+
+//
+// USB keycodes of the modifier bits, CHATPAD_MODIFIER_SHIFT first
+//
+STATIC CONST UINT8  mChatpadModifierKeyCode[4] = {
+  0xE1,  // Shift  -> Left Shift
+  0xE6,  // Green  -> Right Alt
+  0xE4,  // Orange -> Right Control
+  0xE0   // People -> Left Control, the key queue keeps no GUI state
+};
+
+//
+// Initialization sequence. The Chatpad answers the vendor requests 0xA9 with
+// no data; request 0xA1 reads or writes two bytes.
+//
+STATIC CONST EFI_USB_DEVICE_REQUEST  mChatpadInitRequest[] = {
+  { 0x40, 0xA9, 0xA30C, 0x4423, 0 },
+  { 0x40, 0xA9, 0x2344, 0x7F03, 0 },
+  { 0x40, 0xA9, 0x5839, 0x6832, 0 },
+  { 0xC0, 0xA1, 0x0000, 0xE416, 2 },
+  { 0x40, 0xA1, 0x0000, 0xE416, 2 },
+  { 0xC0, 0xA1, 0x0000, 0xE416, 2 }
+};
+
+/**
+  Translate a Chatpad key code into a USB keycode.
+
+  @param  Code      The Chatpad key code.
+
+  @return The USB keycode, or 0 if Code is not a known key.
+
+**/
+STATIC
+UINT8
+ChatpadToUsbKeyCode (
+  IN UINT8  Code
+  )
+{
+  if ((Code >= 0x80) || ((Code & 0x08) != 0)) {
+    return 0;
+  }
+
+  return mChatpadKeyCode[Code >> 4][Code & 0x07];
+}
+
+/**
+  Queue the transition of a Chatpad key, if the key is known.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Code                  The Chatpad key code.
+  @param  IsPressed             TRUE if the key went down.
+
+**/
+STATIC
+VOID
+ChatpadQueueKey (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINT8       Code,
+  IN BOOLEAN     IsPressed
+  )
+{
+  UINT8  KeyCode;
+
+  KeyCode = ChatpadToUsbKeyCode (Code);
+  if (KeyCode == 0) {
+    return;
+  }
+
+  USBKBD_TRACE (USBKBD_TRACE_DIFF, "UsbXbox360: chatpad 0x%lx -> keycode 0x%lx %lu\n", Code, KeyCode, IsPressed);
+
+  QueueButtonTransition (UsbKeyboardDevice, KeyCode, IsPressed);
+}
+
+/**
+  Decode a Chatpad packet received by KeyboardHandler().
+
+  Key packets are turned into USB keycode transitions in UsbKeyQueue. A status
+  packet asking for initialization schedules it on the service timer.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+  @retval TRUE                  Report was a Chatpad packet and is consumed.
+  @retval FALSE                 Report is not a Chatpad packet.
+
+**/
+BOOLEAN
+ChatpadHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  USB_KB_CHATPAD  *Chatpad;
+  UINT8           Modifiers;
+  UINT8           Changed;
+  UINTN           Index;
+  UINT8           Code;
+
+  Chatpad = &UsbKeyboardDevice->Chatpad;
+
+  if (ReportLength < 4) {
+    return FALSE;
+  }
+
+  if (Report[0] == CHATPAD_PACKET_STATUS) {
+    if (Report[1] == CHATPAD_STATUS_REINIT) {
+      Chatpad->ReinitRequested = TRUE;
+    }
+
+    return TRUE;
+  }
+
+  //
+  // Controller input reports share the packet type, but carry their length in byte 1.
+  //
+  if ((Report[0] != CHATPAD_PACKET_KEYS) || (Report[1] == XBOX360_INPUT_REPORT_LENGTH)) {
+    return FALSE;
+  }
+
+  Modifiers = Report[1] & (CHATPAD_MODIFIER_SHIFT | CHATPAD_MODIFIER_GREEN | CHATPAD_MODIFIER_ORANGE | CHATPAD_MODIFIER_PEOPLE);
+  Changed   = Modifiers ^ Chatpad->Modifiers;
+  for (Index = 0; Index < ARRAY_SIZE (mChatpadModifierKeyCode); Index++) {
+    if ((Changed & (1 << Index)) != 0) {
+      QueueButtonTransition (UsbKeyboardDevice, mChatpadModifierKeyCode[Index], (BOOLEAN)((Modifiers & (1 << Index)) != 0));
+    }
+  }
+
+  //
+  // Up to two keys are reported. Release the keys that are gone, then press the new ones.
+  //
+  for (Index = 0; Index < ARRAY_SIZE (Chatpad->Keys); Index++) {
+    Code = Chatpad->Keys[Index];
+    if ((Code != 0) && (Code != Report[2]) && (Code != Report[3])) {
+      ChatpadQueueKey (UsbKeyboardDevice, Code, FALSE);
+    }
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (Chatpad->Keys); Index++) {
+    Code = Report[2 + Index];
+    if ((Code != 0) && (Code != Chatpad->Keys[0]) && (Code != Chatpad->Keys[1])) {
+      ChatpadQueueKey (UsbKeyboardDevice, Code, TRUE);
+    }
+  }
+
+  Chatpad->Modifiers = Modifiers;
+  Chatpad->Keys[0]   = Report[2];
+  Chatpad->Keys[1]   = Report[3];
+
+  return TRUE;
+}
+
+/**
+  Send a control transfer to the Chatpad.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Request               The device request.
+  @param  Data                  The data stage buffer, Request->Length bytes.
+
+  @return The status of the control transfer.
+
+**/
+STATIC
+EFI_STATUS
+ChatpadControl (
+  IN     USB_KB_DEV              *UsbKeyboardDevice,
+  IN     EFI_USB_DEVICE_REQUEST  *Request,
+  IN OUT VOID                    *Data
+  )
+{
+  EFI_USB_DATA_DIRECTION  Direction;
+  UINT32                  UsbStatus;
+
+  if (Request->Length == 0) {
+    Direction = EfiUsbNoData;
+    Data      = NULL;
+  } else if ((Request->RequestType & USB_ENDPOINT_DIR_IN) != 0) {
+    Direction = EfiUsbDataIn;
+  } else {
+    Direction = EfiUsbDataOut;
+  }
+
+  return UsbKeyboardDevice->UsbIo->UsbControlTransfer (
+                                     UsbKeyboardDevice->UsbIo,
+                                     Request,
+                                     Direction,
+                                     CHATPAD_CONTROL_TIMEOUT,
+                                     Data,
+                                     Request->Length,
+                                     &UsbStatus
+                                     );
+}
+
+/**
+  Send the next transfer of the initialization sequence of the Chatpad.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+ChatpadInitStep (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_CHATPAD          *Chatpad;
+  EFI_STATUS              Status;
+  EFI_USB_DEVICE_REQUEST  Request;
+  UINT8                   Data[2];
+
+  Chatpad = &UsbKeyboardDevice->Chatpad;
+
+  CopyMem (&Request, &mChatpadInitRequest[Chatpad->InitStep], sizeof (Request));
+  Data[0] = 0x09;
+  Data[1] = 0x00;
+
+  Status = ChatpadControl (UsbKeyboardDevice, &Request, Data);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "UsbXbox360: Chatpad initialization failed - %r\n", Status));
+    Chatpad->State = CHATPAD_STATE_ABSENT;
+    return;
+  }
+
+  if (++Chatpad->InitStep == ARRAY_SIZE (mChatpadInitRequest)) {
+    Chatpad->State = CHATPAD_STATE_ACTIVE;
+  }
+}
+
+/**
+  Initialize or keep alive the Chatpad. Called on every service timer tick.
+
+  The initialization sequence is spread over the ticks, one transfer each. The
+  keep-alive goes through the output queue.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ChatpadService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_CHATPAD          *Chatpad;
+  EFI_USB_DEVICE_REQUEST  Request;
+
+  Chatpad = &UsbKeyboardDevice->Chatpad;
+
+  if (Chatpad->ReinitRequested || (Chatpad->State == CHATPAD_STATE_UNKNOWN)) {
+    Chatpad->ReinitRequested = FALSE;
+    Chatpad->KeepAliveTicks  = 0;
+    Chatpad->InitStep        = 0;
+    Chatpad->State           = CHATPAD_STATE_INIT;
+  }
+
+  if (Chatpad->State == CHATPAD_STATE_INIT) {
+    ChatpadInitStep (UsbKeyboardDevice);
+    return;
+  }
+
+  if (Chatpad->State != CHATPAD_STATE_ACTIVE) {
+    return;
+  }
+
+  if (++Chatpad->KeepAliveTicks < CHATPAD_KEEP_ALIVE_TICKS) {
+    return;
+  }
+
+  //
+  // The keep-alive alternates between two values.
+  //
+  Chatpad->KeepAliveTicks  = 0;
+  Chatpad->KeepAliveToggle = (BOOLEAN)!Chatpad->KeepAliveToggle;
+
+  Request.RequestType = 0x41;
+  Request.Request     = 0x00;
+  Request.Value       = Chatpad->KeepAliveToggle ? 0x001F : 0x001E;
+  Request.Index       = 0x0002;
+  Request.Length      = 0;
+
+  OutputQueueControl (UsbKeyboardDevice, &Request);
+}
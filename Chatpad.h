@@ -0,0 +1,79 @@
+/** @file
+  Xbox 360 Chatpad support of the USB Xbox 360 controller driver.
+
+  The Chatpad clips onto the wired controller and reports its keys in packets
+  of its own on the interrupt endpoint of the controller. It must be switched
+  on with a vendor specific control transfer sequence and kept alive by
+  another control transfer about once a second, both driven by the service
+  timer of the device. A tick sends at most one initialization transfer; the
+  keep-alive is queued on the output queue and shares its turns.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_CHATPAD_H_
+#define _USB_KB_CHATPAD_H_
+
+#include "EfiKey.h"
+
+//
+// Packet types sent by the Chatpad
+//
+#define CHATPAD_PACKET_KEYS    0x00
+#define CHATPAD_PACKET_STATUS  0xF0
+
+//
+// Status packet asking for the initialization sequence
+//
+#define CHATPAD_STATUS_REINIT  0x03
+
+//
+// Modifier bits in byte 1 of a key packet
+//
+#define CHATPAD_MODIFIER_SHIFT   BIT0
+#define CHATPAD_MODIFIER_GREEN   BIT1
+#define CHATPAD_MODIFIER_ORANGE  BIT2
+#define CHATPAD_MODIFIER_PEOPLE  BIT3
+
+//
+// Service timer ticks between two keep-alive transfers
+//
+#define CHATPAD_KEEP_ALIVE_TICKS  10
+
+#define CHATPAD_CONTROL_TIMEOUT  100    // ms
+
+/**
+  Decode a Chatpad packet received by KeyboardHandler().
+
+  Key packets are turned into USB keycode transitions in UsbKeyQueue. A status
+  packet asking for initialization schedules it on the service timer.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+  @retval TRUE                  Report was a Chatpad packet and is consumed.
+  @retval FALSE                 Report is not a Chatpad packet.
+
+**/
+BOOLEAN
+ChatpadHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+/**
+  Initialize or keep alive the Chatpad. Called on every service timer tick.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ChatpadService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+#endif
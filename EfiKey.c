@@ -9,6 +9,11 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 
 #include "EfiKey.h"
 #include "KeyBoard.h"
+#include "Macro.h"
+#include "Telemetry.h"
+#include "Output.h"
+#include "Script.h"
+#include "AbsolutePointer.h"
 
 //
 // USB Keyboard Driver Global Variables
@@ -53,6 +58,11 @@ USBKeyboardDriverBindingEntryPoint (
              );
   ASSERT_EFI_ERROR (Status);
 
+  //
+  // Tracing is optional, the driver works without the drain event.
+  //
+  UsbKbdTraceInit ();
+
   return EFI_SUCCESS;
 }
 
@@ -127,6 +137,7 @@ USBKeyboardDriverBindingSupported (
 
   @retval EFI_SUCCESS            The controller is controlled by the usb keyboard driver.
   @retval EFI_UNSUPPORTED        No interrupt endpoint can be found.
+  @retval EFI_OUT_OF_RESOURCES   The device instance cannot be allocated.
   @retval Other                  This controller cannot be started.
 
 **/
@@ -144,9 +155,6 @@ USBKeyboardDriverBindingStart (
   UINT8                        EndpointNumber;
   EFI_USB_ENDPOINT_DESCRIPTOR  EndpointDescriptor;
   UINT8                        Index;
-  UINT8                        EndpointAddr;
-  UINT8                        PollingInterval;
-  UINT8                        PacketSize;
   BOOLEAN                      Found;
   EFI_TPL                      OldTpl;
 
@@ -167,7 +175,17 @@ USBKeyboardDriverBindingStart (
   }
 
   UsbKeyboardDevice = AllocateZeroPool (sizeof (USB_KB_DEV));
-  ASSERT (UsbKeyboardDevice != NULL);
+  if (UsbKeyboardDevice == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ErrorExit;
+  }
+
+  //
+  // Initialize the lists up front so that the error handler can always release them.
+  //
+  InitializeListHead (&UsbKeyboardDevice->NotifyList);
+  InitializeListHead (&UsbKeyboardDevice->NsKeyList);
+  UsbKeyboardDevice->PlayerIndex = USB_KB_MAX_PLAYERS;
 
   //
   // Get the Device Path Protocol on Controller's handle
@@ -185,6 +203,9 @@ USBKeyboardDriverBindingStart (
     goto ErrorExit;
   }
 
+  UsbKeyboardDevice->DevicePathKey = GetDevicePathKey (UsbKeyboardDevice->DevicePath);
+  AssignPlayerSlot (UsbKeyboardDevice);
+
   //
   // Report that the USB keyboard is being enabled
   //
@@ -203,7 +224,12 @@ USBKeyboardDriverBindingStart (
     UsbKeyboardDevice->DevicePath
     );
 
-  UsbKeyboardDevice->UsbIo = UsbIo;
+  UsbKeyboardDevice->UsbIo   = UsbIo;
+  UsbKeyboardDevice->Backend = FindBackend (UsbIo);
+  if (UsbKeyboardDevice->Backend == NULL) {
+    Status = EFI_UNSUPPORTED;
+    goto ErrorExit;
+  }
 
   //
   // Get interface & endpoint descriptor
@@ -216,7 +242,8 @@ USBKeyboardDriverBindingStart (
   EndpointNumber = UsbKeyboardDevice->InterfaceDescriptor.NumEndpoints;
 
   //
-  // Traverse endpoints to find interrupt endpoint IN
+  // Traverse endpoints to find interrupt endpoint IN, and interrupt endpoint OUT
+  // for the controllers that take output reports.
   //
   Found = FALSE;
   for (Index = 0; Index < EndpointNumber; Index++) {
@@ -226,15 +253,17 @@ USBKeyboardDriverBindingStart (
              &EndpointDescriptor
              );
 
-    if (((EndpointDescriptor.Attributes & (BIT0 | BIT1)) == USB_ENDPOINT_INTERRUPT) &&
-        ((EndpointDescriptor.EndpointAddress & USB_ENDPOINT_DIR_IN) != 0))
-    {
-      //
-      // We only care interrupt endpoint here
-      //
-      CopyMem (&UsbKeyboardDevice->IntEndpointDescriptor, &EndpointDescriptor, sizeof (EndpointDescriptor));
-      Found = TRUE;
-      break;
+    if ((EndpointDescriptor.Attributes & (BIT0 | BIT1)) != USB_ENDPOINT_INTERRUPT) {
+      continue;
+    }
+
+    if ((EndpointDescriptor.EndpointAddress & USB_ENDPOINT_DIR_IN) != 0) {
+      if (!Found) {
+        CopyMem (&UsbKeyboardDevice->IntEndpointDescriptor, &EndpointDescriptor, sizeof (EndpointDescriptor));
+        Found = TRUE;
+      }
+    } else if (UsbKeyboardDevice->IntOutEndpointAddress == 0) {
+      UsbKeyboardDevice->IntOutEndpointAddress = EndpointDescriptor.EndpointAddress;
     }
   }
 
@@ -259,6 +288,13 @@ USBKeyboardDriverBindingStart (
     UsbKeyboardDevice->DevicePath
     );
 
+  if (UsbKeyboardDevice->Backend->Init != NULL) {
+    Status = UsbKeyboardDevice->Backend->Init (UsbKeyboardDevice);
+    if (EFI_ERROR (Status)) {
+      goto ErrorExit;
+    }
+  }
+
   UsbKeyboardDevice->Signature                 = USB_KB_DEV_SIGNATURE;
   UsbKeyboardDevice->SimpleInput.Reset         = USBKeyboardReset;
   UsbKeyboardDevice->SimpleInput.ReadKeyStroke = USBKeyboardReadKeyStroke;
@@ -269,7 +305,12 @@ USBKeyboardDriverBindingStart (
   UsbKeyboardDevice->SimpleInputEx.RegisterKeyNotify   = USBKeyboardRegisterKeyNotify;
   UsbKeyboardDevice->SimpleInputEx.UnregisterKeyNotify = USBKeyboardUnregisterKeyNotify;
 
-  InitializeListHead (&UsbKeyboardDevice->NotifyList);
+  UsbKeyboardDevice->Xbox360.Revision            = USB_XBOX360_PROTOCOL_REVISION;
+  UsbKeyboardDevice->Xbox360.GetNotifyStatistics = UsbXbox360GetNotifyStatistics;
+  UsbKeyboardDevice->Xbox360.SetRumble           = UsbXbox360SetRumble;
+  UsbKeyboardDevice->Xbox360.InjectFrame         = UsbXbox360InjectFrame;
+  UsbKeyboardDevice->Xbox360.GetPollingState     = UsbXbox360GetPollingState;
+  UsbKeyboardDevice->Xbox360.SetTraceMask        = UsbXbox360SetTraceMask;
 
   Status = gBS->CreateEvent (
                   EVT_TIMER | EVT_NOTIFY_SIGNAL,
@@ -320,6 +361,46 @@ USBKeyboardDriverBindingStart (
     goto ErrorExit;
   }
 
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  USBKeyboardFastPollingHandler,
+                  UsbKeyboardDevice,
+                  &UsbKeyboardDevice->FastPollingEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    goto ErrorExit;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  USBKeyboardServiceHandler,
+                  UsbKeyboardDevice,
+                  &UsbKeyboardDevice->ServiceTimer
+                  );
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->SetTimer (UsbKeyboardDevice->ServiceTimer, TimerPeriodic, USB_KB_SERVICE_INTERVAL);
+  }
+
+  if (EFI_ERROR (Status)) {
+    goto ErrorExit;
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360MacroSupport)) {
+    Status = MacroInit (UsbKeyboardDevice);
+    if (EFI_ERROR (Status)) {
+      goto ErrorExit;
+    }
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    Status = TelemetryInit (UsbKeyboardDevice);
+    if (EFI_ERROR (Status)) {
+      goto ErrorExit;
+    }
+  }
+
   //
   // Install Simple Text Input Protocol and Simple Text Input Ex Protocol
   // for the USB keyboard device.
@@ -333,6 +414,8 @@ USBKeyboardDriverBindingStart (
                   &UsbKeyboardDevice->SimpleInput,
                   &gEfiSimpleTextInputExProtocolGuid,
                   &UsbKeyboardDevice->SimpleInputEx,
+                  &gUsbXbox360ProtocolGuid,
+                  &UsbKeyboardDevice->Xbox360,
                   NULL
                   );
   if (EFI_ERROR (Status)) {
@@ -348,6 +431,8 @@ USBKeyboardDriverBindingStart (
            &UsbKeyboardDevice->SimpleInput,
            &gEfiSimpleTextInputExProtocolGuid,
            &UsbKeyboardDevice->SimpleInputEx,
+           &gUsbXbox360ProtocolGuid,
+           &UsbKeyboardDevice->Xbox360,
            NULL
            );
     goto ErrorExit;
@@ -367,27 +452,24 @@ USBKeyboardDriverBindingStart (
            &UsbKeyboardDevice->SimpleInput,
            &gEfiSimpleTextInputExProtocolGuid,
            &UsbKeyboardDevice->SimpleInputEx,
+           &gUsbXbox360ProtocolGuid,
+           &UsbKeyboardDevice->Xbox360,
            NULL
            );
     goto ErrorExit;
   }
 
   //
-  // Submit Asynchronous Interrupt Transfer to manage this device.
+  // Submit Asynchronous Interrupt Transfer to manage this device, unless
+  // polling is deferred until the console is read. Polling starts at the
+  // endpoint's own interval; PollingService() relaxes it once the pad is idle.
   //
-  EndpointAddr    = UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress;
-  PollingInterval = UsbKeyboardDevice->IntEndpointDescriptor.Interval;
-  PacketSize      = (UINT8)(UsbKeyboardDevice->IntEndpointDescriptor.MaxPacketSize);
-
-  Status = UsbIo->UsbAsyncInterruptTransfer (
-                    UsbIo,
-                    EndpointAddr,
-                    TRUE,
-                    PollingInterval,
-                    PacketSize,
-                    KeyboardHandler,
-                    UsbKeyboardDevice
-                    );
+  UsbKeyboardDevice->PollingInterval  = UsbKeyboardDevice->IntEndpointDescriptor.Interval;
+  UsbKeyboardDevice->LastActivityTime = GetPerformanceCounter ();
+  if (!FeaturePcdGet (PcdUsbXbox360ConnectOnDemand)) {
+    Status = SubmitInterruptTransfer (UsbKeyboardDevice);
+    UsbKeyboardDevice->Polling = (BOOLEAN)!EFI_ERROR (Status);
+  }
 
   if (EFI_ERROR (Status)) {
     gBS->UninstallMultipleProtocolInterfaces (
@@ -396,11 +478,21 @@ USBKeyboardDriverBindingStart (
            &UsbKeyboardDevice->SimpleInput,
            &gEfiSimpleTextInputExProtocolGuid,
            &UsbKeyboardDevice->SimpleInputEx,
+           &gUsbXbox360ProtocolGuid,
+           &UsbKeyboardDevice->Xbox360,
            NULL
            );
     goto ErrorExit;
   }
 
+  //
+  // The touchpad is optional, the keyboard works without it.
+  //
+  Status = AbsolutePointerInstall (UsbKeyboardDevice);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: failed to install the touchpad pointer - %r\n", Status));
+  }
+
   UsbKeyboardDevice->ControllerNameTable = NULL;
   AddUnicodeString2 (
     "eng",
@@ -441,11 +533,36 @@ ErrorExit:
       gBS->CloseEvent (UsbKeyboardDevice->KeyNotifyProcessEvent);
     }
 
+    if (UsbKeyboardDevice->ServiceTimer != NULL) {
+      gBS->CloseEvent (UsbKeyboardDevice->ServiceTimer);
+    }
+
+    if (UsbKeyboardDevice->FastPollingEvent != NULL) {
+      gBS->CloseEvent (UsbKeyboardDevice->FastPollingEvent);
+    }
+
+    //
+    // RepeatTimer and DelayedRecoveryEvent are created by the exhaustive reset.
+    //
+    if (UsbKeyboardDevice->RepeatTimer != NULL) {
+      gBS->CloseEvent (UsbKeyboardDevice->RepeatTimer);
+    }
+
+    if (UsbKeyboardDevice->DelayedRecoveryEvent != NULL) {
+      gBS->CloseEvent (UsbKeyboardDevice->DelayedRecoveryEvent);
+    }
+
     if (UsbKeyboardDevice->KeyboardLayoutEvent != NULL) {
-      ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
       gBS->CloseEvent (UsbKeyboardDevice->KeyboardLayoutEvent);
     }
 
+    MacroRelease (UsbKeyboardDevice);
+    TelemetryRelease (UsbKeyboardDevice);
+    ScriptRelease (UsbKeyboardDevice);
+    ReleasePlayerSlot (UsbKeyboardDevice);
+    KbdFreeNotifyList (&UsbKeyboardDevice->NotifyList);
+    ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
+
     FreePool (UsbKeyboardDevice);
     UsbKeyboardDevice = NULL;
   }
@@ -529,15 +646,18 @@ USBKeyboardDriverBindingStop (
   //
   // Delete the Asynchronous Interrupt Transfer from this device
   //
-  UsbKeyboardDevice->UsbIo->UsbAsyncInterruptTransfer (
-                              UsbKeyboardDevice->UsbIo,
-                              UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
-                              FALSE,
-                              UsbKeyboardDevice->IntEndpointDescriptor.Interval,
-                              0,
-                              NULL,
-                              NULL
-                              );
+  if (UsbKeyboardDevice->Polling) {
+    UsbKeyboardDevice->UsbIo->UsbAsyncInterruptTransfer (
+                                UsbKeyboardDevice->UsbIo,
+                                UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
+                                FALSE,
+                                UsbKeyboardDevice->IntEndpointDescriptor.Interval,
+                                0,
+                                NULL,
+                                NULL
+                                );
+    UsbKeyboardDevice->Polling = FALSE;
+  }
 
   gBS->CloseProtocol (
          Controller,
@@ -546,36 +666,48 @@ USBKeyboardDriverBindingStop (
          Controller
          );
 
+  AbsolutePointerUninstall (UsbKeyboardDevice);
+
   Status = gBS->UninstallMultipleProtocolInterfaces (
                   Controller,
                   &gEfiSimpleTextInProtocolGuid,
                   &UsbKeyboardDevice->SimpleInput,
                   &gEfiSimpleTextInputExProtocolGuid,
                   &UsbKeyboardDevice->SimpleInputEx,
+                  &gUsbXbox360ProtocolGuid,
+                  &UsbKeyboardDevice->Xbox360,
                   NULL
                   );
   //
   // Free all resources.
   //
   gBS->CloseEvent (UsbKeyboardDevice->TimerEvent);
+  gBS->CloseEvent (UsbKeyboardDevice->ServiceTimer);
+  gBS->CloseEvent (UsbKeyboardDevice->FastPollingEvent);
   gBS->CloseEvent (UsbKeyboardDevice->RepeatTimer);
   gBS->CloseEvent (UsbKeyboardDevice->DelayedRecoveryEvent);
   gBS->CloseEvent (UsbKeyboardDevice->SimpleInput.WaitForKey);
   gBS->CloseEvent (UsbKeyboardDevice->SimpleInputEx.WaitForKeyEx);
   gBS->CloseEvent (UsbKeyboardDevice->KeyNotifyProcessEvent);
+  MacroRelease (UsbKeyboardDevice);
+  if (FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    TelemetryFlush (UsbKeyboardDevice);
+  }
+
+  TelemetryRelease (UsbKeyboardDevice);
+  ScriptRelease (UsbKeyboardDevice);
+  ReleasePlayerSlot (UsbKeyboardDevice);
   KbdFreeNotifyList (&UsbKeyboardDevice->NotifyList);
 
   ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
-  gBS->CloseEvent (UsbKeyboardDevice->KeyboardLayoutEvent);
+  if (UsbKeyboardDevice->KeyboardLayoutEvent != NULL) {
+    gBS->CloseEvent (UsbKeyboardDevice->KeyboardLayoutEvent);
+  }
 
   if (UsbKeyboardDevice->ControllerNameTable != NULL) {
     FreeUnicodeStringTable (UsbKeyboardDevice->ControllerNameTable);
   }
 
-  DestroyQueue (&UsbKeyboardDevice->UsbKeyQueue);
-  DestroyQueue (&UsbKeyboardDevice->EfiKeyQueue);
-  DestroyQueue (&UsbKeyboardDevice->EfiKeyQueueForNotify);
-
   FreePool (UsbKeyboardDevice);
 
   return Status;
@@ -602,17 +734,30 @@ USBKeyboardReadKeyStrokeWorker (
   OUT EFI_KEY_DATA   *KeyData
   )
 {
+  UINT64      PackedKeyData;
+  EFI_STATUS  Status;
+
   if (KeyData == NULL) {
     return EFI_INVALID_PARAMETER;
   }
 
-  if (IsQueueEmpty (&UsbKeyboardDevice->EfiKeyQueue)) {
+  EnsurePolling (UsbKeyboardDevice);
+  ScriptFeed (UsbKeyboardDevice);
+
+  //
+  // ReadKeyStroke() and ReadKeyStrokeEx() may be called at any TPL up to
+  // TPL_NOTIFY. The dequeue claims the keystroke with a compare-exchange, so it
+  // needs no TPL of its own.
+  //
+  Status = DequeueKeyData (&UsbKeyboardDevice->EfiKeyQueue, &PackedKeyData);
+
+  if (EFI_ERROR (Status)) {
     ZeroMem (&KeyData->Key, sizeof (KeyData->Key));
     InitializeKeyState (UsbKeyboardDevice, &KeyData->KeyState);
     return EFI_NOT_READY;
   }
 
-  Dequeue (&UsbKeyboardDevice->EfiKeyQueue, KeyData, sizeof (*KeyData));
+  UnpackKeyData (PackedKeyData, KeyData);
 
   return EFI_SUCCESS;
 }
@@ -663,9 +808,7 @@ USBKeyboardReset (
     //
     // Clear the key buffer of this USB keyboard
     //
-    InitQueue (&UsbKeyboardDevice->UsbKeyQueue, sizeof (USB_KEY));
-    InitQueue (&UsbKeyboardDevice->EfiKeyQueue, sizeof (EFI_KEY_DATA));
-    InitQueue (&UsbKeyboardDevice->EfiKeyQueueForNotify, sizeof (EFI_KEY_DATA));
+    ResetKeyQueues (UsbKeyboardDevice);
 
     return EFI_SUCCESS;
   }
@@ -758,72 +901,61 @@ USBKeyboardWaitForKey (
   IN  VOID       *Context
   )
 {
-  USB_KB_DEV    *UsbKeyboardDevice;
-  EFI_KEY_DATA  KeyData;
-  EFI_TPL       OldTpl;
+  USB_KB_DEV          *UsbKeyboardDevice;
+  USB_KEY_DATA_QUEUE  *Queue;
+  UINT32              Index;
+  UINT32              Tail;
 
   UsbKeyboardDevice = (USB_KB_DEV *)Context;
+  Queue             = &UsbKeyboardDevice->EfiKeyQueue;
 
-  //
-  // Enter critical section
-  //
-  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  EnsurePolling (UsbKeyboardDevice);
+  ScriptFeed (UsbKeyboardDevice);
 
   //
   // WaitforKey doesn't support the partial key.
   // Considering if the partial keystroke is enabled, there maybe a partial
-  // keystroke in the queue, so here skip the partial keystroke and get the
-  // next key from the queue
+  // keystroke in the queue, so here look past the partial keystrokes for a
+  // complete one. The queue is only peeked, Head is left to the consumers.
+  // WaitForKey runs at TPL_NOTIFY, so no producer runs during the peek.
   //
-  while (!IsQueueEmpty (&UsbKeyboardDevice->EfiKeyQueue)) {
+  Tail = Queue->Tail;
+  MemoryFence ();
+  for (Index = Queue->Head; Index != Tail; Index++) {
     //
     // If there is pending key, signal the event.
     //
-    CopyMem (
-      &KeyData,
-      UsbKeyboardDevice->EfiKeyQueue.Buffer[UsbKeyboardDevice->EfiKeyQueue.Head],
-      sizeof (EFI_KEY_DATA)
-      );
-    if ((KeyData.Key.ScanCode == SCAN_NULL) && (KeyData.Key.UnicodeChar == CHAR_NULL)) {
-      Dequeue (&UsbKeyboardDevice->EfiKeyQueue, &KeyData, sizeof (EFI_KEY_DATA));
-      continue;
+    if ((Queue->Buffer[Index % ARRAY_SIZE (Queue->Buffer)] & USB_KEY_DATA_KEY_MASK) != 0) {
+      gBS->SignalEvent (Event);
+      break;
     }
-
-    gBS->SignalEvent (Event);
-    break;
   }
-
-  //
-  // Leave critical section and return
-  //
-  gBS->RestoreTPL (OldTpl);
 }
 
 /**
-  Timer handler to convert the key from USB.
+  Translate the next USB keycode transition into the EFI key queue.
 
-  @param  Event                    Indicates the event that invoke this function.
-  @param  Context                  Indicates the calling context.
+  Must be called at TPL_NOTIFY.
+
+  @param  UsbKeyboardDevice        The USB_KB_DEV instance.
 **/
+STATIC
 VOID
-EFIAPI
-USBKeyboardTimerHandler (
-  IN  EFI_EVENT  Event,
-  IN  VOID       *Context
+USBKeyboardTranslateKey (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
   )
 {
   EFI_STATUS    Status;
-  USB_KB_DEV    *UsbKeyboardDevice;
   UINT8         KeyCode;
+  UINT64        KeyTime;
   EFI_KEY_DATA  KeyData;
-
-  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+  UINT64        PackedKeyData;
 
   //
   // Fetch raw data from the USB keyboard buffer,
   // and translate it into USB keycode.
   //
-  Status = USBParseKey (UsbKeyboardDevice, &KeyCode);
+  Status = USBParseKey (UsbKeyboardDevice, &KeyCode, &KeyTime);
   if (EFI_ERROR (Status)) {
     return;
   }
@@ -839,7 +971,68 @@ USBKeyboardTimerHandler (
   //
   // Insert to the EFI Key queue
   //
-  Enqueue (&UsbKeyboardDevice->EfiKeyQueue, &KeyData, sizeof (KeyData));
+  PackedKeyData = PackKeyData (&KeyData);
+  EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueue, PackedKeyData);
+  MacroRecordKey (UsbKeyboardDevice, PackedKeyData);
+  TelemetryRecordLatency (UsbKeyboardDevice, KeyTime);
+}
+
+/**
+  Timer handler to convert the key from USB.
+
+  @param  Event                    Indicates the event that invoke this function.
+  @param  Context                  Indicates the calling context.
+**/
+VOID
+EFIAPI
+USBKeyboardTimerHandler (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+
+  FlushInputErrors (UsbKeyboardDevice);
+  USBKeyboardTranslateKey (UsbKeyboardDevice);
+}
+
+/**
+  Service timer handler, running slow device housekeeping at TPL_CALLBACK.
+
+  Work that needs control transfers or runtime services cannot run from the
+  TPL_NOTIFY handlers, so it is scheduled here instead.
+
+  @param  Event                    Indicates the event that invoke this function.
+  @param  Context                  Indicates the calling context.
+**/
+VOID
+EFIAPI
+USBKeyboardServiceHandler (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+
+  //
+  // A layout change is read and parsed here, the finished table is swapped in
+  // at TPL_NOTIFY.
+  //
+  if (FeaturePcdGet (PcdUsbXbox360HiiLayoutSupport)) {
+    RefreshKeyboardLayout (UsbKeyboardDevice);
+  }
+
+  OutputService (UsbKeyboardDevice);
+  PollingService (UsbKeyboardDevice);
+  ScriptService (UsbKeyboardDevice);
+
+  if (UsbKeyboardDevice->Backend->Service != NULL) {
+    UsbKeyboardDevice->Backend->Service (UsbKeyboardDevice);
+  }
 }
 
 /**
@@ -915,6 +1108,79 @@ IsKeyRegistered (
   return TRUE;
 }
 
+/**
+  Hash a key into the notify key filter.
+
+  @param  Key       The key to hash.
+
+  @return The bit index in the notify key filter.
+
+**/
+STATIC
+UINTN
+NotifyKeyFilterHash (
+  IN EFI_INPUT_KEY  *Key
+  )
+{
+  return (Key->UnicodeChar ^ (Key->UnicodeChar >> 8) ^ (Key->ScanCode * 0x9D)) % USB_KB_NOTIFY_FILTER_SIZE;
+}
+
+/**
+  Count a registration in the notify key filter, or stop counting it.
+
+  The caller holds TPL_NOTIFY, as the timer handler reads the filter.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Key                   The registered key.
+  @param  Add                   TRUE if the key was registered, FALSE if it was
+                                unregistered.
+
+**/
+VOID
+UpdateNotifyKeyFilter (
+  IN OUT USB_KB_DEV     *UsbKeyboardDevice,
+  IN     EFI_INPUT_KEY  *Key,
+  IN     BOOLEAN        Add
+  )
+{
+  UINT16  *Count;
+
+  Count = &UsbKeyboardDevice->NotifyKeyFilter[NotifyKeyFilterHash (Key)];
+
+  //
+  // A saturated count is never decremented, so its keys always walk the list.
+  //
+  if (*Count == MAX_UINT16) {
+    return;
+  }
+
+  if (Add) {
+    (*Count)++;
+  } else {
+    ASSERT (*Count != 0);
+    (*Count)--;
+  }
+}
+
+/**
+  Check whether any registered notify may match the key.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Key                   The key that was pressed.
+
+  @retval TRUE                  A registered notify may match the key.
+  @retval FALSE                 No registered notify matches the key.
+
+**/
+BOOLEAN
+IsNotifyKeyCandidate (
+  IN USB_KB_DEV     *UsbKeyboardDevice,
+  IN EFI_INPUT_KEY  *Key
+  )
+{
+  return (BOOLEAN)(UsbKeyboardDevice->NotifyKeyFilter[NotifyKeyFilterHash (Key)] != 0);
+}
+
 //
 // Simple Text Input Ex protocol functions
 //
@@ -1053,7 +1319,9 @@ USBKeyboardSetState (
     UsbKeyboardDevice->CapsOn = TRUE;
   }
 
-  if ((*KeyToggleState & EFI_KEY_STATE_EXPOSED) == EFI_KEY_STATE_EXPOSED) {
+  if (FeaturePcdGet (PcdUsbXbox360PartialKeySupport) &&
+      ((*KeyToggleState & EFI_KEY_STATE_EXPOSED) == EFI_KEY_STATE_EXPOSED))
+  {
     UsbKeyboardDevice->IsSupportPartialKey = TRUE;
   }
 
@@ -1097,6 +1365,7 @@ USBKeyboardRegisterKeyNotify (
   LIST_ENTRY                     *Link;
   LIST_ENTRY                     *NotifyList;
   KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+  EFI_TPL                        OldTpl;
 
   if ((KeyData == NULL) || (NotifyHandle == NULL) || (KeyNotificationFunction == NULL)) {
     return EFI_INVALID_PARAMETER;
@@ -1104,6 +1373,29 @@ USBKeyboardRegisterKeyNotify (
 
   UsbKeyboardDevice = TEXT_INPUT_EX_USB_KB_DEV_FROM_THIS (This);
 
+  EnsurePolling (UsbKeyboardDevice);
+
+  //
+  // Allocate resource to save the notification function. This is done before
+  // the TPL is raised, as memory services must not be called above TPL_NOTIFY
+  // and the list below is only stable at TPL_NOTIFY.
+  //
+  NewNotify = (KEYBOARD_CONSOLE_IN_EX_NOTIFY *)AllocateZeroPool (sizeof (KEYBOARD_CONSOLE_IN_EX_NOTIFY));
+  if (NewNotify == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewNotify->Signature         = USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE;
+  NewNotify->KeyNotificationFn = KeyNotificationFunction;
+  CopyMem (&NewNotify->KeyData, KeyData, sizeof (EFI_KEY_DATA));
+  USB_KB_PREEMPTION_POINT ();
+
+  //
+  // SignalKeyNotify() walks the list from the timer handler at TPL_NOTIFY, so
+  // the list is only searched and changed at that TPL.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
   //
   // Return EFI_SUCCESS if the (KeyData, NotificationFunction) is already registered.
   //
@@ -1119,26 +1411,20 @@ USBKeyboardRegisterKeyNotify (
                       NotifyEntry,
                       USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE
                       );
-    if (IsKeyRegistered (&CurrentNotify->KeyData, KeyData)) {
+    if (!CurrentNotify->Removed && IsKeyRegistered (&CurrentNotify->KeyData, KeyData)) {
       if (CurrentNotify->KeyNotificationFn == KeyNotificationFunction) {
+        gBS->RestoreTPL (OldTpl);
+        FreePool (NewNotify);
         *NotifyHandle = CurrentNotify;
         return EFI_SUCCESS;
       }
     }
   }
 
-  //
-  // Allocate resource to save the notification function
-  //
-  NewNotify = (KEYBOARD_CONSOLE_IN_EX_NOTIFY *)AllocateZeroPool (sizeof (KEYBOARD_CONSOLE_IN_EX_NOTIFY));
-  if (NewNotify == NULL) {
-    return EFI_OUT_OF_RESOURCES;
-  }
-
-  NewNotify->Signature         = USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE;
-  NewNotify->KeyNotificationFn = KeyNotificationFunction;
-  CopyMem (&NewNotify->KeyData, KeyData, sizeof (EFI_KEY_DATA));
   InsertTailList (&UsbKeyboardDevice->NotifyList, &NewNotify->NotifyEntry);
+  UpdateNotifyKeyFilter (UsbKeyboardDevice, &NewNotify->KeyData.Key, TRUE);
+
+  gBS->RestoreTPL (OldTpl);
 
   *NotifyHandle = NewNotify;
 
@@ -1166,6 +1452,7 @@ USBKeyboardUnregisterKeyNotify (
   KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
   LIST_ENTRY                     *Link;
   LIST_ENTRY                     *NotifyList;
+  EFI_TPL                        OldTpl;
 
   if (NotificationHandle == NULL) {
     return EFI_INVALID_PARAMETER;
@@ -1175,7 +1462,9 @@ USBKeyboardUnregisterKeyNotify (
 
   //
   // Traverse notify list of USB keyboard and remove the entry of NotificationHandle.
+  // The timer handler walks the list at TPL_NOTIFY.
   //
+  OldTpl     = gBS->RaiseTPL (TPL_NOTIFY);
   NotifyList = &UsbKeyboardDevice->NotifyList;
   for (Link = GetFirstNode (NotifyList);
        !IsNull (NotifyList, Link);
@@ -1187,26 +1476,436 @@ USBKeyboardUnregisterKeyNotify (
                       NotifyEntry,
                       USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE
                       );
-    if (CurrentNotify == NotificationHandle) {
+    if ((CurrentNotify == NotificationHandle) && !CurrentNotify->Removed) {
+      CurrentNotify->Removed = TRUE;
+      UpdateNotifyKeyFilter (UsbKeyboardDevice, &CurrentNotify->KeyData.Key, FALSE);
+
+      //
+      // KeyNotifyProcessHandler() may hold links into NotifyList while it
+      // delivers a key, possibly from the notification function calling us.
+      // The entry is then freed when the delivery ends.
+      //
+      if (UsbKeyboardDevice->NotifyPending) {
+        UsbKeyboardDevice->NotifyRemoved = TRUE;
+        gBS->RestoreTPL (OldTpl);
+        return EFI_SUCCESS;
+      }
+
       //
       // Remove the notification function from NotifyList and free resources
       //
       RemoveEntryList (&CurrentNotify->NotifyEntry);
+      gBS->RestoreTPL (OldTpl);
+      USB_KB_PREEMPTION_POINT ();
 
       FreePool (CurrentNotify);
       return EFI_SUCCESS;
     }
   }
 
+  gBS->RestoreTPL (OldTpl);
+
   //
   // Cannot find the matching entry in database.
   //
   return EFI_INVALID_PARAMETER;
 }
 
+//
+// Properties of the performance counter, read once by GetElapsedTime()
+//
+STATIC UINT64  mCounterStartValue;
+STATIC UINT64  mCounterEndValue;
+STATIC UINT64  mCounterFrequency;
+
+/**
+  Get the time elapsed between two performance counter values.
+
+  The counter properties are cached on the first call, as some TimerLib
+  instances compute them from hardware on every query.
+
+  @param  Begin                 The performance counter value at the start.
+  @param  End                   The performance counter value at the end.
+
+  @return The elapsed time in nanoseconds.
+
+**/
+UINT64
+GetElapsedTime (
+  IN UINT64  Begin,
+  IN UINT64  End
+  )
+{
+  UINT64  Ticks;
+  UINT64  Remainder;
+  UINT64  NanoSeconds;
+
+  //
+  // Racing first calls read the same values, so no lock is needed.
+  //
+  if (mCounterFrequency == 0) {
+    mCounterFrequency = GetPerformanceCounterProperties (&mCounterStartValue, &mCounterEndValue);
+    ASSERT (mCounterFrequency != 0);
+  }
+
+  //
+  // The counter may count down and it wraps from EndValue to StartValue.
+  //
+  if (mCounterEndValue >= mCounterStartValue) {
+    Ticks = (End >= Begin) ? End - Begin : (mCounterEndValue - Begin) + (End - mCounterStartValue);
+  } else {
+    Ticks = (Begin >= End) ? Begin - End : (Begin - mCounterEndValue) + (mCounterStartValue - End);
+  }
+
+  //
+  // Same conversion as GetTimeInNanoSecond(), without querying the frequency.
+  //
+  NanoSeconds  = MultU64x32 (DivU64x64Remainder (Ticks, mCounterFrequency, &Remainder), 1000000000u);
+  NanoSeconds += DivU64x64Remainder (MultU64x32 (Remainder, 1000000000u), mCounterFrequency, NULL);
+
+  return NanoSeconds;
+}
+
+/**
+  Invoke a key notification function and record how long it ran.
+
+  @param  Notify                The registered notification.
+  @param  KeyData               The key that was pressed.
+
+**/
+STATIC
+VOID
+InvokeKeyNotify (
+  IN OUT KEYBOARD_CONSOLE_IN_EX_NOTIFY  *Notify,
+  IN     EFI_KEY_DATA                   *KeyData
+  )
+{
+  UINT64  Begin;
+  UINT64  Elapsed;
+
+  Begin = GetPerformanceCounter ();
+  Notify->KeyNotificationFn (KeyData);
+  Elapsed = GetElapsedTime (Begin, GetPerformanceCounter ());
+
+  Notify->CallCount++;
+  Notify->TotalTime += Elapsed;
+  if (Elapsed > Notify->MaxTime) {
+    Notify->MaxTime = Elapsed;
+  }
+
+  if (Elapsed > MultU64x32 (FixedPcdGet32 (PcdUsbXbox360NotifyThresholdUs), 1000)) {
+    if (Notify->OverThresholdCount == 0) {
+      DEBUG ((
+        DEBUG_WARN,
+        "UsbXbox360: key notify %p took %lu us\n",
+        Notify->KeyNotificationFn,
+        DivU64x32 (Elapsed, 1000)
+        ));
+    }
+
+    Notify->OverThresholdCount++;
+  }
+}
+
+/**
+  Retrieve the run time statistics of the registered key notification functions.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Count                 On input, the number of entries in Statistics.
+                                On output, the number of registered notification functions.
+  @param  Statistics            A buffer receiving one entry per registered notification function.
+
+  @retval EFI_SUCCESS           The statistics were returned.
+  @retval EFI_BUFFER_TOO_SMALL  Statistics is too small, Count holds the required number of entries.
+  @retval EFI_INVALID_PARAMETER Count is NULL, or Statistics is NULL while *Count is not 0.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360GetNotifyStatistics (
+  IN     USB_XBOX360_PROTOCOL           *This,
+  IN OUT UINTN                          *Count,
+  OUT    USB_XBOX360_NOTIFY_STATISTICS  *Statistics
+  )
+{
+  USB_KB_DEV                     *UsbKeyboardDevice;
+  LIST_ENTRY                     *Link;
+  LIST_ENTRY                     *NotifyList;
+  KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+  UINTN                          Index;
+  EFI_STATUS                     Status;
+  EFI_TPL                        OldTpl;
+
+  if ((Count == NULL) || ((Statistics == NULL) && (*Count != 0))) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  UsbKeyboardDevice = XBOX360_USB_KB_DEV_FROM_THIS (This);
+
+  //
+  // The statistics are updated by KeyNotifyProcessHandler() at TPL_CALLBACK.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+
+  Index      = 0;
+  NotifyList = &UsbKeyboardDevice->NotifyList;
+  for (Link = GetFirstNode (NotifyList); !IsNull (NotifyList, Link); Link = GetNextNode (NotifyList, Link)) {
+    CurrentNotify = CR (Link, KEYBOARD_CONSOLE_IN_EX_NOTIFY, NotifyEntry, USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE);
+    if (CurrentNotify->Removed) {
+      continue;
+    }
+
+    if (Index < *Count) {
+      Statistics[Index].NotifyHandle            = CurrentNotify;
+      Statistics[Index].KeyNotificationFunction = CurrentNotify->KeyNotificationFn;
+      Statistics[Index].CallCount               = CurrentNotify->CallCount;
+      Statistics[Index].TotalTime               = CurrentNotify->TotalTime;
+      Statistics[Index].MaxTime                 = CurrentNotify->MaxTime;
+      Statistics[Index].OverThresholdCount      = CurrentNotify->OverThresholdCount;
+    }
+
+    Index++;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  Status = (Index > *Count) ? EFI_BUFFER_TOO_SMALL : EFI_SUCCESS;
+  *Count = Index;
+  return Status;
+}
+
+/**
+  Set the rumble level of the controller.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  LeftMotor             Level of the left, low frequency motor.
+  @param  RightMotor            Level of the right, high frequency motor.
+
+  @retval EFI_SUCCESS           The rumble level is queued.
+  @retval EFI_UNSUPPORTED       The controller has no rumble output.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360SetRumble (
+  IN USB_XBOX360_PROTOCOL  *This,
+  IN UINT8                 LeftMotor,
+  IN UINT8                 RightMotor
+  )
+{
+  return QueueRumble (XBOX360_USB_KB_DEV_FROM_THIS (This), LeftMotor, RightMotor);
+}
+
+/**
+  Feed a synthetic controller state into the input pipeline.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Frame                 The state to inject, or NULL to end the injection.
+
+  @retval EFI_SUCCESS           The frame was processed.
+  @retval EFI_OUT_OF_RESOURCES  The frame was processed, but some of its
+                                keystrokes did not fit in the key queue.
+  @retval EFI_UNSUPPORTED       Frame injection is not supported by this build.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360InjectFrame (
+  IN USB_XBOX360_PROTOCOL     *This,
+  IN CONST USB_XBOX360_FRAME  *Frame  OPTIONAL
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+  UINT16      OldButtons;
+  UINT16      NewButtons;
+  UINT32      Dropped;
+  EFI_TPL     OldTpl;
+
+  if (!FeaturePcdGet (PcdUsbXbox360FrameInjection)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  UsbKeyboardDevice = XBOX360_USB_KB_DEV_FROM_THIS (This);
+
+  //
+  // Reports are decoded at TPL_NOTIFY, take the frame in the same context.
+  //
+  OldTpl     = gBS->RaiseTPL (TPL_NOTIFY);
+  OldButtons = UsbKeyboardDevice->XboxState.Buttons;
+  Dropped    = UsbKeyboardDevice->EfiKeyQueue.Dropped;
+
+  if (Frame != NULL) {
+    UsbKeyboardDevice->Injecting                    = TRUE;
+    NewButtons                                      = Frame->Buttons;
+    UsbKeyboardDevice->XboxState.LeftStickXDir      = Frame->LeftStickX;
+    UsbKeyboardDevice->XboxState.LeftStickYDir      = Frame->LeftStickY;
+    UsbKeyboardDevice->XboxState.LeftTriggerActive  = Frame->LeftTrigger;
+    UsbKeyboardDevice->XboxState.RightTriggerActive = Frame->RightTrigger;
+  } else {
+    //
+    // Release the injected state. The next report from the controller must not
+    // be taken for a duplicate by a backend early exit.
+    //
+    UsbKeyboardDevice->Injecting = FALSE;
+    NewButtons                   = 0;
+    ZeroMem (&UsbKeyboardDevice->XboxState, sizeof (UsbKeyboardDevice->XboxState));
+    UsbKeyboardDevice->XboxState.Buttons = OldButtons;
+    ZeroMem (UsbKeyboardDevice->ReportCache, sizeof (UsbKeyboardDevice->ReportCache));
+  }
+
+  if (OldButtons != NewButtons) {
+    ProcessButtonChanges (UsbKeyboardDevice, OldButtons, NewButtons);
+    UsbKeyboardDevice->XboxState.Buttons = NewButtons;
+  }
+
+  //
+  // Translate the transitions now rather than one per timer tick, so a test
+  // can inject frames back to back. The input errors are left to the timer.
+  //
+  while (!IsQueueEmpty (&UsbKeyboardDevice->UsbKeyQueue)) {
+    USBKeyboardTranslateKey (UsbKeyboardDevice);
+  }
+
+  Dropped = UsbKeyboardDevice->EfiKeyQueue.Dropped - Dropped;
+  gBS->RestoreTPL (OldTpl);
+
+  if (Dropped != 0) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: %u injected keystrokes dropped, key queue full\n", Dropped));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Retrieve the polling interval of the controller and how often it changed.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Interval              The interval the controller is polled at, in milliseconds.
+  @param  SwitchCount           The number of polling interval changes since the
+                                controller was started.
+
+  @retval EFI_SUCCESS           The polling state was returned.
+  @retval EFI_INVALID_PARAMETER Interval or SwitchCount is NULL.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360GetPollingState (
+  IN  USB_XBOX360_PROTOCOL  *This,
+  OUT UINT8                 *Interval,
+  OUT UINT32                *SwitchCount
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+  EFI_TPL     OldTpl;
+
+  if ((Interval == NULL) || (SwitchCount == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  UsbKeyboardDevice = XBOX360_USB_KB_DEV_FROM_THIS (This);
+
+  //
+  // The interval is switched at TPL_NOTIFY.
+  //
+  OldTpl       = gBS->RaiseTPL (TPL_NOTIFY);
+  *Interval    = UsbKeyboardDevice->PollingInterval;
+  *SwitchCount = UsbKeyboardDevice->Telemetry.Record.PollingSwitchCount;
+  gBS->RestoreTPL (OldTpl);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Select the trace categories the driver records.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Mask                  The categories to record, a combination of
+                                USB_XBOX360_TRACE_*.
+  @param  OldMask               Receives the categories recorded so far, optional.
+
+  @retval EFI_SUCCESS           The mask is set.
+  @retval EFI_UNSUPPORTED       No trace category is compiled in.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360SetTraceMask (
+  IN  USB_XBOX360_PROTOCOL  *This,
+  IN  UINT32                Mask,
+  OUT UINT32                *OldMask  OPTIONAL
+  )
+{
+  UINT32  PreviousMask;
+
+  if (USBKBD_TRACE_COMPILE_MASK == 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  PreviousMask = UsbKbdTraceSetMask (Mask);
+  if (OldMask != NULL) {
+    *OldMask = PreviousMask;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  End the delivery of the pending key and free the notifications that were
+  unregistered during it.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+KeyNotifyEndDelivery (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  LIST_ENTRY                     RemovedList;
+  LIST_ENTRY                     *Link;
+  LIST_ENTRY                     *NextLink;
+  LIST_ENTRY                     *NotifyList;
+  KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+  EFI_TPL                        OldTpl;
+
+  InitializeListHead (&RemovedList);
+
+  //
+  // Unregistration changes NotifyList at TPL_NOTIFY.
+  //
+  OldTpl                              = gBS->RaiseTPL (TPL_NOTIFY);
+  UsbKeyboardDevice->NotifyPending    = FALSE;
+  UsbKeyboardDevice->NotifyResumeLink = NULL;
+  if (UsbKeyboardDevice->NotifyRemoved) {
+    NotifyList = &UsbKeyboardDevice->NotifyList;
+    for (Link = GetFirstNode (NotifyList); !IsNull (NotifyList, Link); Link = NextLink) {
+      NextLink      = GetNextNode (NotifyList, Link);
+      CurrentNotify = CR (Link, KEYBOARD_CONSOLE_IN_EX_NOTIFY, NotifyEntry, USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE);
+      if (CurrentNotify->Removed) {
+        RemoveEntryList (Link);
+        InsertTailList (&RemovedList, Link);
+      }
+    }
+
+    UsbKeyboardDevice->NotifyRemoved = FALSE;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  KbdFreeNotifyList (&RemovedList);
+}
+
 /**
   Process key notify.
 
+  The keys are delivered to all matching notification functions. The pass
+  budget PcdUsbXbox360NotifyPassBudgetUs is checked after every notification
+  function; once it is spent, the delivery stops and resumes at the next entry
+  on the next signal of the event, so other TPL_CALLBACK work can run in between.
+
   @param  Event                 Indicates the event that invoke this function.
   @param  Context               Indicates the calling context.
 **/
@@ -1219,37 +1918,71 @@ KeyNotifyProcessHandler (
 {
   EFI_STATUS                     Status;
   USB_KB_DEV                     *UsbKeyboardDevice;
-  EFI_KEY_DATA                   KeyData;
+  UINT64                         PackedKeyData;
+  EFI_KEY_DATA                   *KeyData;
   LIST_ENTRY                     *Link;
   LIST_ENTRY                     *NotifyList;
   KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+  UINT64                         PassBegin;
+  UINT64                         PassBudget;
   EFI_TPL                        OldTpl;
 
   UsbKeyboardDevice = (USB_KB_DEV *)Context;
+  NotifyList        = &UsbKeyboardDevice->NotifyList;
+  KeyData           = &UsbKeyboardDevice->NotifyPendingKey;
+  PassBegin         = GetPerformanceCounter ();
+  PassBudget        = MultU64x32 (FixedPcdGet32 (PcdUsbXbox360NotifyPassBudgetUs), 1000);
 
-  //
-  // Invoke notification functions.
-  //
-  NotifyList = &UsbKeyboardDevice->NotifyList;
   while (TRUE) {
+    if (!UsbKeyboardDevice->NotifyPending) {
+      Status = DequeueKeyData (&UsbKeyboardDevice->EfiKeyQueueForNotify, &PackedKeyData);
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+
+      UnpackKeyData (PackedKeyData, KeyData);
+      USBKBD_TRACE (USBKBD_TRACE_NOTIFY, "UsbXbox360: notify scan 0x%lx unicode 0x%lx shift 0x%lx\n", KeyData->Key.ScanCode, KeyData->Key.UnicodeChar, KeyData->KeyState.KeyShiftState);
+      USB_KB_PREEMPTION_POINT ();
+
+      //
+      // From here on, unregistered entries stay linked until the delivery ends.
+      //
+      OldTpl                              = gBS->RaiseTPL (TPL_NOTIFY);
+      UsbKeyboardDevice->NotifyPending    = TRUE;
+      UsbKeyboardDevice->NotifyResumeLink = GetFirstNode (NotifyList);
+      gBS->RestoreTPL (OldTpl);
+    }
+
     //
-    // Enter critical section
-    //
-    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
-    Status = Dequeue (&UsbKeyboardDevice->EfiKeyQueueForNotify, &KeyData, sizeof (KeyData));
-    //
-    // Leave critical section
+    // Invoke notification functions. The next link is saved before the call,
+    // entries registered by the call are delivered the next key.
     //
-    gBS->RestoreTPL (OldTpl);
-    if (EFI_ERROR (Status)) {
-      break;
-    }
+    Link = UsbKeyboardDevice->NotifyResumeLink;
+    while (!IsNull (NotifyList, Link)) {
+      CurrentNotify                       = CR (Link, KEYBOARD_CONSOLE_IN_EX_NOTIFY, NotifyEntry, USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE);
+      Link                                = GetNextNode (NotifyList, Link);
+      UsbKeyboardDevice->NotifyResumeLink = Link;
+      if (CurrentNotify->Removed || !IsKeyRegistered (&CurrentNotify->KeyData, KeyData)) {
+        continue;
+      }
 
-    for (Link = GetFirstNode (NotifyList); !IsNull (NotifyList, Link); Link = GetNextNode (NotifyList, Link)) {
-      CurrentNotify = CR (Link, KEYBOARD_CONSOLE_IN_EX_NOTIFY, NotifyEntry, USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE);
-      if (IsKeyRegistered (&CurrentNotify->KeyData, &KeyData)) {
-        CurrentNotify->KeyNotificationFn (&KeyData);
+      USB_KB_PREEMPTION_POINT ();
+      if (CurrentNotify->Removed) {
+        continue;
+      }
+
+      InvokeKeyNotify (CurrentNotify, KeyData);
+
+      if (GetElapsedTime (PassBegin, GetPerformanceCounter ()) > PassBudget) {
+        if (IsNull (NotifyList, Link)) {
+          KeyNotifyEndDelivery (UsbKeyboardDevice);
+        }
+
+        gBS->SignalEvent (Event);
+        return;
       }
     }
+
+    KeyNotifyEndDelivery (UsbKeyboardDevice);
   }
 }
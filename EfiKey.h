@@ -17,9 +17,13 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include <Protocol/HiiDatabase.h>
 #include <Protocol/UsbIo.h>
 #include <Protocol/DevicePath.h>
+#include <Protocol/UsbXbox360.h>
+#include <Protocol/AbsolutePointer.h>
 
 #include <Guid/HiiKeyBoardLayout.h>
 #include <Guid/UsbKeyBoardLayout.h>
+#include <Guid/UsbXbox360Variable.h>
+#include <Guid/UsbXbox360InputError.h>
 
 #include <Library/DebugLib.h>
 #include <Library/ReportStatusCodeLib.h>
@@ -32,17 +36,41 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #include <Library/PcdLib.h>
 #include <Library/UefiUsbLib.h>
 #include <Library/HiiLib.h>
+#include <Library/TimerLib.h>
+#include <Library/SynchronizationLib.h>
 
 #include <IndustryStandard/Usb.h>
 
+#include "Trace.h"
+
 #define KEYBOARD_TIMER_INTERVAL  200000         // 0.02s
 
+//
+// Period of the service timer, which runs slow device housekeeping such as
+// the Chatpad keep-alive at TPL_CALLBACK.
+//
+#define USB_KB_SERVICE_INTERVAL  1000000        // 0.1s
+
 #define MAX_KEY_ALLOWED  32
 
+//
+// EfiKeyQueue and EfiKeyQueueForNotify hold packed keystrokes, one UINT64 each
+// with the key and its whole key state, and fit four times as many keys as
+// MAX_KEY_ALLOWED. The size must be a power of two, as the ring indexes are
+// free-running counters.
+//
+#define MAX_EFI_KEY_ALLOWED  (MAX_KEY_ALLOWED * 4)
+
 #define HZ                   1000 * 1000 * 10
 #define USBKBD_REPEAT_DELAY  ((HZ) / 2)
 #define USBKBD_REPEAT_RATE   ((HZ) / 50)
 
+//
+// Most repeats emitted by one late repeat timer callback. Repeats missed beyond
+// this are dropped rather than delivered as a burst.
+//
+#define USBKBD_REPEAT_MAX_CATCH_UP  4
+
 #define CLASS_HID          3
 #define SUBCLASS_BOOT      1
 #define PROTOCOL_KEYBOARD  1
@@ -53,15 +81,109 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 typedef struct {
   BOOLEAN    Down;
   UINT8      KeyCode;
+  //
+  // Performance counter when the key was queued, 0 if not recorded
+  //
+  UINT64     Time;
 } USB_KEY;
 
+//
+// The queue storage is embedded so that queue operations, including InitQueue(),
+// never touch the pool. KeyboardHandler(), the timer handlers and the ReadKeyStroke
+// paths must stay allocation-free; only Start/Stop, notify registration and the
+// keyboard layout code may allocate.
+//
+#define USB_SIMPLE_QUEUE_MAX_ITEM_SIZE  sizeof (USB_KEY)
+
 typedef struct {
-  VOID     *Buffer[MAX_KEY_ALLOWED + 1];
+  UINT8    Buffer[(MAX_KEY_ALLOWED + 1) * USB_SIMPLE_QUEUE_MAX_ITEM_SIZE];
   UINTN    Head;
   UINTN    Tail;
   UINTN    ItemSize;
 } USB_SIMPLE_QUEUE;
 
+//
+// Layout of a packed keystroke:
+//   Bits 0..15   EFI_INPUT_KEY.UnicodeChar
+//   Bits 16..31  EFI_INPUT_KEY.ScanCode
+//   Bits 32..41  KeyShiftState bits 0..9 (Shift, Ctrl, Alt, Logo, Menu and SysReq)
+//   Bits 48..54  KeyToggleState bits 0..6 (Scroll Lock, Num Lock, Caps Lock and
+//                EFI_KEY_STATE_EXPOSED)
+// The whole key state is taken when the keystroke is produced; UnpackKeyData()
+// only adds EFI_SHIFT_STATE_VALID and EFI_TOGGLE_STATE_VALID. The key and its
+// 14 state bits do not fit in 32 bits, so a keystroke takes a UINT64.
+//
+#define USB_KEY_DATA_UNICODE_MASK   0x0000FFFF
+#define USB_KEY_DATA_SCAN_SHIFT     16
+#define USB_KEY_DATA_SCAN_MASK      0xFFFF
+#define USB_KEY_DATA_SHIFT_SHIFT    32
+#define USB_KEY_DATA_SHIFT_MASK     0x3FF
+#define USB_KEY_DATA_TOGGLE_SHIFT   48
+#define USB_KEY_DATA_TOGGLE_MASK    0x7F
+#define USB_KEY_DATA_KEY_MASK       0xFFFFFFFF
+
+//
+// A ring of packed keystrokes. Head and Tail are free-running counters, the
+// slot of a counter is its value modulo MAX_EFI_KEY_ALLOWED.
+//
+// Producers run at TPL_NOTIFY, so they never preempt each other, and only they
+// move Tail. Several consumers move Head: ReadKeyStroke(), ReadKeyStrokeEx(),
+// KeyNotifyProcessHandler() and the flush on reset. Consumers run at any TPL up
+// to TPL_NOTIFY and take no lock, so a producer or another consumer may preempt
+// them anywhere. A consumer reads the slot at Head and then claims it by moving
+// Head with a compare-exchange; if another consumer moved Head first, it starts
+// over. A slot is only rewritten once Head has moved past it, so a successful
+// compare-exchange also proves the keystroke read was not overwritten. When the
+// ring is full the newest keystroke is dropped and counted.
+//
+typedef struct {
+  UINT64             Buffer[MAX_EFI_KEY_ALLOWED];
+  volatile UINT32    Head;
+  volatile UINT32    Tail;
+  UINT32             Dropped;
+} USB_KEY_DATA_QUEUE;
+
+//
+// The host-based tests play a producer or a consumer of higher TPL at the
+// preemption points of the consumers, where firmware events could interrupt them.
+//
+#if defined (EDKII_UNIT_TEST_FRAMEWORK_ENABLED)
+VOID
+UsbKbTestPreemptionPoint (
+  VOID
+  );
+
+#define USB_KB_PREEMPTION_POINT()  UsbKbTestPreemptionPoint ()
+#else
+#define USB_KB_PREEMPTION_POINT()
+#endif
+
+STATIC_ASSERT (
+  (MAX_EFI_KEY_ALLOWED & (MAX_EFI_KEY_ALLOWED - 1)) == 0,
+  "MAX_EFI_KEY_ALLOWED must be a power of two"
+  );
+
+//
+// Registrations counted per hash of the registered key, used to skip the notify
+// list walk for keys nobody registered. IsKeyRegistered() requires an exact
+// ScanCode and UnicodeChar match, so the hash only needs to cover those two
+// fields. Counts rather than bits let an unregistration update the filter
+// without walking the list.
+//
+#define USB_KB_NOTIFY_FILTER_SIZE  256
+
+//
+// Input errors are counted per class. The first error is reported at once, the ones
+// following it are folded into one status code per class every USB_KB_ERROR_REPORT_WINDOW
+// timer ticks (1s), so a flaky link cannot flood the status code listeners.
+//
+#define USB_KB_ERROR_CLASS_STALL    USB_XBOX360_INPUT_ERROR_STALL
+#define USB_KB_ERROR_CLASS_TIMEOUT  USB_XBOX360_INPUT_ERROR_TIMEOUT
+#define USB_KB_ERROR_CLASS_OTHER    USB_XBOX360_INPUT_ERROR_OTHER
+#define USB_KB_ERROR_CLASS_COUNT    3
+
+#define USB_KB_ERROR_REPORT_WINDOW  50
+
 #define USB_KB_DEV_SIGNATURE                   SIGNATURE_32 ('u', 'k', 'b', 'd')
 #define USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE  SIGNATURE_32 ('u', 'k', 'b', 'x')
 
@@ -70,6 +192,21 @@ typedef struct _KEYBOARD_CONSOLE_IN_EX_NOTIFY {
   EFI_KEY_DATA               KeyData;
   EFI_KEY_NOTIFY_FUNCTION    KeyNotificationFn;
   LIST_ENTRY                 NotifyEntry;
+
+  //
+  // Set when the notification is unregistered while a key is being delivered.
+  // The entry stays linked until the delivery ends, so the walk in
+  // KeyNotifyProcessHandler() never follows a freed link.
+  //
+  BOOLEAN                    Removed;
+
+  //
+  // Run time statistics of KeyNotificationFn, in nanoseconds
+  //
+  UINT64                     CallCount;
+  UINT64                     TotalTime;
+  UINT64                     MaxTime;
+  UINT64                     OverThresholdCount;
 } KEYBOARD_CONSOLE_IN_EX_NOTIFY;
 
 #define USB_NS_KEY_SIGNATURE  SIGNATURE_32 ('u', 'n', 's', 'k')
@@ -86,6 +223,7 @@ typedef struct {
   //
   // NsKey[0] : Non-spacing key
   // NsKey[1] ~ NsKey[KeyCount] : Physical keys
+  // The descriptors are allocated together with the USB_NS_KEY, right after it.
   //
   EFI_KEY_DESCRIPTOR    *NsKey;
 } USB_NS_KEY;
@@ -100,6 +238,206 @@ typedef struct {
   BOOLEAN  RightTriggerActive;
 } XBOX360_INPUT_STATE;
 
+//
+// Type and length, in bytes 0 and 1, of the controller input report
+//
+#define XBOX360_INPUT_REPORT_TYPE    0x00
+#define XBOX360_INPUT_REPORT_LENGTH  0x14
+
+///
+/// Touchpad exposed through EFI_ABSOLUTE_POINTER_PROTOCOL. State is written by
+/// KeyboardHandler() at TPL_NOTIFY and StateChanged is cleared by GetState().
+///
+typedef struct {
+  EFI_ABSOLUTE_POINTER_PROTOCOL    Protocol;
+  EFI_ABSOLUTE_POINTER_MODE        Mode;
+  EFI_ABSOLUTE_POINTER_STATE       State;
+  BOOLEAN                          StateChanged;
+  BOOLEAN                          Installed;
+} USB_KB_POINTER;
+
+typedef struct _USB_KB_BACKEND USB_KB_BACKEND;
+
+#define CHATPAD_STATE_UNKNOWN  0
+#define CHATPAD_STATE_ACTIVE   1
+#define CHATPAD_STATE_ABSENT   2
+#define CHATPAD_STATE_INIT     3
+
+///
+/// State of the Chatpad. State is only changed by the service timer;
+/// KeyboardHandler() asks for initialization through ReinitRequested.
+///
+typedef struct {
+  UINT8      State;
+  BOOLEAN    ReinitRequested;
+  //
+  // Next transfer of the initialization sequence
+  //
+  UINT8      InitStep;
+  UINT8      Modifiers;
+  UINT8      Keys[2];
+  BOOLEAN    KeepAliveToggle;
+  UINTN      KeepAliveTicks;
+} USB_KB_CHATPAD;
+
+//
+// Number of player slots. Devices beyond this use the map of players 2 and up.
+//
+#define USB_KB_MAX_PLAYERS  4
+
+#define USB_KB_MACRO_MAX_ENTRIES     64
+#define USB_KB_MACRO_REVISION        2
+#define USB_KB_MACRO_VARIABLE_NAME   L"UsbXbox360Macro"
+#define USB_KB_MACRO_RETRY_INTERVAL  KEYBOARD_TIMER_INTERVAL
+
+///
+/// One recorded keystroke. DelayMs is the time since the previous keystroke.
+///
+typedef struct {
+  UINT64    KeyData;
+  UINT16    DelayMs;
+  UINT16    Reserved[3];
+} USB_KB_MACRO_ENTRY;
+
+///
+/// Layout of the macro slot in the USB_KB_MACRO_VARIABLE_NAME variable. Only
+/// the first Count entries are stored.
+///
+typedef struct {
+  UINT16                Revision;
+  UINT16                Count;
+  UINT32                Reserved;
+  USB_KB_MACRO_ENTRY    Entries[USB_KB_MACRO_MAX_ENTRIES];
+} USB_KB_MACRO_SLOT;
+
+///
+/// State of the macro recorder
+///
+typedef struct {
+  USB_KB_MACRO_SLOT    Slot;
+  BOOLEAN              Recording;
+  UINT64               LastKeyTime;
+  UINTN                ReplayIndex;
+  BOOLEAN              ReplayPreserveTiming;
+  BOOLEAN              ReplayDelayDone;
+  EFI_EVENT            ReplayTimer;
+  EFI_EVENT            SaveEvent;
+} USB_KB_MACRO;
+
+//
+// Layout learned for a vendor-specific pad. Controls[0..15] are the buttons,
+// indexed by the bit number of the Xbox 360 button, and the last four are the
+// left stick pushed left, right, up and down.
+//
+#define USB_KB_LEARN_CONTROLS        20
+#define USB_KB_LEARN_STICK_LEFT      16
+#define USB_KB_LEARN_STICK_RIGHT     17
+#define USB_KB_LEARN_STICK_UP        18
+#define USB_KB_LEARN_STICK_DOWN      19
+#define USB_KB_LEARN_REVISION        1
+#define USB_KB_LEARN_VARIABLE_NAME   L"UsbXbox360Layout"
+#define USB_KB_LEARN_REPORT_MAX      64
+#define USB_KB_LEARN_OFFSET_NONE     0xFF
+
+///
+/// Extractor of one control. A button is active when the masked report byte
+/// equals Active; a stick direction is active when the byte is at least half
+/// way from Rest to Active.
+///
+typedef struct {
+  UINT8    Offset;
+  UINT8    Mask;
+  UINT8    Rest;
+  UINT8    Active;
+} USB_KB_LEARN_CONTROL;
+
+///
+/// Learned layout, saved per VID/PID in a non-volatile variable.
+///
+typedef struct {
+  UINT16                  Revision;
+  //
+  // Length of the input reports, reports of other lengths are ignored
+  //
+  UINT16                  ReportLength;
+  USB_KB_LEARN_CONTROL    Controls[USB_KB_LEARN_CONTROLS];
+} USB_KB_LEARN_LAYOUT;
+
+///
+/// State of the learn mode. Step is changed by the service timer, except that
+/// KeyboardHandler() starts learn mode on the learn chord; it also fills
+/// Candidate and sets Detected and Released.
+///
+typedef struct {
+  USB_KB_LEARN_LAYOUT     Layout;
+  BOOLEAN                 Learned;
+  //
+  // Report bytes covered by the learned controls, for the early exit
+  //
+  UINT8                   FirstByte;
+  UINT8                   ByteCount;
+  CHAR16                  VariableName[32];
+
+  UINT8                   Step;
+  UINTN                   Ticks;
+  UINTN                   BaselineReports;
+  UINT8                   Baseline[USB_KB_LEARN_REPORT_MAX];
+  UINT8                   Noise[USB_KB_LEARN_REPORT_MAX];
+  USB_KB_LEARN_CONTROL    Candidate;
+  BOOLEAN                 Detected;
+  BOOLEAN                 Released;
+} USB_KB_LEARN;
+
+//
+// Output reports are coalesced per slot: a report replaces the pending one of
+// its slot, so only the latest LED state, rumble level and Chatpad keep-alive
+// are sent. The control slot holds a device request without data stage.
+//
+#define USB_KB_OUTPUT_LED       0
+#define USB_KB_OUTPUT_RUMBLE    1
+#define USB_KB_OUTPUT_CONTROL   2
+#define USB_KB_OUTPUT_SLOTS     3
+#define USB_KB_OUTPUT_MAX_SIZE  8
+#define USB_KB_OUTPUT_TIMEOUT   20      // ms
+
+typedef struct {
+  EFI_USB_DEVICE_REQUEST    Request;
+  UINT8                     Data[USB_KB_OUTPUT_MAX_SIZE];
+  UINT8                     Length;
+  BOOLEAN                   Pending;
+} USB_KB_OUTPUT_REPORT;
+
+///
+/// Output reports waiting for the service timer. Slots are filled at up to
+/// TPL_NOTIFY and sent at TPL_CALLBACK, one transfer per tick starting at
+/// NextSlot, so a tick blocks for at most USB_KB_OUTPUT_TIMEOUT.
+///
+typedef struct {
+  USB_KB_OUTPUT_REPORT    Slots[USB_KB_OUTPUT_SLOTS];
+  UINTN                   NextSlot;
+} USB_KB_OUTPUT;
+
+///
+/// Key script playback, see Script.h. Keys holds the whole script in the packed
+/// form of the key queues; it is set up at TPL_CALLBACK and played at TPL_NOTIFY.
+///
+typedef struct {
+  UINT64     *Keys;
+  UINTN      Count;
+  UINTN      Next;
+  BOOLEAN    LoadRequested;
+} USB_KB_SCRIPT;
+
+///
+/// Telemetry of one controller. Record is updated at TPL_NOTIFY and written
+/// to VariableName when the driver stops or ExitBootServices() is signaled.
+///
+typedef struct {
+  USB_XBOX360_TELEMETRY    Record;
+  CHAR16                   VariableName[32];
+  EFI_EVENT                ExitBootServicesEvent;
+} USB_KB_TELEMETRY;
+
 ///
 /// Structure to describe USB keyboard device
 ///
@@ -107,17 +445,32 @@ typedef struct {
   UINTN                                Signature;
   EFI_HANDLE                           ControllerHandle;
   EFI_DEVICE_PATH_PROTOCOL             *DevicePath;
+  //
+  // CRC32 of DevicePath, stable across boots and bind order
+  //
+  UINT32                               DevicePathKey;
   EFI_EVENT                            DelayedRecoveryEvent;
   EFI_SIMPLE_TEXT_INPUT_PROTOCOL       SimpleInput;
   EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL    SimpleInputEx;
+  USB_XBOX360_PROTOCOL                 Xbox360;
   EFI_USB_IO_PROTOCOL                  *UsbIo;
+  CONST USB_KB_BACKEND                 *Backend;
+  USB_KB_POINTER                       Pointer;
 
   EFI_USB_INTERFACE_DESCRIPTOR         InterfaceDescriptor;
   EFI_USB_ENDPOINT_DESCRIPTOR          IntEndpointDescriptor;
+  //
+  // Interrupt OUT endpoint, 0 if the interface has none
+  //
+  UINT8                                IntOutEndpointAddress;
+  //
+  // Input bytes of the last report a backend decoded, for its early exit
+  //
+  UINT8                                ReportCache[16];
 
   USB_SIMPLE_QUEUE                     UsbKeyQueue;
-  USB_SIMPLE_QUEUE                     EfiKeyQueue;
-  USB_SIMPLE_QUEUE                     EfiKeyQueueForNotify;
+  USB_KEY_DATA_QUEUE                   EfiKeyQueue;
+  USB_KEY_DATA_QUEUE                   EfiKeyQueueForNotify;
   BOOLEAN                              CtrlOn;
   BOOLEAN                              AltOn;
   BOOLEAN                              ShiftOn;
@@ -125,11 +478,69 @@ typedef struct {
   BOOLEAN                              CapsOn;
   BOOLEAN                              ScrollOn;
   XBOX360_INPUT_STATE                  XboxState;
+  //
+  // Buttons consumed by a Guide chord, ignored until they are released
+  //
+  UINT16                               ChordButtons;
+  //
+  // Guide is held down but its key press is held back, as it may anchor a
+  // chord
+  //
+  BOOLEAN                              GuideKeyPending;
+  //
+  // Player slot, USB_KB_MAX_PLAYERS if none was free, and its button map
+  // indexed by the bit number of the button
+  //
+  UINT8                                PlayerIndex;
+  UINT8                                ButtonKeyCode[16];
+  USB_KB_MACRO                         Macro;
+  USB_KB_CHATPAD                       Chatpad;
+  USB_KB_TELEMETRY                     Telemetry;
+  USB_KB_LEARN                         Learn;
+  USB_KB_OUTPUT                        Output;
+  USB_KB_SCRIPT                        Script;
+  //
+  // Set by KeyboardHandler() on a stall, the halt is cleared by the recovery handler
+  //
+  BOOLEAN                              ClearHaltPending;
+  //
+  // The interrupt transfer is submitted, see EnsurePolling()
+  //
+  BOOLEAN                              Polling;
+  //
+  // The transfer was deleted after an error and waits for the recovery handler
+  //
+  BOOLEAN                              RecoveryPending;
+  //
+  // Reports are ignored while frames come from UsbXbox360InjectFrame()
+  //
+  BOOLEAN                              Injecting;
+  //
+  // Interval of the interrupt transfer in milliseconds and the performance
+  // counter at the last button transition, see PollingService()
+  //
+  UINT8                                PollingInterval;
+  UINT64                               LastActivityTime;
+  EFI_EVENT                            FastPollingEvent;
+  EFI_EVENT                            ServiceTimer;
 
   EFI_EVENT                            TimerEvent;
 
   UINT8                                RepeatKey;
   EFI_EVENT                            RepeatTimer;
+  //
+  // Performance counter at the last repeat callback, and the time from then
+  // until the next repeat is due, in 100ns units
+  //
+  UINT64                               RepeatLastTime;
+  INT64                                RepeatDue;
+
+  //
+  // Input error aggregation, see USB_KB_ERROR_REPORT_WINDOW
+  //
+  UINTN                                InputErrorWindow;
+  UINT32                               InputErrorCount[USB_KB_ERROR_CLASS_COUNT];
+  UINT32                               InputErrorResult[USB_KB_ERROR_CLASS_COUNT];
 
   EFI_UNICODE_STRING_TABLE             *ControllerNameTable;
 
@@ -153,6 +564,15 @@ typedef struct {
   //
   LIST_ENTRY                           NotifyList;
   EFI_EVENT                            KeyNotifyProcessEvent;
+  UINT16                               NotifyKeyFilter[USB_KB_NOTIFY_FILTER_SIZE];
+  //
+  // Key being delivered by KeyNotifyProcessHandler(), and the next entry to
+  // visit when the delivery is resumed after the pass budget ran out
+  //
+  BOOLEAN                              NotifyPending;
+  BOOLEAN                              NotifyRemoved;
+  EFI_KEY_DATA                         NotifyPendingKey;
+  LIST_ENTRY                           *NotifyResumeLink;
 
   //
   // Non-spacing key list
@@ -160,9 +580,92 @@ typedef struct {
   LIST_ENTRY                           NsKeyList;
   USB_NS_KEY                           *CurrentNsKey;
   EFI_KEY_DESCRIPTOR                   *KeyConvertionTable;
+  //
+  // The next layout is parsed into this table and then swapped with
+  // KeyConvertionTable, so no pool is used at TPL_NOTIFY.
+  //
+  EFI_KEY_DESCRIPTOR                   *SpareKeyConvertionTable;
   EFI_EVENT                            KeyboardLayoutEvent;
+  //
+  // Set by the layout event, the table is rebuilt by RefreshKeyboardLayout()
+  // from the TPL_CALLBACK service timer.
+  //
+  BOOLEAN                              KeyboardLayoutDirty;
 } USB_KB_DEV;
 
+/**
+  Decode an input report of the device into the normalized controller state.
+
+  Called from KeyboardHandler() at TPL_NOTIFY for every completed interrupt
+  transfer without error.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+typedef
+VOID
+(*USB_KB_BACKEND_HANDLE_REPORT)(
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+/**
+  Prepare the device for streaming input reports. Called by Start() before the
+  interrupt transfer is submitted.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The device is ready.
+  @retval Others                The device cannot be used.
+
+**/
+typedef
+EFI_STATUS
+(*USB_KB_BACKEND_INIT)(
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Run the periodic housekeeping of the device at TPL_CALLBACK.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+typedef
+VOID
+(*USB_KB_BACKEND_SERVICE)(
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+///
+/// A family of controllers sharing one report format
+///
+struct _USB_KB_BACKEND {
+  UINT16                          VendorId;
+  UINT16                          ProductId;
+  //
+  // Class of the interface carrying the input reports
+  //
+  UINT8                           InterfaceClass;
+  //
+  // Touchpad resolution, 0 if the controller has no touchpad
+  //
+  UINT16                          TouchpadMaxX;
+  UINT16                          TouchpadMaxY;
+  USB_KB_BACKEND_HANDLE_REPORT    HandleReport;
+  //
+  // Called on every service timer tick, NULL if not needed
+  //
+  USB_KB_BACKEND_SERVICE          Service;
+  //
+  // Called once by Start(), NULL if not needed
+  //
+  USB_KB_BACKEND_INIT             Init;
+};
+
 //
 // Global Variables
 //
@@ -174,6 +677,10 @@ extern EFI_COMPONENT_NAME2_PROTOCOL  gUsbKeyboardComponentName2;
     CR(a, USB_KB_DEV, SimpleInput, USB_KB_DEV_SIGNATURE)
 #define TEXT_INPUT_EX_USB_KB_DEV_FROM_THIS(a) \
     CR(a, USB_KB_DEV, SimpleInputEx, USB_KB_DEV_SIGNATURE)
+#define XBOX360_USB_KB_DEV_FROM_THIS(a) \
+    CR(a, USB_KB_DEV, Xbox360, USB_KB_DEV_SIGNATURE)
+#define POINTER_USB_KB_DEV_FROM_THIS(a) \
+    CR(a, USB_KB_DEV, Pointer.Protocol, USB_KB_DEV_SIGNATURE)
 
 //
 // According to Universal Serial Bus HID Usage Tables document ver 1.12,
@@ -523,6 +1030,7 @@ USBKeyboardSetState (
   @retval EFI_SUCCESS                 The notification function was registered successfully.
   @retval EFI_OUT_OF_RESOURCES        Unable to allocate resources for necessary data structures.
   @retval EFI_INVALID_PARAMETER       KeyData or NotifyHandle or KeyNotificationFunction is NULL.
+  @retval EFI_UNSUPPORTED             Key notifications are not supported by this build.
 
 **/
 EFI_STATUS
@@ -597,6 +1105,154 @@ IsKeyRegistered (
   IN EFI_KEY_DATA  *InputData
   );
 
+/**
+  Count a registration in the notify key filter, or stop counting it.
+
+  The caller holds TPL_NOTIFY, as the timer handler reads the filter.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Key                   The registered key.
+  @param  Add                   TRUE if the key was registered, FALSE if it was
+                                unregistered.
+
+**/
+VOID
+UpdateNotifyKeyFilter (
+  IN OUT USB_KB_DEV     *UsbKeyboardDevice,
+  IN     EFI_INPUT_KEY  *Key,
+  IN     BOOLEAN        Add
+  );
+
+/**
+  Check whether any registered notify may match the key.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Key                   The key that was pressed.
+
+  @retval TRUE                  A registered notify may match the key.
+  @retval FALSE                 No registered notify matches the key.
+
+**/
+BOOLEAN
+IsNotifyKeyCandidate (
+  IN USB_KB_DEV     *UsbKeyboardDevice,
+  IN EFI_INPUT_KEY  *Key
+  );
+
+/**
+  Retrieve the run time statistics of the registered key notification functions.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Count                 On input, the number of entries in Statistics.
+                                On output, the number of registered notification functions.
+  @param  Statistics            A buffer receiving one entry per registered notification function.
+
+  @retval EFI_SUCCESS           The statistics were returned.
+  @retval EFI_BUFFER_TOO_SMALL  Statistics is too small, Count holds the required number of entries.
+  @retval EFI_INVALID_PARAMETER Count is NULL, or Statistics is NULL while *Count is not 0.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360GetNotifyStatistics (
+  IN     USB_XBOX360_PROTOCOL           *This,
+  IN OUT UINTN                          *Count,
+  OUT    USB_XBOX360_NOTIFY_STATISTICS  *Statistics
+  );
+
+/**
+  Set the rumble level of the controller.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  LeftMotor             Level of the left, low frequency motor.
+  @param  RightMotor            Level of the right, high frequency motor.
+
+  @retval EFI_SUCCESS           The rumble level is queued.
+  @retval EFI_UNSUPPORTED       The controller has no rumble output.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360SetRumble (
+  IN USB_XBOX360_PROTOCOL  *This,
+  IN UINT8                 LeftMotor,
+  IN UINT8                 RightMotor
+  );
+
+/**
+  Feed a synthetic controller state into the input pipeline.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Frame                 The state to inject, or NULL to end the injection.
+
+  @retval EFI_SUCCESS           The frame was processed.
+  @retval EFI_OUT_OF_RESOURCES  The frame was processed, but some of its
+                                keystrokes did not fit in the key queue.
+  @retval EFI_UNSUPPORTED       Frame injection is not supported by this build.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360InjectFrame (
+  IN USB_XBOX360_PROTOCOL     *This,
+  IN CONST USB_XBOX360_FRAME  *Frame  OPTIONAL
+  );
+
+/**
+  Retrieve the polling interval of the controller and how often it changed.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Interval              The interval the controller is polled at, in milliseconds.
+  @param  SwitchCount           The number of polling interval changes since the
+                                controller was started.
+
+  @retval EFI_SUCCESS           The polling state was returned.
+  @retval EFI_INVALID_PARAMETER Interval or SwitchCount is NULL.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360GetPollingState (
+  IN  USB_XBOX360_PROTOCOL  *This,
+  OUT UINT8                 *Interval,
+  OUT UINT32                *SwitchCount
+  );
+
+/**
+  Select the trace categories the driver records.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Mask                  The categories to record, a combination of
+                                USB_XBOX360_TRACE_*.
+  @param  OldMask               Receives the categories recorded so far, optional.
+
+  @retval EFI_SUCCESS           The mask is set.
+  @retval EFI_UNSUPPORTED       No trace category is compiled in.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbXbox360SetTraceMask (
+  IN  USB_XBOX360_PROTOCOL  *This,
+  IN  UINT32                Mask,
+  OUT UINT32                *OldMask  OPTIONAL
+  );
+
+/**
+  Get the time elapsed between two performance counter values.
+
+  @param  Begin                 The performance counter value at the start.
+  @param  End                   The performance counter value at the end.
+
+  @return The elapsed time in nanoseconds.
+
+**/
+UINT64
+GetElapsedTime (
+  IN UINT64  Begin,
+  IN UINT64  End
+  );
+
 /**
   Timer handler to convert the key from USB.
 
@@ -610,6 +1266,19 @@ USBKeyboardTimerHandler (
   IN  VOID       *Context
   );
 
+/**
+  Service timer handler, running slow device housekeeping at TPL_CALLBACK.
+
+  @param  Event                    Indicates the event that invoke this function.
+  @param  Context                  Indicates the calling context.
+**/
+VOID
+EFIAPI
+USBKeyboardServiceHandler (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  );
+
 /**
   Process key notify.
 
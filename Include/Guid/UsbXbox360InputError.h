@@ -0,0 +1,50 @@
+/** @file
+  GUID and layout of the extended data the USB Xbox 360 controller driver
+  attaches to its aggregated EFI_P_EC_INPUT_ERROR status codes.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __USB_XBOX360_INPUT_ERROR_H__
+#define __USB_XBOX360_INPUT_ERROR_H__
+
+#define USB_XBOX360_INPUT_ERROR_DATA_GUID \
+  { \
+    0xd9a299f3, 0xb6c7, 0x40f6, { 0x9c, 0x86, 0xb3, 0xcc, 0x0c, 0x5f, 0x86, 0xce } \
+  }
+
+//
+// Classes of interrupt transfer errors
+//
+#define USB_XBOX360_INPUT_ERROR_STALL    0
+#define USB_XBOX360_INPUT_ERROR_TIMEOUT  1
+#define USB_XBOX360_INPUT_ERROR_OTHER    2
+
+///
+/// Extended data of an aggregated EFI_P_EC_INPUT_ERROR status code, one per
+/// error class seen in the report window.
+///
+typedef struct {
+  ///
+  /// The controller handle, which carries the device path of the controller.
+  ///
+  EFI_HANDLE    Controller;
+  ///
+  /// USB_XBOX360_INPUT_ERROR_*.
+  ///
+  UINT32        ErrorClass;
+  ///
+  /// Errors of the class folded into this status code.
+  ///
+  UINT32        Count;
+  ///
+  /// EFI_USB_ERR_* result of the last of them.
+  ///
+  UINT32        LastResult;
+} USB_XBOX360_INPUT_ERROR_DATA;
+
+extern EFI_GUID  gUsbXbox360InputErrorDataGuid;
+
+#endif
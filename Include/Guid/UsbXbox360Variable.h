@@ -0,0 +1,91 @@
+/** @file
+  GUID of the variables owned by the USB Xbox 360 controller driver, and the
+  telemetry record the driver leaves behind for the OS.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __USB_XBOX360_VARIABLE_H__
+#define __USB_XBOX360_VARIABLE_H__
+
+#define USB_XBOX360_VARIABLE_GUID \
+  { \
+    0x2667d0d0, 0x0bda, 0x4b63, { 0xbc, 0x28, 0x2a, 0x75, 0xa9, 0xba, 0xda, 0x91 } \
+  }
+
+//
+// One volatile telemetry variable is written per controller when the driver
+// stops managing it or ExitBootServices() is signaled. The name is the prefix
+// followed by the CRC32 of the controller device path in 8 uppercase hex
+// digits, so a controller keeps its name across boots and rebinds.
+//
+#define USB_XBOX360_TELEMETRY_VARIABLE_PREFIX  L"UsbXbox360Telemetry"
+#define USB_XBOX360_TELEMETRY_REVISION         3
+
+//
+// Latency is measured from the report that produced a keystroke until the
+// keystroke is ready to be read. Bucket 0 counts keystrokes ready within 1 ms,
+// bucket N those that took from 2^(N-1) up to 2^N ms, and the last bucket
+// everything slower.
+//
+#define USB_XBOX360_TELEMETRY_LATENCY_BUCKETS  8
+#define USB_XBOX360_TELEMETRY_BUTTONS          16
+
+#pragma pack(1)
+
+///
+/// Telemetry record of one controller.
+///
+typedef struct {
+  ///
+  /// USB_XBOX360_TELEMETRY_REVISION. Later revisions only append fields.
+  ///
+  UINT16    Revision;
+  ///
+  /// Size of the record in bytes.
+  ///
+  UINT16    Size;
+  UINT16    VendorId;
+  UINT16    ProductId;
+  ///
+  /// Input reports received without a transfer error.
+  ///
+  UINT32    ReportCount;
+  ///
+  /// Keystrokes thrown away because a key queue was full.
+  ///
+  UINT32    DropCount;
+  ///
+  /// Interrupt transfers that completed with an error.
+  ///
+  UINT32    ErrorCount;
+  ///
+  /// Interrupt transfers resubmitted after an error.
+  ///
+  UINT32    RecoveryCount;
+  UINT32    LatencyBuckets[USB_XBOX360_TELEMETRY_LATENCY_BUCKETS];
+  ///
+  /// Presses of each button, indexed by the bit number of the Xbox 360 button.
+  ///
+  UINT32    PressCount[USB_XBOX360_TELEMETRY_BUTTONS];
+  ///
+  /// Output reports sent, their bytes, and the reports replaced by a newer
+  /// one before they were sent. Added in revision 2.
+  ///
+  UINT32    OutputReportCount;
+  UINT32    OutputByteCount;
+  UINT32    OutputCoalescedCount;
+  ///
+  /// Switches between the idle and the active polling interval. Added in
+  /// revision 3.
+  ///
+  UINT32    PollingSwitchCount;
+} USB_XBOX360_TELEMETRY;
+
+#pragma pack()
+
+extern EFI_GUID  gUsbXbox360VariableGuid;
+
+#endif
@@ -0,0 +1,232 @@
+/** @file
+  USB Xbox 360 Controller Protocol.
+
+  This protocol is installed next to the Simple Text Input protocols on every
+  controller managed by the USB Xbox 360 controller driver. It exposes driver
+  statistics and controller outputs which are not covered by the standard
+  console protocols.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __USB_XBOX360_PROTOCOL_H__
+#define __USB_XBOX360_PROTOCOL_H__
+
+#include <Protocol/SimpleTextInEx.h>
+
+#define USB_XBOX360_PROTOCOL_GUID \
+  { \
+    0x64281f76, 0xf4e9, 0x43d2, { 0xb8, 0xfb, 0x3f, 0xf3, 0xe3, 0x3c, 0xeb, 0x27 } \
+  }
+
+#define USB_XBOX360_PROTOCOL_REVISION  0x00010004
+
+typedef struct _USB_XBOX360_PROTOCOL USB_XBOX360_PROTOCOL;
+
+///
+/// Run time statistics of one registered key notification function.
+///
+typedef struct {
+  ///
+  /// The handle returned by RegisterKeyNotify().
+  ///
+  VOID                       *NotifyHandle;
+  EFI_KEY_NOTIFY_FUNCTION    KeyNotificationFunction;
+  UINT64                     CallCount;
+  ///
+  /// Cumulative and longest run time of the notification function, in nanoseconds.
+  ///
+  UINT64                     TotalTime;
+  UINT64                     MaxTime;
+  ///
+  /// Number of calls which ran longer than the driver's notify time threshold.
+  ///
+  UINT64                     OverThresholdCount;
+} USB_XBOX360_NOTIFY_STATISTICS;
+
+/**
+  Retrieve the run time statistics of the registered key notification functions.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Count                 On input, the number of entries in Statistics.
+                                On output, the number of registered notification functions.
+  @param  Statistics            A buffer receiving one entry per registered notification function.
+
+  @retval EFI_SUCCESS           The statistics were returned.
+  @retval EFI_BUFFER_TOO_SMALL  Statistics is too small, Count holds the required number of entries.
+  @retval EFI_INVALID_PARAMETER Count is NULL, or Statistics is NULL while *Count is not 0.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *USB_XBOX360_GET_NOTIFY_STATISTICS)(
+  IN     USB_XBOX360_PROTOCOL           *This,
+  IN OUT UINTN                          *Count,
+  OUT    USB_XBOX360_NOTIFY_STATISTICS  *Statistics
+  );
+
+///
+/// Button bits of USB_XBOX360_FRAME.Buttons. They follow the button word of
+/// the wired Xbox 360 input report, whatever the controller.
+///
+#define USB_XBOX360_BUTTON_DPAD_UP         0x0001
+#define USB_XBOX360_BUTTON_DPAD_DOWN       0x0002
+#define USB_XBOX360_BUTTON_DPAD_LEFT       0x0004
+#define USB_XBOX360_BUTTON_DPAD_RIGHT      0x0008
+#define USB_XBOX360_BUTTON_START           0x0010
+#define USB_XBOX360_BUTTON_BACK            0x0020
+#define USB_XBOX360_BUTTON_LEFT_THUMB      0x0040
+#define USB_XBOX360_BUTTON_RIGHT_THUMB     0x0080
+#define USB_XBOX360_BUTTON_LEFT_SHOULDER   0x0100
+#define USB_XBOX360_BUTTON_RIGHT_SHOULDER  0x0200
+#define USB_XBOX360_BUTTON_GUIDE           0x0400
+#define USB_XBOX360_BUTTON_A               0x1000
+#define USB_XBOX360_BUTTON_B               0x2000
+#define USB_XBOX360_BUTTON_X               0x4000
+#define USB_XBOX360_BUTTON_Y               0x8000
+
+///
+/// Normalized controller state, as every backend decodes its reports into.
+///
+typedef struct {
+  ///
+  /// Pressed buttons, a combination of USB_XBOX360_BUTTON_*.
+  ///
+  UINT16     Buttons;
+  ///
+  /// Direction of the left stick: -1 left or down, 0 centered, 1 right or up.
+  ///
+  INT8       LeftStickX;
+  INT8       LeftStickY;
+  BOOLEAN    LeftTrigger;
+  BOOLEAN    RightTrigger;
+} USB_XBOX360_FRAME;
+
+/**
+  Set the rumble level of the controller.
+
+  The level is sent asynchronously; a level set before the previous one was
+  sent replaces it.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  LeftMotor             Level of the left, low frequency motor.
+  @param  RightMotor            Level of the right, high frequency motor.
+
+  @retval EFI_SUCCESS           The rumble level is queued.
+  @retval EFI_UNSUPPORTED       The controller has no rumble output.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *USB_XBOX360_SET_RUMBLE)(
+  IN USB_XBOX360_PROTOCOL  *This,
+  IN UINT8                 LeftMotor,
+  IN UINT8                 RightMotor
+  );
+
+/**
+  Feed a synthetic controller state into the input pipeline.
+
+  The frame goes through the same button diff, repeat and key translation as a
+  report from the controller, and the resulting keystrokes are queued before
+  the function returns. From the first frame on, reports from the controller
+  are ignored, until a NULL frame releases every injected button and hands the
+  input back to the controller. Keystrokes that do not fit in the key queue are
+  dropped, as for a report, and the call fails so the caller can read and retry.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Frame                 The state to inject, or NULL to end the injection.
+
+  @retval EFI_SUCCESS           The frame was processed.
+  @retval EFI_OUT_OF_RESOURCES  The frame was processed, but some of its
+                                keystrokes did not fit in the key queue.
+  @retval EFI_UNSUPPORTED       Frame injection is not supported by this build.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *USB_XBOX360_INJECT_FRAME)(
+  IN USB_XBOX360_PROTOCOL     *This,
+  IN CONST USB_XBOX360_FRAME  *Frame  OPTIONAL
+  );
+
+/**
+  Retrieve the polling interval of the controller and how often it changed.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Interval              The interval the controller is polled at, in milliseconds.
+  @param  SwitchCount           The number of polling interval changes since the
+                                controller was started.
+
+  @retval EFI_SUCCESS           The polling state was returned.
+  @retval EFI_INVALID_PARAMETER Interval or SwitchCount is NULL.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *USB_XBOX360_GET_POLLING_STATE)(
+  IN  USB_XBOX360_PROTOCOL  *This,
+  OUT UINT8                 *Interval,
+  OUT UINT32                *SwitchCount
+  );
+
+///
+/// Trace categories of the driver.
+///
+#define USB_XBOX360_TRACE_REPORT     0x00000001
+#define USB_XBOX360_TRACE_DIFF       0x00000002
+#define USB_XBOX360_TRACE_QUEUE      0x00000004
+#define USB_XBOX360_TRACE_TRANSLATE  0x00000008
+#define USB_XBOX360_TRACE_NOTIFY     0x00000010
+#define USB_XBOX360_TRACE_LAYOUT     0x00000020
+#define USB_XBOX360_TRACE_RECOVERY   0x00000040
+
+/**
+  Select the trace categories the driver records.
+
+  The mask applies to every controller managed by the driver. Categories which
+  are not compiled in are ignored.
+
+  @param  This                  A pointer to the USB_XBOX360_PROTOCOL instance.
+  @param  Mask                  The categories to record, a combination of
+                                USB_XBOX360_TRACE_*.
+  @param  OldMask               Receives the categories recorded so far, optional.
+
+  @retval EFI_SUCCESS           The mask is set.
+  @retval EFI_UNSUPPORTED       No trace category is compiled in.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *USB_XBOX360_SET_TRACE_MASK)(
+  IN  USB_XBOX360_PROTOCOL  *This,
+  IN  UINT32                Mask,
+  OUT UINT32                *OldMask  OPTIONAL
+  );
+
+struct _USB_XBOX360_PROTOCOL {
+  UINT64                               Revision;
+  USB_XBOX360_GET_NOTIFY_STATISTICS    GetNotifyStatistics;
+  ///
+  /// Added in revision 0x00010001.
+  ///
+  USB_XBOX360_SET_RUMBLE               SetRumble;
+  ///
+  /// Added in revision 0x00010002.
+  ///
+  USB_XBOX360_INJECT_FRAME             InjectFrame;
+  ///
+  /// Added in revision 0x00010003.
+  ///
+  USB_XBOX360_GET_POLLING_STATE        GetPollingState;
+  ///
+  /// Added in revision 0x00010004.
+  ///
+  USB_XBOX360_SET_TRACE_MASK           SetTraceMask;
+};
+
+extern EFI_GUID  gUsbXbox360ProtocolGuid;
+
+#endif
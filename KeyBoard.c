@@ -8,25 +8,13 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 **/
 
 #include "KeyBoard.h"
-
-#define XBOX360_VENDOR_ID              0x045E
-#define XBOX360_PRODUCT_ID             0x028E
-
-#define XBOX360_BUTTON_DPAD_UP         BIT0
-#define XBOX360_BUTTON_DPAD_DOWN       BIT1
-#define XBOX360_BUTTON_DPAD_LEFT       BIT2
-#define XBOX360_BUTTON_DPAD_RIGHT      BIT3
-#define XBOX360_BUTTON_START           BIT4
-#define XBOX360_BUTTON_BACK            BIT5
-#define XBOX360_BUTTON_LEFT_THUMB      BIT6
-#define XBOX360_BUTTON_RIGHT_THUMB     BIT7
-#define XBOX360_BUTTON_LEFT_SHOULDER   BIT8
-#define XBOX360_BUTTON_RIGHT_SHOULDER  BIT9
-#define XBOX360_BUTTON_GUIDE           BIT10
-#define XBOX360_BUTTON_A               BIT12
-#define XBOX360_BUTTON_B               BIT13
-#define XBOX360_BUTTON_X               BIT14
-#define XBOX360_BUTTON_Y               BIT15
+#include "Macro.h"
+#include "Chatpad.h"
+#include "Sony.h"
+#include "SwitchPro.h"
+#include "Learn.h"
+#include "Output.h"
+#include "Script.h"
 
 typedef struct {
   UINT16    ButtonMask;
@@ -51,23 +39,72 @@ STATIC CONST XBOX360_BUTTON_MAP  mXbox360ButtonMap[] = {
   { XBOX360_BUTTON_DPAD_RIGHT,     0x4F }  // Right Arrow
 };
 
+//
+// Player slots in use, one bit per slot
+//
+STATIC UINT32  mPlayerSlotMap;
+
 STATIC
 VOID
-QueueButtonTransition (
-  IN USB_KB_DEV  *UsbKeyboardDevice,
-  IN UINT8       KeyCode,
-  IN BOOLEAN     IsPressed
+Xbox360HandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
   );
 
 STATIC
 VOID
-ProcessButtonChanges (
-  IN USB_KB_DEV  *UsbKeyboardDevice,
-  IN UINT16      OldButtons,
-  IN UINT16      NewButtons
+Xbox360Service (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+STATIC
+EFI_STATUS
+Xbox360Init (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
   );
 
-USB_KEYBOARD_LAYOUT_PACK_BIN  mUsbKeyboardLayoutBin = {
+//
+// Supported controllers
+//
+STATIC CONST USB_KB_BACKEND  mBackends[] = {
+  {
+    XBOX360_VENDOR_ID,      XBOX360_PRODUCT_ID,     0xFF,
+    0,                      0,
+    Xbox360HandleReport,    Xbox360Service,         Xbox360Init
+  },
+  {
+    SONY_VENDOR_ID,         DUALSHOCK4_PRODUCT_ID,  CLASS_HID,
+    DUALSHOCK4_TOUCH_MAX_X, DUALSHOCK4_TOUCH_MAX_Y,
+    DualShock4HandleReport, NULL,                   NULL
+  },
+  {
+    SONY_VENDOR_ID,         DUALSHOCK4_PRODUCT_ID2, CLASS_HID,
+    DUALSHOCK4_TOUCH_MAX_X, DUALSHOCK4_TOUCH_MAX_Y,
+    DualShock4HandleReport, NULL,                   NULL
+  },
+  {
+    SONY_VENDOR_ID,         DUALSENSE_PRODUCT_ID,   CLASS_HID,
+    DUALSENSE_TOUCH_MAX_X,  DUALSENSE_TOUCH_MAX_Y,
+    DualSenseHandleReport,  NULL,                   NULL
+  },
+  {
+    NINTENDO_VENDOR_ID,     SWITCH_PRO_PRODUCT_ID,  CLASS_HID,
+    0,                      0,
+    SwitchProHandleReport,  NULL,                   SwitchProInit
+  }
+};
+
+//
+// Any other XInput interface, decoded through a learned layout
+//
+STATIC CONST USB_KB_BACKEND  mLearnBackend = {
+  0,                      0,                      0xFF,
+  0,                      0,
+  LearnHandleReport,      LearnService,           LearnInit
+};
+
+STATIC USB_KEYBOARD_LAYOUT_PACK_BIN  mUsbKeyboardLayoutBin = {
   sizeof (USB_KEYBOARD_LAYOUT_PACK_BIN),   // Binary size
 
   //
@@ -198,6 +235,27 @@ USB_KEYBOARD_LAYOUT_PACK_BIN  mUsbKeyboardLayoutBin = {
   u"English Keyboard",                                // DescriptionString[]
 };
 
+//
+// Key descriptors for the keys in mXbox360ButtonMap, used instead of a keyboard
+// layout when PcdUsbXbox360HiiLayoutSupport is FALSE.
+//
+STATIC CONST EFI_KEY_DESCRIPTOR  mXbox360FixedKeyDescriptors[] = {
+  { EfiKeySpaceBar,   ' ',  ' ',  0, 0, EFI_NULL_MODIFIER,         0 },
+  { EfiKeyTab,        0x09, 0x09, 0, 0, EFI_NULL_MODIFIER,         0 },
+  { EfiKeyEnter,      0x0d, 0x0d, 0, 0, EFI_NULL_MODIFIER,         0 },
+  { EfiKeyEsc,        0x1b, 0x1b, 0, 0, EFI_NULL_MODIFIER,         0 },
+  { EfiKeyBackSpace,  0x08, 0x08, 0, 0, EFI_NULL_MODIFIER,         0 },
+  { EfiKeyPgUp,       0x00, 0x00, 0, 0, EFI_PAGE_UP_MODIFIER,      0 },
+  { EfiKeyPgDn,       0x00, 0x00, 0, 0, EFI_PAGE_DOWN_MODIFIER,    0 },
+  { EfiKeyUpArrow,    0x00, 0x00, 0, 0, EFI_UP_ARROW_MODIFIER,     0 },
+  { EfiKeyDownArrow,  0x00, 0x00, 0, 0, EFI_DOWN_ARROW_MODIFIER,   0 },
+  { EfiKeyLeftArrow,  0x00, 0x00, 0, 0, EFI_LEFT_ARROW_MODIFIER,   0 },
+  { EfiKeyRightArrow, 0x00, 0x00, 0, 0, EFI_RIGHT_ARROW_MODIFIER,  0 },
+  { EfiKeyLCtrl,      0,    0,    0, 0, EFI_LEFT_CONTROL_MODIFIER, 0 },
+  { EfiKeyLShift,     0,    0,    0, 0, EFI_LEFT_SHIFT_MODIFIER,   0 },
+  { EfiKeyLAlt,       0,    0,    0, 0, EFI_LEFT_ALT_MODIFIER,     0 },
+};
+
 //
 // EFI_KEY to USB Keycode conversion table
 // EFI_KEY is defined in UEFI spec.
@@ -427,21 +485,63 @@ IsUSBKeyboard (
   IN  EFI_USB_IO_PROTOCOL  *UsbIo
   )
 {
-  EFI_STATUS                  Status;
-  EFI_USB_DEVICE_DESCRIPTOR   DeviceDescriptor;
+  return (BOOLEAN)(FindBackend (UsbIo) != NULL);
+}
+
+/**
+  Find the backend decoding the input reports of a device.
+
+  @param  UsbIo    Pointer to a USB I/O protocol instance.
+
+  @return The backend, or NULL if the device is not supported.
+
+**/
+CONST USB_KB_BACKEND *
+FindBackend (
+  IN  EFI_USB_IO_PROTOCOL  *UsbIo
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_USB_DEVICE_DESCRIPTOR     DeviceDescriptor;
+  EFI_USB_INTERFACE_DESCRIPTOR  InterfaceDescriptor;
+  UINTN                         Index;
 
   Status = UsbIo->UsbGetDeviceDescriptor (UsbIo, &DeviceDescriptor);
   if (EFI_ERROR (Status)) {
-    return FALSE;
+    return NULL;
+  }
+
+  Status = UsbIo->UsbGetInterfaceDescriptor (UsbIo, &InterfaceDescriptor);
+  if (EFI_ERROR (Status)) {
+    return NULL;
   }
 
-  if ((DeviceDescriptor.IdVendor == XBOX360_VENDOR_ID) &&
-      (DeviceDescriptor.IdProduct == XBOX360_PRODUCT_ID))
+  for (Index = 0; Index < ARRAY_SIZE (mBackends); Index++) {
+    if ((DeviceDescriptor.IdVendor == mBackends[Index].VendorId) &&
+        (DeviceDescriptor.IdProduct == mBackends[Index].ProductId) &&
+        (InterfaceDescriptor.InterfaceClass == mBackends[Index].InterfaceClass))
+    {
+      if ((mBackends[Index].VendorId == SONY_VENDOR_ID) && !FeaturePcdGet (PcdUsbXbox360SonySupport)) {
+        return NULL;
+      }
+
+      if ((mBackends[Index].VendorId == NINTENDO_VENDOR_ID) && !FeaturePcdGet (PcdUsbXbox360SwitchProSupport)) {
+        return NULL;
+      }
+
+      return &mBackends[Index];
+    }
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360LearnSupport) &&
+      (InterfaceDescriptor.InterfaceClass == mLearnBackend.InterfaceClass) &&
+      (InterfaceDescriptor.InterfaceSubClass == XINPUT_INTERFACE_SUBCLASS) &&
+      (InterfaceDescriptor.InterfaceProtocol == XINPUT_INTERFACE_PROTOCOL))
   {
-    return TRUE;
+    return &mLearnBackend;
   }
 
-  return FALSE;
+  return NULL;
 }
 
 /**
@@ -505,19 +605,20 @@ GetCurrentKeyboardLayout (
 }
 
 /**
-  Find Key Descriptor in Key Convertion Table given its USB keycode.
+  Find Key Descriptor in a Key Convertion Table given its USB keycode.
 
-  @param  UsbKeyboardDevice   The USB_KB_DEV instance.
+  @param  KeyConvertionTable  The Key Convertion Table.
   @param  KeyCode             USB Keycode.
 
-  @return The Key Descriptor in Key Convertion Table.
+  @return The Key Descriptor in the table.
           NULL means not found.
 
 **/
+STATIC
 EFI_KEY_DESCRIPTOR *
-GetKeyDescriptor (
-  IN USB_KB_DEV  *UsbKeyboardDevice,
-  IN UINT8       KeyCode
+LookupKeyDescriptor (
+  IN EFI_KEY_DESCRIPTOR  *KeyConvertionTable,
+  IN UINT8               KeyCode
   )
 {
   UINT8  Index;
@@ -538,7 +639,26 @@ GetKeyDescriptor (
     Index = (UINT8)(KeyCode - 0xe0 + NUMBER_OF_VALID_NON_MODIFIER_USB_KEYCODE);
   }
 
-  return &UsbKeyboardDevice->KeyConvertionTable[Index];
+  return &KeyConvertionTable[Index];
+}
+
+/**
+  Find Key Descriptor in Key Convertion Table given its USB keycode.
+
+  @param  UsbKeyboardDevice   The USB_KB_DEV instance.
+  @param  KeyCode             USB Keycode.
+
+  @return The Key Descriptor in Key Convertion Table.
+          NULL means not found.
+
+**/
+EFI_KEY_DESCRIPTOR *
+GetKeyDescriptor (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINT8       KeyCode
+  )
+{
+  return LookupKeyDescriptor (UsbKeyboardDevice->KeyConvertionTable, KeyCode);
 }
 
 /**
@@ -615,12 +735,87 @@ FindPhysicalKey (
   return KeyDescriptor;
 }
 
+/**
+  Initialize Key Convertion Table with the fixed key set of the controller.
+
+  @param  UsbKeyboardDevice    The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+InstallFixedKeyDescriptors (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_KEY_DESCRIPTOR  *TableEntry;
+  UINTN               Index;
+
+  for (Index = 0; Index < ARRAY_SIZE (mXbox360FixedKeyDescriptors); Index++) {
+    TableEntry = GetKeyDescriptor (
+                   UsbKeyboardDevice,
+                   EfiKeyToUsbKeyCodeConvertionTable[mXbox360FixedKeyDescriptors[Index].Key]
+                   );
+    ASSERT (TableEntry != NULL);
+    CopyMem (TableEntry, &mXbox360FixedKeyDescriptors[Index], sizeof (EFI_KEY_DESCRIPTOR));
+  }
+}
+
+/**
+  Free a non-spacing key list of a keyboard layout.
+
+  @param  NsKeyList            The list of USB_NS_KEY to free.
+
+**/
+STATIC
+VOID
+FreeNsKeyList (
+  IN OUT LIST_ENTRY  *NsKeyList
+  )
+{
+  USB_NS_KEY  *UsbNsKey;
+  LIST_ENTRY  *Link;
+
+  while (!IsListEmpty (NsKeyList)) {
+    Link     = GetFirstNode (NsKeyList);
+    UsbNsKey = USB_NS_KEY_FORM_FROM_LINK (Link);
+    RemoveEntryList (&UsbNsKey->Link);
+
+    FreePool (UsbNsKey);
+  }
+}
+
+/**
+  Move all entries of a non-spacing key list to another, empty list.
+
+  @param  Destination          The empty list receiving the entries.
+  @param  Source               The list to empty.
+
+**/
+STATIC
+VOID
+MoveNsKeyList (
+  OUT    LIST_ENTRY  *Destination,
+  IN OUT LIST_ENTRY  *Source
+  )
+{
+  LIST_ENTRY  *Link;
+
+  InitializeListHead (Destination);
+  while (!IsListEmpty (Source)) {
+    Link = GetFirstNode (Source);
+    RemoveEntryList (Link);
+    InsertTailList (Destination, Link);
+  }
+}
+
 /**
   The notification function for EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID.
 
   This function is registered to event of EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID
   group type, which will be triggered by EFI_HII_DATABASE_PROTOCOL.SetKeyboardLayout().
-  It tries to get current keyboard layout from HII database.
+  Setup often sets the layout several times in a row, so the layout is only
+  marked dirty here and RefreshKeyboardLayout() reads it once, before the next
+  key is translated.
 
   @param  Event        Event being signaled.
   @param  Context      Points to USB_KB_DEV instance.
@@ -633,37 +828,48 @@ SetKeyboardLayoutEvent (
   IN VOID       *Context
   )
 {
-  USB_KB_DEV               *UsbKeyboardDevice;
-  EFI_HII_KEYBOARD_LAYOUT  *KeyboardLayout;
-  EFI_KEY_DESCRIPTOR       TempKey;
-  EFI_KEY_DESCRIPTOR       *KeyDescriptor;
-  EFI_KEY_DESCRIPTOR       *TableEntry;
-  EFI_KEY_DESCRIPTOR       *NsKey;
-  USB_NS_KEY               *UsbNsKey;
-  UINTN                    Index;
-  UINTN                    Index2;
-  UINTN                    KeyCount;
-  UINT8                    KeyCode;
+  USB_KB_DEV  *UsbKeyboardDevice;
 
   UsbKeyboardDevice = (USB_KB_DEV *)Context;
   if (UsbKeyboardDevice->Signature != USB_KB_DEV_SIGNATURE) {
     return;
   }
 
-  //
-  // Try to get current keyboard layout from HII database
-  //
-  KeyboardLayout = GetCurrentKeyboardLayout ();
-  if (KeyboardLayout == NULL) {
-    return;
-  }
+  USBKBD_TRACE (USBKBD_TRACE_LAYOUT, "UsbXbox360: layout change signaled, already dirty %lu\n", UsbKeyboardDevice->KeyboardLayoutDirty, 0, 0);
 
-  //
-  // Re-allocate resource for KeyConvertionTable
-  //
-  ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
-  UsbKeyboardDevice->KeyConvertionTable = AllocateZeroPool ((NUMBER_OF_VALID_USB_KEYCODE)*sizeof (EFI_KEY_DESCRIPTOR));
-  ASSERT (UsbKeyboardDevice->KeyConvertionTable != NULL);
+  UsbKeyboardDevice->KeyboardLayoutDirty = TRUE;
+}
+
+/**
+  Parse an HII keyboard layout into a Key Convertion Table.
+
+  @param  KeyboardLayout       The HII keyboard layout.
+  @param  KeyConvertionTable   The zeroed table receiving the key descriptors.
+  @param  NsKeyList            The empty list receiving the non-spacing keys.
+
+  @retval EFI_SUCCESS            The layout was parsed.
+  @retval EFI_INVALID_PARAMETER  The layout has an unknown key or a key without
+                                 USB keycode.
+  @retval EFI_OUT_OF_RESOURCES   A non-spacing key could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+ParseKeyboardLayout (
+  IN     EFI_HII_KEYBOARD_LAYOUT  *KeyboardLayout,
+  IN OUT EFI_KEY_DESCRIPTOR       *KeyConvertionTable,
+  IN OUT LIST_ENTRY               *NsKeyList
+  )
+{
+  EFI_KEY_DESCRIPTOR  TempKey;
+  EFI_KEY_DESCRIPTOR  *KeyDescriptor;
+  EFI_KEY_DESCRIPTOR  *TableEntry;
+  EFI_KEY_DESCRIPTOR  *NsKey;
+  USB_NS_KEY          *UsbNsKey;
+  UINTN               Index;
+  UINTN               Index2;
+  UINTN               KeyCount;
+  UINT8               KeyCode;
 
   //
   // Traverse the list of key descriptors following the header of EFI_HII_KEYBOARD_LAYOUT
@@ -674,16 +880,17 @@ SetKeyboardLayoutEvent (
     // Copy from HII keyboard layout package binary for alignment
     //
     CopyMem (&TempKey, KeyDescriptor, sizeof (EFI_KEY_DESCRIPTOR));
+    if ((UINT8)(TempKey.Key) >= ARRAY_SIZE (EfiKeyToUsbKeyCodeConvertionTable)) {
+      return EFI_INVALID_PARAMETER;
+    }
 
     //
     // Fill the key into KeyConvertionTable, whose index is calculated from USB keycode.
     //
     KeyCode    = EfiKeyToUsbKeyCodeConvertionTable[(UINT8)(TempKey.Key)];
-    TableEntry = GetKeyDescriptor (UsbKeyboardDevice, KeyCode);
+    TableEntry = LookupKeyDescriptor (KeyConvertionTable, KeyCode);
     if (TableEntry == NULL) {
-      ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
-      FreePool (KeyboardLayout);
-      return;
+      return EFI_INVALID_PARAMETER;
     }
 
     CopyMem (TableEntry, KeyDescriptor, sizeof (EFI_KEY_DESCRIPTOR));
@@ -692,11 +899,9 @@ SetKeyboardLayoutEvent (
     // For non-spacing key, create the list with a non-spacing key followed by physical keys.
     //
     if (TempKey.Modifier == EFI_NS_KEY_MODIFIER) {
-      UsbNsKey = AllocateZeroPool (sizeof (USB_NS_KEY));
-      ASSERT (UsbNsKey != NULL);
-
       //
-      // Search for sequential children physical key definitions
+      // Search for sequential children physical key definitions. They are skipped
+      // even without non-spacing key support, so they do not replace the plain keys.
       //
       KeyCount = 0;
       NsKey    = KeyDescriptor + 1;
@@ -711,13 +916,21 @@ SetKeyboardLayoutEvent (
         NsKey++;
       }
 
-      UsbNsKey->Signature = USB_NS_KEY_SIGNATURE;
-      UsbNsKey->KeyCount  = KeyCount;
-      UsbNsKey->NsKey     = AllocateCopyPool (
-                              (KeyCount + 1) * sizeof (EFI_KEY_DESCRIPTOR),
-                              KeyDescriptor
-                              );
-      InsertTailList (&UsbKeyboardDevice->NsKeyList, &UsbNsKey->Link);
+      if (FeaturePcdGet (PcdUsbXbox360NsKeySupport)) {
+        //
+        // Allocate the USB_NS_KEY and its descriptors at once.
+        //
+        UsbNsKey = AllocatePool (sizeof (USB_NS_KEY) + (KeyCount + 1) * sizeof (EFI_KEY_DESCRIPTOR));
+        if (UsbNsKey == NULL) {
+          return EFI_OUT_OF_RESOURCES;
+        }
+
+        UsbNsKey->Signature = USB_NS_KEY_SIGNATURE;
+        UsbNsKey->KeyCount  = KeyCount;
+        UsbNsKey->NsKey     = (EFI_KEY_DESCRIPTOR *)(UsbNsKey + 1);
+        CopyMem (UsbNsKey->NsKey, KeyDescriptor, (KeyCount + 1) * sizeof (EFI_KEY_DESCRIPTOR));
+        InsertTailList (NsKeyList, &UsbNsKey->Link);
+      }
 
       //
       // Skip over the child physical keys
@@ -732,13 +945,123 @@ SetKeyboardLayoutEvent (
   //
   // There are two EfiKeyEnter, duplicate its key descriptor
   //
-  TableEntry    = GetKeyDescriptor (UsbKeyboardDevice, 0x58);
-  KeyDescriptor = GetKeyDescriptor (UsbKeyboardDevice, 0x28);
+  TableEntry    = LookupKeyDescriptor (KeyConvertionTable, 0x58);
+  KeyDescriptor = LookupKeyDescriptor (KeyConvertionTable, 0x28);
 
   if ((TableEntry != NULL) && (KeyDescriptor != NULL)) {
     CopyMem (TableEntry, KeyDescriptor, sizeof (EFI_KEY_DESCRIPTOR));
   }
 
+  return EFI_SUCCESS;
+}
+
+/**
+  Apply an HII keyboard layout to the keyboard.
+
+  The layout is parsed into the spare table first, so the keys keep being
+  translated with the current table meanwhile, and the current table is kept
+  if the layout cannot be parsed. The finished table is swapped in at
+  TPL_NOTIFY, so USBKeyboardTimerHandler() never sees a partial table.
+
+  @param  UsbKeyboardDevice    The USB_KB_DEV instance.
+  @param  KeyboardLayout       The HII keyboard layout.
+
+  @retval EFI_SUCCESS          The layout is used for the next key.
+  @retval Others               The layout was not applied, the previous table is kept.
+
+**/
+STATIC
+EFI_STATUS
+ApplyKeyboardLayout (
+  IN OUT USB_KB_DEV               *UsbKeyboardDevice,
+  IN     EFI_HII_KEYBOARD_LAYOUT  *KeyboardLayout
+  )
+{
+  EFI_STATUS          Status;
+  EFI_KEY_DESCRIPTOR  *KeyConvertionTable;
+  LIST_ENTRY          NsKeyList;
+  LIST_ENTRY          OldNsKeyList;
+  EFI_TPL             OldTpl;
+
+  //
+  // Every layout has the same table size, so the spare table is reused.
+  //
+  KeyConvertionTable = UsbKeyboardDevice->SpareKeyConvertionTable;
+  if (KeyConvertionTable == NULL) {
+    KeyConvertionTable = AllocateZeroPool ((NUMBER_OF_VALID_USB_KEYCODE)*sizeof (EFI_KEY_DESCRIPTOR));
+    if (KeyConvertionTable == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    UsbKeyboardDevice->SpareKeyConvertionTable = KeyConvertionTable;
+  } else {
+    ZeroMem (KeyConvertionTable, (NUMBER_OF_VALID_USB_KEYCODE)*sizeof (EFI_KEY_DESCRIPTOR));
+  }
+
+  InitializeListHead (&NsKeyList);
+  Status = ParseKeyboardLayout (KeyboardLayout, KeyConvertionTable, &NsKeyList);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: keyboard layout rejected - %r, the previous layout is kept\n", Status));
+    FreeNsKeyList (&NsKeyList);
+    return Status;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  UsbKeyboardDevice->SpareKeyConvertionTable = UsbKeyboardDevice->KeyConvertionTable;
+  UsbKeyboardDevice->KeyConvertionTable      = KeyConvertionTable;
+  MoveNsKeyList (&OldNsKeyList, &UsbKeyboardDevice->NsKeyList);
+  MoveNsKeyList (&UsbKeyboardDevice->NsKeyList, &NsKeyList);
+  //
+  // A pending dead key refers to the previous list.
+  //
+  UsbKeyboardDevice->CurrentNsKey = NULL;
+
+  gBS->RestoreTPL (OldTpl);
+
+  FreeNsKeyList (&OldNsKeyList);
+
+  USBKBD_TRACE (USBKBD_TRACE_LAYOUT, "UsbXbox360: layout applied, %lu descriptors, %lu bytes\n", KeyboardLayout->DescriptorCount, KeyboardLayout->LayoutLength, 0);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Rebuild the key conversion table from the current HII keyboard layout if the
+  layout changed since the last rebuild.
+
+  Called at TPL_CALLBACK, as the layout is read from the HII database into pool.
+
+  @param  UsbKeyboardDevice    The USB_KB_DEV instance.
+
+**/
+VOID
+RefreshKeyboardLayout (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_HII_KEYBOARD_LAYOUT  *KeyboardLayout;
+
+  if (!UsbKeyboardDevice->KeyboardLayoutDirty) {
+    return;
+  }
+
+  //
+  // Cleared before the layout is read, so a change signaled meanwhile is
+  // applied on the next call.
+  //
+  UsbKeyboardDevice->KeyboardLayoutDirty = FALSE;
+
+  //
+  // Try to get current keyboard layout from HII database
+  //
+  KeyboardLayout = GetCurrentKeyboardLayout ();
+  if (KeyboardLayout == NULL) {
+    return;
+  }
+
+  ApplyKeyboardLayout (UsbKeyboardDevice, KeyboardLayout);
+
   FreePool (KeyboardLayout);
 }
 
@@ -753,23 +1076,19 @@ ReleaseKeyboardLayoutResources (
   IN OUT USB_KB_DEV  *UsbKeyboardDevice
   )
 {
-  USB_NS_KEY  *UsbNsKey;
-  LIST_ENTRY  *Link;
-
   if (UsbKeyboardDevice->KeyConvertionTable != NULL) {
     FreePool (UsbKeyboardDevice->KeyConvertionTable);
   }
 
-  UsbKeyboardDevice->KeyConvertionTable = NULL;
+  if (UsbKeyboardDevice->SpareKeyConvertionTable != NULL) {
+    FreePool (UsbKeyboardDevice->SpareKeyConvertionTable);
+  }
 
-  while (!IsListEmpty (&UsbKeyboardDevice->NsKeyList)) {
-    Link     = GetFirstNode (&UsbKeyboardDevice->NsKeyList);
-    UsbNsKey = USB_NS_KEY_FORM_FROM_LINK (Link);
-    RemoveEntryList (&UsbNsKey->Link);
+  UsbKeyboardDevice->KeyConvertionTable      = NULL;
+  UsbKeyboardDevice->SpareKeyConvertionTable = NULL;
 
-    FreePool (UsbNsKey->NsKey);
-    FreePool (UsbNsKey);
-  }
+  FreeNsKeyList (&UsbKeyboardDevice->NsKeyList);
+  UsbKeyboardDevice->CurrentNsKey = NULL;
 }
 
 /**
@@ -784,6 +1103,7 @@ ReleaseKeyboardLayoutResources (
   @retval EFI_SUCCESS            Initialization succeeded.
   @retval EFI_NOT_READY          Keyboard layout cannot be retrieve from HII
                                  database, and default layout is disabled.
+  @retval EFI_OUT_OF_RESOURCES   Fail to allocate the key convertion table.
   @retval Other                  Fail to register event to EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID group.
 
 **/
@@ -796,11 +1116,22 @@ InitKeyboardLayout (
   EFI_STATUS               Status;
 
   UsbKeyboardDevice->KeyConvertionTable = AllocateZeroPool ((NUMBER_OF_VALID_USB_KEYCODE)*sizeof (EFI_KEY_DESCRIPTOR));
-  ASSERT (UsbKeyboardDevice->KeyConvertionTable != NULL);
+  if (UsbKeyboardDevice->KeyConvertionTable == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-  InitializeListHead (&UsbKeyboardDevice->NsKeyList);
-  UsbKeyboardDevice->CurrentNsKey        = NULL;
-  UsbKeyboardDevice->KeyboardLayoutEvent = NULL;
+  UsbKeyboardDevice->SpareKeyConvertionTable = NULL;
+  UsbKeyboardDevice->CurrentNsKey            = NULL;
+  UsbKeyboardDevice->KeyboardLayoutEvent     = NULL;
+  UsbKeyboardDevice->KeyboardLayoutDirty     = FALSE;
+
+  if (!FeaturePcdGet (PcdUsbXbox360HiiLayoutSupport)) {
+    //
+    // The minimal build does not track HII keyboard layouts.
+    //
+    InstallFixedKeyDescriptors (UsbKeyboardDevice);
+    return EFI_SUCCESS;
+  }
 
   //
   // Register event to EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID group,
@@ -815,6 +1146,8 @@ InitKeyboardLayout (
                   &UsbKeyboardDevice->KeyboardLayoutEvent
                   );
   if (EFI_ERROR (Status)) {
+    ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
+    UsbKeyboardDevice->KeyboardLayoutEvent = NULL;
     return Status;
   }
 
@@ -822,10 +1155,13 @@ InitKeyboardLayout (
   if (KeyboardLayout != NULL) {
     //
     // If current keyboard layout is successfully retrieved from HII database,
-    // force to initialize the keyboard layout.
+    // apply it right away.
     //
-    gBS->SignalEvent (UsbKeyboardDevice->KeyboardLayoutEvent);
-  } else {
+    Status = ApplyKeyboardLayout (UsbKeyboardDevice, KeyboardLayout);
+    FreePool (KeyboardLayout);
+  }
+
+  if ((KeyboardLayout == NULL) || EFI_ERROR (Status)) {
     if (FeaturePcdGet (PcdDisableDefaultKeyboardLayoutInUsbKbDriver)) {
       //
       // If no keyboard layout can be retrieved from HII database, and default layout
@@ -836,9 +1172,11 @@ InitKeyboardLayout (
 
     //
     // If no keyboard layout can be retrieved from HII database, and default layout
-    // is enabled, then load the default keyboard layout.
+    // is enabled, then load the default keyboard layout. Setting it signals the
+    // layout event, so it is applied here before the first key is translated.
     //
     InstallDefaultKeyboardLayout (UsbKeyboardDevice);
+    RefreshKeyboardLayout (UsbKeyboardDevice);
   }
 
   return EFI_SUCCESS;
@@ -868,9 +1206,7 @@ InitUSBKeyboard (
     UsbKeyboardDevice->DevicePath
     );
 
-  InitQueue (&UsbKeyboardDevice->UsbKeyQueue, sizeof (USB_KEY));
-  InitQueue (&UsbKeyboardDevice->EfiKeyQueue, sizeof (EFI_KEY_DATA));
-  InitQueue (&UsbKeyboardDevice->EfiKeyQueueForNotify, sizeof (EFI_KEY_DATA));
+  ResetKeyQueues (UsbKeyboardDevice);
 
   //
   // Use the config out of the descriptor
@@ -969,9 +1305,16 @@ InitUSBKeyboard (
   return EFI_SUCCESS;
 }
 
-STATIC
-VOID
-QueueButtonTransition (
+/**
+  Queue a key transition into UsbKeyQueue and track the repeat key.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyCode               The USB keycode.
+  @param  IsPressed             TRUE if the key went down.
+
+**/
+VOID
+QueueButtonTransition (
   IN USB_KB_DEV  *UsbKeyboardDevice,
   IN UINT8       KeyCode,
   IN BOOLEAN     IsPressed
@@ -981,14 +1324,60 @@ QueueButtonTransition (
 
   UsbKey.KeyCode = KeyCode;
   UsbKey.Down    = IsPressed;
+  UsbKey.Time    = FeaturePcdGet (PcdUsbXbox360TelemetrySupport) ? GetPerformanceCounter () : 0;
   Enqueue (&UsbKeyboardDevice->UsbKeyQueue, &UsbKey, sizeof (UsbKey));
 
-  if (!IsPressed && (UsbKeyboardDevice->RepeatKey == KeyCode)) {
+  if (FeaturePcdGet (PcdUsbXbox360DynamicPolling)) {
+    UsbKeyboardDevice->LastActivityTime = GetPerformanceCounter ();
+    if (UsbKeyboardDevice->PollingInterval != UsbKeyboardDevice->IntEndpointDescriptor.Interval) {
+      gBS->SignalEvent (UsbKeyboardDevice->FastPollingEvent);
+    }
+  }
+
+  if (UsbKeyboardDevice->RepeatTimer == NULL) {
+    return;
+  }
+
+  //
+  // The last non-modifier key pressed repeats until it is released.
+  //
+  if (IsPressed && (KeyCode < 0xe0)) {
+    UsbKeyboardDevice->RepeatKey      = KeyCode;
+    UsbKeyboardDevice->RepeatLastTime = GetPerformanceCounter ();
+    UsbKeyboardDevice->RepeatDue      = USBKBD_REPEAT_DELAY;
+    gBS->SetTimer (UsbKeyboardDevice->RepeatTimer, TimerRelative, USBKBD_REPEAT_DELAY);
+  } else if (!IsPressed && (UsbKeyboardDevice->RepeatKey == KeyCode)) {
     UsbKeyboardDevice->RepeatKey = 0;
+    gBS->SetTimer (UsbKeyboardDevice->RepeatTimer, TimerCancel, 0);
   }
 }
 
-STATIC
+/**
+  Make Guide the anchor of a chord. If its key press is still held back, Guide
+  produces no keystroke until it is released.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ChordAnchorGuide (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (UsbKeyboardDevice->GuideKeyPending) {
+    UsbKeyboardDevice->GuideKeyPending = FALSE;
+    UsbKeyboardDevice->ChordButtons   |= XBOX360_BUTTON_GUIDE;
+  }
+}
+
+/**
+  Queue the key transitions for the buttons that changed state.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  OldButtons            The previous normalized button state.
+  @param  NewButtons            The new normalized button state.
+
+**/
 VOID
 ProcessButtonChanges (
   IN USB_KB_DEV  *UsbKeyboardDevice,
@@ -996,35 +1385,262 @@ ProcessButtonChanges (
   IN UINT16      NewButtons
   )
 {
-  UINTN  Index;
+  UINT32  ChangedButtons;
+  UINTN   Bit;
+  UINT16  Mask;
+  UINT8   KeyCode;
+  UINT8   GuideKeyCode;
+  UINT16  PressedButtons;
+  UINT16  ChordCandidates;
 
-  for (Index = 0; Index < ARRAY_SIZE (mXbox360ButtonMap); Index++) {
-    UINT16   Mask;
-    BOOLEAN  WasPressed;
+  PressedButtons = NewButtons & ~OldButtons;
+  GuideKeyCode   = UsbKeyboardDevice->ButtonKeyCode[LowBitSet32 (XBOX360_BUTTON_GUIDE)];
+
+  //
+  // The key press of Guide is held back until Guide is released, or another
+  // button that starts no chord is pressed.
+  //
+  if (((PressedButtons & XBOX360_BUTTON_GUIDE) != 0) && (GuideKeyCode != 0)) {
+    UsbKeyboardDevice->GuideKeyPending = TRUE;
+  }
+
+  //
+  // Guide + Back toggles macro recording, Guide + Start replays the macro with
+  // the recorded delays, Guide + X replays it at once and Guide + Y starts or
+  // stops the key script. Neither Guide nor the chord button produce a
+  // keystroke, on press or on release.
+  //
+  if ((NewButtons & XBOX360_BUTTON_GUIDE) != 0) {
+    if (FeaturePcdGet (PcdUsbXbox360MacroSupport) && ((PressedButtons & XBOX360_BUTTON_BACK) != 0)) {
+      UsbKeyboardDevice->ChordButtons |= XBOX360_BUTTON_BACK;
+      ChordAnchorGuide (UsbKeyboardDevice);
+      MacroToggleRecord (UsbKeyboardDevice);
+    }
+
+    if (FeaturePcdGet (PcdUsbXbox360MacroSupport) && ((PressedButtons & XBOX360_BUTTON_START) != 0)) {
+      UsbKeyboardDevice->ChordButtons |= XBOX360_BUTTON_START;
+      ChordAnchorGuide (UsbKeyboardDevice);
+      MacroReplay (UsbKeyboardDevice, TRUE);
+    }
+
+    if (FeaturePcdGet (PcdUsbXbox360MacroSupport) && ((PressedButtons & XBOX360_BUTTON_X) != 0)) {
+      UsbKeyboardDevice->ChordButtons |= XBOX360_BUTTON_X;
+      ChordAnchorGuide (UsbKeyboardDevice);
+      MacroReplay (UsbKeyboardDevice, FALSE);
+    }
+
+    if (FeaturePcdGet (PcdUsbXbox360ScriptSupport) && ((PressedButtons & XBOX360_BUTTON_Y) != 0)) {
+      UsbKeyboardDevice->ChordButtons |= XBOX360_BUTTON_Y;
+      ChordAnchorGuide (UsbKeyboardDevice);
+      ScriptToggle (UsbKeyboardDevice);
+    }
+  }
+
+  //
+  // The stick buttons may still complete the learn chord of an unknown pad.
+  //
+  ChordCandidates = XBOX360_BUTTON_GUIDE | UsbKeyboardDevice->ChordButtons;
+  if (UsbKeyboardDevice->Backend == &mLearnBackend) {
+    ChordCandidates |= XBOX360_BUTTON_LEFT_THUMB | XBOX360_BUTTON_RIGHT_THUMB;
+  }
+
+  if (UsbKeyboardDevice->GuideKeyPending && ((PressedButtons & ~ChordCandidates) != 0)) {
+    UsbKeyboardDevice->GuideKeyPending = FALSE;
+    QueueButtonTransition (UsbKeyboardDevice, GuideKeyCode, TRUE);
+  }
+
+  //
+  // Visit only the buttons that changed, through the map compiled by AssignPlayerSlot().
+  //
+  ChangedButtons = (UINT32)(OldButtons ^ NewButtons);
+  while (ChangedButtons != 0) {
     BOOLEAN  IsPressed;
 
-    Mask       = mXbox360ButtonMap[Index].ButtonMask;
-    WasPressed = ((OldButtons & Mask) != 0);
-    IsPressed  = ((NewButtons & Mask) != 0);
+    Bit             = (UINTN)LowBitSet32 (ChangedButtons);
+    Mask            = (UINT16)(1 << Bit);
+    ChangedButtons &= ChangedButtons - 1;
+    IsPressed       = ((NewButtons & Mask) != 0);
+
+    if (IsPressed && FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+      UsbKeyboardDevice->Telemetry.Record.PressCount[Bit]++;
+    }
+
+    if ((UsbKeyboardDevice->ChordButtons & Mask) != 0) {
+      if (!IsPressed) {
+        UsbKeyboardDevice->ChordButtons &= ~Mask;
+      }
 
-    if (WasPressed == IsPressed) {
       continue;
     }
 
-    QueueButtonTransition (
-      UsbKeyboardDevice,
-      mXbox360ButtonMap[Index].UsbKeyCode,
-      IsPressed
-      );
+    KeyCode = UsbKeyboardDevice->ButtonKeyCode[Bit];
+    if (KeyCode == 0) {
+      continue;
+    }
+
+    //
+    // A held back Guide is tapped when it is released.
+    //
+    if (Mask == XBOX360_BUTTON_GUIDE) {
+      if (IsPressed) {
+        continue;
+      }
+
+      if (UsbKeyboardDevice->GuideKeyPending) {
+        UsbKeyboardDevice->GuideKeyPending = FALSE;
+        QueueButtonTransition (UsbKeyboardDevice, KeyCode, TRUE);
+      }
+    }
+
+    USBKBD_TRACE (USBKBD_TRACE_DIFF, "UsbXbox360: button 0x%lx -> keycode 0x%lx %lu\n", Mask, KeyCode, IsPressed);
+
+    QueueButtonTransition (UsbKeyboardDevice, KeyCode, IsPressed);
+  }
+}
+
+/**
+  Compute the CRC32 of a device path.
+
+  The device path names the port chain from the root bridge, so the value
+  stays the same across boots and does not depend on the order the
+  controllers were bound in.
+
+  @param  DevicePath        The device path of the controller.
+
+  @return The CRC32 of the device path, end node included.
+
+**/
+UINT32
+GetDevicePathKey (
+  IN EFI_DEVICE_PATH_PROTOCOL  *DevicePath
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *Node;
+  UINTN                     NodeLength;
+  UINTN                     Size;
+
+  Size = 0;
+  for (Node = DevicePath; ; Node = (EFI_DEVICE_PATH_PROTOCOL *)((UINT8 *)Node + NodeLength)) {
+    NodeLength = Node->Length[0] | (Node->Length[1] << 8);
+    Size      += NodeLength;
+    if ((NodeLength < sizeof (EFI_DEVICE_PATH_PROTOCOL)) ||
+        ((Node->Type == END_DEVICE_PATH_TYPE) && (Node->SubType == END_ENTIRE_DEVICE_PATH_SUBTYPE)))
+    {
+      break;
+    }
+  }
+
+  return CalculateCrc32 (DevicePath, Size);
+}
+
+/**
+  Check whether the device gets the full button map.
+
+  PcdUsbXbox360PrimaryDevicePaths lists the device path keys of the
+  controllers that do, ended by a zero key. When the list is empty, player 1
+  does.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance, with its player slot
+                                and device path key set.
+
+  @retval TRUE                  The device gets the full map.
+  @retval FALSE                 Buttons in PcdUsbXbox360SecondaryDisabledButtons
+                                are left unmapped.
+
+**/
+STATIC
+BOOLEAN
+IsPrimaryController (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  CONST UINT32  *Keys;
+  UINTN         Count;
+  UINTN         Index;
+
+  Keys  = (CONST UINT32 *)FixedPcdGetPtr (PcdUsbXbox360PrimaryDevicePaths);
+  Count = FixedPcdGetSize (PcdUsbXbox360PrimaryDevicePaths) / sizeof (UINT32);
+
+  if ((Count == 0) || (ReadUnaligned32 (&Keys[0]) == 0)) {
+    return (BOOLEAN)(UsbKeyboardDevice->PlayerIndex == 0);
+  }
+
+  for (Index = 0; (Index < Count) && (ReadUnaligned32 (&Keys[Index]) != 0); Index++) {
+    if (ReadUnaligned32 (&Keys[Index]) == UsbKeyboardDevice->DevicePathKey) {
+      return TRUE;
+    }
   }
+
+  return FALSE;
 }
 
 /**
-  Handler function for Xbox 360 controller asynchronous interrupt transfer.
+  Assign the lowest free player slot to the device and compile its button map
+  into UsbKeyboardDevice->ButtonKeyCode.
 
-  The wired Xbox 360 controller sends a fixed length vendor specific report. This handler
-  maps the controller state into synthetic USB keyboard scan codes so the device can drive
-  the UEFI Simple Text Input (Ex) protocols.
+  The map is mXbox360ButtonMap. A controller that is not primary, see
+  IsPrimaryController(), leaves the buttons in
+  PcdUsbXbox360SecondaryDisabledButtons unmapped.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance, with its device path
+                                key set.
+
+**/
+VOID
+AssignPlayerSlot (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  UINT16  DisabledButtons;
+  UINTN   Index;
+  UINT8   Slot;
+
+  for (Slot = 0; Slot < USB_KB_MAX_PLAYERS; Slot++) {
+    if ((mPlayerSlotMap & (1u << Slot)) == 0) {
+      mPlayerSlotMap |= 1u << Slot;
+      break;
+    }
+  }
+
+  UsbKeyboardDevice->PlayerIndex = Slot;
+
+  DisabledButtons = 0;
+  if (!IsPrimaryController (UsbKeyboardDevice)) {
+    DisabledButtons = FixedPcdGet16 (PcdUsbXbox360SecondaryDisabledButtons);
+  }
+
+  ZeroMem (UsbKeyboardDevice->ButtonKeyCode, sizeof (UsbKeyboardDevice->ButtonKeyCode));
+  for (Index = 0; Index < ARRAY_SIZE (mXbox360ButtonMap); Index++) {
+    if ((mXbox360ButtonMap[Index].ButtonMask & DisabledButtons) == 0) {
+      UsbKeyboardDevice->ButtonKeyCode[LowBitSet32 (mXbox360ButtonMap[Index].ButtonMask)] = mXbox360ButtonMap[Index].UsbKeyCode;
+    }
+  }
+}
+
+/**
+  Release the player slot of the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ReleasePlayerSlot (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (UsbKeyboardDevice->PlayerIndex < USB_KB_MAX_PLAYERS) {
+    mPlayerSlotMap &= ~(1u << UsbKeyboardDevice->PlayerIndex);
+  }
+
+  UsbKeyboardDevice->PlayerIndex = USB_KB_MAX_PLAYERS;
+}
+
+/**
+  Handler function for the controller asynchronous interrupt transfer.
+
+  The report is decoded by the backend of the controller, which maps the controller state
+  into synthetic USB keyboard scan codes so the device can drive the UEFI Simple Text
+  Input (Ex) protocols.
 
   @param  Data             A pointer to a buffer that is filled with key data which is
                            retrieved via asynchronous interrupt transfer.
@@ -1047,10 +1663,6 @@ KeyboardHandler (
 {
   USB_KB_DEV           *UsbKeyboardDevice;
   EFI_USB_IO_PROTOCOL  *UsbIo;
-  UINT8                *Report;
-  UINT16               OldButtons;
-  UINT16               NewButtons;
-  UINT32               UsbStatus;
 
   ASSERT (Context != NULL);
 
@@ -1061,14 +1673,13 @@ KeyboardHandler (
   // Analyzes Result and performs corresponding action.
   //
   if (Result != EFI_USB_NOERROR) {
+    USBKBD_TRACE (USBKBD_TRACE_RECOVERY, "UsbXbox360: transfer error 0x%lx on endpoint 0x%lx\n", Result, UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress, 0);
+
     //
     // Some errors happen during the process
     //
-    REPORT_STATUS_CODE_WITH_DEVICE_PATH (
-      EFI_ERROR_CODE | EFI_ERROR_MINOR,
-      (EFI_PERIPHERAL_KEYBOARD | EFI_P_EC_INPUT_ERROR),
-      UsbKeyboardDevice->DevicePath
-      );
+    ReportInputError (UsbKeyboardDevice, Result);
+    UsbKeyboardDevice->Telemetry.Record.ErrorCount++;
 
     //
     // Stop the repeat key generation if any
@@ -1081,14 +1692,16 @@ KeyboardHandler (
            USBKBD_REPEAT_RATE
            );
 
+    //
+    // Clearing the halt is a synchronous control transfer, leave it to the
+    // recovery handler.
+    //
     if ((Result & EFI_USB_ERR_STALL) == EFI_USB_ERR_STALL) {
-      UsbClearEndpointHalt (
-        UsbIo,
-        UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
-        &UsbStatus
-        );
+      UsbKeyboardDevice->ClearHaltPending = TRUE;
     }
 
+    UsbKeyboardDevice->RecoveryPending = TRUE;
+
     //
     // Delete & Submit this interrupt again
     // Handler of DelayedRecoveryEvent triggered by timer will re-submit the interrupt.
@@ -1114,11 +1727,57 @@ KeyboardHandler (
     return EFI_DEVICE_ERROR;
   }
 
+  if (FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    UsbKeyboardDevice->Telemetry.Record.ReportCount++;
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360FrameInjection) && UsbKeyboardDevice->Injecting) {
+    return EFI_SUCCESS;
+  }
+
   if ((Data == NULL) || (DataLength < 4)) {
     return EFI_SUCCESS;
   }
 
-  Report = (UINT8 *)Data;
+  UsbKeyboardDevice->Backend->HandleReport (UsbKeyboardDevice, (UINT8 *)Data, DataLength);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Decode a report of the wired Xbox 360 controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+STATIC
+VOID
+Xbox360HandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  UINT16  OldButtons;
+  UINT16  NewButtons;
+
+  if (FeaturePcdGet (PcdUsbXbox360ChatpadSupport) &&
+      ChatpadHandleReport (UsbKeyboardDevice, Report, ReportLength))
+  {
+    return;
+  }
+
+  //
+  // Only input reports carry the button state; LED, rumble and headset
+  // status reports are ignored.
+  //
+  if ((Report[0] != XBOX360_INPUT_REPORT_TYPE) || (Report[1] != XBOX360_INPUT_REPORT_LENGTH)) {
+    return;
+  }
+
+  USBKBD_TRACE (USBKBD_TRACE_REPORT, "UsbXbox360: report type 0x%lx len %lu buttons 0x%lx\n", Report[0], ReportLength, Report[2] | ((UINT16)Report[3] << 8));
 
   OldButtons = UsbKeyboardDevice->XboxState.Buttons;
   NewButtons = (UINT16)(Report[2] | ((UINT16)Report[3] << 8));
@@ -1126,19 +1785,190 @@ KeyboardHandler (
     ProcessButtonChanges (UsbKeyboardDevice, OldButtons, NewButtons);
     UsbKeyboardDevice->XboxState.Buttons = NewButtons;
   }
+}
 
-  UsbKeyboardDevice->RepeatKey = 0;
-  if (UsbKeyboardDevice->RepeatTimer != NULL) {
-    gBS->SetTimer (
-           UsbKeyboardDevice->RepeatTimer,
-           TimerCancel,
-           USBKBD_REPEAT_RATE
-           );
+/**
+  Light the ring of the wired Xbox 360 controller with its player number.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The LED report is queued.
+
+**/
+STATIC
+EFI_STATUS
+Xbox360Init (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  UINT8  Data[XBOX360_LED_REPORT_LENGTH];
+
+  Data[0] = XBOX360_LED_REPORT_TYPE;
+  Data[1] = XBOX360_LED_REPORT_LENGTH;
+  if (UsbKeyboardDevice->PlayerIndex < USB_KB_MAX_PLAYERS) {
+    Data[2] = (UINT8)(XBOX360_LED_PLAYER1 + UsbKeyboardDevice->PlayerIndex);
+  } else {
+    Data[2] = XBOX360_LED_ALL_BLINK;
   }
 
+  OutputQueue (UsbKeyboardDevice, USB_KB_OUTPUT_LED, Data, sizeof (Data));
+
   return EFI_SUCCESS;
 }
 
+/**
+  Queue a rumble output report for the controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  LeftMotor             Level of the left, low frequency motor.
+  @param  RightMotor            Level of the right, high frequency motor.
+
+  @retval EFI_SUCCESS           The report is queued.
+  @retval EFI_UNSUPPORTED       The controller has no rumble output.
+
+**/
+EFI_STATUS
+QueueRumble (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       LeftMotor,
+  IN     UINT8       RightMotor
+  )
+{
+  UINT8  Data[XBOX360_RUMBLE_REPORT_LENGTH];
+
+  if ((UsbKeyboardDevice->Backend != &mBackends[0]) || (UsbKeyboardDevice->IntOutEndpointAddress == 0)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  ZeroMem (Data, sizeof (Data));
+  Data[0] = XBOX360_RUMBLE_REPORT_TYPE;
+  Data[1] = XBOX360_RUMBLE_REPORT_LENGTH;
+  Data[3] = LeftMotor;
+  Data[4] = RightMotor;
+
+  OutputQueue (UsbKeyboardDevice, USB_KB_OUTPUT_RUMBLE, Data, sizeof (Data));
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Periodic housekeeping of the wired Xbox 360 controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+Xbox360Service (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (FeaturePcdGet (PcdUsbXbox360ChatpadSupport)) {
+    ChatpadService (UsbKeyboardDevice);
+  }
+}
+
+/**
+  Report an input error of the interrupt transfer.
+
+  The first error in a report window is reported immediately with the device
+  path. Further errors are only counted, and reported by FlushInputErrors().
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Result                The result of the interrupt transfer.
+
+**/
+VOID
+ReportInputError (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT32      Result
+  )
+{
+  UINTN  ErrorClass;
+
+  if ((Result & EFI_USB_ERR_STALL) == EFI_USB_ERR_STALL) {
+    ErrorClass = USB_KB_ERROR_CLASS_STALL;
+  } else if ((Result & EFI_USB_ERR_TIMEOUT) == EFI_USB_ERR_TIMEOUT) {
+    ErrorClass = USB_KB_ERROR_CLASS_TIMEOUT;
+  } else {
+    ErrorClass = USB_KB_ERROR_CLASS_OTHER;
+  }
+
+  if (UsbKeyboardDevice->InputErrorWindow == 0) {
+    REPORT_STATUS_CODE_WITH_DEVICE_PATH (
+      EFI_ERROR_CODE | EFI_ERROR_MINOR,
+      (EFI_PERIPHERAL_KEYBOARD | EFI_P_EC_INPUT_ERROR),
+      UsbKeyboardDevice->DevicePath
+      );
+    UsbKeyboardDevice->InputErrorWindow = USB_KB_ERROR_REPORT_WINDOW;
+    return;
+  }
+
+  UsbKeyboardDevice->InputErrorCount[ErrorClass]++;
+  UsbKeyboardDevice->InputErrorResult[ErrorClass] = Result;
+}
+
+/**
+  Report the input errors counted in the current window.
+
+  This function is called on every tick of the keyboard timer. When the window
+  expires, one status code with the count is reported for every error class
+  that was seen, with USB_XBOX360_INPUT_ERROR_DATA identifying the controller.
+  The window stays open while errors keep arriving.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+FlushInputErrors (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_XBOX360_INPUT_ERROR_DATA  ErrorData;
+  UINTN                         ErrorClass;
+  BOOLEAN                       Reported;
+
+  if (UsbKeyboardDevice->InputErrorWindow == 0) {
+    return;
+  }
+
+  UsbKeyboardDevice->InputErrorWindow--;
+  if (UsbKeyboardDevice->InputErrorWindow != 0) {
+    return;
+  }
+
+  Reported = FALSE;
+  for (ErrorClass = 0; ErrorClass < USB_KB_ERROR_CLASS_COUNT; ErrorClass++) {
+    if (UsbKeyboardDevice->InputErrorCount[ErrorClass] == 0) {
+      continue;
+    }
+
+    ErrorData.Controller = UsbKeyboardDevice->ControllerHandle;
+    ErrorData.ErrorClass = (UINT32)ErrorClass;
+    ErrorData.Count      = UsbKeyboardDevice->InputErrorCount[ErrorClass];
+    ErrorData.LastResult = UsbKeyboardDevice->InputErrorResult[ErrorClass];
+    REPORT_STATUS_CODE_EX (
+      EFI_ERROR_CODE | EFI_ERROR_MINOR,
+      (EFI_PERIPHERAL_KEYBOARD | EFI_P_EC_INPUT_ERROR),
+      0,
+      &gEfiCallerIdGuid,
+      &gUsbXbox360InputErrorDataGuid,
+      &ErrorData,
+      sizeof (ErrorData)
+      );
+
+    UsbKeyboardDevice->InputErrorCount[ErrorClass] = 0;
+    Reported                                       = TRUE;
+  }
+
+  //
+  // Keep aggregating while the errors continue, otherwise report the next one at once.
+  //
+  if (Reported) {
+    UsbKeyboardDevice->InputErrorWindow = USB_KB_ERROR_REPORT_WINDOW;
+  }
+}
+
 /**
   Retrieves a USB keycode after parsing the raw data in keyboard buffer.
 
@@ -1147,6 +1977,8 @@ KeyboardHandler (
 
   @param  UsbKeyboardDevice    The USB_KB_DEV instance.
   @param  KeyCode              Pointer to the USB keycode for output.
+  @param  KeyTime              Pointer to the performance counter for output,
+                               when the keycode was queued.
 
   @retval EFI_SUCCESS          Keycode successfully parsed.
   @retval EFI_NOT_READY        Keyboard buffer is not ready for a valid keycode
@@ -1155,13 +1987,15 @@ KeyboardHandler (
 EFI_STATUS
 USBParseKey (
   IN OUT  USB_KB_DEV  *UsbKeyboardDevice,
-  OUT  UINT8          *KeyCode
+  OUT  UINT8          *KeyCode,
+  OUT  UINT64         *KeyTime
   )
 {
   USB_KEY             UsbKey;
   EFI_KEY_DESCRIPTOR  *KeyDescriptor;
 
   *KeyCode = 0;
+  *KeyTime = 0;
 
   while (!IsQueueEmpty (&UsbKeyboardDevice->UsbKeyQueue)) {
     //
@@ -1372,6 +2206,7 @@ USBParseKey (
     }
 
     *KeyCode = UsbKey.KeyCode;
+    *KeyTime = UsbKey.Time;
     return EFI_SUCCESS;
   }
 
@@ -1473,10 +2308,7 @@ UsbKeyCodeToEfiInputKey (
   OUT EFI_KEY_DATA  *KeyData
   )
 {
-  EFI_KEY_DESCRIPTOR             *KeyDescriptor;
-  LIST_ENTRY                     *Link;
-  LIST_ENTRY                     *NotifyList;
-  KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+  EFI_KEY_DESCRIPTOR  *KeyDescriptor;
 
   //
   // KeyCode must in the range of  [0x4, 0x65] or [0xe0, 0xe7].
@@ -1490,11 +2322,14 @@ UsbKeyCodeToEfiInputKey (
     //
     // If this is a dead key with EFI_NS_KEY_MODIFIER, then record it and return.
     //
-    UsbKeyboardDevice->CurrentNsKey = FindUsbNsKey (UsbKeyboardDevice, KeyDescriptor);
+    if (FeaturePcdGet (PcdUsbXbox360NsKeySupport)) {
+      UsbKeyboardDevice->CurrentNsKey = FindUsbNsKey (UsbKeyboardDevice, KeyDescriptor);
+    }
+
     return EFI_NOT_READY;
   }
 
-  if (UsbKeyboardDevice->CurrentNsKey != NULL) {
+  if (FeaturePcdGet (PcdUsbXbox360NsKeySupport) && (UsbKeyboardDevice->CurrentNsKey != NULL)) {
     //
     // If this keystroke follows a non-spacing key, then find the descriptor for corresponding
     // physical key.
@@ -1588,29 +2423,66 @@ UsbKeyCodeToEfiInputKey (
   //
   InitializeKeyState (UsbKeyboardDevice, &KeyData->KeyState);
 
+  USBKBD_TRACE (USBKBD_TRACE_TRANSLATE, "UsbXbox360: keycode 0x%lx -> scan 0x%lx unicode 0x%lx\n", KeyCode, KeyData->Key.ScanCode, KeyData->Key.UnicodeChar);
+
   //
   // Signal KeyNotify process event if this key pressed matches any key registered.
   //
+  SignalKeyNotify (UsbKeyboardDevice, KeyData);
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Queue a key for the notification functions registered for it.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyData               The key that was pressed.
+
+**/
+VOID
+SignalKeyNotify (
+  IN USB_KB_DEV    *UsbKeyboardDevice,
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  LIST_ENTRY                     *Link;
+  LIST_ENTRY                     *NotifyList;
+  KEYBOARD_CONSOLE_IN_EX_NOTIFY  *CurrentNotify;
+
+  //
+  // Without key notify support the registrations are kept, so console
+  // splitters and boot managers can still register and unregister their
+  // hotkeys, but they are never invoked. The filter lets keys without any
+  // registration skip the list walk.
+  //
+  if (!FeaturePcdGet (PcdUsbXbox360KeyNotifySupport) ||
+      !IsNotifyKeyCandidate (UsbKeyboardDevice, &KeyData->Key))
+  {
+    return;
+  }
+
   NotifyList = &UsbKeyboardDevice->NotifyList;
   for (Link = GetFirstNode (NotifyList); !IsNull (NotifyList, Link); Link = GetNextNode (NotifyList, Link)) {
     CurrentNotify = CR (Link, KEYBOARD_CONSOLE_IN_EX_NOTIFY, NotifyEntry, USB_KB_CONSOLE_IN_EX_NOTIFY_SIGNATURE);
-    if (IsKeyRegistered (&CurrentNotify->KeyData, KeyData)) {
+    if (!CurrentNotify->Removed && IsKeyRegistered (&CurrentNotify->KeyData, KeyData)) {
       //
       // The key notification function needs to run at TPL_CALLBACK
       // while current TPL is TPL_NOTIFY. It will be invoked in
       // KeyNotifyProcessHandler() which runs at TPL_CALLBACK.
       //
-      Enqueue (&UsbKeyboardDevice->EfiKeyQueueForNotify, KeyData, sizeof (*KeyData));
+      EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueueForNotify, PackKeyData (KeyData));
       gBS->SignalEvent (UsbKeyboardDevice->KeyNotifyProcessEvent);
       break;
     }
   }
-
-  return EFI_SUCCESS;
 }
 
 /**
-  Create the queue.
+  Initialize the queue.
+
+  The queue storage is part of USB_SIMPLE_QUEUE, so no memory is allocated
+  and the queue may be reinitialized at any time.
 
   @param  Queue     Points to the queue.
   @param  ItemSize  Size of the single item.
@@ -1622,35 +2494,11 @@ InitQueue (
   IN      UINTN             ItemSize
   )
 {
-  UINTN  Index;
+  ASSERT (ItemSize <= USB_SIMPLE_QUEUE_MAX_ITEM_SIZE);
 
   Queue->ItemSize = ItemSize;
-  Queue->Head     = 0;
-  Queue->Tail     = 0;
-
-  if (Queue->Buffer[0] != NULL) {
-    FreePool (Queue->Buffer[0]);
-  }
-
-  Queue->Buffer[0] = AllocatePool (sizeof (Queue->Buffer) / sizeof (Queue->Buffer[0]) * ItemSize);
-  ASSERT (Queue->Buffer[0] != NULL);
-
-  for (Index = 1; Index < sizeof (Queue->Buffer) / sizeof (Queue->Buffer[0]); Index++) {
-    Queue->Buffer[Index] = ((UINT8 *)Queue->Buffer[Index - 1]) + ItemSize;
-  }
-}
-
-/**
-  Destroy the queue
-
-  @param Queue    Points to the queue.
-**/
-VOID
-DestroyQueue (
-  IN OUT USB_SIMPLE_QUEUE  *Queue
-  )
-{
-  FreePool (Queue->Buffer[0]);
+  Queue->Head     = 0;
+  Queue->Tail     = 0;
 }
 
 /**
@@ -1705,15 +2553,17 @@ Enqueue (
   )
 {
   ASSERT (ItemSize == Queue->ItemSize);
+  ASSERT (EfiGetCurrentTpl () >= TPL_NOTIFY);
   //
   // If keyboard buffer is full, throw the
   // first key out of the keyboard buffer.
   //
   if (IsQueueFull (Queue)) {
+    USBKBD_TRACE (USBKBD_TRACE_QUEUE, "UsbXbox360: raw queue %lx full, item size %lu, head %lu\n", (UINTN)Queue, ItemSize, Queue->Head);
     Queue->Head = (Queue->Head + 1) % (MAX_KEY_ALLOWED + 1);
   }
 
-  CopyMem (Queue->Buffer[Queue->Tail], Item, ItemSize);
+  CopyMem (&Queue->Buffer[Queue->Tail * ItemSize], Item, ItemSize);
 
   //
   // Adjust the tail pointer of the FIFO keyboard buffer.
@@ -1740,13 +2590,14 @@ Dequeue (
   )
 {
   ASSERT (Queue->ItemSize == ItemSize);
+  ASSERT (EfiGetCurrentTpl () >= TPL_NOTIFY);
 
   if (IsQueueEmpty (Queue)) {
     return EFI_DEVICE_ERROR;
   }
 
-  CopyMem (Item, Queue->Buffer[Queue->Head], ItemSize);
-  ZeroMem (Queue->Buffer[Queue->Head], ItemSize);
+  CopyMem (Item, &Queue->Buffer[Queue->Head * ItemSize], ItemSize);
+  ZeroMem (&Queue->Buffer[Queue->Head * ItemSize], ItemSize);
   //
   // Adjust the head pointer of the FIFO keyboard buffer.
   //
@@ -1755,6 +2606,217 @@ Dequeue (
   return EFI_SUCCESS;
 }
 
+/**
+  Discard every keystroke in a packed keystroke queue.
+
+  The flush is a consumer: it moves Head up to Tail with a compare-exchange, so
+  a concurrent dequeue either takes its keystroke first or finds the ring empty.
+
+  @param  Queue     Points to the queue.
+
+**/
+VOID
+FlushKeyDataQueue (
+  IN OUT USB_KEY_DATA_QUEUE  *Queue
+  )
+{
+  UINT32  Head;
+  UINT32  Tail;
+
+  ASSERT (EfiGetCurrentTpl () <= TPL_NOTIFY);
+
+  do {
+    Head = Queue->Head;
+    Tail = Queue->Tail;
+    USB_KB_PREEMPTION_POINT ();
+  } while (InterlockedCompareExchange32 (&Queue->Head, Head, Tail) != Head);
+}
+
+/**
+  Discard every keystroke queued for the device.
+
+  Everything runs at TPL_NOTIFY, so no keystroke is produced in between and
+  the caller may be at any TPL up to TPL_NOTIFY.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ResetKeyQueues (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  FlushKeyDataQueue (&UsbKeyboardDevice->EfiKeyQueue);
+  FlushKeyDataQueue (&UsbKeyboardDevice->EfiKeyQueueForNotify);
+  InitQueue (&UsbKeyboardDevice->UsbKeyQueue, sizeof (USB_KEY));
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Check whether a packed keystroke queue is empty.
+
+  @param  Queue     Points to the queue.
+
+  @retval TRUE      Queue is empty.
+  @retval FALSE     Queue is not empty.
+
+**/
+BOOLEAN
+IsKeyDataQueueEmpty (
+  IN  USB_KEY_DATA_QUEUE  *Queue
+  )
+{
+  return (BOOLEAN)(Queue->Head == Queue->Tail);
+}
+
+/**
+  Check whether a packed keystroke queue is full.
+
+  @param  Queue     Points to the queue.
+
+  @retval TRUE      Queue is full, the next keystroke would be dropped.
+  @retval FALSE     Queue has room for a keystroke.
+
+**/
+BOOLEAN
+IsKeyDataQueueFull (
+  IN  USB_KEY_DATA_QUEUE  *Queue
+  )
+{
+  return (BOOLEAN)((UINT32)(Queue->Tail - Queue->Head) >= ARRAY_SIZE (Queue->Buffer));
+}
+
+/**
+  Enqueue a packed keystroke.
+
+  If the queue is full, the keystroke is thrown away and counted in Dropped.
+  The consumer owns Head, so the producer never discards queued keystrokes.
+
+  @param  Queue     Points to the queue.
+  @param  KeyData   The packed keystroke.
+
+**/
+VOID
+EnqueueKeyData (
+  IN OUT  USB_KEY_DATA_QUEUE  *Queue,
+  IN      UINT64              KeyData
+  )
+{
+  UINT32  Tail;
+
+  ASSERT (EfiGetCurrentTpl () >= TPL_NOTIFY);
+
+  //
+  // Head only moves forward, so a stale Head can only make the ring look full.
+  //
+  Tail = Queue->Tail;
+  if ((UINT32)(Tail - Queue->Head) >= ARRAY_SIZE (Queue->Buffer)) {
+    USBKBD_TRACE (USBKBD_TRACE_QUEUE, "UsbXbox360: key queue %lx full, dropped 0x%lx\n", (UINTN)Queue, KeyData, 0);
+    Queue->Dropped++;
+    return;
+  }
+
+  //
+  // Publish the keystroke before the new Tail makes it visible to the consumers.
+  //
+  Queue->Buffer[Tail % ARRAY_SIZE (Queue->Buffer)] = KeyData;
+  MemoryFence ();
+  Queue->Tail = Tail + 1;
+}
+
+/**
+  Dequeue a packed keystroke.
+
+  The caller may run at any TPL up to TPL_NOTIFY, and may be preempted by a
+  producer or another consumer.
+
+  @param  Queue     Points to the queue.
+  @param  KeyData   Receives the packed keystroke.
+
+  @retval EFI_SUCCESS        Keystroke was successfully dequeued.
+  @retval EFI_DEVICE_ERROR   The queue is empty.
+
+**/
+EFI_STATUS
+DequeueKeyData (
+  IN OUT  USB_KEY_DATA_QUEUE  *Queue,
+  OUT     UINT64              *KeyData
+  )
+{
+  UINT32  Head;
+  UINT64  Data;
+
+  ASSERT (EfiGetCurrentTpl () <= TPL_NOTIFY);
+
+  do {
+    Head = Queue->Head;
+    if (Head == Queue->Tail) {
+      return EFI_DEVICE_ERROR;
+    }
+
+    USB_KB_PREEMPTION_POINT ();
+
+    //
+    // Read the keystroke before the compare-exchange hands its slot back to
+    // the producer. If another consumer claimed it in between, Head moved and
+    // the keystroke read here is discarded.
+    //
+    MemoryFence ();
+    Data = Queue->Buffer[Head % ARRAY_SIZE (Queue->Buffer)];
+    USB_KB_PREEMPTION_POINT ();
+  } while (InterlockedCompareExchange32 (&Queue->Head, Head, Head + 1) != Head);
+
+  *KeyData = Data;
+  return EFI_SUCCESS;
+}
+
+/**
+  Pack a keystroke into its queued UINT64 form.
+
+  @param  KeyData   The keystroke to pack.
+
+  @return The packed keystroke.
+
+**/
+UINT64
+PackKeyData (
+  IN CONST EFI_KEY_DATA  *KeyData
+  )
+{
+  return (UINT64)KeyData->Key.UnicodeChar |
+         LShiftU64 (KeyData->Key.ScanCode, USB_KEY_DATA_SCAN_SHIFT) |
+         LShiftU64 (KeyData->KeyState.KeyShiftState & USB_KEY_DATA_SHIFT_MASK, USB_KEY_DATA_SHIFT_SHIFT) |
+         LShiftU64 (KeyData->KeyState.KeyToggleState & USB_KEY_DATA_TOGGLE_MASK, USB_KEY_DATA_TOGGLE_SHIFT);
+}
+
+/**
+  Expand a packed keystroke into EFI_KEY_DATA.
+
+  The key state is the one the keystroke was produced with, not the current
+  state of the device.
+
+  @param  PackedKeyData         The packed keystroke.
+  @param  KeyData               Receives the expanded keystroke.
+
+**/
+VOID
+UnpackKeyData (
+  IN  UINT64        PackedKeyData,
+  OUT EFI_KEY_DATA  *KeyData
+  )
+{
+  KeyData->Key.UnicodeChar = (CHAR16)(PackedKeyData & USB_KEY_DATA_UNICODE_MASK);
+  KeyData->Key.ScanCode    = (UINT16)(RShiftU64 (PackedKeyData, USB_KEY_DATA_SCAN_SHIFT) & USB_KEY_DATA_SCAN_MASK);
+
+  KeyData->KeyState.KeyShiftState  = EFI_SHIFT_STATE_VALID |
+                                     (UINT32)(RShiftU64 (PackedKeyData, USB_KEY_DATA_SHIFT_SHIFT) & USB_KEY_DATA_SHIFT_MASK);
+  KeyData->KeyState.KeyToggleState = EFI_TOGGLE_STATE_VALID |
+                                     (EFI_KEY_TOGGLE_STATE)(RShiftU64 (PackedKeyData, USB_KEY_DATA_TOGGLE_SHIFT) & USB_KEY_DATA_TOGGLE_MASK);
+}
+
 /**
   Sets USB keyboard LED state.
 
@@ -1778,9 +2840,11 @@ SetKeyLED (
 
   This function is the handler for Repeat Key event triggered
   by timer.
-  After a repeatable key is pressed, the event would be triggered
-  with interval of USBKBD_REPEAT_DELAY. Once the event is triggered,
-  following trigger will come with interval of USBKBD_REPEAT_RATE.
+  After a repeatable key is pressed, the first repeat is due after
+  USBKBD_REPEAT_DELAY and following repeats every USBKBD_REPEAT_RATE.
+  The due times are tracked against the performance counter, so a late
+  callback emits every repeat that is due, up to USBKBD_REPEAT_MAX_CATCH_UP,
+  and the delivered rate does not drift with the timer granularity.
 
   @param  Event              The Repeat Key event.
   @param  Context            Points to the USB_KB_DEV instance.
@@ -1795,29 +2859,52 @@ USBKeyboardRepeatHandler (
 {
   USB_KB_DEV  *UsbKeyboardDevice;
   USB_KEY     UsbKey;
+  EFI_TPL     OldTpl;
+  UINT64      Now;
+  UINTN       Count;
 
   UsbKeyboardDevice = (USB_KB_DEV *)Context;
 
+  //
+  // KeyboardHandler() changes the repeat key and fills UsbKeyQueue at TPL_NOTIFY.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
   //
   // Do nothing when there is no repeat key.
   //
   if (UsbKeyboardDevice->RepeatKey != 0) {
+    Now = GetPerformanceCounter ();
+
+    UsbKeyboardDevice->RepeatDue     -= (INT64)DivU64x32 (GetElapsedTime (UsbKeyboardDevice->RepeatLastTime, Now), 100);
+    UsbKeyboardDevice->RepeatLastTime = Now;
+
     //
-    // Inserts the repeat key into keyboard buffer,
+    // Inserts every repeat that is due into keyboard buffer.
     //
     UsbKey.KeyCode = UsbKeyboardDevice->RepeatKey;
     UsbKey.Down    = TRUE;
-    Enqueue (&UsbKeyboardDevice->UsbKeyQueue, &UsbKey, sizeof (UsbKey));
+    UsbKey.Time    = Now;
+    for (Count = 0; (UsbKeyboardDevice->RepeatDue <= 0) && (Count < USBKBD_REPEAT_MAX_CATCH_UP); Count++) {
+      Enqueue (&UsbKeyboardDevice->UsbKeyQueue, &UsbKey, sizeof (UsbKey));
+      UsbKeyboardDevice->RepeatDue += USBKBD_REPEAT_RATE;
+    }
+
+    if (UsbKeyboardDevice->RepeatDue <= 0) {
+      UsbKeyboardDevice->RepeatDue = USBKBD_REPEAT_RATE;
+    }
 
     //
-    // Set repeat rate for next repeat key generation.
+    // Set the timer for the next repeat key generation.
     //
     gBS->SetTimer (
            UsbKeyboardDevice->RepeatTimer,
            TimerRelative,
-           USBKBD_REPEAT_RATE
+           (UINT64)UsbKeyboardDevice->RepeatDue
            );
   }
+
+  gBS->RestoreTPL (OldTpl);
 }
 
 /**
@@ -1840,26 +2927,235 @@ USBKeyboardRecoveryHandler (
   IN    VOID       *Context
   )
 {
-  USB_KB_DEV           *UsbKeyboardDevice;
-  EFI_USB_IO_PROTOCOL  *UsbIo;
-  UINT8                PacketSize;
+  USB_KB_DEV  *UsbKeyboardDevice;
+  UINT32      UsbStatus;
 
   UsbKeyboardDevice = (USB_KB_DEV *)Context;
 
-  UsbIo = UsbKeyboardDevice->UsbIo;
+  UsbKeyboardDevice->Telemetry.Record.RecoveryCount++;
+  UsbKeyboardDevice->RecoveryPending = FALSE;
+
+  if (UsbKeyboardDevice->ClearHaltPending) {
+    UsbKeyboardDevice->ClearHaltPending = FALSE;
+    UsbClearEndpointHalt (
+      UsbKeyboardDevice->UsbIo,
+      UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
+      &UsbStatus
+      );
+  }
 
-  PacketSize = (UINT8)(UsbKeyboardDevice->IntEndpointDescriptor.MaxPacketSize);
+  USBKBD_TRACE (USBKBD_TRACE_RECOVERY, "UsbXbox360: resubmit endpoint 0x%lx interval %lu packet %lu\n", UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress, UsbKeyboardDevice->IntEndpointDescriptor.Interval, UsbKeyboardDevice->IntEndpointDescriptor.MaxPacketSize);
 
   //
   // Re-submit Asynchronous Interrupt Transfer for recovery.
   //
-  UsbIo->UsbAsyncInterruptTransfer (
-           UsbIo,
-           UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
-           TRUE,
-           UsbKeyboardDevice->IntEndpointDescriptor.Interval,
-           PacketSize,
-           KeyboardHandler,
-           UsbKeyboardDevice
+  SubmitInterruptTransfer (UsbKeyboardDevice);
+}
+
+/**
+  Submit the asynchronous interrupt transfer which polls the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @return The status of UsbAsyncInterruptTransfer().
+
+**/
+EFI_STATUS
+SubmitInterruptTransfer (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  return UsbKeyboardDevice->UsbIo->UsbAsyncInterruptTransfer (
+                                     UsbKeyboardDevice->UsbIo,
+                                     UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
+                                     TRUE,
+                                     UsbKeyboardDevice->PollingInterval,
+                                     (UINT8)(UsbKeyboardDevice->IntEndpointDescriptor.MaxPacketSize),
+                                     KeyboardHandler,
+                                     UsbKeyboardDevice
+                                     );
+}
+
+/**
+  Start polling the device if it is not polled yet.
+
+  With PcdUsbXbox360ConnectOnDemand, Start() leaves the device idle and the
+  first WaitForKey check, ReadKeyStroke(Ex) or RegisterKeyNotify call submits
+  the interrupt transfer.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+EnsurePolling (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS  Status;
+  EFI_TPL     OldTpl;
+
+  if (UsbKeyboardDevice->Polling) {
+    return;
+  }
+
+  //
+  // WaitForKey runs at TPL_NOTIFY, submit under the same TPL so only one caller does.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (!UsbKeyboardDevice->Polling) {
+    Status = SubmitInterruptTransfer (UsbKeyboardDevice);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_ERROR, "UsbXbox360: failed to start polling - %r\n", Status));
+    } else {
+      UsbKeyboardDevice->Polling = TRUE;
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Resubmit the interrupt transfer with a new polling interval.
+
+  The caller runs at TPL_NOTIFY. While the transfer is not submitted, or is
+  waiting for the recovery handler, only the interval is recorded and the next
+  submission picks it up.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Interval              The polling interval in milliseconds.
+
+**/
+STATIC
+VOID
+SetPollingInterval (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       Interval
+  )
+{
+  EFI_STATUS  Status;
+
+  if (UsbKeyboardDevice->PollingInterval == Interval) {
+    return;
+  }
+
+  USBKBD_TRACE (USBKBD_TRACE_RECOVERY, "UsbXbox360: polling interval %lu -> %lu ms\n", UsbKeyboardDevice->PollingInterval, Interval, 0);
+
+  UsbKeyboardDevice->PollingInterval = Interval;
+  UsbKeyboardDevice->Telemetry.Record.PollingSwitchCount++;
+
+  if (!UsbKeyboardDevice->Polling || UsbKeyboardDevice->RecoveryPending) {
+    return;
+  }
+
+  UsbKeyboardDevice->UsbIo->UsbAsyncInterruptTransfer (
+                              UsbKeyboardDevice->UsbIo,
+                              UsbKeyboardDevice->IntEndpointDescriptor.EndpointAddress,
+                              FALSE,
+                              0,
+                              0,
+                              NULL,
+                              NULL
+                              );
+
+  Status = SubmitInterruptTransfer (UsbKeyboardDevice);
+  if (EFI_ERROR (Status)) {
+    //
+    // Leave it to the recovery handler, as for a transfer error.
+    //
+    DEBUG ((DEBUG_ERROR, "UsbXbox360: failed to resubmit at %u ms - %r\n", Interval, Status));
+    UsbKeyboardDevice->RecoveryPending = TRUE;
+    gBS->SetTimer (
+           UsbKeyboardDevice->DelayedRecoveryEvent,
+           TimerRelative,
+           EFI_USB_INTERRUPT_DELAY
            );
+  }
+}
+
+/**
+  Switch to the endpoint's own polling interval after a button transition.
+
+  The event is signaled by the report handler; the transfer is resubmitted
+  once the host controller has returned from the report callback.
+
+  @param  Event              The fast polling event.
+  @param  Context            Points to the USB_KB_DEV instance.
+
+**/
+VOID
+EFIAPI
+USBKeyboardFastPollingHandler (
+  IN    EFI_EVENT  Event,
+  IN    VOID       *Context
+  )
+{
+  USB_KB_DEV  *UsbKeyboardDevice;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+
+  SetPollingInterval (UsbKeyboardDevice, UsbKeyboardDevice->IntEndpointDescriptor.Interval);
+}
+
+/**
+  Check whether any control of the controller is held.
+
+  Held modifiers such as Guide, the stick buttons or the Chatpad keys do not
+  repeat, so RepeatKey alone does not tell whether a release is pending.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval TRUE                  A button or Chatpad key is held.
+  @retval FALSE                 Every control is released.
+
+**/
+STATIC
+BOOLEAN
+IsAnyControlDown (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  return (BOOLEAN)((UsbKeyboardDevice->XboxState.Buttons != 0) ||
+                   (UsbKeyboardDevice->Chatpad.Modifiers != 0) ||
+                   (UsbKeyboardDevice->Chatpad.Keys[0] != 0) ||
+                   (UsbKeyboardDevice->Chatpad.Keys[1] != 0));
+}
+
+/**
+  Drop back to PcdUsbXbox360IdlePollingInterval once no button has changed for
+  PcdUsbXbox360IdleTimeoutMs.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+PollingService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  UINT8    IdleInterval;
+  EFI_TPL  OldTpl;
+
+  if (!FeaturePcdGet (PcdUsbXbox360DynamicPolling)) {
+    return;
+  }
+
+  //
+  // Never poll faster than the endpoint asks for.
+  //
+  IdleInterval = MAX (FixedPcdGet8 (PcdUsbXbox360IdlePollingInterval), UsbKeyboardDevice->IntEndpointDescriptor.Interval);
+
+  //
+  // The report handler updates LastActivityTime at TPL_NOTIFY. A held control
+  // keeps the fast interval, so its release is seen at once.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if ((UsbKeyboardDevice->PollingInterval != IdleInterval) &&
+      !IsAnyControlDown (UsbKeyboardDevice) &&
+      (GetElapsedTime (UsbKeyboardDevice->LastActivityTime, GetPerformanceCounter ()) >=
+       MultU64x32 (FixedPcdGet32 (PcdUsbXbox360IdleTimeoutMs), 1000000)))
+  {
+    SetPollingInterval (UsbKeyboardDevice, IdleInterval);
+  }
+
+  gBS->RestoreTPL (OldTpl);
 }
@@ -17,6 +17,39 @@ SPDX-License-Identifier: BSD-2-Clause-Patent
 #define USB_KEYBOARD_LANGUAGE_STR_LEN     5         // RFC4646 Language Code: "en-US"
 #define USB_KEYBOARD_DESCRIPTION_STR_LEN  (16 + 1)  // Description: "English Keyboard"
 
+#define XBOX360_VENDOR_ID              0x045E
+#define XBOX360_PRODUCT_ID             0x028E
+
+//
+// Buttons of the normalized controller state, XBOX360_INPUT_STATE.Buttons.
+// Other controllers are mapped onto the Xbox 360 layout.
+//
+#define XBOX360_BUTTON_DPAD_UP         BIT0
+#define XBOX360_BUTTON_DPAD_DOWN       BIT1
+#define XBOX360_BUTTON_DPAD_LEFT       BIT2
+#define XBOX360_BUTTON_DPAD_RIGHT      BIT3
+#define XBOX360_BUTTON_START           BIT4
+#define XBOX360_BUTTON_BACK            BIT5
+#define XBOX360_BUTTON_LEFT_THUMB      BIT6
+#define XBOX360_BUTTON_RIGHT_THUMB     BIT7
+#define XBOX360_BUTTON_LEFT_SHOULDER   BIT8
+#define XBOX360_BUTTON_RIGHT_SHOULDER  BIT9
+#define XBOX360_BUTTON_GUIDE           BIT10
+#define XBOX360_BUTTON_A               BIT12
+#define XBOX360_BUTTON_B               BIT13
+#define XBOX360_BUTTON_X               BIT14
+#define XBOX360_BUTTON_Y               BIT15
+
+//
+// LED and rumble output reports of the wired Xbox 360 controller
+//
+#define XBOX360_LED_REPORT_TYPE        0x01
+#define XBOX360_LED_REPORT_LENGTH      0x03
+#define XBOX360_LED_ALL_BLINK          0x01
+#define XBOX360_LED_PLAYER1            0x06
+#define XBOX360_RUMBLE_REPORT_TYPE     0x00
+#define XBOX360_RUMBLE_REPORT_LENGTH   0x08
+
 #pragma pack (1)
 typedef struct {
   //
@@ -59,6 +92,46 @@ IsUSBKeyboard (
   IN  EFI_USB_IO_PROTOCOL  *UsbIo
   );
 
+/**
+  Find the backend decoding the input reports of a device.
+
+  @param  UsbIo    Pointer to a USB I/O protocol instance.
+
+  @return The backend, or NULL if the device is not supported.
+
+**/
+CONST USB_KB_BACKEND *
+FindBackend (
+  IN  EFI_USB_IO_PROTOCOL  *UsbIo
+  );
+
+/**
+  Queue the key transitions for the buttons that changed state.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  OldButtons            The previous normalized button state.
+  @param  NewButtons            The new normalized button state.
+
+**/
+VOID
+ProcessButtonChanges (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINT16      OldButtons,
+  IN UINT16      NewButtons
+  );
+
+/**
+  Make Guide the anchor of a chord. If its key press is still held back, Guide
+  produces no keystroke until it is released.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ChordAnchorGuide (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  );
+
 /**
   Initialize USB keyboard device and all private data structures.
 
@@ -85,6 +158,7 @@ InitUSBKeyboard (
   @retval EFI_SUCCESS            Initialization succeeded.
   @retval EFI_NOT_READY          Keyboard layout cannot be retrieve from HII
                                  database, and default layout is disabled.
+  @retval EFI_OUT_OF_RESOURCES   Fail to allocate the key convertion table.
   @retval Other                  Fail to register event to EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID group.
 
 **/
@@ -104,6 +178,20 @@ ReleaseKeyboardLayoutResources (
   IN OUT USB_KB_DEV  *UsbKeyboardDevice
   );
 
+/**
+  Rebuild the key conversion table from the current HII keyboard layout if the
+  layout changed since the last rebuild.
+
+  Called at TPL_CALLBACK, as the layout is read from the HII database into pool.
+
+  @param  UsbKeyboardDevice    The USB_KB_DEV instance.
+
+**/
+VOID
+RefreshKeyboardLayout (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
 /**
   Handler function for USB keyboard's asynchronous interrupt transfer.
 
@@ -131,6 +219,63 @@ KeyboardHandler (
   IN  UINT32  Result
   );
 
+/**
+  Submit the asynchronous interrupt transfer which polls the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @return The status of UsbAsyncInterruptTransfer().
+
+**/
+EFI_STATUS
+SubmitInterruptTransfer (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Start polling the device if it is not polled yet.
+
+  With PcdUsbXbox360ConnectOnDemand, Start() leaves the device idle and the
+  first WaitForKey check, ReadKeyStroke(Ex) or RegisterKeyNotify call submits
+  the interrupt transfer.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+EnsurePolling (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Switch to the endpoint's own polling interval after a button transition.
+
+  The event is signaled by the report handler; the transfer is resubmitted
+  once the host controller has returned from the report callback.
+
+  @param  Event              The fast polling event.
+  @param  Context            Points to the USB_KB_DEV instance.
+
+**/
+VOID
+EFIAPI
+USBKeyboardFastPollingHandler (
+  IN    EFI_EVENT  Event,
+  IN    VOID       *Context
+  );
+
+/**
+  Drop back to PcdUsbXbox360IdlePollingInterval once no button has changed for
+  PcdUsbXbox360IdleTimeoutMs.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+PollingService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
 /**
   Handler for Delayed Recovery event.
 
@@ -151,6 +296,38 @@ USBKeyboardRecoveryHandler (
   IN    VOID       *Context
   );
 
+/**
+  Report an input error of the interrupt transfer.
+
+  The first error in a report window is reported immediately with the device
+  path. Further errors are only counted, and reported by FlushInputErrors().
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Result                The result of the interrupt transfer.
+
+**/
+VOID
+ReportInputError (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT32      Result
+  );
+
+/**
+  Report the input errors counted in the current window.
+
+  This function is called on every tick of the keyboard timer. When the window
+  expires, one status code with the count is reported for every error class
+  that was seen, with USB_XBOX360_INPUT_ERROR_DATA identifying the controller.
+  The window stays open while errors keep arriving.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+FlushInputErrors (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
 /**
   Retrieves a USB keycode after parsing the raw data in keyboard buffer.
 
@@ -159,6 +336,8 @@ USBKeyboardRecoveryHandler (
 
   @param  UsbKeyboardDevice    The USB_KB_DEV instance.
   @param  KeyCode              Pointer to the USB keycode for output.
+  @param  KeyTime              Pointer to the performance counter for output,
+                               when the keycode was queued.
 
   @retval EFI_SUCCESS          Keycode successfully parsed.
   @retval EFI_NOT_READY        Keyboard buffer is not ready for a valid keycode
@@ -167,7 +346,8 @@ USBKeyboardRecoveryHandler (
 EFI_STATUS
 USBParseKey (
   IN OUT  USB_KB_DEV  *UsbKeyboardDevice,
-  OUT     UINT8       *KeyCode
+  OUT     UINT8       *KeyCode,
+  OUT     UINT64      *KeyTime
   );
 
 /**
@@ -194,26 +374,102 @@ UsbKeyCodeToEfiInputKey (
   );
 
 /**
-  Create the queue.
+  Queue a key transition into UsbKeyQueue and track the repeat key.
 
-  @param  Queue     Points to the queue.
-  @param  ItemSize  Size of the single item.
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyCode               The USB keycode.
+  @param  IsPressed             TRUE if the key went down.
 
 **/
 VOID
-InitQueue (
-  IN OUT  USB_SIMPLE_QUEUE  *Queue,
-  IN      UINTN             ItemSize
+QueueButtonTransition (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINT8       KeyCode,
+  IN BOOLEAN     IsPressed
+  );
+
+/**
+  Compute the CRC32 of a device path.
+
+  @param  DevicePath        The device path of the controller.
+
+  @return The CRC32 of the device path, end node included.
+
+**/
+UINT32
+GetDevicePathKey (
+  IN EFI_DEVICE_PATH_PROTOCOL  *DevicePath
+  );
+
+/**
+  Assign the lowest free player slot to the device and compile its button map
+  into UsbKeyboardDevice->ButtonKeyCode.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance, with its device path
+                                key set.
+
+**/
+VOID
+AssignPlayerSlot (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Release the player slot of the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ReleasePlayerSlot (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Queue a rumble output report for the controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  LeftMotor             Level of the left, low frequency motor.
+  @param  RightMotor            Level of the right, high frequency motor.
+
+  @retval EFI_SUCCESS           The report is queued.
+  @retval EFI_UNSUPPORTED       The controller has no rumble output.
+
+**/
+EFI_STATUS
+QueueRumble (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       LeftMotor,
+  IN     UINT8       RightMotor
+  );
+
+/**
+  Queue a key for the notification functions registered for it.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyData               The key that was pressed.
+
+**/
+VOID
+SignalKeyNotify (
+  IN USB_KB_DEV    *UsbKeyboardDevice,
+  IN EFI_KEY_DATA  *KeyData
   );
 
 /**
-  Destroy the queue
+  Initialize the queue.
+
+  The queue storage is part of USB_SIMPLE_QUEUE, so no memory is allocated
+  and the queue may be reinitialized at any time.
+
+  @param  Queue     Points to the queue.
+  @param  ItemSize  Size of the single item.
 
-  @param Queue    Points to the queue.
 **/
 VOID
-DestroyQueue (
-  IN OUT USB_SIMPLE_QUEUE  *Queue
+InitQueue (
+  IN OUT  USB_SIMPLE_QUEUE  *Queue,
+  IN      UINTN             ItemSize
   );
 
 /**
@@ -276,6 +532,125 @@ Dequeue (
   IN      UINTN             ItemSize
   );
 
+/**
+  Discard every keystroke queued for the device.
+
+  Everything runs at TPL_NOTIFY, so no keystroke is produced in between and
+  the caller may be at any TPL up to TPL_NOTIFY.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ResetKeyQueues (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Discard every keystroke in a packed keystroke queue.
+
+  Only the consumer side may call this, since it moves Head. The caller may
+  run at any TPL up to TPL_NOTIFY.
+
+  @param  Queue     Points to the queue.
+
+**/
+VOID
+FlushKeyDataQueue (
+  IN OUT USB_KEY_DATA_QUEUE  *Queue
+  );
+
+/**
+  Check whether a packed keystroke queue is empty.
+
+  @param  Queue     Points to the queue.
+
+  @retval TRUE      Queue is empty.
+  @retval FALSE     Queue is not empty.
+
+**/
+BOOLEAN
+IsKeyDataQueueEmpty (
+  IN  USB_KEY_DATA_QUEUE  *Queue
+  );
+
+/**
+  Check whether a packed keystroke queue is full.
+
+  @param  Queue     Points to the queue.
+
+  @retval TRUE      Queue is full, the next keystroke would be dropped.
+  @retval FALSE     Queue has room for a keystroke.
+
+**/
+BOOLEAN
+IsKeyDataQueueFull (
+  IN  USB_KEY_DATA_QUEUE  *Queue
+  );
+
+/**
+  Enqueue a packed keystroke.
+
+  If the queue is full, the keystroke is thrown away and counted in Dropped.
+
+  @param  Queue     Points to the queue.
+  @param  KeyData   The packed keystroke.
+
+**/
+VOID
+EnqueueKeyData (
+  IN OUT  USB_KEY_DATA_QUEUE  *Queue,
+  IN      UINT64              KeyData
+  );
+
+/**
+  Dequeue a packed keystroke.
+
+  The caller may run at any TPL up to TPL_NOTIFY, and may be preempted by a
+  producer or another consumer.
+
+  @param  Queue     Points to the queue.
+  @param  KeyData   Receives the packed keystroke.
+
+  @retval EFI_SUCCESS        Keystroke was successfully dequeued.
+  @retval EFI_DEVICE_ERROR   The queue is empty.
+
+**/
+EFI_STATUS
+DequeueKeyData (
+  IN OUT  USB_KEY_DATA_QUEUE  *Queue,
+  OUT     UINT64              *KeyData
+  );
+
+/**
+  Pack a keystroke into its queued UINT64 form.
+
+  @param  KeyData   The keystroke to pack.
+
+  @return The packed keystroke.
+
+**/
+UINT64
+PackKeyData (
+  IN CONST EFI_KEY_DATA  *KeyData
+  );
+
+/**
+  Expand a packed keystroke into EFI_KEY_DATA.
+
+  The key state is the one the keystroke was produced with, not the current
+  state of the device.
+
+  @param  PackedKeyData         The packed keystroke.
+  @param  KeyData               Receives the expanded keystroke.
+
+**/
+VOID
+UnpackKeyData (
+  IN  UINT64        PackedKeyData,
+  OUT EFI_KEY_DATA  *KeyData
+  );
+
 /**
   Handler for Repeat Key event.
 
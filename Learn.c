@@ -0,0 +1,673 @@
+/** @file
+  Layout learning of vendor-specific XInput pads for the USB Xbox 360 controller
+  driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Learn.h"
+
+#include <Library/PrintLib.h>
+
+//
+// Steps of learn mode before the first control, and the step of a pad that is
+// not in learn mode
+//
+#define LEARN_STEP_IDLE      0xFC
+#define LEARN_STEP_START     0xFD
+#define LEARN_STEP_BASELINE  0xFE
+
+//
+// Guide with both stick buttons starts learn mode
+//
+#define LEARN_CHORD  (XBOX360_BUTTON_GUIDE | XBOX360_BUTTON_LEFT_THUMB | XBOX360_BUTTON_RIGHT_THUMB)
+
+//
+// Service timer ticks spent sampling the idle report, and waited for a
+// control before it is skipped
+//
+#define LEARN_BASELINE_TICKS  10
+#define LEARN_SKIP_TICKS      50
+
+//
+// A stick byte must move this far from rest to be detected, and come back
+// this close to count as released.
+//
+#define LEARN_AXIS_MIN   0x40
+#define LEARN_AXIS_REST  0x20
+
+//
+// Prompt of each control, NULL if the control is not learned
+//
+STATIC CONST CHAR16  *mLearnControlName[USB_KB_LEARN_CONTROLS] = {
+  L"D-pad up",
+  L"D-pad down",
+  L"D-pad left",
+  L"D-pad right",
+  L"Start",
+  L"Back",
+  L"the left stick button",
+  L"the right stick button",
+  L"the left shoulder",
+  L"the right shoulder",
+  L"Guide",
+  NULL,
+  L"A",
+  L"B",
+  L"X",
+  L"Y",
+  L"the left stick to the left",
+  L"the left stick to the right",
+  L"the left stick up",
+  L"the left stick down"
+};
+
+/**
+  Get the signed distance of a stick byte from its rest value.
+
+  Subtracting in 8 bits handles both signed axes resting at 0 and unsigned
+  axes resting at 0x80.
+
+  @param  Value     The report byte.
+  @param  Rest      The report byte at rest.
+
+  @return The distance.
+
+**/
+STATIC
+INT8
+LearnAxisDelta (
+  IN UINT8  Value,
+  IN UINT8  Rest
+  )
+{
+  return (INT8)(UINT8)(Value - Rest);
+}
+
+/**
+  Check whether a learned control is active in a report.
+
+  @param  Control       The extractor of the control.
+  @param  IsStick       TRUE if the control is a stick direction.
+  @param  Report        The interrupt transfer data.
+  @param  ReportLength  The length of Report.
+
+  @retval TRUE          The control is active.
+  @retval FALSE         The control is not active or was not learned.
+
+**/
+STATIC
+BOOLEAN
+LearnIsActive (
+  IN CONST USB_KB_LEARN_CONTROL  *Control,
+  IN       BOOLEAN               IsStick,
+  IN       UINT8                 *Report,
+  IN       UINTN                 ReportLength
+  )
+{
+  INT8  Delta;
+  INT8  Target;
+
+  if ((Control->Offset == USB_KB_LEARN_OFFSET_NONE) || (Control->Offset >= ReportLength)) {
+    return FALSE;
+  }
+
+  if (!IsStick) {
+    return (BOOLEAN)((Report[Control->Offset] & Control->Mask) == Control->Active);
+  }
+
+  Delta  = LearnAxisDelta (Report[Control->Offset], Control->Rest);
+  Target = LearnAxisDelta (Control->Active, Control->Rest);
+  if (Target < 0) {
+    return (BOOLEAN)(Delta <= Target / 2);
+  }
+
+  return (BOOLEAN)(Delta >= Target / 2);
+}
+
+/**
+  Find the report bytes covered by the learned controls.
+
+  @param  Learn     The learn mode state.
+
+**/
+STATIC
+VOID
+LearnCompile (
+  IN OUT USB_KB_LEARN  *Learn
+  )
+{
+  UINTN  Index;
+  UINT8  First;
+  UINT8  Last;
+
+  First = USB_KB_LEARN_OFFSET_NONE;
+  Last  = 0;
+  for (Index = 0; Index < USB_KB_LEARN_CONTROLS; Index++) {
+    if (Learn->Layout.Controls[Index].Offset == USB_KB_LEARN_OFFSET_NONE) {
+      continue;
+    }
+
+    First = MIN (First, Learn->Layout.Controls[Index].Offset);
+    Last  = MAX (Last, Learn->Layout.Controls[Index].Offset);
+  }
+
+  if (First == USB_KB_LEARN_OFFSET_NONE) {
+    Learn->FirstByte = 0;
+    Learn->ByteCount = 0;
+  } else {
+    Learn->FirstByte = First;
+    Learn->ByteCount = (UINT8)(Last - First + 1);
+  }
+}
+
+/**
+  Look for the control being learned in a report.
+
+  A button is the first report byte with a bit that differs from the idle
+  report and did not flicker while idle. A single changed bit is a plain
+  button, several are taken as a hat switch value in a nibble. A stick
+  direction is the byte that moved furthest from rest.
+
+  @param  Learn         The learn mode state.
+  @param  Report        The interrupt transfer data.
+  @param  Length        The length of Report, at most USB_KB_LEARN_REPORT_MAX.
+
+  @retval TRUE          The control was found and stored in Candidate.
+  @retval FALSE         The report does not show the control.
+
+**/
+STATIC
+BOOLEAN
+LearnDetect (
+  IN OUT USB_KB_LEARN  *Learn,
+  IN     UINT8         *Report,
+  IN     UINTN         Length
+  )
+{
+  UINTN  Offset;
+  UINT8  Diff;
+  UINT8  Mask;
+  INT8   Delta;
+  UINTN  Best;
+  UINTN  BestDistance;
+
+  if (Learn->Step >= USB_KB_LEARN_STICK_LEFT) {
+    Best         = Length;
+    BestDistance = LEARN_AXIS_MIN - 1;
+    for (Offset = 0; Offset < Length; Offset++) {
+      Delta = LearnAxisDelta (Report[Offset], Learn->Baseline[Offset]);
+      if ((UINTN)ABS (Delta) > BestDistance) {
+        Best         = Offset;
+        BestDistance = (UINTN)ABS (Delta);
+      }
+    }
+
+    if (Best == Length) {
+      return FALSE;
+    }
+
+    Learn->Candidate.Offset = (UINT8)Best;
+    Learn->Candidate.Mask   = 0xFF;
+    Learn->Candidate.Rest   = Learn->Baseline[Best];
+    Learn->Candidate.Active = Report[Best];
+    return TRUE;
+  }
+
+  for (Offset = 0; Offset < Length; Offset++) {
+    Diff = (UINT8)((Report[Offset] ^ Learn->Baseline[Offset]) & ~Learn->Noise[Offset]);
+    if (Diff == 0) {
+      continue;
+    }
+
+    if ((Diff & (Diff - 1)) == 0) {
+      Mask = Diff;
+    } else {
+      Mask = (UINT8)((((Diff & 0x0F) != 0) ? 0x0F : 0) | (((Diff & 0xF0) != 0) ? 0xF0 : 0));
+    }
+
+    Learn->Candidate.Offset = (UINT8)Offset;
+    Learn->Candidate.Mask   = Mask;
+    Learn->Candidate.Rest   = (UINT8)(Learn->Baseline[Offset] & Mask);
+    Learn->Candidate.Active = (UINT8)(Report[Offset] & Mask);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+  Check whether the detected control is back at rest.
+
+  @param  Learn         The learn mode state.
+  @param  Report        The interrupt transfer data.
+
+  @retval TRUE          The control was released.
+  @retval FALSE         The control is still held.
+
+**/
+STATIC
+BOOLEAN
+LearnIsReleased (
+  IN USB_KB_LEARN  *Learn,
+  IN UINT8         *Report
+  )
+{
+  CONST USB_KB_LEARN_CONTROL  *Candidate;
+
+  Candidate = &Learn->Candidate;
+  if (Learn->Step >= USB_KB_LEARN_STICK_LEFT) {
+    return (BOOLEAN)(ABS (LearnAxisDelta (Report[Candidate->Offset], Candidate->Rest)) < LEARN_AXIS_REST);
+  }
+
+  return (BOOLEAN)((Report[Candidate->Offset] & Candidate->Mask) == Candidate->Rest);
+}
+
+/**
+  Load the saved layout of the pad.
+
+  The variable is read at the TPL of the caller, and the layout is replaced at
+  TPL_NOTIFY, as KeyboardHandler() decodes through it. A layout that covers no
+  report byte is not used.
+
+  @param  Learn     The learn mode state.
+
+  @retval TRUE      A layout was loaded.
+  @retval FALSE     There is no valid layout, the pad is not learned.
+
+**/
+STATIC
+BOOLEAN
+LearnLoad (
+  IN OUT USB_KB_LEARN  *Learn
+  )
+{
+  EFI_STATUS           Status;
+  USB_KB_LEARN_LAYOUT  Layout;
+  UINTN                DataSize;
+  UINTN                Index;
+  UINTN                Length;
+  BOOLEAN              Valid;
+  EFI_TPL              OldTpl;
+
+  DataSize = sizeof (Layout);
+  Status   = gRT->GetVariable (
+                    Learn->VariableName,
+                    &gUsbXbox360VariableGuid,
+                    NULL,
+                    &DataSize,
+                    &Layout
+                    );
+  Valid = (BOOLEAN)(!EFI_ERROR (Status) &&
+                    (DataSize == sizeof (Layout)) &&
+                    (Layout.Revision == USB_KB_LEARN_REVISION));
+  if (Valid) {
+    Length = MIN (Layout.ReportLength, USB_KB_LEARN_REPORT_MAX);
+    for (Index = 0; Index < USB_KB_LEARN_CONTROLS; Index++) {
+      if ((Layout.Controls[Index].Offset != USB_KB_LEARN_OFFSET_NONE) &&
+          (Layout.Controls[Index].Offset >= Length))
+      {
+        Valid = FALSE;
+      }
+    }
+  }
+
+  //
+  // Leave the layout alone if the learn chord was pressed meanwhile.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (Learn->Step == LEARN_STEP_IDLE) {
+    Learn->Learned = FALSE;
+    if (Valid) {
+      CopyMem (&Learn->Layout, &Layout, sizeof (Layout));
+      LearnCompile (Learn);
+      Learn->Learned = (BOOLEAN)(Learn->ByteCount != 0);
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  return Learn->Learned;
+}
+
+/**
+  Enter learn mode.
+
+  The service timer prompts for the controls from the next tick on. Must be
+  called at TPL_NOTIFY, or before the pad is polled.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+LearnStart (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_LEARN  *Learn;
+
+  Learn = &UsbKeyboardDevice->Learn;
+
+  ZeroMem (&Learn->Layout, sizeof (Learn->Layout));
+  ZeroMem (Learn->Noise, sizeof (Learn->Noise));
+  ZeroMem (UsbKeyboardDevice->ReportCache, sizeof (UsbKeyboardDevice->ReportCache));
+  Learn->Layout.Revision = USB_KB_LEARN_REVISION;
+  Learn->Learned         = FALSE;
+  Learn->BaselineReports = 0;
+  Learn->Detected        = FALSE;
+  Learn->Released        = FALSE;
+  Learn->Step            = LEARN_STEP_START;
+}
+
+/**
+  Load the learned layout of the pad.
+
+  A pad without a layout is decoded as a wired Xbox 360 controller. It enters
+  learn mode on the learn chord, or right away if PcdUsbXbox360LearnOnStart is
+  set.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The layout is loaded, or the pad is not learned.
+  @retval Others                The device descriptor cannot be read.
+
+**/
+EFI_STATUS
+LearnInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_USB_DEVICE_DESCRIPTOR  DeviceDescriptor;
+  USB_KB_LEARN               *Learn;
+
+  Learn = &UsbKeyboardDevice->Learn;
+
+  Status = UsbKeyboardDevice->UsbIo->UsbGetDeviceDescriptor (UsbKeyboardDevice->UsbIo, &DeviceDescriptor);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  UnicodeSPrint (
+    Learn->VariableName,
+    sizeof (Learn->VariableName),
+    L"%s%04x%04x",
+    USB_KB_LEARN_VARIABLE_NAME,
+    DeviceDescriptor.IdVendor,
+    DeviceDescriptor.IdProduct
+    );
+
+  Learn->Step = LEARN_STEP_IDLE;
+  if (!LearnLoad (Learn) && FeaturePcdGet (PcdUsbXbox360LearnOnStart)) {
+    LearnStart (UsbKeyboardDevice);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Feed a report to learn mode.
+
+  @param  Learn         The learn mode state.
+  @param  Report        The interrupt transfer data.
+  @param  ReportLength  The length of Report.
+
+**/
+STATIC
+VOID
+LearnFeedReport (
+  IN OUT USB_KB_LEARN  *Learn,
+  IN     UINT8         *Report,
+  IN     UINTN         ReportLength
+  )
+{
+  UINTN  Length;
+  UINTN  Index;
+
+  if (Learn->Layout.ReportLength == 0) {
+    Learn->Layout.ReportLength = (UINT16)ReportLength;
+  }
+
+  if (ReportLength != Learn->Layout.ReportLength) {
+    return;
+  }
+
+  Length = MIN (ReportLength, USB_KB_LEARN_REPORT_MAX);
+
+  if (Learn->Step == LEARN_STEP_BASELINE) {
+    if (Learn->BaselineReports == 0) {
+      CopyMem (Learn->Baseline, Report, Length);
+    } else {
+      for (Index = 0; Index < Length; Index++) {
+        Learn->Noise[Index] |= (UINT8)(Report[Index] ^ Learn->Baseline[Index]);
+      }
+    }
+
+    Learn->BaselineReports++;
+    return;
+  }
+
+  if (Learn->Step >= USB_KB_LEARN_CONTROLS) {
+    return;
+  }
+
+  if (!Learn->Detected) {
+    Learn->Detected = LearnDetect (Learn, Report, Length);
+  }
+
+  if (Learn->Detected && !Learn->Released) {
+    Learn->Released = LearnIsReleased (Learn, Report);
+  }
+}
+
+/**
+  Decode a report through the learned layout, or feed it to learn mode.
+
+  A pad that is not learned is decoded as a wired Xbox 360 controller. The
+  learned stick directions press the D-pad buttons.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+LearnHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  USB_KB_LEARN          *Learn;
+  USB_KB_LEARN_CONTROL  *Controls;
+  UINTN                 Bit;
+  UINT16                OldButtons;
+  UINT16                NewButtons;
+
+  Learn = &UsbKeyboardDevice->Learn;
+
+  if (Learn->Step != LEARN_STEP_IDLE) {
+    LearnFeedReport (Learn, Report, ReportLength);
+    return;
+  }
+
+  if (!Learn->Learned) {
+    if ((ReportLength < XBOX360_INPUT_REPORT_LENGTH) ||
+        (Report[0] != XBOX360_INPUT_REPORT_TYPE) ||
+        (Report[1] != XBOX360_INPUT_REPORT_LENGTH))
+    {
+      return;
+    }
+
+    NewButtons = (UINT16)(Report[2] | ((UINT16)Report[3] << 8));
+  } else {
+    if (ReportLength != Learn->Layout.ReportLength) {
+      return;
+    }
+
+    //
+    // Skip reports whose learned bytes are unchanged.
+    //
+    if (Learn->ByteCount <= sizeof (UsbKeyboardDevice->ReportCache)) {
+      if (CompareMem (UsbKeyboardDevice->ReportCache, &Report[Learn->FirstByte], Learn->ByteCount) == 0) {
+        return;
+      }
+
+      CopyMem (UsbKeyboardDevice->ReportCache, &Report[Learn->FirstByte], Learn->ByteCount);
+    }
+
+    Controls   = Learn->Layout.Controls;
+    NewButtons = 0;
+    for (Bit = 0; Bit < USB_KB_LEARN_STICK_LEFT; Bit++) {
+      if (LearnIsActive (&Controls[Bit], FALSE, Report, ReportLength)) {
+        NewButtons |= (UINT16)(1 << Bit);
+      }
+    }
+
+    if (LearnIsActive (&Controls[USB_KB_LEARN_STICK_LEFT], TRUE, Report, ReportLength)) {
+      NewButtons |= XBOX360_BUTTON_DPAD_LEFT;
+    } else if (LearnIsActive (&Controls[USB_KB_LEARN_STICK_RIGHT], TRUE, Report, ReportLength)) {
+      NewButtons |= XBOX360_BUTTON_DPAD_RIGHT;
+    }
+
+    if (LearnIsActive (&Controls[USB_KB_LEARN_STICK_UP], TRUE, Report, ReportLength)) {
+      NewButtons |= XBOX360_BUTTON_DPAD_UP;
+    } else if (LearnIsActive (&Controls[USB_KB_LEARN_STICK_DOWN], TRUE, Report, ReportLength)) {
+      NewButtons |= XBOX360_BUTTON_DPAD_DOWN;
+    }
+  }
+
+  OldButtons = UsbKeyboardDevice->XboxState.Buttons;
+
+  //
+  // The learn chord releases the keys held so far and starts learn mode;
+  // Guide and the button completing the chord produce no keystroke.
+  //
+  if (((NewButtons & LEARN_CHORD) == LEARN_CHORD) && ((OldButtons & LEARN_CHORD) != LEARN_CHORD)) {
+    ChordAnchorGuide (UsbKeyboardDevice);
+    ProcessButtonChanges (UsbKeyboardDevice, OldButtons, 0);
+    UsbKeyboardDevice->XboxState.Buttons = 0;
+    LearnStart (UsbKeyboardDevice);
+    return;
+  }
+
+  if (OldButtons != NewButtons) {
+    ProcessButtonChanges (UsbKeyboardDevice, OldButtons, NewButtons);
+    UsbKeyboardDevice->XboxState.Buttons = NewButtons;
+  }
+}
+
+/**
+  Prompt for the next control and save the layout once all are learned.
+
+  The step is advanced at TPL_NOTIFY, as KeyboardHandler() reads it; the
+  prompts and the variable are written at TPL_CALLBACK. A layout without any
+  learned control is not saved, and the saved layout, if any, stays in use.
+
+  Learn mode can be entered while a setup form owns the console, so the
+  prompts go to the debug log and the start and end are status codes.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+LearnService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS    Status;
+  USB_KB_LEARN  *Learn;
+  EFI_TPL       OldTpl;
+  BOOLEAN       Advance;
+
+  Learn = &UsbKeyboardDevice->Learn;
+  if (Learn->Step == LEARN_STEP_IDLE) {
+    return;
+  }
+
+  if (Learn->Step == LEARN_STEP_START) {
+    REPORT_STATUS_CODE_WITH_DEVICE_PATH (
+      EFI_PROGRESS_CODE,
+      (EFI_PERIPHERAL_KEYBOARD | EFI_P_PC_RECONFIG),
+      UsbKeyboardDevice->DevicePath
+      );
+    DEBUG ((DEBUG_INFO, "UsbXbox360: learning the layout of this controller, release all controls\n"));
+    Learn->Ticks = 0;
+    Learn->Step  = LEARN_STEP_BASELINE;
+    return;
+  }
+
+  OldTpl  = gBS->RaiseTPL (TPL_NOTIFY);
+  Advance = FALSE;
+  Learn->Ticks++;
+  if (Learn->Step == LEARN_STEP_BASELINE) {
+    Advance = (BOOLEAN)(Learn->Ticks >= LEARN_BASELINE_TICKS);
+  } else if (Learn->Released) {
+    CopyMem (&Learn->Layout.Controls[Learn->Step], &Learn->Candidate, sizeof (Learn->Candidate));
+    Advance = TRUE;
+  } else if (!Learn->Detected && (Learn->Ticks >= LEARN_SKIP_TICKS)) {
+    Learn->Layout.Controls[Learn->Step].Offset = USB_KB_LEARN_OFFSET_NONE;
+    Advance                                    = TRUE;
+  }
+
+  if (Advance) {
+    //
+    // Move to the next control which has a prompt.
+    //
+    do {
+      Learn->Step = (UINT8)((Learn->Step == LEARN_STEP_BASELINE) ? 0 : Learn->Step + 1);
+      if ((Learn->Step < USB_KB_LEARN_CONTROLS) && (mLearnControlName[Learn->Step] == NULL)) {
+        Learn->Layout.Controls[Learn->Step].Offset = USB_KB_LEARN_OFFSET_NONE;
+      }
+    } while ((Learn->Step < USB_KB_LEARN_CONTROLS) && (mLearnControlName[Learn->Step] == NULL));
+
+    Learn->Ticks    = 0;
+    Learn->Detected = FALSE;
+    Learn->Released = FALSE;
+
+    if (Learn->Step >= USB_KB_LEARN_CONTROLS) {
+      LearnCompile (Learn);
+      Learn->Learned = (BOOLEAN)(Learn->ByteCount != 0);
+      Learn->Step    = LEARN_STEP_IDLE;
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  if (!Advance) {
+    return;
+  }
+
+  if (Learn->Step != LEARN_STEP_IDLE) {
+    DEBUG ((DEBUG_INFO, "UsbXbox360: press %s, or wait to skip it\n", mLearnControlName[Learn->Step]));
+    return;
+  }
+
+  if (!Learn->Learned) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: no control was detected, the layout is not saved\n"));
+    LearnLoad (Learn);
+    return;
+  }
+
+  Status = gRT->SetVariable (
+                  Learn->VariableName,
+                  &gUsbXbox360VariableGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                  sizeof (Learn->Layout),
+                  &Learn->Layout
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: failed to save the learned layout - %r\n", Status));
+  }
+
+  REPORT_STATUS_CODE_WITH_DEVICE_PATH (
+    EFI_PROGRESS_CODE,
+    (EFI_PERIPHERAL_KEYBOARD | EFI_P_PC_ENABLE),
+    UsbKeyboardDevice->DevicePath
+    );
+  DEBUG ((DEBUG_INFO, "UsbXbox360: layout learned\n"));
+}
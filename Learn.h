@@ -0,0 +1,68 @@
+/** @file
+  Layout learning of vendor-specific XInput pads for the USB Xbox 360 controller
+  driver.
+
+  Pads with an XInput interface but an unknown VID/PID often shift the fields of
+  their input report. On Guide + both stick buttons, the driver prompts on the
+  console for each button and stick direction, detects the report bits that
+  change, and saves the result as an extractor table in a non-volatile variable
+  named after the VID/PID. Later reports are decoded through the table; until
+  then, reports are decoded as those of a wired Xbox 360 controller.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_LEARN_H_
+#define _USB_KB_LEARN_H_
+
+#include "EfiKey.h"
+
+//
+// Subclass and protocol of the XInput controller interface
+//
+#define XINPUT_INTERFACE_SUBCLASS  0x5D
+#define XINPUT_INTERFACE_PROTOCOL  0x01
+
+/**
+  Load the learned layout of the pad.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The layout is loaded, or the pad is not learned.
+  @retval Others                The device descriptor cannot be read.
+
+**/
+EFI_STATUS
+LearnInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Decode a report through the learned layout, or feed it to learn mode.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+LearnHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+/**
+  Prompt for the next control and save the layout once all are learned.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+LearnService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+#endif
@@ -0,0 +1,298 @@
+/** @file
+  Macro recorder of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Macro.h"
+
+/**
+  Save the macro slot to its non-volatile variable.
+
+  Runtime services may not be called at TPL_NOTIFY, so the save is deferred
+  to this TPL_CALLBACK event.
+
+  @param  Event             The save event.
+  @param  Context           Pointing to USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+EFIAPI
+MacroSaveHandler (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  EFI_STATUS         Status;
+  USB_KB_DEV         *UsbKeyboardDevice;
+  USB_KB_MACRO_SLOT  Slot;
+  EFI_TPL            OldTpl;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+
+  //
+  // Take a snapshot, the slot is written at TPL_NOTIFY.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  CopyMem (&Slot, &UsbKeyboardDevice->Macro.Slot, sizeof (Slot));
+  gBS->RestoreTPL (OldTpl);
+
+  Status = gRT->SetVariable (
+                  USB_KB_MACRO_VARIABLE_NAME,
+                  &gUsbXbox360VariableGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                  OFFSET_OF (USB_KB_MACRO_SLOT, Entries) + Slot.Count * sizeof (USB_KB_MACRO_ENTRY),
+                  &Slot
+                  );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: failed to save macro - %r\n", Status));
+  }
+}
+
+/**
+  Inject the macro slot into EfiKeyQueue.
+
+  If the replay preserves timing, the recorded delays are waited for by
+  re-arming this timer, otherwise every keystroke is injected at once. Either
+  way the replay is paced by the consumer: while a key queue is full, the timer
+  is re-armed instead, so no keystroke of the macro is dropped.
+
+  @param  Event             The replay timer.
+  @param  Context           Pointing to USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+EFIAPI
+MacroReplayHandler (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  USB_KB_DEV          *UsbKeyboardDevice;
+  USB_KB_MACRO        *Macro;
+  USB_KB_MACRO_ENTRY  *Entry;
+  EFI_KEY_DATA        KeyData;
+
+  UsbKeyboardDevice = (USB_KB_DEV *)Context;
+  Macro             = &UsbKeyboardDevice->Macro;
+
+  while (Macro->ReplayIndex < Macro->Slot.Count) {
+    Entry = &Macro->Slot.Entries[Macro->ReplayIndex];
+    if (Macro->ReplayPreserveTiming && (Entry->DelayMs != 0) && !Macro->ReplayDelayDone) {
+      Macro->ReplayDelayDone = TRUE;
+      gBS->SetTimer (Event, TimerRelative, MultU64x32 (Entry->DelayMs, 10000));
+      return;
+    }
+
+    if (IsKeyDataQueueFull (&UsbKeyboardDevice->EfiKeyQueue) ||
+        IsKeyDataQueueFull (&UsbKeyboardDevice->EfiKeyQueueForNotify))
+    {
+      gBS->SetTimer (Event, TimerRelative, USB_KB_MACRO_RETRY_INTERVAL);
+      return;
+    }
+
+    Macro->ReplayDelayDone = FALSE;
+    Macro->ReplayIndex++;
+
+    EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueue, Entry->KeyData);
+    UnpackKeyData (Entry->KeyData, &KeyData);
+    SignalKeyNotify (UsbKeyboardDevice, &KeyData);
+  }
+}
+
+/**
+  Create the macro events and load the saved macro slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The macro recorder is initialized.
+  @retval Others                An event could not be created.
+
+**/
+EFI_STATUS
+MacroInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS         Status;
+  USB_KB_MACRO       *Macro;
+  USB_KB_MACRO_SLOT  *Slot;
+  UINTN              DataSize;
+
+  Macro = &UsbKeyboardDevice->Macro;
+  Slot  = &Macro->Slot;
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  MacroReplayHandler,
+                  UsbKeyboardDevice,
+                  &Macro->ReplayTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MacroSaveHandler,
+                  UsbKeyboardDevice,
+                  &Macro->SaveEvent
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->CloseEvent (Macro->ReplayTimer);
+    Macro->ReplayTimer = NULL;
+    return Status;
+  }
+
+  //
+  // A missing or malformed variable leaves the slot empty.
+  //
+  DataSize = sizeof (*Slot);
+  Status   = gRT->GetVariable (
+                    USB_KB_MACRO_VARIABLE_NAME,
+                    &gUsbXbox360VariableGuid,
+                    NULL,
+                    &DataSize,
+                    Slot
+                    );
+  if (EFI_ERROR (Status) ||
+      (DataSize < OFFSET_OF (USB_KB_MACRO_SLOT, Entries)) ||
+      (Slot->Revision != USB_KB_MACRO_REVISION) ||
+      (Slot->Count > USB_KB_MACRO_MAX_ENTRIES) ||
+      (DataSize != OFFSET_OF (USB_KB_MACRO_SLOT, Entries) + Slot->Count * sizeof (USB_KB_MACRO_ENTRY)))
+  {
+    ZeroMem (Slot, sizeof (*Slot));
+  }
+
+  Slot->Revision     = USB_KB_MACRO_REVISION;
+  Macro->ReplayIndex = Slot->Count;
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Close the macro events.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+MacroRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (UsbKeyboardDevice->Macro.ReplayTimer != NULL) {
+    gBS->CloseEvent (UsbKeyboardDevice->Macro.ReplayTimer);
+    UsbKeyboardDevice->Macro.ReplayTimer = NULL;
+  }
+
+  if (UsbKeyboardDevice->Macro.SaveEvent != NULL) {
+    gBS->CloseEvent (UsbKeyboardDevice->Macro.SaveEvent);
+    UsbKeyboardDevice->Macro.SaveEvent = NULL;
+  }
+}
+
+/**
+  Enter or leave record mode. Leaving record mode saves the slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+MacroToggleRecord (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_MACRO  *Macro;
+
+  Macro = &UsbKeyboardDevice->Macro;
+
+  if (Macro->Recording) {
+    Macro->Recording = FALSE;
+    gBS->SignalEvent (Macro->SaveEvent);
+    return;
+  }
+
+  //
+  // Abort a replay in progress and start over with an empty slot.
+  //
+  gBS->SetTimer (Macro->ReplayTimer, TimerCancel, 0);
+  Macro->Slot.Count  = 0;
+  Macro->ReplayIndex = 0;
+  Macro->Recording   = TRUE;
+}
+
+/**
+  Append a keystroke to the macro slot if record mode is active.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  PackedKeyData         The keystroke as returned by PackKeyData().
+
+**/
+VOID
+MacroRecordKey (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT64      PackedKeyData
+  )
+{
+  USB_KB_MACRO        *Macro;
+  USB_KB_MACRO_ENTRY  *Entry;
+  UINT64              Now;
+  UINT64              DelayMs;
+
+  Macro = &UsbKeyboardDevice->Macro;
+  if (!Macro->Recording || (Macro->Slot.Count >= USB_KB_MACRO_MAX_ENTRIES)) {
+    return;
+  }
+
+  Now     = GetPerformanceCounter ();
+  DelayMs = 0;
+  if (Macro->Slot.Count != 0) {
+    DelayMs = DivU64x32 (GetElapsedTime (Macro->LastKeyTime, Now), 1000000);
+  }
+
+  Macro->LastKeyTime = Now;
+
+  Entry           = &Macro->Slot.Entries[Macro->Slot.Count++];
+  Entry->KeyData  = PackedKeyData;
+  Entry->DelayMs  = (UINT16)MIN (DelayMs, MAX_UINT16);
+  ZeroMem (Entry->Reserved, sizeof (Entry->Reserved));
+}
+
+/**
+  Start replaying the macro slot into EfiKeyQueue.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  PreserveTiming        TRUE to wait for the recorded delays, FALSE to
+                                inject every keystroke at once.
+
+**/
+VOID
+MacroReplay (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     BOOLEAN     PreserveTiming
+  )
+{
+  USB_KB_MACRO  *Macro;
+
+  Macro = &UsbKeyboardDevice->Macro;
+  if (Macro->Recording || (Macro->Slot.Count == 0)) {
+    return;
+  }
+
+  //
+  // The first keystroke is injected right away, its delay is always 0.
+  //
+  Macro->ReplayIndex          = 0;
+  Macro->ReplayPreserveTiming = PreserveTiming;
+  Macro->ReplayDelayDone      = FALSE;
+  gBS->SetTimer (Macro->ReplayTimer, TimerCancel, 0);
+  gBS->SignalEvent (Macro->ReplayTimer);
+}
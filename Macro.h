@@ -0,0 +1,82 @@
+/** @file
+  Macro recorder of the USB Xbox 360 controller driver.
+
+  Guide + Back toggles record mode. While recording, every keystroke delivered
+  to EfiKeyQueue is appended to the macro slot together with the time since the
+  previous keystroke. Leaving record mode saves the slot to a non-volatile
+  variable. Guide + Start replays the slot.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_MACRO_H_
+#define _USB_KB_MACRO_H_
+
+#include "EfiKey.h"
+
+/**
+  Create the macro events and load the saved macro slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The macro recorder is initialized.
+  @retval Others                An event could not be created.
+
+**/
+EFI_STATUS
+MacroInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Close the macro events.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+MacroRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Enter or leave record mode. Leaving record mode saves the slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+MacroToggleRecord (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Append a keystroke to the macro slot if record mode is active.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  PackedKeyData         The keystroke as returned by PackKeyData().
+
+**/
+VOID
+MacroRecordKey (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT64      PackedKeyData
+  );
+
+/**
+  Start replaying the macro slot into EfiKeyQueue.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  PreserveTiming        TRUE to wait for the recorded delays, FALSE to
+                                inject every keystroke at once.
+
+**/
+VOID
+MacroReplay (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     BOOLEAN     PreserveTiming
+  );
+
+#endif
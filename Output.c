@@ -0,0 +1,162 @@
+/** @file
+  Output report queue of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Output.h"
+
+/**
+  Queue an output report, replacing the report pending in its slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Slot                  USB_KB_OUTPUT_LED or USB_KB_OUTPUT_RUMBLE.
+  @param  Data                  The output report.
+  @param  Length                The length of Data, at most USB_KB_OUTPUT_MAX_SIZE.
+
+**/
+VOID
+OutputQueue (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINTN       Slot,
+  IN     CONST UINT8 *Data,
+  IN     UINTN       Length
+  )
+{
+  USB_KB_OUTPUT_REPORT  *Report;
+  EFI_TPL               OldTpl;
+
+  ASSERT (Slot < USB_KB_OUTPUT_SLOTS);
+  ASSERT (Length <= USB_KB_OUTPUT_MAX_SIZE);
+
+  if (UsbKeyboardDevice->IntOutEndpointAddress == 0) {
+    return;
+  }
+
+  Report = &UsbKeyboardDevice->Output.Slots[Slot];
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (Report->Pending && FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    UsbKeyboardDevice->Telemetry.Record.OutputCoalescedCount++;
+  }
+
+  CopyMem (Report->Data, Data, Length);
+  Report->Length  = (UINT8)Length;
+  Report->Pending = TRUE;
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Queue a device request without data stage, replacing the pending one.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Request               The device request. Request->Length must be 0.
+
+**/
+VOID
+OutputQueueControl (
+  IN OUT USB_KB_DEV                    *UsbKeyboardDevice,
+  IN     CONST EFI_USB_DEVICE_REQUEST  *Request
+  )
+{
+  USB_KB_OUTPUT_REPORT  *Report;
+  EFI_TPL               OldTpl;
+
+  ASSERT (Request->Length == 0);
+
+  Report = &UsbKeyboardDevice->Output.Slots[USB_KB_OUTPUT_CONTROL];
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (Report->Pending && FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    UsbKeyboardDevice->Telemetry.Record.OutputCoalescedCount++;
+  }
+
+  CopyMem (&Report->Request, Request, sizeof (Report->Request));
+  Report->Length  = 0;
+  Report->Pending = TRUE;
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Send the next pending output report. Called on every service timer tick.
+
+  At most one transfer is made per tick, so the service timer blocks for at
+  most USB_KB_OUTPUT_TIMEOUT. The slots take turns, so a busy slot does not
+  hold back the others.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+OutputService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS            Status;
+  USB_KB_OUTPUT         *Output;
+  USB_KB_OUTPUT_REPORT  Report;
+  UINTN                 Slot;
+  UINTN                 Index;
+  UINTN                 DataLength;
+  UINT32                UsbStatus;
+  EFI_TPL               OldTpl;
+
+  Output = &UsbKeyboardDevice->Output;
+
+  //
+  // Take the report out at TPL_NOTIFY, so a newer one queued meanwhile is kept.
+  //
+  Report.Pending = FALSE;
+  Slot           = 0;
+  OldTpl         = gBS->RaiseTPL (TPL_NOTIFY);
+  for (Index = 0; Index < USB_KB_OUTPUT_SLOTS; Index++) {
+    Slot = (Output->NextSlot + Index) % USB_KB_OUTPUT_SLOTS;
+    if (Output->Slots[Slot].Pending) {
+      CopyMem (&Report, &Output->Slots[Slot], sizeof (Report));
+      Output->Slots[Slot].Pending = FALSE;
+      Output->NextSlot            = (Slot + 1) % USB_KB_OUTPUT_SLOTS;
+      break;
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  if (!Report.Pending) {
+    return;
+  }
+
+  DataLength = Report.Length;
+  if (Slot == USB_KB_OUTPUT_CONTROL) {
+    Status = UsbKeyboardDevice->UsbIo->UsbControlTransfer (
+                                         UsbKeyboardDevice->UsbIo,
+                                         &Report.Request,
+                                         EfiUsbNoData,
+                                         USB_KB_OUTPUT_TIMEOUT,
+                                         NULL,
+                                         0,
+                                         &UsbStatus
+                                         );
+  } else {
+    Status = UsbKeyboardDevice->UsbIo->UsbSyncInterruptTransfer (
+                                         UsbKeyboardDevice->UsbIo,
+                                         UsbKeyboardDevice->IntOutEndpointAddress,
+                                         Report.Data,
+                                         &DataLength,
+                                         USB_KB_OUTPUT_TIMEOUT,
+                                         &UsbStatus
+                                         );
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: output report %u failed - %r\n", (UINT32)Slot, Status));
+    return;
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360TelemetrySupport)) {
+    UsbKeyboardDevice->Telemetry.Record.OutputReportCount++;
+    UsbKeyboardDevice->Telemetry.Record.OutputByteCount += (UINT32)DataLength;
+  }
+}
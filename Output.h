@@ -0,0 +1,63 @@
+/** @file
+  Output report queue of the USB Xbox 360 controller driver.
+
+  LED and rumble reports go out on the interrupt OUT endpoint, the Chatpad
+  keep-alive as a control transfer. They are queued from any TPL up to
+  TPL_NOTIFY and sent by the service timer, so no synchronous transfer is made
+  from the input path. A report replaces the one still pending in its slot.
+
+  UsbIo has no asynchronous OUT transfer, so the service timer sends one
+  report per tick with a short timeout instead.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_OUTPUT_H_
+#define _USB_KB_OUTPUT_H_
+
+#include "EfiKey.h"
+
+/**
+  Queue an output report, replacing the report pending in its slot.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Slot                  USB_KB_OUTPUT_LED or USB_KB_OUTPUT_RUMBLE.
+  @param  Data                  The output report.
+  @param  Length                The length of Data, at most USB_KB_OUTPUT_MAX_SIZE.
+
+**/
+VOID
+OutputQueue (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINTN       Slot,
+  IN     CONST UINT8 *Data,
+  IN     UINTN       Length
+  );
+
+/**
+  Queue a device request without data stage, replacing the pending one.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Request               The device request. Request->Length must be 0.
+
+**/
+VOID
+OutputQueueControl (
+  IN OUT USB_KB_DEV                    *UsbKeyboardDevice,
+  IN     CONST EFI_USB_DEVICE_REQUEST  *Request
+  );
+
+/**
+  Send the next pending output report. Called on every service timer tick.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+OutputService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+#endif
@@ -0,0 +1,556 @@
+/** @file
+  Key script playback of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Script.h"
+
+#include <Protocol/SimpleFileSystem.h>
+
+///
+/// A special key of the script syntax.
+///
+typedef struct {
+  CONST CHAR16    *Name;
+  UINT16          ScanCode;
+  CHAR16          UnicodeChar;
+} USB_KB_SCRIPT_KEY_NAME;
+
+STATIC CONST USB_KB_SCRIPT_KEY_NAME  mScriptKeyNames[] = {
+  { L"ENTER",  SCAN_NULL,      CHAR_CARRIAGE_RETURN },
+  { L"ESC",    SCAN_ESC,       CHAR_NULL            },
+  { L"TAB",    SCAN_NULL,      CHAR_TAB             },
+  { L"BS",     SCAN_NULL,      CHAR_BACKSPACE       },
+  { L"SPACE",  SCAN_NULL,      L' '                 },
+  { L"UP",     SCAN_UP,        CHAR_NULL            },
+  { L"DOWN",   SCAN_DOWN,      CHAR_NULL            },
+  { L"LEFT",   SCAN_LEFT,      CHAR_NULL            },
+  { L"RIGHT",  SCAN_RIGHT,     CHAR_NULL            },
+  { L"HOME",   SCAN_HOME,      CHAR_NULL            },
+  { L"END",    SCAN_END,       CHAR_NULL            },
+  { L"PGUP",   SCAN_PAGE_UP,   CHAR_NULL            },
+  { L"PGDN",   SCAN_PAGE_DOWN, CHAR_NULL            },
+  { L"INS",    SCAN_INSERT,    CHAR_NULL            },
+  { L"DEL",    SCAN_DELETE,    CHAR_NULL            },
+  { L"F1",     SCAN_F1,        CHAR_NULL            },
+  { L"F2",     SCAN_F2,        CHAR_NULL            },
+  { L"F3",     SCAN_F3,        CHAR_NULL            },
+  { L"F4",     SCAN_F4,        CHAR_NULL            },
+  { L"F5",     SCAN_F5,        CHAR_NULL            },
+  { L"F6",     SCAN_F6,        CHAR_NULL            },
+  { L"F7",     SCAN_F7,        CHAR_NULL            },
+  { L"F8",     SCAN_F8,        CHAR_NULL            },
+  { L"F9",     SCAN_F9,        CHAR_NULL            },
+  { L"F10",    SCAN_F10,       CHAR_NULL            },
+  { L"F11",    SCAN_F11,       CHAR_NULL            },
+  { L"F12",    SCAN_F12,       CHAR_NULL            },
+  { L"LBRACE", SCAN_NULL,      L'{'                 },
+  { L"RBRACE", SCAN_NULL,      L'}'                 }
+};
+
+/**
+  Read the script file from the first file system that has it.
+
+  @param  Data                  Receives the file contents, allocated from pool.
+  @param  Size                  Receives the size of the file.
+
+  @retval EFI_SUCCESS           The file was read.
+  @retval EFI_NOT_FOUND         No file system has the script.
+  @retval EFI_BAD_BUFFER_SIZE   The file is larger than USB_KB_SCRIPT_MAX_SIZE.
+  @retval Others                The file could not be read.
+
+**/
+STATIC
+EFI_STATUS
+ScriptReadFile (
+  OUT UINT8  **Data,
+  OUT UINTN  *Size
+  )
+{
+  EFI_STATUS                       Status;
+  EFI_HANDLE                       *Handles;
+  UINTN                            HandleCount;
+  UINTN                            Index;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL  *FileSystem;
+  EFI_FILE_PROTOCOL                *Root;
+  EFI_FILE_PROTOCOL                *File;
+  UINT64                           FileSize;
+
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiSimpleFileSystemProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_FOUND;
+  }
+
+  File = NULL;
+  for (Index = 0; (Index < HandleCount) && (File == NULL); Index++) {
+    Status = gBS->HandleProtocol (Handles[Index], &gEfiSimpleFileSystemProtocolGuid, (VOID **)&FileSystem);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = FileSystem->OpenVolume (FileSystem, &Root);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = Root->Open (Root, &File, USB_KB_SCRIPT_FILE_NAME, EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR (Status)) {
+      File = NULL;
+    }
+
+    Root->Close (Root);
+  }
+
+  FreePool (Handles);
+
+  if (File == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  //
+  // Setting the position to MAX_UINT64 moves it to the end of the file.
+  //
+  Status = File->SetPosition (File, MAX_UINT64);
+  if (!EFI_ERROR (Status)) {
+    Status = File->GetPosition (File, &FileSize);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = File->SetPosition (File, 0);
+  }
+
+  if (!EFI_ERROR (Status) && (FileSize > USB_KB_SCRIPT_MAX_SIZE)) {
+    Status = EFI_BAD_BUFFER_SIZE;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    *Size = (UINTN)FileSize;
+    *Data = AllocatePool (MAX (*Size, 1));
+    if (*Data == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = File->Read (File, Size, *Data);
+    if (EFI_ERROR (Status)) {
+      FreePool (*Data);
+    }
+  }
+
+  File->Close (File);
+  return Status;
+}
+
+/**
+  Decode the script text into CHAR16.
+
+  Text starting with the byte order mark 0xFF 0xFE is UCS-2, anything else is
+  UTF-8. Characters outside the Basic Multilingual Plane cannot be typed and
+  are rejected.
+
+  @param  Data                  The file contents.
+  @param  Size                  The size of Data.
+  @param  Text                  Receives the characters, room for Size characters.
+  @param  Length                Receives the number of characters.
+
+  @retval EFI_SUCCESS           The text was decoded.
+  @retval EFI_UNSUPPORTED       The text is not valid UTF-8 or UCS-2.
+
+**/
+STATIC
+EFI_STATUS
+ScriptDecode (
+  IN  CONST UINT8  *Data,
+  IN  UINTN        Size,
+  OUT CHAR16       *Text,
+  OUT UINTN        *Length
+  )
+{
+  UINTN   Index;
+  UINTN   Extra;
+  UINT32  Char;
+
+  *Length = 0;
+
+  if ((Size >= 2) && (Data[0] == 0xFF) && (Data[1] == 0xFE)) {
+    if ((Size % 2) != 0) {
+      return EFI_UNSUPPORTED;
+    }
+
+    for (Index = 2; Index < Size; Index += 2) {
+      Text[(*Length)++] = (CHAR16)(Data[Index] | (Data[Index + 1] << 8));
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  Index = 0;
+  if ((Size >= 3) && (Data[0] == 0xEF) && (Data[1] == 0xBB) && (Data[2] == 0xBF)) {
+    Index = 3;
+  }
+
+  while (Index < Size) {
+    Char = Data[Index++];
+    if (Char < 0x80) {
+      Extra = 0;
+    } else if ((Char & 0xE0) == 0xC0) {
+      Extra = 1;
+      Char &= 0x1F;
+    } else if ((Char & 0xF0) == 0xE0) {
+      Extra = 2;
+      Char &= 0x0F;
+    } else {
+      return EFI_UNSUPPORTED;
+    }
+
+    if (Extra > Size - Index) {
+      return EFI_UNSUPPORTED;
+    }
+
+    for ( ; Extra > 0; Extra--) {
+      if ((Data[Index] & 0xC0) != 0x80) {
+        return EFI_UNSUPPORTED;
+      }
+
+      Char = (Char << 6) | (Data[Index++] & 0x3F);
+    }
+
+    Text[(*Length)++] = (CHAR16)Char;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Translate the script text into packed keystrokes.
+
+  @param  Text                  The script text.
+  @param  Length                The number of characters in Text.
+  @param  Keys                  Receives the keystrokes, or NULL to only count them.
+  @param  Count                 Receives the number of keystrokes.
+
+  @retval EFI_SUCCESS           The script was translated.
+  @retval EFI_INVALID_PARAMETER The script has a syntax error.
+  @retval EFI_BAD_BUFFER_SIZE   The script has more than USB_KB_SCRIPT_MAX_KEYS keystrokes.
+
+**/
+STATIC
+EFI_STATUS
+ScriptParse (
+  IN  CONST CHAR16  *Text,
+  IN  UINTN         Length,
+  OUT UINT64        *Keys  OPTIONAL,
+  OUT UINTN         *Count
+  )
+{
+  UINTN         Index;
+  UINTN         End;
+  UINTN         NameLength;
+  UINTN         Repeat;
+  UINTN         Name;
+  EFI_KEY_DATA  KeyData;
+  UINT64        PackedKeyData;
+
+  *Count = 0;
+  Index  = 0;
+  while (Index < Length) {
+    ZeroMem (&KeyData, sizeof (KeyData));
+    Repeat = 1;
+
+    if ((Text[Index] == CHAR_CARRIAGE_RETURN) || (Text[Index] == CHAR_LINEFEED)) {
+      Index++;
+      continue;
+    }
+
+    if (Text[Index] != L'{') {
+      KeyData.Key.UnicodeChar = Text[Index++];
+    } else {
+      for (End = Index + 1; (End < Length) && (Text[End] != L'}'); End++) {
+      }
+
+      if (End == Length) {
+        DEBUG ((DEBUG_WARN, "UsbXbox360: script brace at %u is not closed\n", (UINT32)Index));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      for (NameLength = 0; (Index + 1 + NameLength < End) && (Text[Index + 1 + NameLength] != L'*'); NameLength++) {
+      }
+
+      if (Index + 1 + NameLength < End) {
+        Repeat = 0;
+        for (Name = Index + 2 + NameLength; Name < End; Name++) {
+          if ((Text[Name] < L'0') || (Text[Name] > L'9') || (Repeat > USB_KB_SCRIPT_MAX_REPEAT)) {
+            break;
+          }
+
+          Repeat = Repeat * 10 + (Text[Name] - L'0');
+        }
+
+        if ((Name != End) || (Repeat == 0) || (Repeat > USB_KB_SCRIPT_MAX_REPEAT)) {
+          DEBUG ((DEBUG_WARN, "UsbXbox360: script repeat count at %u is invalid\n", (UINT32)Index));
+          return EFI_INVALID_PARAMETER;
+        }
+      }
+
+      for (Name = 0; Name < ARRAY_SIZE (mScriptKeyNames); Name++) {
+        if ((StrLen (mScriptKeyNames[Name].Name) == NameLength) &&
+            (StrnCmp (mScriptKeyNames[Name].Name, &Text[Index + 1], NameLength) == 0))
+        {
+          break;
+        }
+      }
+
+      if (Name == ARRAY_SIZE (mScriptKeyNames)) {
+        DEBUG ((DEBUG_WARN, "UsbXbox360: script key name at %u is unknown\n", (UINT32)Index));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      KeyData.Key.ScanCode    = mScriptKeyNames[Name].ScanCode;
+      KeyData.Key.UnicodeChar = mScriptKeyNames[Name].UnicodeChar;
+      Index                   = End + 1;
+    }
+
+    if (*Count + Repeat > USB_KB_SCRIPT_MAX_KEYS) {
+      return EFI_BAD_BUFFER_SIZE;
+    }
+
+    PackedKeyData = PackKeyData (&KeyData);
+    for ( ; Repeat > 0; Repeat--) {
+      if (Keys != NULL) {
+        Keys[*Count] = PackedKeyData;
+      }
+
+      (*Count)++;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Stop the playback. The caller runs at TPL_NOTIFY.
+
+  @param  Script                The script state of the device.
+
+**/
+STATIC
+VOID
+ScriptStop (
+  IN OUT USB_KB_SCRIPT  *Script
+  )
+{
+  if (Script->Keys != NULL) {
+    FreePool (Script->Keys);
+  }
+
+  Script->Keys          = NULL;
+  Script->Count         = 0;
+  Script->Next          = 0;
+  Script->LoadRequested = FALSE;
+}
+
+/**
+  Read and translate the script, then start the playback unless it was
+  cancelled in the meantime.
+
+  File services may not be called above TPL_CALLBACK, so this runs from the
+  service timer rather than from the chord.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+ScriptLoad (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS  Status;
+  UINT8       *Data;
+  UINTN       Size;
+  CHAR16      *Text;
+  UINTN       Length;
+  UINT64      *Keys;
+  UINTN       Count;
+  EFI_TPL     OldTpl;
+
+  Keys   = NULL;
+  Count  = 0;
+  Text   = NULL;
+  Length = 0;
+
+  Status = ScriptReadFile (&Data, &Size);
+  if (!EFI_ERROR (Status)) {
+    Text = AllocatePool (MAX (Size, 1) * sizeof (CHAR16));
+    if (Text == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+    } else {
+      Status = ScriptDecode (Data, Size, Text, &Length);
+    }
+
+    FreePool (Data);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = ScriptParse (Text, Length, NULL, &Count);
+  }
+
+  if (!EFI_ERROR (Status) && (Count != 0)) {
+    Keys = AllocatePool (Count * sizeof (UINT64));
+    if (Keys == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+    } else {
+      Status = ScriptParse (Text, Length, Keys, &Count);
+    }
+  }
+
+  if (Text != NULL) {
+    FreePool (Text);
+  }
+
+  if (EFI_ERROR (Status) || (Count == 0)) {
+    DEBUG ((DEBUG_WARN, "UsbXbox360: key script %s not played - %r\n", USB_KB_SCRIPT_FILE_NAME, Status));
+    if (Keys != NULL) {
+      FreePool (Keys);
+      Keys = NULL;
+    }
+  } else {
+    DEBUG ((DEBUG_INFO, "UsbXbox360: playing %u keystrokes from %s\n", (UINT32)Count, USB_KB_SCRIPT_FILE_NAME));
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (UsbKeyboardDevice->Script.LoadRequested && (Keys != NULL)) {
+    UsbKeyboardDevice->Script.Keys  = Keys;
+    UsbKeyboardDevice->Script.Count = Count;
+    UsbKeyboardDevice->Script.Next  = 0;
+    Keys                            = NULL;
+  }
+
+  UsbKeyboardDevice->Script.LoadRequested = FALSE;
+  gBS->RestoreTPL (OldTpl);
+
+  if (Keys != NULL) {
+    FreePool (Keys);
+  }
+}
+
+/**
+  Start or stop the playback. Loading the script is left to ScriptService().
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptToggle (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_SCRIPT  *Script;
+
+  Script = &UsbKeyboardDevice->Script;
+  if ((Script->Keys != NULL) || Script->LoadRequested) {
+    ScriptStop (Script);
+    return;
+  }
+
+  Script->LoadRequested = TRUE;
+}
+
+/**
+  Load a requested script, then feed the next keystroke if the queue is empty.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (!FeaturePcdGet (PcdUsbXbox360ScriptSupport)) {
+    return;
+  }
+
+  if (UsbKeyboardDevice->Script.LoadRequested) {
+    ScriptLoad (UsbKeyboardDevice);
+  }
+
+  ScriptFeed (UsbKeyboardDevice);
+}
+
+/**
+  Feed the next keystroke of the playback if the key queue is empty.
+
+  This is called wherever a consumer looks for a keystroke, so the playback is
+  paced by the consumer and no keystroke is ever dropped for a full queue.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptFeed (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_KB_SCRIPT  *Script;
+  UINT64         PackedKeyData;
+  EFI_KEY_DATA   KeyData;
+  EFI_TPL        OldTpl;
+
+  if (!FeaturePcdGet (PcdUsbXbox360ScriptSupport)) {
+    return;
+  }
+
+  Script = &UsbKeyboardDevice->Script;
+
+  //
+  // Every console read gets here, so keep the common no playback case off
+  // the TPL. Keys is checked again at TPL_NOTIFY, where the playback can stop.
+  //
+  if (Script->Keys == NULL) {
+    return;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if ((Script->Keys != NULL) && IsKeyDataQueueEmpty (&UsbKeyboardDevice->EfiKeyQueue)) {
+    PackedKeyData = Script->Keys[Script->Next++];
+    EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueue, PackedKeyData);
+    UnpackKeyData (PackedKeyData, &KeyData);
+    SignalKeyNotify (UsbKeyboardDevice, &KeyData);
+
+    if (Script->Next == Script->Count) {
+      ScriptStop (Script);
+    }
+  }
+
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Stop the playback and free the script.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  ScriptStop (&UsbKeyboardDevice->Script);
+  gBS->RestoreTPL (OldTpl);
+}
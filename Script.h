@@ -0,0 +1,79 @@
+/** @file
+  Key script playback of the USB Xbox 360 controller driver.
+
+  Guide + Y loads USB_KB_SCRIPT_FILE_NAME from the root of the first file
+  system that has it, translates the whole script into keystrokes once, and
+  plays them back. A keystroke is fed whenever the console consumer finds the
+  key queue empty, so the playback runs as fast as the consumer reads. Guide + Y
+  during playback stops it.
+
+  The script is UTF-8 or UCS-2 text. Every character is one keystroke, except
+  that line breaks are ignored and braces name special keys: {ENTER}, {ESC},
+  {TAB}, {BS}, {SPACE}, {UP}, {DOWN}, {LEFT}, {RIGHT}, {HOME}, {END}, {PGUP},
+  {PGDN}, {INS}, {DEL}, {F1} to {F12}, {LBRACE} and {RBRACE}. A name may be
+  followed by a repeat count, as in {DOWN*3}.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_SCRIPT_H_
+#define _USB_KB_SCRIPT_H_
+
+#include "EfiKey.h"
+
+#define USB_KB_SCRIPT_FILE_NAME   L"\\UsbXbox360.keys"
+
+//
+// Largest script file read, and most keystrokes a script may expand to
+//
+#define USB_KB_SCRIPT_MAX_SIZE    SIZE_64KB
+#define USB_KB_SCRIPT_MAX_KEYS    16384
+#define USB_KB_SCRIPT_MAX_REPEAT  999
+
+/**
+  Start or stop the playback. Loading the script is left to ScriptService().
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptToggle (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Load a requested script, then feed the next keystroke if the queue is empty.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptService (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Feed the next keystroke of the playback if the key queue is empty.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptFeed (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Stop the playback and free the script.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+ScriptRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+#endif
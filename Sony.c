@@ -0,0 +1,192 @@
+/** @file
+  DualShock 4 and DualSense support of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "AbsolutePointer.h"
+#include "Sony.h"
+
+///
+/// Offsets of the fields in input report 0x01
+///
+typedef struct {
+  //
+  // Hat switch in bits 0-3, Square, Cross, Circle and Triangle in bits 4-7
+  //
+  UINT8    HatButtons;
+  //
+  // L1, R1, L2, R2, Share/Create, Options, L3 and R3 in bits 0-7
+  //
+  UINT8    Buttons1;
+  //
+  // PS in bit 0, touchpad click in bit 1
+  //
+  UINT8    Buttons2;
+  //
+  // First touchpad contact: bit 7 of byte 0 is set when there is no contact,
+  // bytes 1-3 hold the 12-bit X and Y coordinates.
+  //
+  UINT8    Touch;
+} SONY_REPORT_LAYOUT;
+
+STATIC CONST SONY_REPORT_LAYOUT  mDualShock4Layout = { 5, 6, 7, 35 };
+STATIC CONST SONY_REPORT_LAYOUT  mDualSenseLayout  = { 8, 9, 10, 33 };
+
+//
+// D-pad buttons of the hat switch values, 8 and above mean released
+//
+STATIC CONST UINT16  mSonyHatToButtons[16] = {
+  XBOX360_BUTTON_DPAD_UP,
+  XBOX360_BUTTON_DPAD_UP | XBOX360_BUTTON_DPAD_RIGHT,
+  XBOX360_BUTTON_DPAD_RIGHT,
+  XBOX360_BUTTON_DPAD_DOWN | XBOX360_BUTTON_DPAD_RIGHT,
+  XBOX360_BUTTON_DPAD_DOWN,
+  XBOX360_BUTTON_DPAD_DOWN | XBOX360_BUTTON_DPAD_LEFT,
+  XBOX360_BUTTON_DPAD_LEFT,
+  XBOX360_BUTTON_DPAD_UP | XBOX360_BUTTON_DPAD_LEFT,
+  0,
+  0,
+  0,
+  0,
+  0,
+  0,
+  0,
+  0
+};
+
+//
+// Xbox 360 buttons of Square, Cross, Circle and Triangle, in report bit order
+//
+STATIC CONST UINT16  mSonyFaceButtons[4] = {
+  XBOX360_BUTTON_X,
+  XBOX360_BUTTON_A,
+  XBOX360_BUTTON_B,
+  XBOX360_BUTTON_Y
+};
+
+//
+// Xbox 360 buttons of the Buttons1 bits. L2 and R2 have no counterpart.
+//
+STATIC CONST UINT16  mSonyButtons1[8] = {
+  XBOX360_BUTTON_LEFT_SHOULDER,
+  XBOX360_BUTTON_RIGHT_SHOULDER,
+  0,
+  0,
+  XBOX360_BUTTON_BACK,
+  XBOX360_BUTTON_START,
+  XBOX360_BUTTON_LEFT_THUMB,
+  XBOX360_BUTTON_RIGHT_THUMB
+};
+
+/**
+  Decode input report 0x01 of a Sony controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+  @param  Layout                Offsets of the fields in Report.
+
+**/
+STATIC
+VOID
+SonyHandleReport (
+  IN OUT USB_KB_DEV                *UsbKeyboardDevice,
+  IN     UINT8                     *Report,
+  IN     UINTN                     ReportLength,
+  IN     CONST SONY_REPORT_LAYOUT  *Layout
+  )
+{
+  UINT8   HatButtons;
+  UINT8   Buttons1;
+  UINT8   Buttons2;
+  UINT16  OldButtons;
+  UINT16  NewButtons;
+  UINTN   Index;
+  UINT8   *Touch;
+
+  if ((ReportLength < (UINTN)Layout->Touch + 4) || (Report[0] != SONY_INPUT_REPORT_ID)) {
+    return;
+  }
+
+  HatButtons = Report[Layout->HatButtons];
+  Buttons1   = Report[Layout->Buttons1];
+  Buttons2   = Report[Layout->Buttons2];
+
+  NewButtons = mSonyHatToButtons[HatButtons & 0x0F];
+  for (Index = 0; Index < 4; Index++) {
+    if ((HatButtons & (BIT4 << Index)) != 0) {
+      NewButtons |= mSonyFaceButtons[Index];
+    }
+  }
+
+  for (Index = 0; Index < 8; Index++) {
+    if ((Buttons1 & (1 << Index)) != 0) {
+      NewButtons |= mSonyButtons1[Index];
+    }
+  }
+
+  if ((Buttons2 & BIT0) != 0) {
+    NewButtons |= XBOX360_BUTTON_GUIDE;
+  }
+
+  //
+  // The controller reports continuously, mostly with unchanged buttons.
+  //
+  OldButtons = UsbKeyboardDevice->XboxState.Buttons;
+  if (OldButtons != NewButtons) {
+    USBKBD_TRACE (USBKBD_TRACE_REPORT, "UsbXbox360: sony report len %lu buttons 0x%lx\n", ReportLength, NewButtons, 0);
+    ProcessButtonChanges (UsbKeyboardDevice, OldButtons, NewButtons);
+    UsbKeyboardDevice->XboxState.Buttons = NewButtons;
+  }
+
+  if (UsbKeyboardDevice->Pointer.Installed) {
+    Touch = &Report[Layout->Touch];
+    AbsolutePointerReport (
+      UsbKeyboardDevice,
+      (BOOLEAN)((Touch[0] & BIT7) == 0),
+      (UINT16)(Touch[1] | ((Touch[2] & 0x0F) << 8)),
+      (UINT16)((Touch[2] >> 4) | (Touch[3] << 4)),
+      (BOOLEAN)((Buttons2 & BIT1) != 0)
+      );
+  }
+}
+
+/**
+  Decode an input report of the DualShock 4.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+DualShock4HandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  SonyHandleReport (UsbKeyboardDevice, Report, ReportLength, &mDualShock4Layout);
+}
+
+/**
+  Decode an input report of the DualSense.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+DualSenseHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  SonyHandleReport (UsbKeyboardDevice, Report, ReportLength, &mDualSenseLayout);
+}
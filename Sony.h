@@ -0,0 +1,63 @@
+/** @file
+  DualShock 4 and DualSense support of the USB Xbox 360 controller driver.
+
+  Both controllers send input report 0x01 with the buttons and touchpad
+  contacts at fixed offsets. The buttons are mapped onto the Xbox 360 button
+  layout, and the touchpad drives EFI_ABSOLUTE_POINTER_PROTOCOL.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_SONY_H_
+#define _USB_KB_SONY_H_
+
+#include "EfiKey.h"
+
+#define SONY_VENDOR_ID          0x054C
+#define DUALSHOCK4_PRODUCT_ID   0x05C4
+#define DUALSHOCK4_PRODUCT_ID2  0x09CC
+#define DUALSENSE_PRODUCT_ID    0x0CE6
+
+#define SONY_INPUT_REPORT_ID  0x01
+
+//
+// Largest touchpad coordinates
+//
+#define DUALSHOCK4_TOUCH_MAX_X  1919
+#define DUALSHOCK4_TOUCH_MAX_Y  941
+#define DUALSENSE_TOUCH_MAX_X   1919
+#define DUALSENSE_TOUCH_MAX_Y   1079
+
+/**
+  Decode an input report of the DualShock 4.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+DualShock4HandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+/**
+  Decode an input report of the DualSense.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+DualSenseHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+#endif
@@ -0,0 +1,234 @@
+/** @file
+  Nintendo Switch Pro Controller support of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "SwitchPro.h"
+
+//
+// Offsets in the 0x30 full report. The three button bytes are followed by the
+// 12-bit X and Y of the left stick and then of the right stick.
+//
+#define SWITCH_PRO_BUTTONS_RIGHT   3
+#define SWITCH_PRO_BUTTONS_SHARED  4
+#define SWITCH_PRO_BUTTONS_LEFT    5
+#define SWITCH_PRO_LEFT_STICK      6
+#define SWITCH_PRO_INPUT_END       12
+
+//
+// A stick counts as pushed when it is this far from the center of 2048.
+//
+#define SWITCH_PRO_STICK_CENTER    2048
+#define SWITCH_PRO_STICK_DEADZONE  768
+
+//
+// Xbox 360 buttons of the bits of each button byte. The face buttons are
+// mapped by position, so B, at the bottom, is Xbox A.
+//
+STATIC CONST UINT16  mSwitchProButtonsRight[8] = {
+  XBOX360_BUTTON_X,                 // Y
+  XBOX360_BUTTON_Y,                 // X
+  XBOX360_BUTTON_A,                 // B
+  XBOX360_BUTTON_B,                 // A
+  0,                                // SR
+  0,                                // SL
+  XBOX360_BUTTON_RIGHT_SHOULDER,    // R
+  0                                 // ZR
+};
+
+STATIC CONST UINT16  mSwitchProButtonsShared[8] = {
+  XBOX360_BUTTON_BACK,              // Minus
+  XBOX360_BUTTON_START,             // Plus
+  XBOX360_BUTTON_RIGHT_THUMB,       // Right stick
+  XBOX360_BUTTON_LEFT_THUMB,        // Left stick
+  XBOX360_BUTTON_GUIDE,             // Home
+  0,                                // Capture
+  0,
+  0                                 // Charging grip
+};
+
+STATIC CONST UINT16  mSwitchProButtonsLeft[8] = {
+  XBOX360_BUTTON_DPAD_DOWN,         // Down
+  XBOX360_BUTTON_DPAD_UP,           // Up
+  XBOX360_BUTTON_DPAD_RIGHT,        // Right
+  XBOX360_BUTTON_DPAD_LEFT,         // Left
+  0,                                // SR
+  0,                                // SL
+  XBOX360_BUTTON_LEFT_SHOULDER,     // L
+  0                                 // ZL
+};
+
+/**
+  Send a command of output report 0x80.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Command               The command.
+
+  @return The status of the interrupt transfer.
+
+**/
+STATIC
+EFI_STATUS
+SwitchProUsbCommand (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINT8       Command
+  )
+{
+  UINT8   Data[2];
+  UINTN   DataLength;
+  UINT32  UsbStatus;
+
+  Data[0]    = SWITCH_PRO_USB_COMMAND;
+  Data[1]    = Command;
+  DataLength = sizeof (Data);
+
+  return UsbKeyboardDevice->UsbIo->UsbSyncInterruptTransfer (
+                                     UsbKeyboardDevice->UsbIo,
+                                     UsbKeyboardDevice->IntOutEndpointAddress,
+                                     Data,
+                                     &DataLength,
+                                     SWITCH_PRO_OUT_TIMEOUT,
+                                     &UsbStatus
+                                     );
+}
+
+/**
+  Send the USB handshake and the force-USB command.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The controller will stream full reports.
+  @retval EFI_UNSUPPORTED       The interface has no interrupt OUT endpoint.
+  @retval Others                A command could not be sent.
+
+**/
+EFI_STATUS
+SwitchProInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS  Status;
+
+  if (UsbKeyboardDevice->IntOutEndpointAddress == 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = SwitchProUsbCommand (UsbKeyboardDevice, SWITCH_PRO_USB_HANDSHAKE);
+  if (!EFI_ERROR (Status)) {
+    Status = SwitchProUsbCommand (UsbKeyboardDevice, SWITCH_PRO_USB_FORCE_USB);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "UsbXbox360: Switch Pro handshake failed - %r\n", Status));
+  }
+
+  return Status;
+}
+
+/**
+  Map a 12-bit stick axis to a direction.
+
+  @param  Value     The axis value.
+
+  @return -1, 0 or 1.
+
+**/
+STATIC
+INT8
+SwitchProStickDirection (
+  IN UINT16  Value
+  )
+{
+  if (Value < SWITCH_PRO_STICK_CENTER - SWITCH_PRO_STICK_DEADZONE) {
+    return -1;
+  }
+
+  if (Value > SWITCH_PRO_STICK_CENTER + SWITCH_PRO_STICK_DEADZONE) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+  Decode a report of the Switch Pro Controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+SwitchProHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  )
+{
+  UINT16  OldButtons;
+  UINT16  NewButtons;
+  UINTN   Index;
+  INT8    XDir;
+  INT8    YDir;
+
+  if ((ReportLength < SWITCH_PRO_INPUT_END) || (Report[0] != SWITCH_PRO_FULL_REPORT_ID)) {
+    return;
+  }
+
+  NewButtons = 0;
+  for (Index = 0; Index < 8; Index++) {
+    if ((Report[SWITCH_PRO_BUTTONS_RIGHT] & (1 << Index)) != 0) {
+      NewButtons |= mSwitchProButtonsRight[Index];
+    }
+
+    if ((Report[SWITCH_PRO_BUTTONS_SHARED] & (1 << Index)) != 0) {
+      NewButtons |= mSwitchProButtonsShared[Index];
+    }
+
+    if ((Report[SWITCH_PRO_BUTTONS_LEFT] & (1 << Index)) != 0) {
+      NewButtons |= mSwitchProButtonsLeft[Index];
+    }
+  }
+
+  //
+  // The left stick presses the D-pad buttons. Its 12-bit axes jitter in every
+  // report, so they are quantized to directions before anything is compared;
+  // full reports stream at a high rate, and only a change of the decoded
+  // buttons is processed.
+  //
+  XDir = SwitchProStickDirection (
+           (UINT16)(Report[SWITCH_PRO_LEFT_STICK] | ((Report[SWITCH_PRO_LEFT_STICK + 1] & 0x0F) << 8))
+           );
+  YDir = SwitchProStickDirection (
+           (UINT16)((Report[SWITCH_PRO_LEFT_STICK + 1] >> 4) | (Report[SWITCH_PRO_LEFT_STICK + 2] << 4))
+           );
+
+  if (XDir < 0) {
+    NewButtons |= XBOX360_BUTTON_DPAD_LEFT;
+  } else if (XDir > 0) {
+    NewButtons |= XBOX360_BUTTON_DPAD_RIGHT;
+  }
+
+  //
+  // Y grows upward.
+  //
+  if (YDir > 0) {
+    NewButtons |= XBOX360_BUTTON_DPAD_UP;
+  } else if (YDir < 0) {
+    NewButtons |= XBOX360_BUTTON_DPAD_DOWN;
+  }
+
+  UsbKeyboardDevice->XboxState.LeftStickXDir = XDir;
+  UsbKeyboardDevice->XboxState.LeftStickYDir = YDir;
+
+  OldButtons = UsbKeyboardDevice->XboxState.Buttons;
+  if (OldButtons != NewButtons) {
+    USBKBD_TRACE (USBKBD_TRACE_REPORT, "UsbXbox360: switch report len %lu buttons 0x%lx\n", ReportLength, NewButtons, 0);
+    ProcessButtonChanges (UsbKeyboardDevice, OldButtons, NewButtons);
+    UsbKeyboardDevice->XboxState.Buttons = NewButtons;
+  }
+}
@@ -0,0 +1,63 @@
+/** @file
+  Nintendo Switch Pro Controller support of the USB Xbox 360 controller driver.
+
+  Over USB the controller stays silent until the host sends the handshake and
+  the force-USB command on the interrupt OUT endpoint. It then streams 0x30
+  full reports, whose buttons are mapped by position onto the Xbox 360
+  button layout.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_SWITCH_PRO_H_
+#define _USB_KB_SWITCH_PRO_H_
+
+#include "EfiKey.h"
+
+#define NINTENDO_VENDOR_ID     0x057E
+#define SWITCH_PRO_PRODUCT_ID  0x2009
+
+#define SWITCH_PRO_FULL_REPORT_ID  0x30
+
+//
+// Commands of output report 0x80
+//
+#define SWITCH_PRO_USB_COMMAND    0x80
+#define SWITCH_PRO_USB_HANDSHAKE  0x02
+#define SWITCH_PRO_USB_FORCE_USB  0x04
+
+#define SWITCH_PRO_OUT_TIMEOUT  100     // ms
+
+/**
+  Send the USB handshake and the force-USB command.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The controller will stream full reports.
+  @retval EFI_UNSUPPORTED       The interface has no interrupt OUT endpoint.
+  @retval Others                A command could not be sent.
+
+**/
+EFI_STATUS
+SwitchProInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Decode a report of the Switch Pro Controller.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  Report                The interrupt transfer data.
+  @param  ReportLength          The length of Report.
+
+**/
+VOID
+SwitchProHandleReport (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT8       *Report,
+  IN     UINTN       ReportLength
+  );
+
+#endif
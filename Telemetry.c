@@ -0,0 +1,159 @@
+/** @file
+  Telemetry of the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "KeyBoard.h"
+#include "Telemetry.h"
+
+#include <Library/PrintLib.h>
+
+/**
+  Write the telemetry record to its volatile variable.
+
+  Memory must not be allocated once ExitBootServices() is signaled, so the
+  record and the variable name are kept in the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+TelemetryFlush (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  USB_XBOX360_TELEMETRY  *Record;
+
+  Record = &UsbKeyboardDevice->Telemetry.Record;
+
+  Record->DropCount = UsbKeyboardDevice->EfiKeyQueue.Dropped + UsbKeyboardDevice->EfiKeyQueueForNotify.Dropped;
+
+  gRT->SetVariable (
+         UsbKeyboardDevice->Telemetry.VariableName,
+         &gUsbXbox360VariableGuid,
+         EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+         sizeof (*Record),
+         Record
+         );
+}
+
+/**
+  Write the telemetry record when ExitBootServices() is signaled.
+
+  @param  Event             The ExitBootServices event.
+  @param  Context           Pointing to USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+EFIAPI
+TelemetryExitBootServices (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  TelemetryFlush ((USB_KB_DEV *)Context);
+}
+
+/**
+  Name the telemetry variable of the controller and create the event which
+  writes it.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The telemetry is initialized.
+  @retval Others                The event could not be created.
+
+**/
+EFI_STATUS
+TelemetryInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_USB_DEVICE_DESCRIPTOR  DeviceDescriptor;
+  USB_KB_TELEMETRY           *Telemetry;
+
+  Telemetry = &UsbKeyboardDevice->Telemetry;
+
+  //
+  // The learned layout backend has no VID/PID of its own.
+  //
+  Status = UsbKeyboardDevice->UsbIo->UsbGetDeviceDescriptor (UsbKeyboardDevice->UsbIo, &DeviceDescriptor);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Telemetry->Record.Revision  = USB_XBOX360_TELEMETRY_REVISION;
+  Telemetry->Record.Size      = sizeof (Telemetry->Record);
+  Telemetry->Record.VendorId  = DeviceDescriptor.IdVendor;
+  Telemetry->Record.ProductId = DeviceDescriptor.IdProduct;
+
+  UnicodeSPrint (
+    Telemetry->VariableName,
+    sizeof (Telemetry->VariableName),
+    L"%s%08X",
+    USB_XBOX360_TELEMETRY_VARIABLE_PREFIX,
+    UsbKeyboardDevice->DevicePathKey
+    );
+
+  return gBS->CreateEvent (
+                EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                TPL_CALLBACK,
+                TelemetryExitBootServices,
+                UsbKeyboardDevice,
+                &Telemetry->ExitBootServicesEvent
+                );
+}
+
+/**
+  Close the telemetry event.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+TelemetryRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  if (UsbKeyboardDevice->Telemetry.ExitBootServicesEvent != NULL) {
+    gBS->CloseEvent (UsbKeyboardDevice->Telemetry.ExitBootServicesEvent);
+    UsbKeyboardDevice->Telemetry.ExitBootServicesEvent = NULL;
+  }
+}
+
+/**
+  Count a keystroke in the latency histogram.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyTime               Performance counter when the key was queued,
+                                0 if it was not recorded.
+
+**/
+VOID
+TelemetryRecordLatency (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT64      KeyTime
+  )
+{
+  UINT64  LatencyMs;
+  UINTN   Bucket;
+
+  if (KeyTime == 0) {
+    return;
+  }
+
+  LatencyMs = DivU64x32 (GetElapsedTime (KeyTime, GetPerformanceCounter ()), 1000000);
+
+  for (Bucket = 0; Bucket < USB_XBOX360_TELEMETRY_LATENCY_BUCKETS - 1; Bucket++) {
+    if (LatencyMs < LShiftU64 (1, Bucket)) {
+      break;
+    }
+  }
+
+  UsbKeyboardDevice->Telemetry.Record.LatencyBuckets[Bucket]++;
+}
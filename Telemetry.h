@@ -0,0 +1,72 @@
+/** @file
+  Telemetry of the USB Xbox 360 controller driver.
+
+  Every controller keeps a USB_XBOX360_TELEMETRY record while it is managed.
+  When the driver stops or ExitBootServices() is signaled the record is
+  written to a volatile variable, so OS tools can collect it after the handoff.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_TELEMETRY_H_
+#define _USB_KB_TELEMETRY_H_
+
+#include "EfiKey.h"
+
+/**
+  Name the telemetry variable of the controller and create the event which
+  writes it.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+  @retval EFI_SUCCESS           The telemetry is initialized.
+  @retval Others                The event could not be created.
+
+**/
+EFI_STATUS
+TelemetryInit (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Write the telemetry record to its volatile variable.
+
+  Memory must not be allocated once ExitBootServices() is signaled, so the
+  record and the variable name are kept in the device.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+TelemetryFlush (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Close the telemetry event.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+
+**/
+VOID
+TelemetryRelease (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice
+  );
+
+/**
+  Count a keystroke in the latency histogram.
+
+  @param  UsbKeyboardDevice     The USB_KB_DEV instance.
+  @param  KeyTime               Performance counter when the key was queued,
+                                0 if it was not recorded.
+
+**/
+VOID
+TelemetryRecordLatency (
+  IN OUT USB_KB_DEV  *UsbKeyboardDevice,
+  IN     UINT64      KeyTime
+  );
+
+#endif
@@ -0,0 +1,405 @@
+/** @file
+  Host-based stress test of the driver binding Start() and Stop().
+
+  A controller is started and stopped thousands of times. In between, the
+  keyboard layout is switched and key notifications are registered, and some
+  of them are left registered for Stop() to free. After the last cycle no pool
+  buffer, event or protocol of the driver may be left, and the times Start()
+  and Stop() took are reported.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "../Common/TestDevice.h"
+
+#include <Library/UnitTestLib.h>
+
+#define UNIT_TEST_NAME     "USB Xbox 360 bind stress host test"
+#define UNIT_TEST_VERSION  "1.0"
+
+#define BIND_STRESS_CYCLES  10000
+
+//
+// Most key notifications registered in one cycle.
+//
+#define BIND_STRESS_MAX_NOTIFY  3
+
+//
+// Layout used in turn with the default one. Enter, the key of the A button,
+// produces 'e' so the test can tell which layout is applied.
+//
+#define BIND_STRESS_LAYOUT_GUID \
+  { 0x3c1f7e52, 0x9a0d, 0x4b68, { 0x8e, 0x27, 0xd5, 0x41, 0xa9, 0x6c, 0x0b, 0xf3 } }
+
+STATIC CONST EFI_GUID  mBindStressLayoutGuid = BIND_STRESS_LAYOUT_GUID;
+
+STATIC CONST EFI_KEY_DESCRIPTOR  mBindStressLayout[] = {
+  { EfiKeySpaceBar,   ' ',  ' ',  0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyTab,        0x09, 0x09, 0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyEnter,      'e',  'E',  0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyEsc,        0x1b, 0x1b, 0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyBackSpace,  0x08, 0x08, 0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyUpArrow,    0x00, 0x00, 0, 0, EFI_UP_ARROW_MODIFIER,    0 },
+  { EfiKeyDownArrow,  0x00, 0x00, 0, 0, EFI_DOWN_ARROW_MODIFIER,  0 },
+  { EfiKeyLeftArrow,  0x00, 0x00, 0, 0, EFI_LEFT_ARROW_MODIFIER,  0 },
+  { EfiKeyRightArrow, 0x00, 0x00, 0, 0, EFI_RIGHT_ARROW_MODIFIER, 0 },
+  { EfiKeyLShift,     0,    0,    0, 0, EFI_LEFT_SHIFT_MODIFIER,  0 }
+};
+
+//
+// Start() and Stop() times of every cycle, in nanoseconds.
+//
+STATIC UINT64  mStartTimes[BIND_STRESS_CYCLES];
+STATIC UINT64  mStopTimes[BIND_STRESS_CYCLES];
+
+/**
+  Key notification function that does nothing.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+BindStressNotify (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  return EFI_SUCCESS;
+}
+
+/**
+  Sort times in place, in ascending order.
+
+  @param  Times         The times.
+  @param  Count         The number of times.
+
+**/
+STATIC
+VOID
+BindStressSort (
+  IN OUT UINT64  *Times,
+  IN     UINTN   Count
+  )
+{
+  UINTN   Gap;
+  UINTN   Index;
+  UINTN   Slot;
+  UINT64  Time;
+
+  //
+  // Shell sort with the Ciura gaps extended by 2.25.
+  //
+  for (Gap = 1; Gap < Count / 3; Gap = Gap * 9 / 4 + 1) {
+  }
+
+  for ( ; Gap > 0; Gap = (Gap == 1) ? 0 : Gap * 4 / 9) {
+    for (Index = Gap; Index < Count; Index++) {
+      Time = Times[Index];
+      for (Slot = Index; Slot >= Gap && Times[Slot - Gap] > Time; Slot -= Gap) {
+        Times[Slot] = Times[Slot - Gap];
+      }
+
+      Times[Slot] = Time;
+    }
+  }
+}
+
+/**
+  Report the mean and the 99th percentile of times.
+
+  @param  Name          The name of the timed call.
+  @param  Times         The times, in nanoseconds. They are sorted.
+  @param  Count         The number of times.
+
+**/
+STATIC
+VOID
+BindStressReportTimes (
+  IN     CONST CHAR8  *Name,
+  IN OUT UINT64       *Times,
+  IN     UINTN        Count
+  )
+{
+  UINT64  Total;
+  UINTN   Index;
+
+  Total = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Total += Times[Index];
+  }
+
+  BindStressSort (Times, Count);
+  UT_LOG_INFO (
+    "%a: mean %lu ns, p99 %lu ns, max %lu ns\n",
+    Name,
+    DivU64x64Remainder (Total, Count, NULL),
+    Times[(Count * 99) / 100],
+    Times[Count - 1]
+    );
+}
+
+/**
+  Press and release A, let the timer handler translate it and read the key.
+
+  @param  Controller          The handle of the controller.
+  @param  UsbKeyboardDevice   The USB_KB_DEV instance of the controller.
+  @param  UnicodeChar         Receives the character of the key.
+
+  @retval EFI_SUCCESS   The key was read.
+  @retval Others        No key was produced.
+
+**/
+STATIC
+EFI_STATUS
+BindStressTypeA (
+  IN  EFI_HANDLE  Controller,
+  IN  USB_KB_DEV  *UsbKeyboardDevice,
+  OUT CHAR16      *UnicodeChar
+  )
+{
+  EFI_KEY_DATA  KeyData;
+  EFI_STATUS    Status;
+
+  Status = TestDeviceSendButtons (Controller, XBOX360_BUTTON_A);
+  if (!EFI_ERROR (Status)) {
+    Status = TestDeviceSendButtons (Controller, 0);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  FakeAdvanceTimers (2 * KEYBOARD_TIMER_INTERVAL);
+  Status = UsbKeyboardDevice->SimpleInputEx.ReadKeyStrokeEx (&UsbKeyboardDevice->SimpleInputEx, &KeyData);
+  if (!EFI_ERROR (Status)) {
+    *UnicodeChar = KeyData.Key.UnicodeChar;
+  }
+
+  return Status;
+}
+
+/**
+  Start and stop a controller many times, switching the keyboard layout and
+  registering key notifications in between, and check that nothing leaks.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              Nothing leaked.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A cycle failed or a resource leaked.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+StartStopDoesNotLeak (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  EFI_HII_DATABASE_PROTOCOL       *HiiDatabase;
+  FAKE_ALLOCATION_STATS           PoolBefore;
+  FAKE_ALLOCATION_STATS           PoolAfter;
+  FAKE_BOOT_SERVICES_STATS        ServicesBefore;
+  FAKE_BOOT_SERVICES_STATS        ServicesAfter;
+  EFI_HANDLE                      Controller;
+  USB_KB_DEV                      *UsbKeyboardDevice;
+  EFI_SIMPLE_TEXT_INPUT_PROTOCOL  *SimpleInput;
+  EFI_KEY_DATA                    KeyData;
+  VOID                            *NotifyHandles[BIND_STRESS_MAX_NOTIFY];
+  CONST EFI_GUID                  *Layout;
+  CHAR16                          UnicodeChar;
+  UINT32                          Random;
+  UINTN                           Cycle;
+  UINTN                           NotifyCount;
+  UINTN                           Index;
+  UINTN                           LayoutSwitches;
+  UINTN                           LeftRegistered;
+  UINT64                          Begin;
+
+  UT_ASSERT_NOT_EFI_ERROR (gBS->LocateProtocol (&gEfiHiiDatabaseProtocolGuid, NULL, (VOID **)&HiiDatabase));
+  UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mBindStressLayoutGuid, mBindStressLayout, ARRAY_SIZE (mBindStressLayout)));
+
+  //
+  // The driver allocates its module-wide state on the first Start(), which is
+  // done before counting.
+  //
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, NULL));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+
+  FakeGetAllocationStats (&PoolBefore);
+  FakeGetBootServicesStats (&ServicesBefore);
+
+  Random         = 0x2545F491;
+  Layout         = &gUsbKeyboardLayoutKeyGuid;
+  LayoutSwitches = 0;
+  LeftRegistered = 0;
+  for (Cycle = 0; Cycle < BIND_STRESS_CYCLES; Cycle++) {
+    UT_ASSERT_NOT_EFI_ERROR (TestDeviceCreate ((UINT8)(1 + Cycle % 4), &Controller));
+    UT_ASSERT_NOT_EFI_ERROR (gUsbKeyboardDriverBinding.Supported (&gUsbKeyboardDriverBinding, Controller, NULL));
+
+    Begin = GetPerformanceCounter ();
+    UT_ASSERT_NOT_EFI_ERROR (gUsbKeyboardDriverBinding.Start (&gUsbKeyboardDriverBinding, Controller, NULL));
+    mStartTimes[Cycle] = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+
+    UT_ASSERT_NOT_EFI_ERROR (gBS->HandleProtocol (Controller, &gEfiSimpleTextInProtocolGuid, (VOID **)&SimpleInput));
+    UsbKeyboardDevice = USB_KB_DEV_FROM_THIS (SimpleInput);
+
+    NotifyCount = TestRandom (&Random) % (BIND_STRESS_MAX_NOTIFY + 1);
+    for (Index = 0; Index < NotifyCount; Index++) {
+      ZeroMem (&KeyData, sizeof (KeyData));
+      KeyData.Key.UnicodeChar = (Index == 0) ? CHAR_CARRIAGE_RETURN : (CHAR16)('a' + Index);
+      UT_ASSERT_NOT_EFI_ERROR (
+        UsbKeyboardDevice->SimpleInputEx.RegisterKeyNotify (
+                                           &UsbKeyboardDevice->SimpleInputEx,
+                                           &KeyData,
+                                           BindStressNotify,
+                                           &NotifyHandles[Index]
+                                           )
+        );
+    }
+
+    //
+    // Switch the layout in one cycle out of four, before or after the first
+    // key, and check the key the new layout gives once it is applied.
+    //
+    if ((TestRandom (&Random) % 4) == 0) {
+      if ((TestRandom (&Random) % 2) == 0) {
+        UT_ASSERT_NOT_EFI_ERROR (BindStressTypeA (Controller, UsbKeyboardDevice, &UnicodeChar));
+      }
+
+      Layout = (Layout == &gUsbKeyboardLayoutKeyGuid) ? &mBindStressLayoutGuid : &gUsbKeyboardLayoutKeyGuid;
+      UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->SetKeyboardLayout (HiiDatabase, (EFI_GUID *)Layout));
+      //
+      // The service timer applies the new layout.
+      //
+      FakeAdvanceTimers (USB_KB_SERVICE_INTERVAL);
+      UT_ASSERT_NOT_EFI_ERROR (BindStressTypeA (Controller, UsbKeyboardDevice, &UnicodeChar));
+      UT_ASSERT_EQUAL (UnicodeChar, (Layout == &mBindStressLayoutGuid) ? L'e' : CHAR_CARRIAGE_RETURN);
+      LayoutSwitches++;
+    }
+
+    //
+    // Unregister the notifications in one cycle out of two; otherwise Stop()
+    // frees them.
+    //
+    if ((TestRandom (&Random) % 2) == 0) {
+      for (Index = 0; Index < NotifyCount; Index++) {
+        UT_ASSERT_NOT_EFI_ERROR (UsbKeyboardDevice->SimpleInputEx.UnregisterKeyNotify (&UsbKeyboardDevice->SimpleInputEx, NotifyHandles[Index]));
+      }
+    } else {
+      LeftRegistered += NotifyCount;
+    }
+
+    Begin = GetPerformanceCounter ();
+    UT_ASSERT_NOT_EFI_ERROR (gUsbKeyboardDriverBinding.Stop (&gUsbKeyboardDriverBinding, Controller, 0, NULL));
+    mStopTimes[Cycle] = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+
+    UT_ASSERT_NOT_EFI_ERROR (FakeUsbDestroyDevice (Controller));
+  }
+
+  FakeGetAllocationStats (&PoolAfter);
+  FakeGetBootServicesStats (&ServicesAfter);
+
+  UT_LOG_INFO (
+    "%lu cycles, %lu layout switches, %lu notifications left to Stop()\n",
+    (UINT64)BIND_STRESS_CYCLES,
+    (UINT64)LayoutSwitches,
+    (UINT64)LeftRegistered
+    );
+  UT_LOG_INFO (
+    "Pool: %lu allocations, %lu frees, %lu buffers and %lu bytes outstanding\n",
+    PoolAfter.AllocateCount - PoolBefore.AllocateCount,
+    PoolAfter.FreeCount - PoolBefore.FreeCount,
+    PoolAfter.OutstandingCount - PoolBefore.OutstandingCount,
+    PoolAfter.OutstandingBytes - PoolBefore.OutstandingBytes
+    );
+  UT_LOG_INFO (
+    "Open events %lu, open protocols %lu, installed protocols %lu (before: %lu, %lu, %lu)\n",
+    (UINT64)ServicesAfter.OpenEvents,
+    (UINT64)ServicesAfter.OpenProtocols,
+    (UINT64)ServicesAfter.InstalledProtocols,
+    (UINT64)ServicesBefore.OpenEvents,
+    (UINT64)ServicesBefore.OpenProtocols,
+    (UINT64)ServicesBefore.InstalledProtocols
+    );
+  BindStressReportTimes ("Start()", mStartTimes, BIND_STRESS_CYCLES);
+  BindStressReportTimes ("Stop()", mStopTimes, BIND_STRESS_CYCLES);
+
+  UT_ASSERT_NOT_EQUAL (LayoutSwitches, 0);
+  UT_ASSERT_NOT_EQUAL (LeftRegistered, 0);
+  UT_ASSERT_EQUAL (PoolAfter.OutstandingCount, PoolBefore.OutstandingCount);
+  UT_ASSERT_EQUAL (PoolAfter.OutstandingBytes, PoolBefore.OutstandingBytes);
+  UT_ASSERT_EQUAL (ServicesAfter.OpenEvents, ServicesBefore.OpenEvents);
+  UT_ASSERT_EQUAL (ServicesAfter.OpenProtocols, ServicesBefore.OpenProtocols);
+  UT_ASSERT_EQUAL (ServicesAfter.InstalledProtocols, ServicesBefore.InstalledProtocols);
+  UT_ASSERT_EQUAL (ServicesAfter.TplErrors, 0);
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Initialize the unit test framework, suite, and unit tests for Start() and
+  Stop() and run them.
+
+  @retval  EFI_SUCCESS           All test cases were dispatched.
+  @retval  EFI_OUT_OF_RESOURCES  There are not enough resources available to
+                                 initialize the unit tests.
+**/
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      BindSuite;
+
+  Framework = NULL;
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+  Status = TestDriverLoad ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&BindSuite, Framework, "Bind Stress Tests", "UsbXbox360.BindStress", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in CreateUnitTestSuite for the bind suite\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (BindSuite, "Start and Stop leak no pool, events or protocols", "StartStopDoesNotLeak", StartStopDoesNotLeak, NULL, NULL, NULL);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+/**
+  Standard POSIX C entry point for host based unit test execution.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UefiTestMain ();
+}
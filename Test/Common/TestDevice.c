@@ -0,0 +1,249 @@
+/** @file
+  Helpers of the host-based tests to bind the driver to fake controllers, to
+  add keyboard layouts to the HII database and to make repeatable random choices.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "TestDevice.h"
+
+/**
+  Reset the fake services, install the HII database and run the entry point of
+  the driver.
+
+  @retval EFI_SUCCESS   The driver is loaded.
+  @retval Others        The entry point failed.
+
+**/
+EFI_STATUS
+TestDriverLoad (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+
+  FakeUefiServicesReset ();
+  Status = FakeHiiDatabaseInstall ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return USBKeyboardDriverBindingEntryPoint (gImageHandle, gST);
+}
+
+/**
+  Create a fake Xbox 360 controller and start the driver on it.
+
+  @param  Port                The port number of the device path.
+  @param  Controller          Receives the handle of the controller.
+  @param  UsbKeyboardDevice   Receives the USB_KB_DEV instance, optional.
+
+  @retval EFI_SUCCESS   The driver manages the controller.
+  @retval Others        The controller could not be created or started.
+
+**/
+EFI_STATUS
+TestDeviceStart (
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller,
+  OUT USB_KB_DEV  **UsbKeyboardDevice  OPTIONAL
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_SIMPLE_TEXT_INPUT_PROTOCOL  *SimpleInput;
+
+  Status = TestDeviceCreate (Port, Controller);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gUsbKeyboardDriverBinding.Supported (&gUsbKeyboardDriverBinding, *Controller, NULL);
+  if (!EFI_ERROR (Status)) {
+    Status = gUsbKeyboardDriverBinding.Start (&gUsbKeyboardDriverBinding, *Controller, NULL);
+  }
+
+  if (EFI_ERROR (Status)) {
+    FakeUsbDestroyDevice (*Controller);
+    return Status;
+  }
+
+  if (UsbKeyboardDevice != NULL) {
+    Status = gBS->HandleProtocol (*Controller, &gEfiSimpleTextInProtocolGuid, (VOID **)&SimpleInput);
+    ASSERT_EFI_ERROR (Status);
+    *UsbKeyboardDevice = USB_KB_DEV_FROM_THIS (SimpleInput);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Stop the driver on a fake controller and remove the controller.
+
+  @param  Controller    The handle of the controller.
+
+  @retval EFI_SUCCESS   The controller is gone.
+  @retval Others        The driver could not be stopped.
+
+**/
+EFI_STATUS
+TestDeviceStop (
+  IN EFI_HANDLE  Controller
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = gUsbKeyboardDriverBinding.Stop (&gUsbKeyboardDriverBinding, Controller, 0, NULL);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return FakeUsbDestroyDevice (Controller);
+}
+
+/**
+  Send an Xbox 360 input report with the given buttons and centered sticks.
+
+  @param  Controller    The handle of the controller.
+  @param  Buttons       The button bits, XBOX360_BUTTON_*.
+
+  @retval EFI_SUCCESS   The report was delivered.
+  @retval Others        The controller is not polled.
+
+**/
+EFI_STATUS
+TestDeviceSendButtons (
+  IN EFI_HANDLE  Controller,
+  IN UINT16      Buttons
+  )
+{
+  UINT8  Report[XBOX360_INPUT_REPORT_LENGTH];
+
+  ZeroMem (Report, sizeof (Report));
+  Report[0] = XBOX360_INPUT_REPORT_TYPE;
+  Report[1] = XBOX360_INPUT_REPORT_LENGTH;
+  Report[2] = (UINT8)Buttons;
+  Report[3] = (UINT8)(Buttons >> 8);
+  return FakeUsbSendReport (Controller, Report, sizeof (Report));
+}
+
+/**
+  Create a fake Xbox 360 controller without starting the driver on it.
+
+  @param  Port          The port number of the device path.
+  @param  Controller    Receives the handle of the controller.
+
+  @retval EFI_SUCCESS   The controller was created.
+  @retval Others        The controller could not be created.
+
+**/
+EFI_STATUS
+TestDeviceCreate (
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller
+  )
+{
+  return FakeUsbCreateDevice (
+           XBOX360_VENDOR_ID,
+           XBOX360_PRODUCT_ID,
+           0xFF,
+           XINPUT_INTERFACE_SUBCLASS,
+           XINPUT_INTERFACE_PROTOCOL,
+           Port,
+           Controller
+           );
+}
+
+/**
+  Add a keyboard layout package to the HII database.
+
+  The layout has no description strings.
+
+  @param  KeyGuid           The GUID of the layout.
+  @param  Descriptors       The key descriptors of the layout.
+  @param  DescriptorCount   The number of descriptors, at most 255.
+
+  @retval EFI_SUCCESS           The layout was added.
+  @retval EFI_INVALID_PARAMETER DescriptorCount is above 255.
+  @retval EFI_OUT_OF_RESOURCES  The package could not be built or added.
+
+**/
+EFI_STATUS
+TestLayoutAdd (
+  IN CONST EFI_GUID            *KeyGuid,
+  IN CONST EFI_KEY_DESCRIPTOR  *Descriptors,
+  IN UINTN                     DescriptorCount
+  )
+{
+  EFI_HII_PACKAGE_HEADER  PackageHeader;
+  UINT8                   *Package;
+  UINT8                   *Data;
+  UINT32                  DescriptorOffset;
+  UINT32                  LayoutLength;
+  UINT32                  Length;
+  EFI_HII_HANDLE          HiiHandle;
+
+  if (DescriptorCount > MAX_UINT8) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // UINT32 length, package header, layout count, then one layout: its length,
+  // GUID, string offset, descriptor count, descriptors and an empty
+  // description count.
+  //
+  DescriptorOffset = sizeof (UINT16) + sizeof (EFI_GUID) + sizeof (UINT32) + sizeof (UINT8) +
+                     (UINT32)(DescriptorCount * sizeof (EFI_KEY_DESCRIPTOR));
+  LayoutLength = DescriptorOffset + sizeof (UINT16);
+  Length       = sizeof (UINT32) + sizeof (EFI_HII_PACKAGE_HEADER) + sizeof (UINT16) + LayoutLength;
+
+  Package = AllocateZeroPool (Length);
+  if (Package == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  PackageHeader.Length = Length - sizeof (UINT32);
+  PackageHeader.Type   = EFI_HII_PACKAGE_KEYBOARD_LAYOUT;
+
+  Data = Package;
+  WriteUnaligned32 ((UINT32 *)Data, Length);
+  Data += sizeof (UINT32);
+  CopyMem (Data, &PackageHeader, sizeof (PackageHeader));
+  Data += sizeof (PackageHeader);
+  WriteUnaligned16 ((UINT16 *)Data, 1);
+  Data += sizeof (UINT16);
+  WriteUnaligned16 ((UINT16 *)Data, (UINT16)LayoutLength);
+  Data += sizeof (UINT16);
+  CopyMem (Data, KeyGuid, sizeof (EFI_GUID));
+  Data += sizeof (EFI_GUID);
+  WriteUnaligned32 ((UINT32 *)Data, DescriptorOffset);
+  Data += sizeof (UINT32);
+  *Data = (UINT8)DescriptorCount;
+  Data += sizeof (UINT8);
+  CopyMem (Data, Descriptors, DescriptorCount * sizeof (EFI_KEY_DESCRIPTOR));
+
+  HiiHandle = HiiAddPackages (&gUsbKeyboardLayoutPackageGuid, NULL, Package, NULL);
+  FreePool (Package);
+  return (HiiHandle == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+/**
+  Return the next number of a xorshift generator, so every run of a test
+  makes the same choices.
+
+  @param  State         The state of the generator, not 0.
+
+  @return The next number.
+
+**/
+UINT32
+TestRandom (
+  IN OUT UINT32  *State
+  )
+{
+  *State ^= *State << 13;
+  *State ^= *State >> 17;
+  *State ^= *State << 5;
+  return *State;
+}
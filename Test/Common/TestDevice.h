@@ -0,0 +1,150 @@
+/** @file
+  Helpers of the host-based tests to bind the driver to fake controllers, to
+  add keyboard layouts to the HII database and to make repeatable random choices.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_TEST_DEVICE_H_
+#define _USB_KB_TEST_DEVICE_H_
+
+#include "../../EfiKey.h"
+#include "../../KeyBoard.h"
+#include "../../Learn.h"
+
+#include <Library/FakeUefiServicesLib.h>
+
+/**
+  Entrypoint of USB Keyboard Driver, defined in EfiKey.c.
+
+  @param  ImageHandle       The firmware allocated handle for the EFI image.
+  @param  SystemTable       A pointer to the EFI System Table.
+
+  @retval EFI_SUCCESS       The entry point is executed successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+USBKeyboardDriverBindingEntryPoint (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+/**
+  Reset the fake services, install the HII database and run the entry point of
+  the driver.
+
+  Call this once, before the first test; the driver keeps module globals that
+  outlive a reset.
+
+  @retval EFI_SUCCESS   The driver is loaded.
+  @retval Others        The entry point failed.
+
+**/
+EFI_STATUS
+TestDriverLoad (
+  VOID
+  );
+
+/**
+  Create a fake Xbox 360 controller and start the driver on it.
+
+  @param  Port                The port number of the device path.
+  @param  Controller          Receives the handle of the controller.
+  @param  UsbKeyboardDevice   Receives the USB_KB_DEV instance, optional.
+
+  @retval EFI_SUCCESS   The driver manages the controller.
+  @retval Others        The controller could not be created or started.
+
+**/
+EFI_STATUS
+TestDeviceStart (
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller,
+  OUT USB_KB_DEV  **UsbKeyboardDevice  OPTIONAL
+  );
+
+/**
+  Stop the driver on a fake controller and remove the controller.
+
+  @param  Controller    The handle of the controller.
+
+  @retval EFI_SUCCESS   The controller is gone.
+  @retval Others        The driver could not be stopped.
+
+**/
+EFI_STATUS
+TestDeviceStop (
+  IN EFI_HANDLE  Controller
+  );
+
+/**
+  Send an Xbox 360 input report with the given buttons and centered sticks.
+
+  @param  Controller    The handle of the controller.
+  @param  Buttons       The button bits, XBOX360_BUTTON_*.
+
+  @retval EFI_SUCCESS   The report was delivered.
+  @retval Others        The controller is not polled.
+
+**/
+EFI_STATUS
+TestDeviceSendButtons (
+  IN EFI_HANDLE  Controller,
+  IN UINT16      Buttons
+  );
+
+/**
+  Create a fake Xbox 360 controller without starting the driver on it.
+
+  @param  Port          The port number of the device path.
+  @param  Controller    Receives the handle of the controller.
+
+  @retval EFI_SUCCESS   The controller was created.
+  @retval Others        The controller could not be created.
+
+**/
+EFI_STATUS
+TestDeviceCreate (
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller
+  );
+
+/**
+  Add a keyboard layout package to the HII database.
+
+  The layout has no description strings.
+
+  @param  KeyGuid           The GUID of the layout.
+  @param  Descriptors       The key descriptors of the layout.
+  @param  DescriptorCount   The number of descriptors, at most 255.
+
+  @retval EFI_SUCCESS           The layout was added.
+  @retval EFI_INVALID_PARAMETER DescriptorCount is above 255.
+  @retval EFI_OUT_OF_RESOURCES  The package could not be built or added.
+
+**/
+EFI_STATUS
+TestLayoutAdd (
+  IN CONST EFI_GUID            *KeyGuid,
+  IN CONST EFI_KEY_DESCRIPTOR  *Descriptors,
+  IN UINTN                     DescriptorCount
+  );
+
+/**
+  Return the next number of a xorshift generator, so every run of a test
+  makes the same choices.
+
+  @param  State         The state of the generator, not 0.
+
+  @return The next number.
+
+**/
+UINT32
+TestRandom (
+  IN OUT UINT32  *State
+  );
+
+#endif
@@ -0,0 +1,339 @@
+/** @file
+  Host-based test that the hot paths of the driver do not allocate pool.
+
+  A started controller is fed thousands of reports, timer ticks and
+  ReadKeyStrokeEx() calls while the keyboard layout keeps changing. The pool
+  allocations and frees made inside each path are counted separately. Reports
+  and reads must not touch the pool. The timer events may only read a changed
+  layout, from the TPL_CALLBACK service timer; nothing may be allocated or
+  freed at TPL_NOTIFY, where USBKeyboardTimerHandler() runs.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "../Common/TestDevice.h"
+
+#include <Library/UnitTestLib.h>
+
+#define UNIT_TEST_NAME     "USB Xbox 360 hot path allocation host test"
+#define UNIT_TEST_VERSION  "1.0"
+
+#define HOT_PATH_ITERATIONS  5000
+
+//
+// Frames a button pattern is held, long enough for the key repeat to start.
+//
+#define HOT_PATH_HOLD_FRAMES  40
+
+//
+// Frames between two keyboard layout changes.
+//
+#define HOT_PATH_LAYOUT_FRAMES  200
+
+#define HOT_PATH_LAYOUT_GUID \
+  { 0x5d2b8f41, 0x7c3e, 0x4a19, { 0x9b, 0x06, 0xe4, 0x3a, 0x1f, 0x8d, 0x62, 0xc7 } }
+
+typedef struct {
+  CONST CHAR8    *Name;
+  UINT64         Calls;
+  UINT64         Allocations;
+  UINT64         Frees;
+  UINT64         NotifyAllocations;
+  UINT64         NotifyFrees;
+} HOT_PATH_COUNTER;
+
+typedef enum {
+  HotPathReport,
+  HotPathTimer,
+  HotPathRead,
+  HotPathMax
+} HOT_PATH;
+
+STATIC HOT_PATH_COUNTER  mHotPaths[HotPathMax] = {
+  { "KeyboardHandler" },
+  { "Timer events"    },
+  { "ReadKeyStrokeEx" }
+};
+
+STATIC FAKE_ALLOCATION_STATS  mHotPathStart;
+STATIC UINTN                  mNotifyCount;
+
+STATIC CONST EFI_GUID  mHotPathLayoutGuid = HOT_PATH_LAYOUT_GUID;
+
+//
+// The layout switched to and from the default one; A gives 'e' instead of
+// Enter.
+//
+STATIC CONST EFI_KEY_DESCRIPTOR  mHotPathLayout[] = {
+  { EfiKeySpaceBar,   ' ',  ' ',  0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyEnter,      'e',  'E',  0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyEsc,        0x1b, 0x1b, 0, 0, EFI_NULL_MODIFIER,        0 },
+  { EfiKeyUpArrow,    0x00, 0x00, 0, 0, EFI_UP_ARROW_MODIFIER,    0 },
+  { EfiKeyDownArrow,  0x00, 0x00, 0, 0, EFI_DOWN_ARROW_MODIFIER,  0 },
+  { EfiKeyLeftArrow,  0x00, 0x00, 0, 0, EFI_LEFT_ARROW_MODIFIER,  0 },
+  { EfiKeyRightArrow, 0x00, 0x00, 0, 0, EFI_RIGHT_ARROW_MODIFIER, 0 },
+  { EfiKeyLShift,     0,    0,    0, 0, EFI_LEFT_SHIFT_MODIFIER,  0 }
+};
+
+//
+// Button patterns sent in turn; Guide is left out since its chords start
+// macros and scripts, which are not hot paths.
+//
+STATIC CONST UINT16  mButtonPatterns[] = {
+  XBOX360_BUTTON_A,
+  0,
+  XBOX360_BUTTON_DPAD_DOWN,
+  XBOX360_BUTTON_DPAD_DOWN | XBOX360_BUTTON_LEFT_THUMB,
+  0,
+  XBOX360_BUTTON_B | XBOX360_BUTTON_X,
+  XBOX360_BUTTON_LEFT_SHOULDER,
+  XBOX360_BUTTON_START | XBOX360_BUTTON_RIGHT_THUMB,
+  0
+};
+
+/**
+  Start counting the pool traffic of a hot path.
+
+**/
+STATIC
+VOID
+HotPathBegin (
+  VOID
+  )
+{
+  FakeGetAllocationStats (&mHotPathStart);
+}
+
+/**
+  Stop counting the pool traffic of a hot path and add it to its counter.
+
+  @param  Path          The hot path.
+
+**/
+STATIC
+VOID
+HotPathEnd (
+  IN HOT_PATH  Path
+  )
+{
+  FAKE_ALLOCATION_STATS  Stats;
+
+  FakeGetAllocationStats (&Stats);
+  mHotPaths[Path].Calls++;
+  mHotPaths[Path].Allocations += Stats.AllocateCount - mHotPathStart.AllocateCount;
+  mHotPaths[Path].Frees       += Stats.FreeCount - mHotPathStart.FreeCount;
+
+  mHotPaths[Path].NotifyAllocations += Stats.NotifyAllocateCount - mHotPathStart.NotifyAllocateCount;
+  mHotPaths[Path].NotifyFrees       += Stats.NotifyFreeCount - mHotPathStart.NotifyFreeCount;
+}
+
+/**
+  Key notification function counting its calls.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+HotPathNotify (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  mNotifyCount++;
+  return EFI_SUCCESS;
+}
+
+/**
+  Drive reports, timer ticks and reads across layout changes and check that
+  none of them allocates or frees pool, but for the layout read by the
+  service timer.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              No hot path touched the pool.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A hot path allocated or freed pool.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+HotPathsDoNotAllocate (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  EFI_HII_DATABASE_PROTOCOL  *HiiDatabase;
+  EFI_HANDLE                 Controller;
+  USB_KB_DEV                 *UsbKeyboardDevice;
+  EFI_KEY_DATA               KeyData;
+  CONST EFI_GUID             *Layout;
+  VOID                       *NotifyHandle;
+  EFI_STATUS                 Status;
+  UINTN                      Iteration;
+  UINTN                      Keys;
+  UINTN                      LayoutKeys;
+  UINTN                      LayoutChanges;
+  UINTN                      Index;
+
+  UT_ASSERT_NOT_EFI_ERROR (gBS->LocateProtocol (&gEfiHiiDatabaseProtocolGuid, NULL, (VOID **)&HiiDatabase));
+  UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mHotPathLayoutGuid, mHotPathLayout, ARRAY_SIZE (mHotPathLayout)));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &UsbKeyboardDevice));
+
+  ZeroMem (&KeyData, sizeof (KeyData));
+  KeyData.Key.UnicodeChar = CHAR_CARRIAGE_RETURN;
+  UT_ASSERT_NOT_EFI_ERROR (
+    UsbKeyboardDevice->SimpleInputEx.RegisterKeyNotify (
+                                       &UsbKeyboardDevice->SimpleInputEx,
+                                       &KeyData,
+                                       HotPathNotify,
+                                       &NotifyHandle
+                                       )
+    );
+
+  mNotifyCount  = 0;
+  Keys          = 0;
+  LayoutKeys    = 0;
+  LayoutChanges = 0;
+  Layout        = &gUsbKeyboardLayoutKeyGuid;
+  for (Iteration = 0; Iteration < HOT_PATH_ITERATIONS; Iteration++) {
+    if ((Iteration % HOT_PATH_LAYOUT_FRAMES) == HOT_PATH_LAYOUT_FRAMES - 1) {
+      Layout = (Layout == &gUsbKeyboardLayoutKeyGuid) ? &mHotPathLayoutGuid : &gUsbKeyboardLayoutKeyGuid;
+      UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->SetKeyboardLayout (HiiDatabase, (EFI_GUID *)Layout));
+      LayoutChanges++;
+    }
+
+    HotPathBegin ();
+    Status = TestDeviceSendButtons (
+               Controller,
+               mButtonPatterns[(Iteration / HOT_PATH_HOLD_FRAMES) % ARRAY_SIZE (mButtonPatterns)]
+               );
+    HotPathEnd (HotPathReport);
+    UT_ASSERT_NOT_EFI_ERROR (Status);
+
+    HotPathBegin ();
+    FakeAdvanceTimers (KEYBOARD_TIMER_INTERVAL);
+    HotPathEnd (HotPathTimer);
+
+    do {
+      HotPathBegin ();
+      Status = UsbKeyboardDevice->SimpleInputEx.ReadKeyStrokeEx (&UsbKeyboardDevice->SimpleInputEx, &KeyData);
+      HotPathEnd (HotPathRead);
+      if (!EFI_ERROR (Status)) {
+        Keys++;
+        if (KeyData.Key.UnicodeChar == L'e') {
+          LayoutKeys++;
+        }
+      }
+    } while (!EFI_ERROR (Status));
+  }
+
+  UT_ASSERT_NOT_EFI_ERROR (UsbKeyboardDevice->SimpleInputEx.UnregisterKeyNotify (&UsbKeyboardDevice->SimpleInputEx, NotifyHandle));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+
+  for (Index = 0; Index < HotPathMax; Index++) {
+    UT_LOG_INFO (
+      "%a: %lu calls, %lu allocations, %lu frees, %lu allocations and %lu frees at TPL_NOTIFY\n",
+      mHotPaths[Index].Name,
+      mHotPaths[Index].Calls,
+      mHotPaths[Index].Allocations,
+      mHotPaths[Index].Frees,
+      mHotPaths[Index].NotifyAllocations,
+      mHotPaths[Index].NotifyFrees
+      );
+  }
+
+  UT_LOG_INFO (
+    "%lu keystrokes read, %lu from the second layout, %lu key notifications, %lu layout changes\n",
+    (UINT64)Keys,
+    (UINT64)LayoutKeys,
+    (UINT64)mNotifyCount,
+    (UINT64)LayoutChanges
+    );
+
+  UT_ASSERT_NOT_EQUAL (Keys, 0);
+  UT_ASSERT_NOT_EQUAL (LayoutKeys, 0);
+  UT_ASSERT_NOT_EQUAL (mNotifyCount, 0);
+  for (Index = 0; Index < HotPathMax; Index++) {
+    UT_ASSERT_EQUAL (mHotPaths[Index].NotifyAllocations, 0);
+    UT_ASSERT_EQUAL (mHotPaths[Index].NotifyFrees, 0);
+    if (Index != HotPathTimer) {
+      UT_ASSERT_EQUAL (mHotPaths[Index].Allocations, 0);
+      UT_ASSERT_EQUAL (mHotPaths[Index].Frees, 0);
+    }
+  }
+
+  //
+  // The service timer reads each new layout into one buffer and frees it.
+  //
+  UT_ASSERT_EQUAL (mHotPaths[HotPathTimer].Allocations, LayoutChanges);
+  UT_ASSERT_EQUAL (mHotPaths[HotPathTimer].Frees, LayoutChanges);
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Initialize the unit test framework, suite, and unit tests for the hot paths
+  and run them.
+
+  @retval  EFI_SUCCESS           All test cases were dispatched.
+  @retval  EFI_OUT_OF_RESOURCES  There are not enough resources available to
+                                 initialize the unit tests.
+**/
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      HotPathSuite;
+
+  Framework = NULL;
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+  Status = TestDriverLoad ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&HotPathSuite, Framework, "Hot Path Allocation Tests", "UsbXbox360.HotPath", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in CreateUnitTestSuite for the hot path suite\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (HotPathSuite, "Reports, timer ticks and reads do not allocate pool", "HotPathsDoNotAllocate", HotPathsDoNotAllocate, NULL, NULL, NULL);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+/**
+  Standard POSIX C entry point for host based unit test execution.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UefiTestMain ();
+}
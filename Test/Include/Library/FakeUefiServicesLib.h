@@ -0,0 +1,262 @@
+/** @file
+  Fake UEFI services for the host-based tests of the USB Xbox 360 controller
+  driver.
+
+  The library produces gBS, gRT and gST, the TimerLib, MemoryAllocationLib,
+  UefiLib, HiiLib and UefiUsbLib functions the driver links against, an HII
+  database for keyboard layouts and fake USB devices. The boot services keep a
+  TPL and dispatch signaled events on RestoreTPL() like DxeCore, and count the
+  memory, events and protocols in use so a test can check for leaks.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _FAKE_UEFI_SERVICES_LIB_H_
+#define _FAKE_UEFI_SERVICES_LIB_H_
+
+#include <Uefi.h>
+
+///
+/// Counters of the pool allocator behind AllocatePool() and gBS->AllocatePool().
+///
+typedef struct {
+  UINT64    AllocateCount;
+  UINT64    FreeCount;
+  UINT64    AllocatedBytes;
+  ///
+  /// Buffers allocated and not yet freed.
+  ///
+  UINT64    OutstandingCount;
+  UINT64    OutstandingBytes;
+  ///
+  /// Allocations and frees made at TPL_NOTIFY or above.
+  ///
+  UINT64    NotifyAllocateCount;
+  UINT64    NotifyFreeCount;
+} FAKE_ALLOCATION_STATS;
+
+///
+/// Counters of the boot services, for leak checks.
+///
+typedef struct {
+  ///
+  /// Events created and not yet closed.
+  ///
+  UINTN    OpenEvents;
+  ///
+  /// Protocols opened BY_DRIVER and not yet closed.
+  ///
+  UINTN    OpenProtocols;
+  ///
+  /// Protocol interfaces installed on all handles.
+  ///
+  UINTN    InstalledProtocols;
+  ///
+  /// RaiseTPL() to a lower TPL, or RestoreTPL() to a higher TPL. DxeCore
+  /// asserts on both.
+  ///
+  UINTN    TplErrors;
+} FAKE_BOOT_SERVICES_STATS;
+
+/**
+  Called at a preemption point of the code under test.
+
+  @param  Context       The context passed to FakeSetPreemptionHandler().
+
+**/
+typedef
+VOID
+(EFIAPI *FAKE_PREEMPTION_HANDLER)(
+  IN VOID  *Context
+  );
+
+/**
+  Reset the fake services.
+
+  Every event, handle and variable is dropped and the counters are cleared.
+  Pool buffers still allocated are not freed. The TPL goes back to
+  TPL_APPLICATION.
+
+**/
+VOID
+EFIAPI
+FakeUefiServicesReset (
+  VOID
+  );
+
+/**
+  Read the pool allocator counters.
+
+  @param  Stats         Receives the counters.
+
+**/
+VOID
+EFIAPI
+FakeGetAllocationStats (
+  OUT FAKE_ALLOCATION_STATS  *Stats
+  );
+
+/**
+  Read the boot services counters.
+
+  @param  Stats         Receives the counters.
+
+**/
+VOID
+EFIAPI
+FakeGetBootServicesStats (
+  OUT FAKE_BOOT_SERVICES_STATS  *Stats
+  );
+
+/**
+  Advance the timer clock and signal the timer events that became due.
+
+  The clock only moves when this is called, so periodic handlers such as the
+  key repeat and the service timer run exactly when a test asks for them. The
+  performance counter of the TimerLib runs with the host clock and also moves
+  by the time advanced here, so code that times itself with it sees both.
+
+  @param  Time          The time to advance, in 100 ns units.
+
+**/
+VOID
+EFIAPI
+FakeAdvanceTimers (
+  IN UINT64  Time
+  );
+
+/**
+  Signal the events of an event group.
+
+  Events created with EVT_SIGNAL_EXIT_BOOT_SERVICES belong to the
+  gEfiEventExitBootServicesGuid group.
+
+  @param  EventGroup    The event group.
+
+**/
+VOID
+EFIAPI
+FakeSignalEventGroup (
+  IN CONST EFI_GUID  *EventGroup
+  );
+
+/**
+  Set the handler called from UsbKbTestPreemptionPoint().
+
+  @param  Handler       The handler, or NULL to remove it.
+  @param  Context       The context passed to Handler.
+
+**/
+VOID
+EFIAPI
+FakeSetPreemptionHandler (
+  IN FAKE_PREEMPTION_HANDLER  Handler  OPTIONAL,
+  IN VOID                     *Context OPTIONAL
+  );
+
+/**
+  Install a fake HII database protocol that holds keyboard layouts.
+
+  HiiAddPackages() adds package lists to it, and SetKeyboardLayout() signals
+  the EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID group. Without it, the driver
+  finds no keyboard layout. FakeUefiServicesReset() removes it.
+
+  @retval EFI_SUCCESS   The protocol is installed.
+  @retval Others        The protocol could not be installed.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeHiiDatabaseInstall (
+  VOID
+  );
+
+/**
+  Create a handle with a fake USB I/O and device path protocol.
+
+  The device has one interface with an interrupt IN endpoint 0x81 and an
+  interrupt OUT endpoint 0x01, both with a 4 ms interval and 32-byte packets.
+
+  @param  VendorId          The vendor ID of the device descriptor.
+  @param  ProductId         The product ID of the device descriptor.
+  @param  InterfaceClass    The class of the interface descriptor.
+  @param  InterfaceSubClass The subclass of the interface descriptor.
+  @param  InterfaceProtocol The protocol of the interface descriptor.
+  @param  Port              The port number in the device path.
+  @param  Controller        Receives the handle.
+
+  @retval EFI_SUCCESS           The device was created.
+  @retval EFI_OUT_OF_RESOURCES  The device could not be allocated.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbCreateDevice (
+  IN  UINT16      VendorId,
+  IN  UINT16      ProductId,
+  IN  UINT8       InterfaceClass,
+  IN  UINT8       InterfaceSubClass,
+  IN  UINT8       InterfaceProtocol,
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller
+  );
+
+/**
+  Remove a handle created by FakeUsbCreateDevice().
+
+  @param  Controller        The handle of the device.
+
+  @retval EFI_SUCCESS       The device was removed.
+  @retval EFI_ACCESS_DENIED The USB I/O protocol is still opened by a driver.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbDestroyDevice (
+  IN EFI_HANDLE  Controller
+  );
+
+/**
+  Complete the asynchronous interrupt transfer of a fake device with a report.
+
+  The callback of the transfer runs at TPL_NOTIFY, as the USB bus driver calls it.
+
+  @param  Controller        The handle of the device.
+  @param  Report            The report data.
+  @param  Length            The length of Report.
+
+  @retval EFI_SUCCESS       The report was delivered.
+  @retval EFI_NOT_READY     No asynchronous interrupt transfer is active.
+  @retval EFI_NOT_FOUND     Controller is not a fake USB device.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbSendReport (
+  IN EFI_HANDLE  Controller,
+  IN VOID        *Report,
+  IN UINTN       Length
+  );
+
+/**
+  Count the transfers a fake device has seen.
+
+  @param  Controller        The handle of the device.
+  @param  ControlTransfers  Receives the number of control transfers.
+  @param  ActiveAsync       Receives TRUE if an asynchronous interrupt transfer is active.
+
+  @retval EFI_SUCCESS       The counters were returned.
+  @retval EFI_NOT_FOUND     Controller is not a fake USB device.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbGetTransferStats (
+  IN  EFI_HANDLE  Controller,
+  OUT UINTN       *ControlTransfers,
+  OUT BOOLEAN     *ActiveAsync
+  );
+
+#endif
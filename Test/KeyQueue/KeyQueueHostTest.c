@@ -0,0 +1,1186 @@
+/** @file
+  Host-based test of the keystroke queues under preemption.
+
+  Keystrokes carry their ring position, and a check value made from its
+  inverted low bits in the key state, so a consumer can tell which slot it
+  claimed and whether the value is torn. At every preemption point of the
+  driver the harness may play what firmware events could do there: a producer
+  at TPL_NOTIFY, a WaitForKey check, or a consumer, a flush or a reset at a TPL
+  above the interrupted one. Once the queue is drained, every accepted position
+  must have been claimed exactly once or flushed.
+
+  The notification path is played the same way: keystrokes are queued for
+  KeyNotifyProcessHandler() while notification functions are registered and
+  unregistered at its preemption points and from the notification functions
+  themselves. No function may be called after it was unregistered, each must
+  see its keystrokes in order, and the registrations that stay must see every
+  keystroke that was not dropped.
+
+  The raw USB_SIMPLE_QUEUE is checked against a model that drops the oldest
+  key when full. Every test reports its throughput.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "../Common/TestDevice.h"
+
+#include <Library/UnitTestLib.h>
+
+#define UNIT_TEST_NAME     "USB Xbox 360 key queue host test"
+#define UNIT_TEST_VERSION  "1.0"
+
+//
+// Ring positions tested. A position is carried in the 32 key bits of a
+// keystroke and checked with 17 bits in its key state.
+//
+#define KEY_QUEUE_POSITIONS  2000000
+#define KEY_QUEUE_SEED       0x2545F491
+#define KEY_QUEUE_CHECK_MASK  0x1FFFF
+
+//
+// Head and Tail start this far below the wrap of their 32-bit counters, so
+// the run crosses it.
+//
+#define KEY_QUEUE_WRAP_OFFSET  (KEY_QUEUE_POSITIONS / 2)
+
+//
+// Keystrokes queued for the notification functions, and the functions and
+// keys registered. The registrations of the first function stay for the whole
+// run.
+//
+#define NOTIFY_KEYSTROKES  1000000
+#define NOTIFY_FUNCTIONS   4
+#define NOTIFY_KEYS        2
+#define NOTIFY_SLOTS       (NOTIFY_FUNCTIONS * NOTIFY_KEYS)
+
+//
+// Operations on the raw USB_SIMPLE_QUEUE, in phases of a random fill rate.
+//
+#define SIMPLE_QUEUE_OPERATIONS  4000000
+#define SIMPLE_QUEUE_PHASE       4096
+
+typedef enum {
+  PositionPending,
+  PositionClaimed,
+  PositionFlushed
+} KEY_QUEUE_POSITION_STATE;
+
+typedef struct {
+  USB_KB_DEV            *UsbKeyboardDevice;
+  USB_KEY_DATA_QUEUE    *Queue;
+  UINT32                Base;
+  UINT32                Random;
+  UINT8                 State[KEY_QUEUE_POSITIONS];
+  INT32                 LastClaimed;
+  UINT32                Produced;
+  UINT32                Claimed;
+  UINT32                Read;
+  UINT32                Flushed;
+  UINT32                Duplicated;
+  UINT32                Torn;
+  UINT32                OutOfOrder;
+  UINT32                Waits;
+  UINT32                WaitMismatches;
+  UINT32                Preemptions;
+} KEY_QUEUE_HARNESS;
+
+typedef struct {
+  VOID       *Handle;
+  BOOLEAN    Registered;
+  BOOLEAN    Seen;
+  UINT32     LastTag;
+  UINT32     Calls;
+} NOTIFY_SLOT;
+
+typedef struct {
+  USB_KB_DEV      *UsbKeyboardDevice;
+  UINT32          Random;
+  UINT32          Tag;
+  NOTIFY_SLOT     Slots[NOTIFY_SLOTS];
+  UINT32          Produced;
+  UINT32          ProducedPerKey[NOTIFY_KEYS];
+  UINT32          DroppedPerKey[NOTIFY_KEYS];
+  UINT32          Calls;
+  UINT32          Late;
+  UINT32          Mismatched;
+  UINT32          OutOfOrder;
+  UINT32          Registrations;
+  UINT32          Unregistrations;
+  UINT32          BudgetSpent;
+  UINT32          Preemptions;
+} NOTIFY_HARNESS;
+
+STATIC KEY_QUEUE_HARNESS  mHarness;
+STATIC NOTIFY_HARNESS     mNotify;
+
+/**
+  Report the throughput of a test.
+
+  @param  Name          What was counted.
+  @param  Count         The number counted.
+  @param  Time          The time it took, in nanoseconds.
+
+**/
+STATIC
+VOID
+ReportThroughput (
+  IN CONST CHAR8  *Name,
+  IN UINT64       Count,
+  IN UINT64       Time
+  )
+{
+  UT_LOG_INFO (
+    "%lu %a in %lu ms, %lu per second\n",
+    Count,
+    Name,
+    DivU64x32 (Time, 1000000),
+    (Time == 0) ? 0 : DivU64x64Remainder (MultU64x32 (Count, 1000000000), Time, NULL)
+    );
+}
+
+/**
+  Make the packed keystroke of a ring position.
+
+  The position plus one fills the key, so no keystroke is partial, and the
+  inverted low bits of the position fill the shift and toggle states.
+
+  @param  Position      The ring position.
+
+  @return The packed keystroke.
+
+**/
+STATIC
+UINT64
+HarnessKeyData (
+  IN UINT32  Position
+  )
+{
+  EFI_KEY_DATA  KeyData;
+  UINT32        Check;
+
+  Check = ~Position & KEY_QUEUE_CHECK_MASK;
+  ZeroMem (&KeyData, sizeof (KeyData));
+  KeyData.Key.UnicodeChar          = (CHAR16)(Position + 1);
+  KeyData.Key.ScanCode             = (UINT16)((Position + 1) >> 16);
+  KeyData.KeyState.KeyShiftState   = Check & USB_KEY_DATA_SHIFT_MASK;
+  KeyData.KeyState.KeyToggleState  = (EFI_KEY_TOGGLE_STATE)(Check >> 10);
+  return PackKeyData (&KeyData);
+}
+
+/**
+  Read the ring position of a packed keystroke.
+
+  @param  PackedKeyData   The packed keystroke.
+  @param  Position        Receives the ring position.
+
+  @retval TRUE      The keystroke is intact.
+  @retval FALSE     The keystroke is torn.
+
+**/
+STATIC
+BOOLEAN
+HarnessPosition (
+  IN  UINT64  PackedKeyData,
+  OUT UINT32  *Position
+  )
+{
+  EFI_KEY_DATA  KeyData;
+  UINT32        Check;
+
+  UnpackKeyData (PackedKeyData, &KeyData);
+  *Position = ((UINT32)KeyData.Key.UnicodeChar | ((UINT32)KeyData.Key.ScanCode << 16)) - 1;
+  Check     = (KeyData.KeyState.KeyShiftState & USB_KEY_DATA_SHIFT_MASK) |
+              ((KeyData.KeyState.KeyToggleState & USB_KEY_DATA_TOGGLE_MASK) << 10);
+  return (BOOLEAN)(Check == (~*Position & KEY_QUEUE_CHECK_MASK));
+}
+
+/**
+  Enqueue the keystroke of the next ring position at TPL_NOTIFY.
+
+**/
+STATIC
+VOID
+HarnessProduce (
+  VOID
+  )
+{
+  EFI_TPL  OldTpl;
+  UINT32   Position;
+
+  OldTpl   = gBS->RaiseTPL (TPL_NOTIFY);
+  Position = mHarness.Queue->Tail - mHarness.Base;
+  if (Position < KEY_QUEUE_POSITIONS) {
+    EnqueueKeyData (mHarness.Queue, HarnessKeyData (Position));
+    mHarness.Produced++;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+}
+
+/**
+  Account for a claimed keystroke.
+
+  @param  PackedKeyData   The packed keystroke.
+
+**/
+STATIC
+VOID
+HarnessClaim (
+  IN UINT64  PackedKeyData
+  )
+{
+  UINT32  Position;
+
+  if (!HarnessPosition (PackedKeyData, &Position)) {
+    mHarness.Torn++;
+    return;
+  }
+
+  if ((Position >= KEY_QUEUE_POSITIONS) || (mHarness.State[Position] != PositionPending)) {
+    mHarness.Duplicated++;
+    return;
+  }
+
+  //
+  // Claims are recorded in the order their compare-exchange succeeded, which
+  // is ring order.
+  //
+  if ((INT32)Position <= mHarness.LastClaimed) {
+    mHarness.OutOfOrder++;
+  }
+
+  mHarness.LastClaimed     = (INT32)Position;
+  mHarness.State[Position] = PositionClaimed;
+  mHarness.Claimed++;
+}
+
+/**
+  Dequeue a keystroke and account for the position it carries.
+
+  @retval TRUE      A keystroke was dequeued.
+  @retval FALSE     The queue was empty.
+
+**/
+STATIC
+BOOLEAN
+HarnessConsume (
+  VOID
+  )
+{
+  UINT64  KeyData;
+
+  if (EFI_ERROR (DequeueKeyData (mHarness.Queue, &KeyData))) {
+    return FALSE;
+  }
+
+  HarnessClaim (KeyData);
+  return TRUE;
+}
+
+/**
+  Read a keystroke through ReadKeyStrokeEx() and account for the position it
+  carries.
+
+**/
+STATIC
+VOID
+HarnessRead (
+  VOID
+  )
+{
+  EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL  *SimpleInputEx;
+  EFI_KEY_DATA                       KeyData;
+
+  SimpleInputEx = &mHarness.UsbKeyboardDevice->SimpleInputEx;
+  if (!EFI_ERROR (SimpleInputEx->ReadKeyStrokeEx (SimpleInputEx, &KeyData))) {
+    HarnessClaim (PackKeyData (&KeyData));
+    mHarness.Read++;
+  }
+}
+
+/**
+  Flush the queue and account for the positions it discarded.
+
+  Positions the flush moved Head over and no consumer claimed meanwhile are
+  the ones it discarded.
+
+  @param  Reset         Flush through SimpleInput.Reset() instead of
+                        FlushKeyDataQueue().
+
+**/
+STATIC
+VOID
+HarnessFlush (
+  IN BOOLEAN  Reset
+  )
+{
+  UINT32  Head;
+  UINT32  Counter;
+  UINT32  Position;
+
+  Head = mHarness.Queue->Head;
+  if (Reset) {
+    mHarness.UsbKeyboardDevice->SimpleInput.Reset (&mHarness.UsbKeyboardDevice->SimpleInput, FALSE);
+  } else {
+    FlushKeyDataQueue (mHarness.Queue);
+  }
+
+  for (Counter = Head; Counter != mHarness.Queue->Head; Counter++) {
+    Position = Counter - mHarness.Base;
+    if (mHarness.State[Position] == PositionPending) {
+      mHarness.State[Position] = PositionFlushed;
+      mHarness.Flushed++;
+    }
+  }
+}
+
+/**
+  Check a WaitForKey event against the queue.
+
+  Every keystroke of the harness is complete, so the event must be signaled
+  exactly when the queue holds one.
+
+**/
+STATIC
+VOID
+HarnessWaitForKey (
+  VOID
+  )
+{
+  EFI_EVENT  WaitForKey;
+  BOOLEAN    Expected;
+
+  WaitForKey = ((TestRandom (&mHarness.Random) & 1) != 0) ?
+               mHarness.UsbKeyboardDevice->SimpleInput.WaitForKey :
+               mHarness.UsbKeyboardDevice->SimpleInputEx.WaitForKeyEx;
+
+  Expected = (BOOLEAN)(mHarness.Queue->Head != mHarness.Queue->Tail);
+  if ((gBS->CheckEvent (WaitForKey) == EFI_SUCCESS) != Expected) {
+    mHarness.WaitMismatches++;
+  }
+
+  mHarness.Waits++;
+}
+
+/**
+  Play an event that could preempt the consumer at its preemption point.
+
+  Nothing preempts a consumer at TPL_NOTIFY. Below it, a producer or a
+  WaitForKey check runs at TPL_NOTIFY, and a consumer, a flush or a reset at a
+  TPL above the interrupted one.
+
+  @param  Context       Not used.
+
+**/
+STATIC
+VOID
+EFIAPI
+HarnessPreempt (
+  IN VOID  *Context
+  )
+{
+  EFI_TPL  Tpl;
+  EFI_TPL  OldTpl;
+  UINT32   Choice;
+  UINT32   Count;
+
+  Tpl = EfiGetCurrentTpl ();
+  if (Tpl >= TPL_NOTIFY) {
+    return;
+  }
+
+  mHarness.Preemptions++;
+  Choice = TestRandom (&mHarness.Random) % 256;
+  if (Choice < 96) {
+    for (Count = Choice % 4; Count < 4; Count++) {
+      HarnessProduce ();
+    }
+  } else if (Choice < 112) {
+    HarnessWaitForKey ();
+  } else if (Choice < 176) {
+    OldTpl = gBS->RaiseTPL (((Tpl < TPL_CALLBACK) && ((Choice & 1) != 0)) ? TPL_CALLBACK : TPL_NOTIFY);
+    if ((Choice & 2) != 0) {
+      HarnessRead ();
+    } else {
+      HarnessConsume ();
+    }
+
+    gBS->RestoreTPL (OldTpl);
+  } else if (Choice == 176) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    HarnessFlush (FALSE);
+    gBS->RestoreTPL (OldTpl);
+  } else if ((Choice == 177) && (Tpl < TPL_CALLBACK)) {
+    OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+    HarnessFlush (TRUE);
+    gBS->RestoreTPL (OldTpl);
+  }
+}
+
+/**
+  Run producers and consumers at random TPLs with random preemption and check
+  that no keystroke is lost, duplicated or torn, and that WaitForKey agrees
+  with the queue.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              Every keystroke is accounted for.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A keystroke was lost, duplicated or torn.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+PreemptedConsumers (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  STATIC CONST EFI_TPL      Tpls[] = { TPL_APPLICATION, TPL_CALLBACK, TPL_NOTIFY };
+  FAKE_BOOT_SERVICES_STATS  Before;
+  FAKE_BOOT_SERVICES_STATS  After;
+  EFI_HANDLE                Controller;
+  EFI_TPL                   OldTpl;
+  UINT32                    Choice;
+  UINT32                    Position;
+  UINT32                    Lost;
+  UINT64                    Begin;
+  UINT64                    Time;
+
+  ZeroMem (&mHarness, sizeof (mHarness));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &mHarness.UsbKeyboardDevice));
+  mHarness.Queue       = &mHarness.UsbKeyboardDevice->EfiKeyQueue;
+  mHarness.Base        = (UINT32)0 - KEY_QUEUE_WRAP_OFFSET;
+  mHarness.Random      = KEY_QUEUE_SEED;
+  mHarness.LastClaimed = -1;
+
+  OldTpl                 = gBS->RaiseTPL (TPL_NOTIFY);
+  mHarness.Queue->Head    = mHarness.Base;
+  mHarness.Queue->Tail    = mHarness.Base;
+  mHarness.Queue->Dropped = 0;
+  gBS->RestoreTPL (OldTpl);
+
+  FakeGetBootServicesStats (&Before);
+  FakeSetPreemptionHandler (HarnessPreempt, NULL);
+
+  Begin = GetPerformanceCounter ();
+  while ((UINT32)(mHarness.Queue->Tail - mHarness.Base) < KEY_QUEUE_POSITIONS) {
+    Choice = TestRandom (&mHarness.Random) % 1000;
+    if (Choice < 300) {
+      HarnessProduce ();
+      continue;
+    }
+
+    OldTpl = gBS->RaiseTPL (Tpls[TestRandom (&mHarness.Random) % ARRAY_SIZE (Tpls)]);
+    if (Choice < 900) {
+      HarnessConsume ();
+    } else if (Choice < 970) {
+      HarnessRead ();
+    } else if (Choice < 995) {
+      HarnessWaitForKey ();
+    } else {
+      HarnessFlush (FALSE);
+    }
+
+    gBS->RestoreTPL (OldTpl);
+  }
+
+  FakeSetPreemptionHandler (NULL, NULL);
+  while (HarnessConsume ()) {
+  }
+
+  Time = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+  FakeGetBootServicesStats (&After);
+
+  Lost = 0;
+  for (Position = 0; Position < (UINT32)(mHarness.Queue->Tail - mHarness.Base); Position++) {
+    if (mHarness.State[Position] == PositionPending) {
+      Lost++;
+    }
+  }
+
+  UT_LOG_INFO (
+    "produced %u, dropped full %u, claimed %u (%u read), flushed %u, wait checks %u, preemptions %u\n",
+    mHarness.Produced,
+    mHarness.Queue->Dropped,
+    mHarness.Claimed,
+    mHarness.Read,
+    mHarness.Flushed,
+    mHarness.Waits,
+    mHarness.Preemptions
+    );
+  UT_LOG_INFO (
+    "lost %u, duplicated %u, torn %u, out of order %u, wait mismatches %u\n",
+    Lost,
+    mHarness.Duplicated,
+    mHarness.Torn,
+    mHarness.OutOfOrder,
+    mHarness.WaitMismatches
+    );
+  ReportThroughput ("queue operations", (UINT64)mHarness.Produced + mHarness.Claimed + mHarness.Flushed + mHarness.Waits, Time);
+
+  UT_ASSERT_EQUAL (Lost, 0);
+  UT_ASSERT_EQUAL (mHarness.Duplicated, 0);
+  UT_ASSERT_EQUAL (mHarness.Torn, 0);
+  UT_ASSERT_EQUAL (mHarness.OutOfOrder, 0);
+  UT_ASSERT_EQUAL (mHarness.WaitMismatches, 0);
+  UT_ASSERT_EQUAL (mHarness.Produced, (UINT32)(mHarness.Queue->Tail - mHarness.Base) + mHarness.Queue->Dropped);
+  UT_ASSERT_EQUAL (mHarness.Claimed + mHarness.Flushed, (UINT32)(mHarness.Queue->Tail - mHarness.Base));
+  UT_ASSERT_TRUE (mHarness.Queue->Tail < mHarness.Base);
+  UT_ASSERT_NOT_EQUAL (mHarness.Queue->Dropped, 0);
+  UT_ASSERT_NOT_EQUAL (mHarness.Flushed, 0);
+  UT_ASSERT_NOT_EQUAL (mHarness.Read, 0);
+  UT_ASSERT_EQUAL (After.TplErrors, Before.TplErrors);
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Account for a call of a notification function.
+
+  @param  Function      The index of the notification function.
+  @param  KeyData       The keystroke it was called with.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+NotifyHarnessCall (
+  IN UINTN         Function,
+  IN EFI_KEY_DATA  *KeyData
+  );
+
+/**
+  Notification function 0; its registrations stay for the whole run.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+NotifyHarness0 (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  return NotifyHarnessCall (0, KeyData);
+}
+
+/**
+  Notification function 1.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+NotifyHarness1 (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  return NotifyHarnessCall (1, KeyData);
+}
+
+/**
+  Notification function 2.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+NotifyHarness2 (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  return NotifyHarnessCall (2, KeyData);
+}
+
+/**
+  Notification function 3.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+NotifyHarness3 (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  return NotifyHarnessCall (3, KeyData);
+}
+
+STATIC CONST EFI_KEY_NOTIFY_FUNCTION  mNotifyFunctions[NOTIFY_FUNCTIONS] = {
+  NotifyHarness0,
+  NotifyHarness1,
+  NotifyHarness2,
+  NotifyHarness3
+};
+
+/**
+  Register a slot, a notification function for a key.
+
+  @param  Slot          The slot.
+
+**/
+STATIC
+VOID
+NotifyRegister (
+  IN UINTN  Slot
+  )
+{
+  EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL  *SimpleInputEx;
+  EFI_KEY_DATA                       KeyData;
+  VOID                               *Handle;
+
+  SimpleInputEx = &mNotify.UsbKeyboardDevice->SimpleInputEx;
+  ZeroMem (&KeyData, sizeof (KeyData));
+  KeyData.Key.UnicodeChar = (CHAR16)(L'a' + Slot % NOTIFY_KEYS);
+  if (!EFI_ERROR (SimpleInputEx->RegisterKeyNotify (SimpleInputEx, &KeyData, mNotifyFunctions[Slot / NOTIFY_KEYS], &Handle))) {
+    mNotify.Slots[Slot].Handle     = Handle;
+    mNotify.Slots[Slot].Registered = TRUE;
+    mNotify.Slots[Slot].Seen       = FALSE;
+    mNotify.Registrations++;
+  }
+}
+
+/**
+  Unregister a slot. It counts as unregistered before the call, so a
+  notification during the call is not an error.
+
+  @param  Slot          The slot.
+
+**/
+STATIC
+VOID
+NotifyUnregister (
+  IN UINTN  Slot
+  )
+{
+  EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL  *SimpleInputEx;
+
+  SimpleInputEx                  = &mNotify.UsbKeyboardDevice->SimpleInputEx;
+  mNotify.Slots[Slot].Registered = FALSE;
+  SimpleInputEx->UnregisterKeyNotify (SimpleInputEx, mNotify.Slots[Slot].Handle);
+  mNotify.Unregistrations++;
+}
+
+/**
+  Register or unregister a random slot that does not stay for the run.
+
+**/
+STATIC
+VOID
+NotifyToggleSlot (
+  VOID
+  )
+{
+  UINTN  Slot;
+
+  Slot = NOTIFY_KEYS + TestRandom (&mNotify.Random) % (NOTIFY_SLOTS - NOTIFY_KEYS);
+  if (mNotify.Slots[Slot].Registered) {
+    NotifyUnregister (Slot);
+  } else {
+    NotifyRegister (Slot);
+  }
+}
+
+/**
+  Queue the next keystroke for the notification functions at TPL_NOTIFY.
+
+  The key is random, and the tag of the keystroke is carried in its shift and
+  toggle states, which the registrations ignore.
+
+**/
+STATIC
+VOID
+NotifyProduce (
+  VOID
+  )
+{
+  EFI_KEY_DATA  KeyData;
+  EFI_TPL       OldTpl;
+  UINTN         Key;
+  UINT32        Dropped;
+
+  Key = TestRandom (&mNotify.Random) % NOTIFY_KEYS;
+  ZeroMem (&KeyData, sizeof (KeyData));
+  KeyData.Key.UnicodeChar         = (CHAR16)(L'a' + Key);
+  KeyData.KeyState.KeyShiftState  = mNotify.Tag & USB_KEY_DATA_SHIFT_MASK;
+  KeyData.KeyState.KeyToggleState = (EFI_KEY_TOGGLE_STATE)((mNotify.Tag >> 10) & USB_KEY_DATA_TOGGLE_MASK);
+  mNotify.Tag                     = (mNotify.Tag + 1) & KEY_QUEUE_CHECK_MASK;
+
+  OldTpl  = gBS->RaiseTPL (TPL_NOTIFY);
+  Dropped = mNotify.UsbKeyboardDevice->EfiKeyQueueForNotify.Dropped;
+  SignalKeyNotify (mNotify.UsbKeyboardDevice, &KeyData);
+  if (mNotify.UsbKeyboardDevice->EfiKeyQueueForNotify.Dropped != Dropped) {
+    mNotify.DroppedPerKey[Key]++;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  mNotify.ProducedPerKey[Key]++;
+  mNotify.Produced++;
+}
+
+STATIC
+EFI_STATUS
+NotifyHarnessCall (
+  IN UINTN         Function,
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  NOTIFY_SLOT  *Slot;
+  UINTN        Key;
+  UINT32       Tag;
+  UINT32       Distance;
+
+  mNotify.Calls++;
+  Key = (UINTN)(KeyData->Key.UnicodeChar - L'a');
+  if ((Key >= NOTIFY_KEYS) || (KeyData->Key.ScanCode != SCAN_NULL)) {
+    mNotify.Mismatched++;
+    return EFI_SUCCESS;
+  }
+
+  Slot = &mNotify.Slots[Function * NOTIFY_KEYS + Key];
+  if (!Slot->Registered) {
+    mNotify.Late++;
+  }
+
+  //
+  // Tags only grow, modulo their width, and a slot sees far fewer keystrokes
+  // than half of it between two calls.
+  //
+  Tag = (KeyData->KeyState.KeyShiftState & USB_KEY_DATA_SHIFT_MASK) |
+        ((KeyData->KeyState.KeyToggleState & USB_KEY_DATA_TOGGLE_MASK) << 10);
+  Distance = (Tag - Slot->LastTag) & KEY_QUEUE_CHECK_MASK;
+  if (Slot->Seen && ((Distance == 0) || (Distance > KEY_QUEUE_CHECK_MASK / 2))) {
+    mNotify.OutOfOrder++;
+  }
+
+  Slot->Seen    = TRUE;
+  Slot->LastTag = Tag;
+  Slot->Calls++;
+
+  //
+  // The other functions change the registrations from inside the delivery.
+  //
+  if ((Function != 0) && ((TestRandom (&mNotify.Random) % 8) == 0)) {
+    NotifyToggleSlot ();
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Play an event that could preempt the notification path at its preemption
+  point.
+
+  Below TPL_NOTIFY, a producer queues keystrokes at TPL_NOTIFY, a slot is
+  registered or unregistered, or the pass budget of the delivery is spent.
+
+  @param  Context       Not used.
+
+**/
+STATIC
+VOID
+EFIAPI
+NotifyPreempt (
+  IN VOID  *Context
+  )
+{
+  EFI_TPL  OldTpl;
+  UINT32   Choice;
+  UINT32   Count;
+
+  if (EfiGetCurrentTpl () >= TPL_NOTIFY) {
+    return;
+  }
+
+  //
+  // A delivery has a few preemption points per keystroke, so less than one
+  // keystroke is produced per point on average, or it would never end.
+  //
+  mNotify.Preemptions++;
+  Choice = TestRandom (&mNotify.Random) % 256;
+  if ((Choice < 24) && (mNotify.Produced < NOTIFY_KEYSTROKES)) {
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    for (Count = Choice % 4; Count < 4; Count++) {
+      NotifyProduce ();
+    }
+
+    gBS->RestoreTPL (OldTpl);
+  } else if (Choice < 56) {
+    NotifyToggleSlot ();
+  } else if (Choice == 56) {
+    //
+    // Move the clock past the pass budget, so the delivery stops after the
+    // next notification function and resumes on the next signal.
+    //
+    FakeAdvanceTimers (MultU64x32 (FixedPcdGet32 (PcdUsbXbox360NotifyPassBudgetUs), 10) + 1);
+    mNotify.BudgetSpent++;
+  }
+}
+
+/**
+  Queue keystrokes for the notification functions while registrations change
+  at every preemption point of the notification path, and check every call.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              Every notification was delivered as expected.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A notification was late, out of order or lost.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+PreemptedNotifications (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  FAKE_BOOT_SERVICES_STATS  Before;
+  FAKE_BOOT_SERVICES_STATS  After;
+  FAKE_ALLOCATION_STATS     PoolBefore;
+  FAKE_ALLOCATION_STATS     PoolAfter;
+  EFI_HANDLE                Controller;
+  EFI_TPL                   OldTpl;
+  UINT32                    Choice;
+  UINT32                    Count;
+  UINTN                     Slot;
+  UINTN                     Key;
+  UINT64                    Begin;
+  UINT64                    Time;
+
+  ZeroMem (&mNotify, sizeof (mNotify));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &mNotify.UsbKeyboardDevice));
+  mNotify.Random = KEY_QUEUE_SEED;
+
+  FakeGetAllocationStats (&PoolBefore);
+  FakeGetBootServicesStats (&Before);
+
+  for (Key = 0; Key < NOTIFY_KEYS; Key++) {
+    NotifyRegister (Key);
+    UT_ASSERT_TRUE (mNotify.Slots[Key].Registered);
+  }
+
+  FakeSetPreemptionHandler (NotifyPreempt, NULL);
+
+  Begin = GetPerformanceCounter ();
+  while (mNotify.Produced < NOTIFY_KEYSTROKES) {
+    Choice = TestRandom (&mNotify.Random) % 16;
+    if (Choice < 10) {
+      //
+      // Keystrokes from the timer handler; the delivery runs when the TPL
+      // drops below TPL_CALLBACK.
+      //
+      OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+      for (Count = Choice % 8; Count < 8; Count++) {
+        NotifyProduce ();
+      }
+
+      gBS->RestoreTPL (OldTpl);
+    } else if (Choice < 13) {
+      OldTpl = gBS->RaiseTPL (((Choice & 1) != 0) ? TPL_CALLBACK : TPL_APPLICATION);
+      NotifyToggleSlot ();
+      gBS->RestoreTPL (OldTpl);
+    } else {
+      //
+      // Keystrokes queued while another TPL_CALLBACK handler runs.
+      //
+      OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+      for (Count = 8; Count < Choice; Count++) {
+        NotifyProduce ();
+      }
+
+      gBS->RestoreTPL (OldTpl);
+    }
+  }
+
+  FakeSetPreemptionHandler (NULL, NULL);
+
+  //
+  // Deliver what a spent pass budget left for the next signal.
+  //
+  gBS->SignalEvent (mNotify.UsbKeyboardDevice->KeyNotifyProcessEvent);
+  Time = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+  Time = Time - MultU64x32 (MultU64x32 (FixedPcdGet32 (PcdUsbXbox360NotifyPassBudgetUs), 1000) + 100, mNotify.BudgetSpent);
+
+  UT_ASSERT_TRUE (IsKeyDataQueueEmpty (&mNotify.UsbKeyboardDevice->EfiKeyQueueForNotify));
+  UT_ASSERT_FALSE (mNotify.UsbKeyboardDevice->NotifyPending);
+
+  UT_LOG_INFO (
+    "produced %u, dropped full %u, calls %u, registrations %u, unregistrations %u, budget spent %u, preemptions %u\n",
+    mNotify.Produced,
+    mNotify.UsbKeyboardDevice->EfiKeyQueueForNotify.Dropped,
+    mNotify.Calls,
+    mNotify.Registrations,
+    mNotify.Unregistrations,
+    mNotify.BudgetSpent,
+    mNotify.Preemptions
+    );
+  UT_LOG_INFO (
+    "late %u, mismatched %u, out of order %u\n",
+    mNotify.Late,
+    mNotify.Mismatched,
+    mNotify.OutOfOrder
+    );
+  ReportThroughput ("notifications", mNotify.Calls, Time);
+
+  UT_ASSERT_EQUAL (mNotify.Late, 0);
+  UT_ASSERT_EQUAL (mNotify.Mismatched, 0);
+  UT_ASSERT_EQUAL (mNotify.OutOfOrder, 0);
+  for (Key = 0; Key < NOTIFY_KEYS; Key++) {
+    UT_ASSERT_EQUAL (mNotify.Slots[Key].Calls, mNotify.ProducedPerKey[Key] - mNotify.DroppedPerKey[Key]);
+  }
+
+  UT_ASSERT_NOT_EQUAL (mNotify.Unregistrations, 0);
+  UT_ASSERT_NOT_EQUAL (mNotify.BudgetSpent, 0);
+
+  for (Slot = 0; Slot < NOTIFY_SLOTS; Slot++) {
+    if (mNotify.Slots[Slot].Registered) {
+      NotifyUnregister (Slot);
+    }
+  }
+
+  FakeGetAllocationStats (&PoolAfter);
+  FakeGetBootServicesStats (&After);
+  UT_ASSERT_EQUAL (PoolAfter.OutstandingBytes, PoolBefore.OutstandingBytes);
+  UT_ASSERT_EQUAL (After.TplErrors, Before.TplErrors);
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Enqueue and dequeue raw keys at TPL_NOTIFY and compare the queue with a
+  model that holds MAX_KEY_ALLOWED keys and drops the oldest when full.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              The queue behaved as the model.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A key was lost, reordered or made up.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+SimpleQueueKeepsNewest (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  STATIC USB_SIMPLE_QUEUE  Queue;
+  USB_KEY                  UsbKey;
+  EFI_TPL                  OldTpl;
+  EFI_STATUS               Status;
+  UINT32                   Random;
+  UINT32                   FillRate;
+  UINT32                   Operation;
+  UINT64                   ModelHead;
+  UINT64                   ModelTail;
+  UINT64                   Overwritten;
+  UINT64                   Mismatches;
+  UINT64                   Begin;
+  UINT64                   Time;
+
+  Random      = KEY_QUEUE_SEED;
+  FillRate    = 4;
+  ModelHead   = 0;
+  ModelTail   = 0;
+  Overwritten = 0;
+  Mismatches  = 0;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  InitQueue (&Queue, sizeof (USB_KEY));
+
+  Begin = GetPerformanceCounter ();
+  for (Operation = 0; Operation < SIMPLE_QUEUE_OPERATIONS; Operation++) {
+    if ((Operation % SIMPLE_QUEUE_PHASE) == 0) {
+      FillRate = TestRandom (&Random) % 9;
+    }
+
+    if ((TestRandom (&Random) % 8) < FillRate) {
+      UsbKey.Down    = (BOOLEAN)(ModelTail & 1);
+      UsbKey.KeyCode = (UINT8)ModelTail;
+      UsbKey.Time    = ModelTail;
+      Enqueue (&Queue, &UsbKey, sizeof (UsbKey));
+      ModelTail++;
+      if (ModelTail - ModelHead > MAX_KEY_ALLOWED) {
+        ModelHead++;
+        Overwritten++;
+      }
+    } else {
+      Status = Dequeue (&Queue, &UsbKey, sizeof (UsbKey));
+      if (ModelHead == ModelTail) {
+        if (Status != EFI_DEVICE_ERROR) {
+          Mismatches++;
+        }
+      } else {
+        if (EFI_ERROR (Status) || (UsbKey.Time != ModelHead) || (UsbKey.KeyCode != (UINT8)ModelHead) ||
+            (UsbKey.Down != (BOOLEAN)(ModelHead & 1)))
+        {
+          Mismatches++;
+        }
+
+        ModelHead++;
+      }
+    }
+
+    if (IsQueueEmpty (&Queue) != (ModelHead == ModelTail)) {
+      Mismatches++;
+    }
+  }
+
+  Time = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+  gBS->RestoreTPL (OldTpl);
+
+  UT_LOG_INFO ("enqueued %lu, overwritten %lu, mismatches %lu\n", ModelTail, Overwritten, Mismatches);
+  ReportThroughput ("raw queue operations", SIMPLE_QUEUE_OPERATIONS, Time);
+
+  UT_ASSERT_EQUAL (Mismatches, 0);
+  UT_ASSERT_NOT_EQUAL (Overwritten, 0);
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Read and reset a started device at TPL_NOTIFY, the highest TPL the console
+  may call in at.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              The keystrokes were read without a TPL error.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A read failed or moved the TPL the wrong way.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+ReadAtNotify (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  FAKE_BOOT_SERVICES_STATS  Before;
+  FAKE_BOOT_SERVICES_STATS  After;
+  EFI_HANDLE                Controller;
+  USB_KB_DEV                *UsbKeyboardDevice;
+  EFI_KEY_DATA              KeyData;
+  EFI_INPUT_KEY             Key;
+  EFI_TPL                   OldTpl;
+  EFI_STATUS                ReadExStatus;
+  EFI_STATUS                ReadStatus;
+  EFI_STATUS                EmptyStatus;
+  EFI_STATUS                ResetStatus;
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &UsbKeyboardDevice));
+
+  FakeGetBootServicesStats (&Before);
+
+  ZeroMem (&KeyData, sizeof (KeyData));
+  KeyData.Key.UnicodeChar = L'a';
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueue, PackKeyData (&KeyData));
+  KeyData.Key.UnicodeChar = L'b';
+  EnqueueKeyData (&UsbKeyboardDevice->EfiKeyQueue, PackKeyData (&KeyData));
+  ZeroMem (&KeyData, sizeof (KeyData));
+  ReadExStatus = UsbKeyboardDevice->SimpleInputEx.ReadKeyStrokeEx (&UsbKeyboardDevice->SimpleInputEx, &KeyData);
+  ReadStatus   = UsbKeyboardDevice->SimpleInput.ReadKeyStroke (&UsbKeyboardDevice->SimpleInput, &Key);
+  EmptyStatus  = UsbKeyboardDevice->SimpleInput.ReadKeyStroke (&UsbKeyboardDevice->SimpleInput, &Key);
+  ResetStatus  = UsbKeyboardDevice->SimpleInput.Reset (&UsbKeyboardDevice->SimpleInput, FALSE);
+  gBS->RestoreTPL (OldTpl);
+
+  FakeGetBootServicesStats (&After);
+
+  UT_ASSERT_NOT_EFI_ERROR (ReadExStatus);
+  UT_ASSERT_EQUAL (KeyData.Key.UnicodeChar, L'a');
+  UT_ASSERT_NOT_EFI_ERROR (ReadStatus);
+  UT_ASSERT_EQUAL (Key.UnicodeChar, L'b');
+  UT_ASSERT_STATUS_EQUAL (EmptyStatus, EFI_NOT_READY);
+  UT_ASSERT_NOT_EFI_ERROR (ResetStatus);
+  UT_ASSERT_EQUAL (After.TplErrors, Before.TplErrors);
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Initialize the unit test framework, suite, and unit tests for the key queue
+  and run them.
+
+  @retval  EFI_SUCCESS           All test cases were dispatched.
+  @retval  EFI_OUT_OF_RESOURCES  There are not enough resources available to
+                                 initialize the unit tests.
+**/
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      KeyQueueSuite;
+
+  Framework = NULL;
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+  Status = TestDriverLoad ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&KeyQueueSuite, Framework, "Key Queue Preemption Tests", "UsbXbox360.KeyQueue", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in CreateUnitTestSuite for the key queue suite\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (KeyQueueSuite, "Preempted consumers lose, duplicate or tear no keystroke", "PreemptedConsumers", PreemptedConsumers, NULL, NULL, NULL);
+  AddTestCase (KeyQueueSuite, "Preempted notifications are delivered in order and never late", "PreemptedNotifications", PreemptedNotifications, NULL, NULL, NULL);
+  AddTestCase (KeyQueueSuite, "The raw key queue keeps the newest keys", "SimpleQueueKeepsNewest", SimpleQueueKeepsNewest, NULL, NULL, NULL);
+  AddTestCase (KeyQueueSuite, "ReadKeyStroke, ReadKeyStrokeEx and Reset work at TPL_NOTIFY", "ReadAtNotify", ReadAtNotify, NULL, NULL, NULL);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+/**
+  Standard POSIX C entry point for host based unit test execution.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UefiTestMain ();
+}
@@ -0,0 +1,678 @@
+/** @file
+  Host-based benchmark of applying keyboard layouts.
+
+  A corpus of US, UK, German, French and Nordic layouts, and two synthetic
+  worst cases, a layout made only of dead keys and one dead key with the
+  longest chain of dependent keys, is added to the HII database. Each layout
+  is applied by RefreshKeyboardLayout() many times, and the time, the pool
+  allocations and the pool kept for the layout are reported. Every apply after
+  the first two must allocate only the layout copy and one buffer per dead key.
+  A layout with an unknown key must leave the current layout in place.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "../Common/TestDevice.h"
+
+#include <Library/UnitTestLib.h>
+
+#define UNIT_TEST_NAME     "USB Xbox 360 keyboard layout corpus host test"
+#define UNIT_TEST_VERSION  "1.0"
+
+#define LAYOUT_APPLY_RUNS  500
+
+//
+// A layout package holds at most 255 key descriptors.
+//
+#define LAYOUT_MAX_DESCRIPTORS  255
+
+//
+// A key of a national layout that differs from the US layout.
+//
+typedef struct {
+  EFI_KEY    Key;
+  CHAR16     Unicode;
+  CHAR16     ShiftedUnicode;
+  CHAR16     AltGrUnicode;
+} LAYOUT_KEY;
+
+//
+// A dead key and what it makes of the vowels A, E, I, O, U and Y, lower case
+// then upper case. A zero skips the vowel.
+//
+typedef struct {
+  EFI_KEY    Key;
+  CHAR16     Unicode;
+  CHAR16     ShiftedUnicode;
+  CHAR16     Composed[12];
+} LAYOUT_DEAD_KEY;
+
+typedef struct {
+  CONST CHAR8              *Name;
+  EFI_GUID                 Guid;
+  CONST LAYOUT_KEY         *Keys;
+  UINTN                    KeyCount;
+  CONST LAYOUT_DEAD_KEY    *DeadKeys;
+  UINTN                    DeadKeyCount;
+} LAYOUT_CORPUS_ENTRY;
+
+STATIC CONST EFI_KEY  mVowelKeys[] = { EfiKeyC1, EfiKeyD3, EfiKeyD8, EfiKeyD9, EfiKeyD7, EfiKeyD6 };
+
+STATIC CONST LAYOUT_KEY  mUkKeys[] = {
+  { EfiKeyE0,  L'`',  0x00AC, L'|'   },
+  { EfiKeyE2,  L'2',  L'"',   0      },
+  { EfiKeyE3,  L'3',  0x00A3, 0      },
+  { EfiKeyE4,  L'4',  L'$',   0x20AC },
+  { EfiKeyC11, L'\'', L'@',   0      },
+  { EfiKeyC12, L'#',  L'~',   0      },
+  { EfiKeyB0,  L'\\', L'|',   0      }
+};
+
+STATIC CONST LAYOUT_KEY  mGermanKeys[] = {
+  { EfiKeyD6,  L'z',    L'Z',    0      },
+  { EfiKeyB1,  L'y',    L'Y',    0      },
+  { EfiKeyD1,  L'q',    L'Q',    L'@'   },
+  { EfiKeyE2,  L'2',    L'"',    0x00B2 },
+  { EfiKeyE3,  L'3',    0x00A7,  0x00B3 },
+  { EfiKeyE6,  L'6',    L'&',    0      },
+  { EfiKeyE7,  L'7',    L'/',    L'{'   },
+  { EfiKeyE8,  L'8',    L'(',    L'['   },
+  { EfiKeyE9,  L'9',    L')',    L']'   },
+  { EfiKeyE10, L'0',    L'=',    L'}'   },
+  { EfiKeyE11, 0x00DF,  L'?',    L'\\'  },
+  { EfiKeyD11, 0x00FC,  0x00DC,  0      },
+  { EfiKeyD12, L'+',    L'*',    L'~'   },
+  { EfiKeyC10, 0x00F6,  0x00D6,  0      },
+  { EfiKeyC11, 0x00E4,  0x00C4,  0      },
+  { EfiKeyC12, L'#',    L'\'',   0      },
+  { EfiKeyB0,  L'<',    L'>',    L'|'   },
+  { EfiKeyB8,  L'.',    L':',    0      },
+  { EfiKeyB9,  L'-',    L'_',    0      },
+  { EfiKeyB7,  L',',    L';',    0      }
+};
+
+STATIC CONST LAYOUT_DEAD_KEY  mGermanDeadKeys[] = {
+  { EfiKeyE0,  L'^',   0x00B0, { 0x00E2, 0x00EA, 0x00EE, 0x00F4, 0x00FB, 0, 0x00C2, 0x00CA, 0x00CE, 0x00D4, 0x00DB, 0 } },
+  { EfiKeyE12, 0x00B4, L'`',   { 0x00E1, 0x00E9, 0x00ED, 0x00F3, 0x00FA, 0x00FD, 0x00C1, 0x00C9, 0x00CD, 0x00D3, 0x00DA, 0x00DD } }
+};
+
+STATIC CONST LAYOUT_KEY  mFrenchKeys[] = {
+  { EfiKeyC1,  L'q',    L'Q',    0      },
+  { EfiKeyD1,  L'a',    L'A',    0      },
+  { EfiKeyD2,  L'z',    L'Z',    0      },
+  { EfiKeyB1,  L'w',    L'W',    0      },
+  { EfiKeyC10, L'm',    L'M',    0      },
+  { EfiKeyB7,  L',',    L'?',    0      },
+  { EfiKeyB8,  L';',    L'.',    0      },
+  { EfiKeyB9,  L':',    L'/',    0      },
+  { EfiKeyB10, L'!',    0x00A7,  0      },
+  { EfiKeyE0,  0x00B2,  0,       0      },
+  { EfiKeyE1,  L'&',    L'1',    0      },
+  { EfiKeyE2,  0x00E9,  L'2',    L'~'   },
+  { EfiKeyE3,  L'"',    L'3',    L'#'   },
+  { EfiKeyE4,  L'\'',   L'4',    L'{'   },
+  { EfiKeyE5,  L'(',    L'5',    L'['   },
+  { EfiKeyE6,  L'-',    L'6',    L'|'   },
+  { EfiKeyE7,  0x00E8,  L'7',    L'`'   },
+  { EfiKeyE8,  L'_',    L'8',    L'\\'  },
+  { EfiKeyE9,  0x00E7,  L'9',    L'^'   },
+  { EfiKeyE10, 0x00E0,  L'0',    L'@'   },
+  { EfiKeyE11, L')',    0x00B0,  L']'   },
+  { EfiKeyE12, L'=',    L'+',    L'}'   },
+  { EfiKeyD12, L'$',    0x00A3,  0x00A4 },
+  { EfiKeyC11, 0x00F9,  L'%',    0      },
+  { EfiKeyC12, L'*',    0x00B5,  0      },
+  { EfiKeyB0,  L'<',    L'>',    0      }
+};
+
+STATIC CONST LAYOUT_DEAD_KEY  mFrenchDeadKeys[] = {
+  { EfiKeyD11, L'^', 0x00A8, { 0x00E2, 0x00EA, 0x00EE, 0x00F4, 0x00FB, 0, 0x00C2, 0x00CA, 0x00CE, 0x00D4, 0x00DB, 0 } }
+};
+
+STATIC CONST LAYOUT_KEY  mNordicKeys[] = {
+  { EfiKeyE0,  0x00A7,  0x00BD,  0      },
+  { EfiKeyE2,  L'2',    L'"',    L'@'   },
+  { EfiKeyE3,  L'3',    L'#',    0x00A3 },
+  { EfiKeyE4,  L'4',    0x00A4,  L'$'   },
+  { EfiKeyE6,  L'6',    L'&',    0      },
+  { EfiKeyE7,  L'7',    L'/',    L'{'   },
+  { EfiKeyE8,  L'8',    L'(',    L'['   },
+  { EfiKeyE9,  L'9',    L')',    L']'   },
+  { EfiKeyE10, L'0',    L'=',    L'}'   },
+  { EfiKeyE11, L'+',    L'?',    L'\\'  },
+  { EfiKeyD11, 0x00E5,  0x00C5,  0      },
+  { EfiKeyC10, 0x00F6,  0x00D6,  0      },
+  { EfiKeyC11, 0x00E4,  0x00C4,  0      },
+  { EfiKeyC12, L'\'',   L'*',    0      },
+  { EfiKeyB0,  L'<',    L'>',    L'|'   },
+  { EfiKeyB7,  L',',    L';',    0      },
+  { EfiKeyB8,  L'.',    L':',    0      },
+  { EfiKeyB9,  L'-',    L'_',    0      }
+};
+
+STATIC CONST LAYOUT_DEAD_KEY  mNordicDeadKeys[] = {
+  { EfiKeyE12, 0x00B4, L'`', { 0x00E1, 0x00E9, 0x00ED, 0x00F3, 0x00FA, 0x00FD, 0x00C1, 0x00C9, 0x00CD, 0x00D3, 0x00DA, 0x00DD } },
+  { EfiKeyD12, 0x00A8, L'^', { 0x00E4, 0x00EB, 0x00EF, 0x00F6, 0x00FC, 0x00FF, 0x00C4, 0x00CB, 0x00CF, 0x00D6, 0x00DC, 0      } }
+};
+
+#define LAYOUT_CORPUS_GUID(Index) \
+  { 0x7d2e9b41, 0x5c63, 0x4a0f, { 0x91, 0xb8, 0x2e, 0x6d, 0x04, 0xc7, 0x3a, (Index) } }
+
+STATIC LAYOUT_CORPUS_ENTRY  mCorpus[] = {
+  { "US",     LAYOUT_CORPUS_GUID (1), NULL,         0,                          NULL,            0                              },
+  { "UK",     LAYOUT_CORPUS_GUID (2), mUkKeys,      ARRAY_SIZE (mUkKeys),      NULL,            0                              },
+  { "German", LAYOUT_CORPUS_GUID (3), mGermanKeys,  ARRAY_SIZE (mGermanKeys),  mGermanDeadKeys, ARRAY_SIZE (mGermanDeadKeys) },
+  { "French", LAYOUT_CORPUS_GUID (4), mFrenchKeys,  ARRAY_SIZE (mFrenchKeys),  mFrenchDeadKeys, ARRAY_SIZE (mFrenchDeadKeys) },
+  { "Nordic", LAYOUT_CORPUS_GUID (5), mNordicKeys,  ARRAY_SIZE (mNordicKeys),  mNordicDeadKeys, ARRAY_SIZE (mNordicDeadKeys) }
+};
+
+STATIC CONST EFI_GUID  mAllDeadKeysGuid = LAYOUT_CORPUS_GUID (6);
+STATIC CONST EFI_GUID  mLongChainGuid   = LAYOUT_CORPUS_GUID (7);
+STATIC CONST EFI_GUID  mBadKeyGuid      = LAYOUT_CORPUS_GUID (8);
+
+STATIC EFI_KEY_DESCRIPTOR  mUsDescriptors[LAYOUT_MAX_DESCRIPTORS];
+STATIC UINTN               mUsDescriptorCount;
+STATIC EFI_KEY_DESCRIPTOR  mDescriptors[LAYOUT_MAX_DESCRIPTORS];
+
+/**
+  Find the descriptor of a key.
+
+  @param  Descriptors       The descriptors.
+  @param  Count             The number of descriptors.
+  @param  Key               The key.
+
+  @return The index of the descriptor, or Count if the key has none.
+
+**/
+STATIC
+UINTN
+LayoutFindKey (
+  IN CONST EFI_KEY_DESCRIPTOR  *Descriptors,
+  IN UINTN                     Count,
+  IN EFI_KEY                   Key
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < Count; Index++) {
+    if (Descriptors[Index].Key == Key) {
+      break;
+    }
+  }
+
+  return Index;
+}
+
+/**
+  Build a national layout into mDescriptors: the US layout with the keys of
+  the entry changed or added, Right Alt as AltGr if a key uses it, and the
+  dead keys moved to the end with their dependent keys after them.
+
+  @param  Entry         The corpus entry.
+  @param  Count         Receives the number of descriptors.
+  @param  DependentKeys Receives the number of dependent keys.
+
+  @retval EFI_SUCCESS           The layout was built.
+  @retval EFI_BUFFER_TOO_SMALL  The layout has more than 255 descriptors.
+
+**/
+STATIC
+EFI_STATUS
+LayoutBuildNational (
+  IN  CONST LAYOUT_CORPUS_ENTRY  *Entry,
+  OUT UINTN                      *Count,
+  OUT UINTN                      *DependentKeys
+  )
+{
+  EFI_KEY_DESCRIPTOR  *Descriptor;
+  UINTN               Index;
+  UINTN               Vowel;
+  UINTN               Slot;
+
+  CopyMem (mDescriptors, mUsDescriptors, mUsDescriptorCount * sizeof (EFI_KEY_DESCRIPTOR));
+  *Count         = mUsDescriptorCount;
+  *DependentKeys = 0;
+
+  for (Index = 0; Index < Entry->KeyCount; Index++) {
+    Slot = LayoutFindKey (mDescriptors, *Count, Entry->Keys[Index].Key);
+    if (Slot == *Count) {
+      if (*Count == LAYOUT_MAX_DESCRIPTORS) {
+        return EFI_BUFFER_TOO_SMALL;
+      }
+
+      ZeroMem (&mDescriptors[Slot], sizeof (EFI_KEY_DESCRIPTOR));
+      mDescriptors[Slot].Key               = Entry->Keys[Index].Key;
+      mDescriptors[Slot].AffectedAttribute = EFI_AFFECTED_BY_STANDARD_SHIFT;
+      (*Count)++;
+    }
+
+    Descriptor                      = &mDescriptors[Slot];
+    Descriptor->Unicode             = Entry->Keys[Index].Unicode;
+    Descriptor->ShiftedUnicode      = Entry->Keys[Index].ShiftedUnicode;
+    Descriptor->AltGrUnicode        = Entry->Keys[Index].AltGrUnicode;
+    Descriptor->ShiftedAltGrUnicode = 0;
+    if (Entry->Keys[Index].AltGrUnicode != 0) {
+      Slot = LayoutFindKey (mDescriptors, *Count, EfiKeyA2);
+      if (Slot < *Count) {
+        mDescriptors[Slot].Modifier = EFI_ALT_GR_MODIFIER;
+      }
+    }
+  }
+
+  for (Index = 0; Index < Entry->DeadKeyCount; Index++) {
+    Slot = LayoutFindKey (mDescriptors, *Count, Entry->DeadKeys[Index].Key);
+    if (Slot < *Count) {
+      CopyMem (&mDescriptors[Slot], &mDescriptors[Slot + 1], (*Count - Slot - 1) * sizeof (EFI_KEY_DESCRIPTOR));
+      (*Count)--;
+    }
+
+    if (*Count == LAYOUT_MAX_DESCRIPTORS) {
+      return EFI_BUFFER_TOO_SMALL;
+    }
+
+    Descriptor = &mDescriptors[(*Count)++];
+    ZeroMem (Descriptor, sizeof (EFI_KEY_DESCRIPTOR));
+    Descriptor->Key            = Entry->DeadKeys[Index].Key;
+    Descriptor->Unicode        = Entry->DeadKeys[Index].Unicode;
+    Descriptor->ShiftedUnicode = Entry->DeadKeys[Index].ShiftedUnicode;
+    Descriptor->Modifier       = EFI_NS_KEY_MODIFIER;
+
+    for (Vowel = 0; Vowel < ARRAY_SIZE (mVowelKeys); Vowel++) {
+      if (Entry->DeadKeys[Index].Composed[Vowel] == 0) {
+        continue;
+      }
+
+      if (*Count == LAYOUT_MAX_DESCRIPTORS) {
+        return EFI_BUFFER_TOO_SMALL;
+      }
+
+      Descriptor = &mDescriptors[(*Count)++];
+      ZeroMem (Descriptor, sizeof (EFI_KEY_DESCRIPTOR));
+      Descriptor->Key               = mVowelKeys[Vowel];
+      Descriptor->Unicode           = Entry->DeadKeys[Index].Composed[Vowel];
+      Descriptor->ShiftedUnicode    = Entry->DeadKeys[Index].Composed[Vowel + ARRAY_SIZE (mVowelKeys)];
+      Descriptor->Modifier          = EFI_NS_KEY_DEPENDENCY_MODIFIER;
+      Descriptor->AffectedAttribute = EFI_AFFECTED_BY_STANDARD_SHIFT | EFI_AFFECTED_BY_CAPS_LOCK;
+      (*DependentKeys)++;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Build a synthetic layout into mDescriptors: DeadKeyCount dead keys on the
+  first US keys, each followed by ChainLength dependent keys, filling all 255
+  descriptors.
+
+  @param  DeadKeyCount  The number of dead keys.
+  @param  ChainLength   The number of dependent keys per dead key.
+
+**/
+STATIC
+VOID
+LayoutBuildSynthetic (
+  IN UINTN  DeadKeyCount,
+  IN UINTN  ChainLength
+  )
+{
+  EFI_KEY_DESCRIPTOR  *Descriptor;
+  UINTN               DeadKey;
+  UINTN               Link;
+
+  ASSERT (DeadKeyCount * (ChainLength + 1) == LAYOUT_MAX_DESCRIPTORS);
+  ASSERT (DeadKeyCount <= mUsDescriptorCount);
+
+  ZeroMem (mDescriptors, sizeof (mDescriptors));
+  Descriptor = mDescriptors;
+  for (DeadKey = 0; DeadKey < DeadKeyCount; DeadKey++) {
+    Descriptor->Key            = mUsDescriptors[DeadKey].Key;
+    Descriptor->Unicode        = (CHAR16)(0x0300 + DeadKey);
+    Descriptor->ShiftedUnicode = (CHAR16)(0x0300 + DeadKey);
+    Descriptor->Modifier       = EFI_NS_KEY_MODIFIER;
+    Descriptor++;
+
+    for (Link = 0; Link < ChainLength; Link++) {
+      Descriptor->Key               = mUsDescriptors[Link % mUsDescriptorCount].Key;
+      Descriptor->Unicode           = (CHAR16)(0x1E00 + Link);
+      Descriptor->ShiftedUnicode    = (CHAR16)(0x1E00 + Link);
+      Descriptor->Modifier          = EFI_NS_KEY_DEPENDENCY_MODIFIER;
+      Descriptor->AffectedAttribute = EFI_AFFECTED_BY_STANDARD_SHIFT;
+      Descriptor++;
+    }
+  }
+}
+
+/**
+  Apply a layout many times and report the time, the allocations and the pool
+  kept for it.
+
+  The first apply after ReleaseKeyboardLayoutResources() allocates the key
+  conversion table and the second one the spare table the next layout is
+  parsed into; the pool the layout keeps is measured there. Every later apply
+  reuses both tables and is timed.
+
+  @param  Name              The name of the layout.
+  @param  Guid              The GUID of the layout.
+  @param  DescriptorCount   The number of descriptors of the layout.
+  @param  DeadKeys          The number of dead keys of the layout.
+  @param  DependentKeys     The number of dependent keys of the layout.
+  @param  UsbKeyboardDevice The USB_KB_DEV instance.
+  @param  HiiDatabase       The HII database.
+
+  @retval UNIT_TEST_PASSED              The layout was applied as expected.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   The layout was not applied, or an apply
+                                        allocated more than expected.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+LayoutMeasure (
+  IN CONST CHAR8                *Name,
+  IN CONST EFI_GUID             *Guid,
+  IN UINTN                      DescriptorCount,
+  IN UINTN                      DeadKeys,
+  IN UINTN                      DependentKeys,
+  IN USB_KB_DEV                 *UsbKeyboardDevice,
+  IN EFI_HII_DATABASE_PROTOCOL  *HiiDatabase
+  )
+{
+  FAKE_ALLOCATION_STATS  Before;
+  FAKE_ALLOCATION_STATS  After;
+  LIST_ENTRY             *Link;
+  USB_NS_KEY             *UsbNsKey;
+  EFI_TPL                OldTpl;
+  UINTN                  Run;
+  UINTN                  NsKeys;
+  UINTN                  NsKeyChildren;
+  UINT64                 Begin;
+  UINT64                 Time;
+  UINT64                 TotalTime;
+  UINT64                 BestTime;
+  UINT64                 Allocations;
+  UINT64                 AllocatedBytes;
+  UINT64                 KeptBytes;
+  UINT64                 ExpectedAllocations;
+
+  UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->SetKeyboardLayout (HiiDatabase, (EFI_GUID *)Guid));
+  UT_ASSERT_TRUE (UsbKeyboardDevice->KeyboardLayoutDirty);
+
+  ReleaseKeyboardLayoutResources (UsbKeyboardDevice);
+  FakeGetAllocationStats (&Before);
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  RefreshKeyboardLayout (UsbKeyboardDevice);
+  UsbKeyboardDevice->KeyboardLayoutDirty = TRUE;
+  RefreshKeyboardLayout (UsbKeyboardDevice);
+  gBS->RestoreTPL (OldTpl);
+  FakeGetAllocationStats (&After);
+  KeptBytes = After.OutstandingBytes - Before.OutstandingBytes;
+
+  UT_ASSERT_NOT_NULL (UsbKeyboardDevice->KeyConvertionTable);
+  UT_ASSERT_NOT_NULL (UsbKeyboardDevice->SpareKeyConvertionTable);
+  NsKeys        = 0;
+  NsKeyChildren = 0;
+  for (Link = GetFirstNode (&UsbKeyboardDevice->NsKeyList); !IsNull (&UsbKeyboardDevice->NsKeyList, Link); Link = GetNextNode (&UsbKeyboardDevice->NsKeyList, Link)) {
+    UsbNsKey = USB_NS_KEY_FORM_FROM_LINK (Link);
+    NsKeys++;
+    NsKeyChildren += UsbNsKey->KeyCount;
+  }
+
+  if (FeaturePcdGet (PcdUsbXbox360NsKeySupport)) {
+    UT_ASSERT_EQUAL (NsKeys, DeadKeys);
+    UT_ASSERT_EQUAL (NsKeyChildren, DependentKeys);
+    ExpectedAllocations = 1 + DeadKeys;
+  } else {
+    UT_ASSERT_EQUAL (NsKeys, 0);
+    ExpectedAllocations = 1;
+  }
+
+  TotalTime      = 0;
+  BestTime       = MAX_UINT64;
+  Allocations    = 0;
+  AllocatedBytes = 0;
+  for (Run = 0; Run < LAYOUT_APPLY_RUNS; Run++) {
+    //
+    // Setting the current layout again signals nothing, so the change is
+    // marked as SetKeyboardLayoutEvent() does.
+    //
+    UsbKeyboardDevice->KeyboardLayoutDirty = TRUE;
+
+    FakeGetAllocationStats (&Before);
+    OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+    Begin  = GetPerformanceCounter ();
+    RefreshKeyboardLayout (UsbKeyboardDevice);
+    Time = GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+    gBS->RestoreTPL (OldTpl);
+    FakeGetAllocationStats (&After);
+
+    TotalTime      += Time;
+    BestTime        = MIN (BestTime, Time);
+    Allocations    += After.AllocateCount - Before.AllocateCount;
+    AllocatedBytes += After.AllocatedBytes - Before.AllocatedBytes;
+    UT_ASSERT_EQUAL (After.OutstandingBytes, Before.OutstandingBytes);
+  }
+
+  UT_LOG_INFO (
+    "%a: %lu descriptors, %lu dead keys, %lu dependent keys; apply mean %lu ns, best %lu ns; %lu allocations and %lu bytes per apply, %lu bytes kept\n",
+    Name,
+    (UINT64)DescriptorCount,
+    (UINT64)DeadKeys,
+    (UINT64)DependentKeys,
+    DivU64x32 (TotalTime, LAYOUT_APPLY_RUNS),
+    BestTime,
+    DivU64x32 (Allocations, LAYOUT_APPLY_RUNS),
+    DivU64x32 (AllocatedBytes, LAYOUT_APPLY_RUNS),
+    KeptBytes
+    );
+
+  UT_ASSERT_EQUAL (Allocations, MultU64x32 (ExpectedAllocations, LAYOUT_APPLY_RUNS));
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Apply every layout of the corpus and the synthetic worst cases.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              Every layout was applied as expected.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A layout was not applied as expected.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+ApplyLayoutCorpus (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  EFI_HII_DATABASE_PROTOCOL  *HiiDatabase;
+  EFI_HII_KEYBOARD_LAYOUT    *UsLayout;
+  EFI_HANDLE                 Controller;
+  USB_KB_DEV                 *UsbKeyboardDevice;
+  UNIT_TEST_STATUS           TestStatus;
+  UINT16                     Length;
+  UINTN                      Index;
+  UINTN                      Count;
+  UINTN                      DependentKeys;
+  STATIC UINT8               Buffer[sizeof (EFI_HII_KEYBOARD_LAYOUT) + LAYOUT_MAX_DESCRIPTORS * sizeof (EFI_KEY_DESCRIPTOR) + 256];
+
+  UT_ASSERT_NOT_EFI_ERROR (gBS->LocateProtocol (&gEfiHiiDatabaseProtocolGuid, NULL, (VOID **)&HiiDatabase));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &UsbKeyboardDevice));
+
+  //
+  // The corpus is derived from the US layout the driver installs.
+  //
+  Length   = sizeof (Buffer);
+  UsLayout = (EFI_HII_KEYBOARD_LAYOUT *)Buffer;
+  UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->GetKeyboardLayout (HiiDatabase, &gUsbKeyboardLayoutKeyGuid, &Length, UsLayout));
+  mUsDescriptorCount = UsLayout->DescriptorCount;
+  CopyMem (mUsDescriptors, UsLayout + 1, mUsDescriptorCount * sizeof (EFI_KEY_DESCRIPTOR));
+
+  for (Index = 0; Index < ARRAY_SIZE (mCorpus); Index++) {
+    UT_ASSERT_NOT_EFI_ERROR (LayoutBuildNational (&mCorpus[Index], &Count, &DependentKeys));
+    UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mCorpus[Index].Guid, mDescriptors, Count));
+    TestStatus = LayoutMeasure (mCorpus[Index].Name, &mCorpus[Index].Guid, Count, mCorpus[Index].DeadKeyCount, DependentKeys, UsbKeyboardDevice, HiiDatabase);
+    if (TestStatus != UNIT_TEST_PASSED) {
+      return TestStatus;
+    }
+  }
+
+  //
+  // 85 dead keys with two dependent keys each, the most dead keys a layout
+  // that gives each one a use can hold.
+  //
+  LayoutBuildSynthetic (85, 2);
+  UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mAllDeadKeysGuid, mDescriptors, LAYOUT_MAX_DESCRIPTORS));
+  TestStatus = LayoutMeasure ("All dead keys", &mAllDeadKeysGuid, LAYOUT_MAX_DESCRIPTORS, 85, 170, UsbKeyboardDevice, HiiDatabase);
+  if (TestStatus != UNIT_TEST_PASSED) {
+    return TestStatus;
+  }
+
+  //
+  // One dead key with the 254 other descriptors as its chain.
+  //
+  LayoutBuildSynthetic (1, LAYOUT_MAX_DESCRIPTORS - 1);
+  UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mLongChainGuid, mDescriptors, LAYOUT_MAX_DESCRIPTORS));
+  TestStatus = LayoutMeasure ("Long chain", &mLongChainGuid, LAYOUT_MAX_DESCRIPTORS, 1, LAYOUT_MAX_DESCRIPTORS - 1, UsbKeyboardDevice, HiiDatabase);
+  if (TestStatus != UNIT_TEST_PASSED) {
+    return TestStatus;
+  }
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Set a layout with an unknown key and check the current layout is kept.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              The current layout was kept.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   The rejected layout changed the table.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+RejectBadLayout (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  EFI_HII_DATABASE_PROTOCOL  *HiiDatabase;
+  EFI_HII_KEYBOARD_LAYOUT    *UsLayout;
+  EFI_HANDLE                 Controller;
+  USB_KB_DEV                 *UsbKeyboardDevice;
+  EFI_KEY_DESCRIPTOR         *KeyConvertionTable;
+  FAKE_ALLOCATION_STATS      Before;
+  FAKE_ALLOCATION_STATS      After;
+  EFI_TPL                    OldTpl;
+  UINT16                     Length;
+  STATIC UINT8               Buffer[sizeof (EFI_HII_KEYBOARD_LAYOUT) + LAYOUT_MAX_DESCRIPTORS * sizeof (EFI_KEY_DESCRIPTOR) + 256];
+  STATIC EFI_KEY_DESCRIPTOR  Saved[NUMBER_OF_VALID_USB_KEYCODE];
+
+  UT_ASSERT_NOT_EFI_ERROR (gBS->LocateProtocol (&gEfiHiiDatabaseProtocolGuid, NULL, (VOID **)&HiiDatabase));
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &UsbKeyboardDevice));
+  UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->SetKeyboardLayout (HiiDatabase, &gUsbKeyboardLayoutKeyGuid));
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  RefreshKeyboardLayout (UsbKeyboardDevice);
+  gBS->RestoreTPL (OldTpl);
+
+  KeyConvertionTable = UsbKeyboardDevice->KeyConvertionTable;
+  UT_ASSERT_NOT_NULL (KeyConvertionTable);
+  CopyMem (Saved, KeyConvertionTable, sizeof (Saved));
+
+  //
+  // The US layout with its last key replaced by the key after EfiKeyPause,
+  // which has no USB keycode.
+  //
+  Length   = sizeof (Buffer);
+  UsLayout = (EFI_HII_KEYBOARD_LAYOUT *)Buffer;
+  UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->GetKeyboardLayout (HiiDatabase, &gUsbKeyboardLayoutKeyGuid, &Length, UsLayout));
+  mUsDescriptorCount = UsLayout->DescriptorCount;
+  CopyMem (mDescriptors, UsLayout + 1, mUsDescriptorCount * sizeof (EFI_KEY_DESCRIPTOR));
+  mDescriptors[mUsDescriptorCount - 1].Key = (EFI_KEY)(EfiKeyPause + 1);
+  UT_ASSERT_NOT_EFI_ERROR (TestLayoutAdd (&mBadKeyGuid, mDescriptors, mUsDescriptorCount));
+  UT_ASSERT_NOT_EFI_ERROR (HiiDatabase->SetKeyboardLayout (HiiDatabase, &mBadKeyGuid));
+
+  FakeGetAllocationStats (&Before);
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  RefreshKeyboardLayout (UsbKeyboardDevice);
+  gBS->RestoreTPL (OldTpl);
+  FakeGetAllocationStats (&After);
+
+  UT_ASSERT_EQUAL ((UINTN)UsbKeyboardDevice->KeyConvertionTable, (UINTN)KeyConvertionTable);
+  UT_ASSERT_MEM_EQUAL (KeyConvertionTable, Saved, sizeof (Saved));
+  UT_ASSERT_EQUAL (After.OutstandingBytes, Before.OutstandingBytes);
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Initialize the unit test framework, suite, and unit tests for the keyboard
+  layout corpus and run them.
+
+  @retval  EFI_SUCCESS           All test cases were dispatched.
+  @retval  EFI_OUT_OF_RESOURCES  There are not enough resources available to
+                                 initialize the unit tests.
+**/
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      LayoutSuite;
+
+  Framework = NULL;
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+  Status = TestDriverLoad ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&LayoutSuite, Framework, "Keyboard Layout Corpus Tests", "UsbXbox360.LayoutCorpus", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in CreateUnitTestSuite for the layout suite\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (LayoutSuite, "Apply national and worst-case layouts", "ApplyLayoutCorpus", ApplyLayoutCorpus, NULL, NULL, NULL);
+  AddTestCase (LayoutSuite, "Keep the layout when a layout is rejected", "RejectBadLayout", RejectBadLayout, NULL, NULL, NULL);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+/**
+  Standard POSIX C entry point for host based unit test execution.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UefiTestMain ();
+}
@@ -0,0 +1,1315 @@
+/** @file
+  Fake boot services for the host-based tests.
+
+  The TPL, event and timer services follow DxeCore: RaiseTPL() and RestoreTPL()
+  assert on a TPL moving the wrong way, a signaled event is queued and its
+  notification function runs as soon as the TPL drops below the TPL of the
+  event, highest TPL first. Timers only fire from FakeAdvanceTimers(), so the
+  tests control when periodic handlers run.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "FakeUefiServicesLibInternal.h"
+
+#define FAKE_EVENT_SIGNATURE   SIGNATURE_32 ('f', 'e', 'v', 't')
+#define FAKE_HANDLE_SIGNATURE  SIGNATURE_32 ('f', 'h', 'n', 'd')
+#define FAKE_POOL_SIGNATURE    SIGNATURE_32 ('f', 'p', 'o', 'l')
+
+typedef struct {
+  UINT32              Signature;
+  LIST_ENTRY          Link;
+  LIST_ENTRY          PendingLink;
+  BOOLEAN             Pending;
+  BOOLEAN             Signaled;
+  UINT32              Type;
+  EFI_TPL             NotifyTpl;
+  EFI_EVENT_NOTIFY    NotifyFunction;
+  VOID                *NotifyContext;
+  BOOLEAN             InGroup;
+  EFI_GUID            EventGroup;
+  BOOLEAN             TimerArmed;
+  BOOLEAN             Periodic;
+  UINT64              TriggerTime;
+  UINT64              Period;
+} FAKE_EVENT;
+
+typedef struct {
+  LIST_ENTRY    Link;
+  EFI_GUID      Guid;
+  VOID          *Interface;
+  UINTN         OpenCount;
+} FAKE_PROTOCOL_INTERFACE;
+
+typedef struct {
+  UINT32        Signature;
+  LIST_ENTRY    Link;
+  LIST_ENTRY    Protocols;
+} FAKE_HANDLE;
+
+typedef struct {
+  UINT32    Signature;
+  UINT32    Reserved;
+  UINT64    Size;
+} FAKE_POOL_HEADER;
+
+STATIC EFI_TPL                  mCurrentTpl = TPL_APPLICATION;
+STATIC LIST_ENTRY               mEvents     = INITIALIZE_LIST_HEAD_VARIABLE (mEvents);
+STATIC LIST_ENTRY               mPending    = INITIALIZE_LIST_HEAD_VARIABLE (mPending);
+STATIC LIST_ENTRY               mHandles    = INITIALIZE_LIST_HEAD_VARIABLE (mHandles);
+STATIC UINT64                   mTimerNow;
+STATIC FAKE_ALLOCATION_STATS    mAllocationStats;
+STATIC FAKE_BOOT_SERVICES_STATS mBootServicesStats;
+STATIC FAKE_PREEMPTION_HANDLER  mPreemptionHandler;
+STATIC VOID                     *mPreemptionContext;
+STATIC BOOLEAN                  mInPreemption;
+STATIC EFI_BOOT_SERVICES        mBootServices;
+STATIC EFI_SYSTEM_TABLE         mSystemTable;
+
+EFI_HANDLE         gImageHandle = NULL;
+EFI_SYSTEM_TABLE   *gST         = &mSystemTable;
+EFI_BOOT_SERVICES  *gBS         = &mBootServices;
+
+/**
+  Find the event behind an EFI_EVENT.
+
+  @param  Event         The event.
+
+  @return The event, or NULL if Event is not an open event.
+
+**/
+STATIC
+FAKE_EVENT *
+FakeFindEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  LIST_ENTRY  *Link;
+
+  for (Link = GetFirstNode (&mEvents); !IsNull (&mEvents, Link); Link = GetNextNode (&mEvents, Link)) {
+    if ((EFI_EVENT)BASE_CR (Link, FAKE_EVENT, Link) == Event) {
+      return BASE_CR (Link, FAKE_EVENT, Link);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Run the notification functions of the queued events above a TPL.
+
+  The events run highest TPL first, and in signal order within a TPL. Each
+  runs at its own TPL.
+
+  @param  Tpl           The TPL the events must be above.
+
+**/
+STATIC
+VOID
+FakeDispatchEvents (
+  IN EFI_TPL  Tpl
+  )
+{
+  LIST_ENTRY  *Link;
+  FAKE_EVENT  *Event;
+  FAKE_EVENT  *Next;
+  EFI_TPL     SavedTpl;
+
+  for ( ; ;) {
+    Next = NULL;
+    for (Link = GetFirstNode (&mPending); !IsNull (&mPending, Link); Link = GetNextNode (&mPending, Link)) {
+      Event = BASE_CR (Link, FAKE_EVENT, PendingLink);
+      if ((Event->NotifyTpl > Tpl) && ((Next == NULL) || (Event->NotifyTpl > Next->NotifyTpl))) {
+        Next = Event;
+      }
+    }
+
+    if (Next == NULL) {
+      return;
+    }
+
+    RemoveEntryList (&Next->PendingLink);
+    Next->Pending = FALSE;
+
+    SavedTpl    = mCurrentTpl;
+    mCurrentTpl = Next->NotifyTpl;
+    Next->NotifyFunction ((EFI_EVENT)Next, Next->NotifyContext);
+    mCurrentTpl = SavedTpl;
+  }
+}
+
+/**
+  Queue the notification function of a signaled event.
+
+  @param  Event         The event.
+
+**/
+STATIC
+VOID
+FakeQueueEvent (
+  IN FAKE_EVENT  *Event
+  )
+{
+  if ((Event->Type & EVT_NOTIFY_SIGNAL) == 0) {
+    Event->Signaled = TRUE;
+    return;
+  }
+
+  if (!Event->Pending && (Event->NotifyFunction != NULL)) {
+    Event->Pending = TRUE;
+    InsertTailList (&mPending, &Event->PendingLink);
+  }
+}
+
+/**
+  Raise the TPL.
+
+  @param  NewTpl        The new TPL.
+
+  @return The previous TPL.
+
+**/
+STATIC
+EFI_TPL
+EFIAPI
+FakeRaiseTpl (
+  IN EFI_TPL  NewTpl
+  )
+{
+  EFI_TPL  OldTpl;
+
+  OldTpl = mCurrentTpl;
+  if (OldTpl > NewTpl) {
+    DEBUG ((DEBUG_ERROR, "FakeRaiseTpl: OldTpl(0x%x) > NewTpl(0x%x)\n", OldTpl, NewTpl));
+    mBootServicesStats.TplErrors++;
+    ASSERT (OldTpl <= NewTpl);
+  }
+
+  mCurrentTpl = NewTpl;
+  return OldTpl;
+}
+
+/**
+  Restore the TPL and run the events queued above it.
+
+  @param  NewTpl        The TPL to restore.
+
+**/
+STATIC
+VOID
+EFIAPI
+FakeRestoreTpl (
+  IN EFI_TPL  NewTpl
+  )
+{
+  if (NewTpl > mCurrentTpl) {
+    DEBUG ((DEBUG_ERROR, "FakeRestoreTpl: NewTpl(0x%x) > OldTpl(0x%x)\n", NewTpl, mCurrentTpl));
+    mBootServicesStats.TplErrors++;
+    ASSERT (NewTpl <= mCurrentTpl);
+  }
+
+  FakeDispatchEvents (NewTpl);
+  mCurrentTpl = NewTpl;
+}
+
+/**
+  Create an event, optionally in an event group.
+
+  @param  Type            The type of the event.
+  @param  NotifyTpl       The TPL of the notification function.
+  @param  NotifyFunction  The notification function.
+  @param  NotifyContext   The context of the notification function.
+  @param  EventGroup      The event group, or NULL.
+  @param  Event           Receives the event.
+
+  @retval EFI_SUCCESS             The event was created.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_OUT_OF_RESOURCES    The event could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeCreateEventEx (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  CONST VOID        *NotifyContext  OPTIONAL,
+  IN  CONST EFI_GUID    *EventGroup     OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  FAKE_EVENT  *NewEvent;
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (((Type & (EVT_NOTIFY_SIGNAL | EVT_NOTIFY_WAIT)) != 0) &&
+      ((NotifyFunction == NULL) || (NotifyTpl <= TPL_APPLICATION) || (NotifyTpl >= TPL_HIGH_LEVEL)))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  NewEvent = calloc (1, sizeof (FAKE_EVENT));
+  if (NewEvent == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewEvent->Signature      = FAKE_EVENT_SIGNATURE;
+  NewEvent->Type           = Type;
+  NewEvent->NotifyTpl      = NotifyTpl;
+  NewEvent->NotifyFunction = NotifyFunction;
+  NewEvent->NotifyContext  = (VOID *)NotifyContext;
+  if (Type == EVT_SIGNAL_EXIT_BOOT_SERVICES) {
+    EventGroup = &gEfiEventExitBootServicesGuid;
+  }
+
+  if (EventGroup != NULL) {
+    NewEvent->InGroup = TRUE;
+    CopyGuid (&NewEvent->EventGroup, EventGroup);
+  }
+
+  InsertTailList (&mEvents, &NewEvent->Link);
+  mBootServicesStats.OpenEvents++;
+
+  *Event = (EFI_EVENT)NewEvent;
+  return EFI_SUCCESS;
+}
+
+/**
+  Create an event.
+
+  @param  Type            The type of the event.
+  @param  NotifyTpl       The TPL of the notification function.
+  @param  NotifyFunction  The notification function.
+  @param  NotifyContext   The context of the notification function.
+  @param  Event           Receives the event.
+
+  @retval EFI_SUCCESS             The event was created.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_OUT_OF_RESOURCES    The event could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeCreateEvent (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction  OPTIONAL,
+  IN  VOID              *NotifyContext  OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  return FakeCreateEventEx (Type, NotifyTpl, NotifyFunction, NotifyContext, NULL, Event);
+}
+
+/**
+  Close an event.
+
+  @param  Event         The event.
+
+  @retval EFI_SUCCESS             The event was closed.
+  @retval EFI_INVALID_PARAMETER   Event is not an open event.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeCloseEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  FAKE_EVENT  *OldEvent;
+
+  OldEvent = FakeFindEvent (Event);
+  if (OldEvent == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (OldEvent->Pending) {
+    RemoveEntryList (&OldEvent->PendingLink);
+  }
+
+  RemoveEntryList (&OldEvent->Link);
+  mBootServicesStats.OpenEvents--;
+  OldEvent->Signature = 0;
+  free (OldEvent);
+  return EFI_SUCCESS;
+}
+
+/**
+  Signal an event, or every event of its group.
+
+  @param  Event         The event.
+
+  @retval EFI_SUCCESS             The event was signaled.
+  @retval EFI_INVALID_PARAMETER   Event is not an open event.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeSignalEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  FAKE_EVENT  *Signaled;
+  EFI_TPL     OldTpl;
+
+  Signaled = FakeFindEvent (Event);
+  if (Signaled == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Signaled->InGroup) {
+    FakeSignalEventGroup (&Signaled->EventGroup);
+    return EFI_SUCCESS;
+  }
+
+  //
+  // The queue is protected at TPL_HIGH_LEVEL, and dropping back dispatches
+  // whatever is now above the caller's TPL.
+  //
+  OldTpl = FakeRaiseTpl (TPL_HIGH_LEVEL);
+  FakeQueueEvent (Signaled);
+  FakeRestoreTpl (OldTpl);
+  return EFI_SUCCESS;
+}
+
+/**
+  Check whether an event is signaled.
+
+  The notification function of an EVT_NOTIFY_WAIT event runs first, as it does
+  in DxeCore.
+
+  @param  Event         The event.
+
+  @retval EFI_SUCCESS             The event is signaled.
+  @retval EFI_NOT_READY           The event is not signaled.
+  @retval EFI_INVALID_PARAMETER   Event is not an open event or is an EVT_NOTIFY_SIGNAL event.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeCheckEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  FAKE_EVENT  *Checked;
+  EFI_TPL     OldTpl;
+
+  Checked = FakeFindEvent (Event);
+  if ((Checked == NULL) || ((Checked->Type & EVT_NOTIFY_SIGNAL) != 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (!Checked->Signaled && ((Checked->Type & EVT_NOTIFY_WAIT) != 0)) {
+    OldTpl = FakeRaiseTpl (Checked->NotifyTpl);
+    Checked->NotifyFunction (Event, Checked->NotifyContext);
+    FakeRestoreTpl (OldTpl);
+  }
+
+  if (Checked->Signaled) {
+    Checked->Signaled = FALSE;
+    return EFI_SUCCESS;
+  }
+
+  return EFI_NOT_READY;
+}
+
+/**
+  Arm or cancel the timer of an event.
+
+  @param  Event         The event.
+  @param  Type          The type of the timer.
+  @param  TriggerTime   The time of the timer, in 100 ns units.
+
+  @retval EFI_SUCCESS             The timer was set.
+  @retval EFI_INVALID_PARAMETER   Event is not an open timer event.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeSetTimer (
+  IN EFI_EVENT        Event,
+  IN EFI_TIMER_DELAY  Type,
+  IN UINT64           TriggerTime
+  )
+{
+  FAKE_EVENT  *Timer;
+
+  Timer = FakeFindEvent (Event);
+  if ((Timer == NULL) || ((Timer->Type & EVT_TIMER) == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  switch (Type) {
+    case TimerCancel:
+      Timer->TimerArmed = FALSE;
+      break;
+
+    case TimerRelative:
+      Timer->TimerArmed  = TRUE;
+      Timer->Periodic    = FALSE;
+      Timer->Period      = 0;
+      Timer->TriggerTime = mTimerNow + TriggerTime;
+      break;
+
+    case TimerPeriodic:
+      //
+      // A zero period fires on every timer tick; the fake has no ticks, so it
+      // fires once per FakeAdvanceTimers().
+      //
+      Timer->TimerArmed  = TRUE;
+      Timer->Periodic    = TRUE;
+      Timer->Period      = TriggerTime;
+      Timer->TriggerTime = mTimerNow + TriggerTime;
+      break;
+
+    default:
+      return EFI_INVALID_PARAMETER;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Find a handle.
+
+  @param  Handle        The handle.
+
+  @return The handle, or NULL if Handle is not a handle.
+
+**/
+STATIC
+FAKE_HANDLE *
+FakeFindHandle (
+  IN EFI_HANDLE  Handle
+  )
+{
+  LIST_ENTRY  *Link;
+
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    if ((EFI_HANDLE)BASE_CR (Link, FAKE_HANDLE, Link) == Handle) {
+      return BASE_CR (Link, FAKE_HANDLE, Link);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Find a protocol interface on a handle.
+
+  @param  Handle        The handle.
+  @param  Protocol      The protocol.
+
+  @return The protocol interface, or NULL if the handle does not have it.
+
+**/
+STATIC
+FAKE_PROTOCOL_INTERFACE *
+FakeFindProtocol (
+  IN FAKE_HANDLE     *Handle,
+  IN CONST EFI_GUID  *Protocol
+  )
+{
+  LIST_ENTRY               *Link;
+  FAKE_PROTOCOL_INTERFACE  *Interface;
+
+  for (Link = GetFirstNode (&Handle->Protocols); !IsNull (&Handle->Protocols, Link); Link = GetNextNode (&Handle->Protocols, Link)) {
+    Interface = BASE_CR (Link, FAKE_PROTOCOL_INTERFACE, Link);
+    if (CompareGuid (&Interface->Guid, Protocol)) {
+      return Interface;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Remove a protocol interface, and the handle once it has none left.
+
+  @param  Handle        The handle.
+  @param  Interface     The protocol interface.
+
+**/
+STATIC
+VOID
+FakeRemoveProtocol (
+  IN FAKE_HANDLE              *Handle,
+  IN FAKE_PROTOCOL_INTERFACE  *Interface
+  )
+{
+  mBootServicesStats.OpenProtocols -= Interface->OpenCount;
+  mBootServicesStats.InstalledProtocols--;
+  RemoveEntryList (&Interface->Link);
+  free (Interface);
+
+  if (IsListEmpty (&Handle->Protocols)) {
+    RemoveEntryList (&Handle->Link);
+    Handle->Signature = 0;
+    free (Handle);
+  }
+}
+
+/**
+  Install protocol interfaces on a handle, creating it if needed.
+
+  @param  Handle        The handle, or a pointer to NULL for a new handle.
+  @param  ...           Pairs of protocol GUID and interface, terminated by NULL.
+
+  @retval EFI_SUCCESS             The interfaces were installed.
+  @retval EFI_INVALID_PARAMETER   Handle is invalid or a protocol is already installed.
+  @retval EFI_OUT_OF_RESOURCES    The handle or an interface could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeInstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE  *Handle,
+  ...
+  )
+{
+  VA_LIST                  Args;
+  EFI_GUID                 *Protocol;
+  VOID                     *Interface;
+  FAKE_HANDLE              *Target;
+  FAKE_PROTOCOL_INTERFACE  *NewInterface;
+  EFI_STATUS               Status;
+
+  if (Handle == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Target = NULL;
+  if (*Handle != NULL) {
+    Target = FakeFindHandle (*Handle);
+    if (Target == NULL) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    //
+    // Nothing is installed if one of the protocols is already there.
+    //
+    VA_START (Args, Handle);
+    for (Protocol = VA_ARG (Args, EFI_GUID *); Protocol != NULL; Protocol = VA_ARG (Args, EFI_GUID *)) {
+      VA_ARG (Args, VOID *);
+      if (FakeFindProtocol (Target, Protocol) != NULL) {
+        VA_END (Args);
+        return EFI_INVALID_PARAMETER;
+      }
+    }
+
+    VA_END (Args);
+  }
+
+  if (Target == NULL) {
+    Target = calloc (1, sizeof (FAKE_HANDLE));
+    if (Target == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Target->Signature = FAKE_HANDLE_SIGNATURE;
+    InitializeListHead (&Target->Protocols);
+    InsertTailList (&mHandles, &Target->Link);
+  }
+
+  Status = EFI_SUCCESS;
+  VA_START (Args, Handle);
+  for (Protocol = VA_ARG (Args, EFI_GUID *); Protocol != NULL; Protocol = VA_ARG (Args, EFI_GUID *)) {
+    Interface    = VA_ARG (Args, VOID *);
+    NewInterface = calloc (1, sizeof (FAKE_PROTOCOL_INTERFACE));
+    if (NewInterface == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      break;
+    }
+
+    CopyGuid (&NewInterface->Guid, Protocol);
+    NewInterface->Interface = Interface;
+    InsertTailList (&Target->Protocols, &NewInterface->Link);
+    mBootServicesStats.InstalledProtocols++;
+  }
+
+  VA_END (Args);
+
+  *Handle = (EFI_HANDLE)Target;
+  return Status;
+}
+
+/**
+  Uninstall protocol interfaces from a handle.
+
+  @param  Handle        The handle.
+  @param  ...           Pairs of protocol GUID and interface, terminated by NULL.
+
+  @retval EFI_SUCCESS             The interfaces were uninstalled.
+  @retval EFI_INVALID_PARAMETER   A protocol interface is not installed on Handle.
+  @retval EFI_ACCESS_DENIED       A protocol interface is opened by a driver.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUninstallMultipleProtocolInterfaces (
+  IN EFI_HANDLE  Handle,
+  ...
+  )
+{
+  VA_LIST                  Args;
+  EFI_GUID                 *Protocol;
+  VOID                     *Interface;
+  FAKE_HANDLE              *Target;
+  FAKE_PROTOCOL_INTERFACE  *Installed;
+
+  Target = FakeFindHandle (Handle);
+  if (Target == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // Nothing is uninstalled unless every interface can be.
+  //
+  VA_START (Args, Handle);
+  for (Protocol = VA_ARG (Args, EFI_GUID *); Protocol != NULL; Protocol = VA_ARG (Args, EFI_GUID *)) {
+    Interface = VA_ARG (Args, VOID *);
+    Installed = FakeFindProtocol (Target, Protocol);
+    if ((Installed == NULL) || (Installed->Interface != Interface)) {
+      VA_END (Args);
+      return EFI_INVALID_PARAMETER;
+    }
+
+    if (Installed->OpenCount != 0) {
+      VA_END (Args);
+      return EFI_ACCESS_DENIED;
+    }
+  }
+
+  VA_END (Args);
+
+  VA_START (Args, Handle);
+  for (Protocol = VA_ARG (Args, EFI_GUID *); Protocol != NULL; Protocol = VA_ARG (Args, EFI_GUID *)) {
+    VA_ARG (Args, VOID *);
+    FakeRemoveProtocol (Target, FakeFindProtocol (Target, Protocol));
+  }
+
+  VA_END (Args);
+  return EFI_SUCCESS;
+}
+
+/**
+  Open a protocol interface on a handle.
+
+  Only one agent may open a protocol BY_DRIVER at a time.
+
+  @param  Handle            The handle.
+  @param  Protocol          The protocol.
+  @param  Interface         Receives the interface.
+  @param  AgentHandle       The agent opening the protocol.
+  @param  ControllerHandle  The controller the agent manages.
+  @param  Attributes        The open mode.
+
+  @retval EFI_SUCCESS             The protocol was opened.
+  @retval EFI_INVALID_PARAMETER   Handle is not a handle.
+  @retval EFI_UNSUPPORTED         Handle does not have the protocol.
+  @retval EFI_ALREADY_STARTED     The protocol is already opened BY_DRIVER.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeOpenProtocol (
+  IN  EFI_HANDLE  Handle,
+  IN  EFI_GUID    *Protocol,
+  OUT VOID        **Interface  OPTIONAL,
+  IN  EFI_HANDLE  AgentHandle,
+  IN  EFI_HANDLE  ControllerHandle,
+  IN  UINT32      Attributes
+  )
+{
+  FAKE_HANDLE              *Target;
+  FAKE_PROTOCOL_INTERFACE  *Installed;
+
+  Target = FakeFindHandle (Handle);
+  if ((Target == NULL) || (Protocol == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if ((Attributes != EFI_OPEN_PROTOCOL_TEST_PROTOCOL) && (Interface == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Installed = FakeFindProtocol (Target, Protocol);
+  if (Installed == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) != 0) {
+    if (Installed->OpenCount != 0) {
+      *Interface = Installed->Interface;
+      return EFI_ALREADY_STARTED;
+    }
+
+    Installed->OpenCount++;
+    mBootServicesStats.OpenProtocols++;
+  }
+
+  if (Attributes != EFI_OPEN_PROTOCOL_TEST_PROTOCOL) {
+    *Interface = Installed->Interface;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Close a protocol opened BY_DRIVER.
+
+  @param  Handle            The handle.
+  @param  Protocol          The protocol.
+  @param  AgentHandle       The agent that opened the protocol.
+  @param  ControllerHandle  The controller the agent manages.
+
+  @retval EFI_SUCCESS             The protocol was closed.
+  @retval EFI_INVALID_PARAMETER   Handle is not a handle.
+  @retval EFI_NOT_FOUND           The protocol is not opened BY_DRIVER.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeCloseProtocol (
+  IN EFI_HANDLE  Handle,
+  IN EFI_GUID    *Protocol,
+  IN EFI_HANDLE  AgentHandle,
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  FAKE_HANDLE              *Target;
+  FAKE_PROTOCOL_INTERFACE  *Installed;
+
+  Target = FakeFindHandle (Handle);
+  if ((Target == NULL) || (Protocol == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Installed = FakeFindProtocol (Target, Protocol);
+  if ((Installed == NULL) || (Installed->OpenCount == 0)) {
+    return EFI_NOT_FOUND;
+  }
+
+  Installed->OpenCount--;
+  mBootServicesStats.OpenProtocols--;
+  return EFI_SUCCESS;
+}
+
+/**
+  Get a protocol interface of a handle.
+
+  @param  Handle        The handle.
+  @param  Protocol      The protocol.
+  @param  Interface     Receives the interface.
+
+  @retval EFI_SUCCESS             The interface was returned.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_UNSUPPORTED         Handle does not have the protocol.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeHandleProtocol (
+  IN  EFI_HANDLE  Handle,
+  IN  EFI_GUID    *Protocol,
+  OUT VOID        **Interface
+  )
+{
+  return FakeOpenProtocol (Handle, Protocol, Interface, gImageHandle, NULL, EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+}
+
+/**
+  Find the first interface of a protocol.
+
+  @param  Protocol      The protocol.
+  @param  Registration  Not supported, must be NULL.
+  @param  Interface     Receives the interface.
+
+  @retval EFI_SUCCESS             The interface was returned.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_NOT_FOUND           No handle has the protocol.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeLocateProtocol (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Registration  OPTIONAL,
+  OUT VOID      **Interface
+  )
+{
+  LIST_ENTRY               *Link;
+  FAKE_PROTOCOL_INTERFACE  *Installed;
+
+  if ((Protocol == NULL) || (Interface == NULL) || (Registration != NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    Installed = FakeFindProtocol (BASE_CR (Link, FAKE_HANDLE, Link), Protocol);
+    if (Installed != NULL) {
+      *Interface = Installed->Interface;
+      return EFI_SUCCESS;
+    }
+  }
+
+  *Interface = NULL;
+  return EFI_NOT_FOUND;
+}
+
+/**
+  Return the handles that have a protocol, or all handles.
+
+  @param  SearchType    AllHandles or ByProtocol.
+  @param  Protocol      The protocol for ByProtocol.
+  @param  SearchKey     Not supported.
+  @param  NoHandles     Receives the number of handles.
+  @param  Buffer        Receives the handles, in a buffer from AllocatePool().
+
+  @retval EFI_SUCCESS             The handles were returned.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_NOT_FOUND           No handle matches.
+  @retval EFI_OUT_OF_RESOURCES    The buffer could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeLocateHandleBuffer (
+  IN     EFI_LOCATE_SEARCH_TYPE  SearchType,
+  IN     EFI_GUID                *Protocol   OPTIONAL,
+  IN     VOID                    *SearchKey  OPTIONAL,
+  OUT    UINTN                   *NoHandles,
+  OUT    EFI_HANDLE              **Buffer
+  )
+{
+  LIST_ENTRY   *Link;
+  FAKE_HANDLE  *Handle;
+  UINTN        Count;
+
+  if ((NoHandles == NULL) || (Buffer == NULL) ||
+      ((SearchType != AllHandles) && (SearchType != ByProtocol)) ||
+      ((SearchType == ByProtocol) && (Protocol == NULL)))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *NoHandles = 0;
+  *Buffer    = NULL;
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    Handle = BASE_CR (Link, FAKE_HANDLE, Link);
+    if ((SearchType == AllHandles) || (FakeFindProtocol (Handle, Protocol) != NULL)) {
+      (*NoHandles)++;
+    }
+  }
+
+  if (*NoHandles == 0) {
+    return EFI_NOT_FOUND;
+  }
+
+  *Buffer = AllocatePool (*NoHandles * sizeof (EFI_HANDLE));
+  if (*Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Count = 0;
+  for (Link = GetFirstNode (&mHandles); !IsNull (&mHandles, Link); Link = GetNextNode (&mHandles, Link)) {
+    Handle = BASE_CR (Link, FAKE_HANDLE, Link);
+    if ((SearchType == AllHandles) || (FakeFindProtocol (Handle, Protocol) != NULL)) {
+      (*Buffer)[Count++] = (EFI_HANDLE)Handle;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Allocate a pool buffer and count it.
+
+  @param  PoolType      The memory type, ignored.
+  @param  Size          The size of the buffer.
+  @param  Buffer        Receives the buffer.
+
+  @retval EFI_SUCCESS             The buffer was allocated.
+  @retval EFI_INVALID_PARAMETER   Buffer is NULL.
+  @retval EFI_OUT_OF_RESOURCES    The buffer could not be allocated.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeAllocatePool (
+  IN  EFI_MEMORY_TYPE  PoolType,
+  IN  UINTN            Size,
+  OUT VOID             **Buffer
+  )
+{
+  FAKE_POOL_HEADER  *Header;
+
+  if (Buffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Header = malloc (sizeof (FAKE_POOL_HEADER) + Size);
+  if (Header == NULL) {
+    *Buffer = NULL;
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Header->Signature = FAKE_POOL_SIGNATURE;
+  Header->Size      = Size;
+
+  mAllocationStats.AllocateCount++;
+  mAllocationStats.AllocatedBytes += Size;
+  mAllocationStats.OutstandingCount++;
+  mAllocationStats.OutstandingBytes += Size;
+  if (mCurrentTpl >= TPL_NOTIFY) {
+    mAllocationStats.NotifyAllocateCount++;
+  }
+
+  *Buffer = Header + 1;
+  return EFI_SUCCESS;
+}
+
+/**
+  Free a pool buffer and count it.
+
+  @param  Buffer        The buffer.
+
+  @retval EFI_SUCCESS             The buffer was freed.
+  @retval EFI_INVALID_PARAMETER   Buffer was not allocated by FakeAllocatePool().
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeFreePool (
+  IN VOID  *Buffer
+  )
+{
+  FAKE_POOL_HEADER  *Header;
+
+  if (Buffer == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Header = (FAKE_POOL_HEADER *)Buffer - 1;
+  if (Header->Signature != FAKE_POOL_SIGNATURE) {
+    DEBUG ((DEBUG_ERROR, "FakeFreePool: %p is not a pool buffer\n", Buffer));
+    ASSERT (Header->Signature == FAKE_POOL_SIGNATURE);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  mAllocationStats.FreeCount++;
+  mAllocationStats.OutstandingCount--;
+  mAllocationStats.OutstandingBytes -= Header->Size;
+  if (mCurrentTpl >= TPL_NOTIFY) {
+    mAllocationStats.NotifyFreeCount++;
+  }
+
+  Header->Signature = 0;
+  free (Header);
+  return EFI_SUCCESS;
+}
+
+/**
+  Stall, which the fake does not need to.
+
+  @param  Microseconds  The time to stall.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeStall (
+  IN UINTN  Microseconds
+  )
+{
+  return EFI_SUCCESS;
+}
+
+/**
+  Fill the boot services and system tables.
+
+**/
+STATIC
+VOID
+FakeInitTables (
+  VOID
+  )
+{
+  mBootServices.RaiseTPL                            = FakeRaiseTpl;
+  mBootServices.RestoreTPL                          = FakeRestoreTpl;
+  mBootServices.AllocatePool                        = FakeAllocatePool;
+  mBootServices.FreePool                            = FakeFreePool;
+  mBootServices.CreateEvent                         = FakeCreateEvent;
+  mBootServices.CreateEventEx                       = FakeCreateEventEx;
+  mBootServices.SetTimer                            = FakeSetTimer;
+  mBootServices.SignalEvent                         = FakeSignalEvent;
+  mBootServices.CloseEvent                          = FakeCloseEvent;
+  mBootServices.CheckEvent                          = FakeCheckEvent;
+  mBootServices.HandleProtocol                      = FakeHandleProtocol;
+  mBootServices.OpenProtocol                        = FakeOpenProtocol;
+  mBootServices.CloseProtocol                       = FakeCloseProtocol;
+  mBootServices.LocateProtocol                      = FakeLocateProtocol;
+  mBootServices.LocateHandleBuffer                  = FakeLocateHandleBuffer;
+  mBootServices.InstallMultipleProtocolInterfaces   = FakeInstallMultipleProtocolInterfaces;
+  mBootServices.UninstallMultipleProtocolInterfaces = FakeUninstallMultipleProtocolInterfaces;
+  mBootServices.Stall                               = FakeStall;
+
+  mSystemTable.BootServices    = &mBootServices;
+  mSystemTable.RuntimeServices = gRT;
+}
+
+/**
+  Reset the fake services.
+
+  Every event, handle and variable is dropped and the counters are cleared.
+  Pool buffers still allocated are not freed. The TPL goes back to
+  TPL_APPLICATION.
+
+**/
+VOID
+EFIAPI
+FakeUefiServicesReset (
+  VOID
+  )
+{
+  LIST_ENTRY               *Link;
+  FAKE_EVENT               *Event;
+  FAKE_HANDLE              *Handle;
+  FAKE_PROTOCOL_INTERFACE  *Interface;
+
+  while (!IsListEmpty (&mEvents)) {
+    Link  = GetFirstNode (&mEvents);
+    Event = BASE_CR (Link, FAKE_EVENT, Link);
+    RemoveEntryList (Link);
+    free (Event);
+  }
+
+  while (!IsListEmpty (&mHandles)) {
+    Link   = GetFirstNode (&mHandles);
+    Handle = BASE_CR (Link, FAKE_HANDLE, Link);
+    while (!IsListEmpty (&Handle->Protocols)) {
+      Interface = BASE_CR (GetFirstNode (&Handle->Protocols), FAKE_PROTOCOL_INTERFACE, Link);
+      RemoveEntryList (&Interface->Link);
+      free (Interface);
+    }
+
+    RemoveEntryList (Link);
+    free (Handle);
+  }
+
+  InitializeListHead (&mPending);
+  FakeResetVariables ();
+  FakeResetUsbDevices ();
+  FakeResetHiiDatabase ();
+
+  mCurrentTpl        = TPL_APPLICATION;
+  mTimerNow          = 0;
+  mPreemptionHandler = NULL;
+  mPreemptionContext = NULL;
+  mInPreemption      = FALSE;
+  ZeroMem (&mAllocationStats, sizeof (mAllocationStats));
+  ZeroMem (&mBootServicesStats, sizeof (mBootServicesStats));
+
+  FakeInitTables ();
+}
+
+/**
+  Read the pool allocator counters.
+
+  @param  Stats         Receives the counters.
+
+**/
+VOID
+EFIAPI
+FakeGetAllocationStats (
+  OUT FAKE_ALLOCATION_STATS  *Stats
+  )
+{
+  CopyMem (Stats, &mAllocationStats, sizeof (*Stats));
+}
+
+/**
+  Read the boot services counters.
+
+  @param  Stats         Receives the counters.
+
+**/
+VOID
+EFIAPI
+FakeGetBootServicesStats (
+  OUT FAKE_BOOT_SERVICES_STATS  *Stats
+  )
+{
+  CopyMem (Stats, &mBootServicesStats, sizeof (*Stats));
+}
+
+/**
+  Advance the timer clock and signal the timer events that became due.
+
+  @param  Time          The time to advance, in 100 ns units.
+
+**/
+VOID
+EFIAPI
+FakeAdvanceTimers (
+  IN UINT64  Time
+  )
+{
+  UINT64      Target;
+  LIST_ENTRY  *Link;
+  FAKE_EVENT  *Event;
+  FAKE_EVENT  *Due;
+
+  Target = mTimerNow + Time;
+  for ( ; ;) {
+    //
+    // Fire the earliest due timer first, and move the clock to it, so a
+    // handler that rearms its own timer sees the time it fired at.
+    //
+    Due = NULL;
+    for (Link = GetFirstNode (&mEvents); !IsNull (&mEvents, Link); Link = GetNextNode (&mEvents, Link)) {
+      Event = BASE_CR (Link, FAKE_EVENT, Link);
+      if (!Event->TimerArmed || (Event->TriggerTime > Target)) {
+        continue;
+      }
+
+      if ((Due == NULL) || (Event->TriggerTime < Due->TriggerTime)) {
+        Due = Event;
+      }
+    }
+
+    if (Due == NULL) {
+      break;
+    }
+
+    mTimerNow = MAX (mTimerNow, Due->TriggerTime);
+    if (!Due->Periodic) {
+      Due->TimerArmed = FALSE;
+    } else if (Due->Period != 0) {
+      Due->TriggerTime += Due->Period;
+    } else {
+      Due->TriggerTime = Target + 1;
+    }
+
+    FakeSignalEvent ((EFI_EVENT)Due);
+  }
+
+  mTimerNow = Target;
+}
+
+/**
+  Return the time advanced by FakeAdvanceTimers().
+
+  @return The time, in 100 ns units.
+
+**/
+UINT64
+FakeGetTimerNow (
+  VOID
+  )
+{
+  return mTimerNow;
+}
+
+/**
+  Signal the events of an event group.
+
+  @param  EventGroup    The event group.
+
+**/
+VOID
+EFIAPI
+FakeSignalEventGroup (
+  IN CONST EFI_GUID  *EventGroup
+  )
+{
+  LIST_ENTRY  *Link;
+  FAKE_EVENT  *Event;
+  EFI_TPL     OldTpl;
+
+  OldTpl = FakeRaiseTpl (TPL_HIGH_LEVEL);
+  for (Link = GetFirstNode (&mEvents); !IsNull (&mEvents, Link); Link = GetNextNode (&mEvents, Link)) {
+    Event = BASE_CR (Link, FAKE_EVENT, Link);
+    if (Event->InGroup && CompareGuid (&Event->EventGroup, EventGroup)) {
+      FakeQueueEvent (Event);
+    }
+  }
+
+  FakeRestoreTpl (OldTpl);
+}
+
+/**
+  Set the handler called from UsbKbTestPreemptionPoint().
+
+  @param  Handler       The handler, or NULL to remove it.
+  @param  Context       The context passed to Handler.
+
+**/
+VOID
+EFIAPI
+FakeSetPreemptionHandler (
+  IN FAKE_PREEMPTION_HANDLER  Handler  OPTIONAL,
+  IN VOID                     *Context OPTIONAL
+  )
+{
+  mPreemptionHandler = Handler;
+  mPreemptionContext = Context;
+}
+
+/**
+  Preemption point of the driver under test.
+
+  The driver calls this where an event of a higher TPL could interrupt it on
+  real hardware. The handler plays that event; it is not called again from
+  code it runs itself.
+
+**/
+VOID
+UsbKbTestPreemptionPoint (
+  VOID
+  )
+{
+  if ((mPreemptionHandler == NULL) || mInPreemption) {
+    return;
+  }
+
+  mInPreemption = TRUE;
+  mPreemptionHandler (mPreemptionContext);
+  mInPreemption = FALSE;
+}
+
+/**
+  Return the current TPL.
+
+  @return The current TPL.
+
+**/
+EFI_TPL
+EFIAPI
+EfiGetCurrentTpl (
+  VOID
+  )
+{
+  return mCurrentTpl;
+}
@@ -0,0 +1,279 @@
+/** @file
+  Fake HII database holding keyboard layouts.
+
+  Only the services the driver and the tests use are implemented: package
+  lists are parsed for keyboard layout packages, and the current layout can be
+  read and set. Setting a layout signals the EFI_HII_SET_KEYBOARD_LAYOUT_EVENT_GUID
+  group like the HII database driver does. Memory of the database itself comes
+  from the host heap, so it does not show in the pool counters.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "FakeUefiServicesLibInternal.h"
+
+#define FAKE_HII_LAYOUT_SIGNATURE  SIGNATURE_32 ('f', 'h', 'k', 'l')
+
+typedef struct {
+  UINT32                     Signature;
+  LIST_ENTRY                 Link;
+  EFI_HII_HANDLE             PackageList;
+  EFI_HII_KEYBOARD_LAYOUT    *Layout;
+} FAKE_HII_LAYOUT;
+
+STATIC LIST_ENTRY                 mLayouts       = INITIALIZE_LIST_HEAD_VARIABLE (mLayouts);
+STATIC FAKE_HII_LAYOUT            *mCurrentLayout;
+STATIC UINTN                      mPackageLists;
+STATIC EFI_HII_DATABASE_PROTOCOL  mHiiDatabase;
+STATIC EFI_HANDLE                 mHiiDatabaseHandle;
+
+/**
+  Find a keyboard layout by its GUID.
+
+  @param  KeyGuid       The GUID of the layout.
+
+  @return The layout, or NULL if the database does not have it.
+
+**/
+STATIC
+FAKE_HII_LAYOUT *
+FakeFindLayout (
+  IN CONST EFI_GUID  *KeyGuid
+  )
+{
+  LIST_ENTRY       *Link;
+  FAKE_HII_LAYOUT  *Layout;
+
+  for (Link = GetFirstNode (&mLayouts); !IsNull (&mLayouts, Link); Link = GetNextNode (&mLayouts, Link)) {
+    Layout = BASE_CR (Link, FAKE_HII_LAYOUT, Link);
+    if (CompareGuid (&Layout->Layout->Guid, KeyGuid)) {
+      return Layout;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Add the keyboard layouts of a package list to the database.
+
+  @param  This          The HII database protocol.
+  @param  PackageList   The package list.
+  @param  DriverHandle  The driver handle, not used.
+  @param  Handle        Receives the HII handle of the package list.
+
+  @retval EFI_SUCCESS             The package list was added.
+  @retval EFI_INVALID_PARAMETER   PackageList or Handle is NULL, or a package is malformed.
+  @retval EFI_OUT_OF_RESOURCES    A layout could not be stored.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeHiiNewPackageList (
+  IN CONST EFI_HII_DATABASE_PROTOCOL    *This,
+  IN CONST EFI_HII_PACKAGE_LIST_HEADER  *PackageList,
+  IN       EFI_HANDLE                   DriverHandle  OPTIONAL,
+  OUT      EFI_HII_HANDLE               *Handle
+  )
+{
+  CONST UINT8                   *Package;
+  CONST UINT8                   *End;
+  CONST UINT8                   *LayoutData;
+  EFI_HII_PACKAGE_HEADER        PackageHeader;
+  EFI_HII_KEYBOARD_PACKAGE_HDR  KeyboardHeader;
+  FAKE_HII_LAYOUT               *Layout;
+  UINT16                        LayoutLength;
+  UINT16                        Index;
+
+  if ((PackageList == NULL) || (Handle == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  mPackageLists++;
+  *Handle = (EFI_HII_HANDLE)mPackageLists;
+
+  Package = (CONST UINT8 *)(PackageList + 1);
+  End     = (CONST UINT8 *)PackageList + PackageList->PackageLength;
+  while (Package + sizeof (PackageHeader) <= End) {
+    CopyMem (&PackageHeader, Package, sizeof (PackageHeader));
+    if ((PackageHeader.Type == EFI_HII_PACKAGE_END) || (PackageHeader.Length < sizeof (PackageHeader)) ||
+        (Package + PackageHeader.Length > End))
+    {
+      break;
+    }
+
+    if (PackageHeader.Type == EFI_HII_PACKAGE_KEYBOARD_LAYOUT) {
+      CopyMem (&KeyboardHeader, Package, sizeof (KeyboardHeader));
+      LayoutData = Package + sizeof (KeyboardHeader);
+      for (Index = 0; Index < KeyboardHeader.LayoutCount; Index++) {
+        LayoutLength = ReadUnaligned16 ((CONST UINT16 *)LayoutData);
+        if ((LayoutLength < sizeof (EFI_HII_KEYBOARD_LAYOUT)) || (LayoutData + LayoutLength > Package + PackageHeader.Length)) {
+          return EFI_INVALID_PARAMETER;
+        }
+
+        Layout = calloc (1, sizeof (FAKE_HII_LAYOUT));
+        if (Layout != NULL) {
+          Layout->Layout = malloc (LayoutLength);
+        }
+
+        if ((Layout == NULL) || (Layout->Layout == NULL)) {
+          free (Layout);
+          return EFI_OUT_OF_RESOURCES;
+        }
+
+        Layout->Signature   = FAKE_HII_LAYOUT_SIGNATURE;
+        Layout->PackageList = *Handle;
+        CopyMem (Layout->Layout, LayoutData, LayoutLength);
+        InsertTailList (&mLayouts, &Layout->Link);
+        LayoutData += LayoutLength;
+      }
+    }
+
+    Package += PackageHeader.Length;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Read a keyboard layout.
+
+  @param  This                  The HII database protocol.
+  @param  KeyGuid               The GUID of the layout, or NULL for the current one.
+  @param  KeyboardLayoutLength  On input the size of KeyboardLayout, on output
+                                the size of the layout.
+  @param  KeyboardLayout        Receives the layout.
+
+  @retval EFI_SUCCESS             The layout was returned.
+  @retval EFI_BUFFER_TOO_SMALL    KeyboardLayout is too small.
+  @retval EFI_NOT_FOUND           The layout does not exist.
+  @retval EFI_INVALID_PARAMETER   KeyboardLayoutLength is NULL.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeHiiGetKeyboardLayout (
+  IN     CONST EFI_HII_DATABASE_PROTOCOL  *This,
+  IN     CONST EFI_GUID                   *KeyGuid  OPTIONAL,
+  IN OUT UINT16                           *KeyboardLayoutLength,
+  OUT    EFI_HII_KEYBOARD_LAYOUT          *KeyboardLayout
+  )
+{
+  FAKE_HII_LAYOUT  *Layout;
+
+  if (KeyboardLayoutLength == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Layout = (KeyGuid == NULL) ? mCurrentLayout : FakeFindLayout (KeyGuid);
+  if (Layout == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (*KeyboardLayoutLength < Layout->Layout->LayoutLength) {
+    *KeyboardLayoutLength = Layout->Layout->LayoutLength;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  if (KeyboardLayout == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CopyMem (KeyboardLayout, Layout->Layout, Layout->Layout->LayoutLength);
+  *KeyboardLayoutLength = Layout->Layout->LayoutLength;
+  return EFI_SUCCESS;
+}
+
+/**
+  Set the current keyboard layout and signal the layout change event group.
+
+  @param  This          The HII database protocol.
+  @param  KeyGuid       The GUID of the layout.
+
+  @retval EFI_SUCCESS             The layout is current.
+  @retval EFI_NOT_FOUND           The layout does not exist.
+  @retval EFI_INVALID_PARAMETER   KeyGuid is NULL.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeHiiSetKeyboardLayout (
+  IN CONST EFI_HII_DATABASE_PROTOCOL  *This,
+  IN CONST EFI_GUID                   *KeyGuid
+  )
+{
+  FAKE_HII_LAYOUT  *Layout;
+
+  if (KeyGuid == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Layout = FakeFindLayout (KeyGuid);
+  if (Layout == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (Layout == mCurrentLayout) {
+    return EFI_SUCCESS;
+  }
+
+  mCurrentLayout = Layout;
+  FakeSignalEventGroup (&gEfiHiiKeyBoardLayoutGuid);
+  return EFI_SUCCESS;
+}
+
+/**
+  Install the fake HII database protocol on a new handle.
+
+  @retval EFI_SUCCESS   The protocol is installed.
+  @retval Others        The protocol could not be installed.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeHiiDatabaseInstall (
+  VOID
+  )
+{
+  mHiiDatabase.NewPackageList    = FakeHiiNewPackageList;
+  mHiiDatabase.GetKeyboardLayout = FakeHiiGetKeyboardLayout;
+  mHiiDatabase.SetKeyboardLayout = FakeHiiSetKeyboardLayout;
+
+  mHiiDatabaseHandle = NULL;
+  return gBS->InstallMultipleProtocolInterfaces (
+                &mHiiDatabaseHandle,
+                &gEfiHiiDatabaseProtocolGuid,
+                &mHiiDatabase,
+                NULL
+                );
+}
+
+/**
+  Drop every keyboard layout.
+
+**/
+VOID
+FakeResetHiiDatabase (
+  VOID
+  )
+{
+  LIST_ENTRY       *Link;
+  FAKE_HII_LAYOUT  *Layout;
+
+  while (!IsListEmpty (&mLayouts)) {
+    Link   = GetFirstNode (&mLayouts);
+    Layout = BASE_CR (Link, FAKE_HII_LAYOUT, Link);
+    RemoveEntryList (Link);
+    free (Layout->Layout);
+    free (Layout);
+  }
+
+  mCurrentLayout     = NULL;
+  mPackageLists      = 0;
+  mHiiDatabaseHandle = NULL;
+}
@@ -0,0 +1,771 @@
+/** @file
+  The MemoryAllocationLib, TimerLib, UefiLib, HiiLib and UefiUsbLib functions
+  the driver links against, on top of the fake boot services.
+
+  The pool functions go through gBS->AllocatePool() and gBS->FreePool(), so
+  every buffer of the driver is counted. The performance counter follows the
+  host clock in nanoseconds.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "FakeUefiServicesLibInternal.h"
+
+//
+// Timeout of the control transfers of the UefiUsbLib functions, in milliseconds.
+// The fake USB I/O completes every transfer at once.
+//
+#define FAKE_USB_TRANSFER_TIMEOUT  3000
+
+/**
+  Allocate a pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocatePool (
+  IN UINTN  AllocationSize
+  )
+{
+  VOID  *Buffer;
+
+  if (EFI_ERROR (gBS->AllocatePool (EfiBootServicesData, AllocationSize, &Buffer))) {
+    return NULL;
+  }
+
+  return Buffer;
+}
+
+/**
+  Allocate a runtime pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateRuntimePool (
+  IN UINTN  AllocationSize
+  )
+{
+  return AllocatePool (AllocationSize);
+}
+
+/**
+  Allocate a reserved pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateReservedPool (
+  IN UINTN  AllocationSize
+  )
+{
+  return AllocatePool (AllocationSize);
+}
+
+/**
+  Allocate a zeroed pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateZeroPool (
+  IN UINTN  AllocationSize
+  )
+{
+  VOID  *Buffer;
+
+  Buffer = AllocatePool (AllocationSize);
+  if (Buffer != NULL) {
+    ZeroMem (Buffer, AllocationSize);
+  }
+
+  return Buffer;
+}
+
+/**
+  Allocate a zeroed runtime pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateRuntimeZeroPool (
+  IN UINTN  AllocationSize
+  )
+{
+  return AllocateZeroPool (AllocationSize);
+}
+
+/**
+  Allocate a zeroed reserved pool buffer.
+
+  @param  AllocationSize  The size of the buffer.
+
+  @return The buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateReservedZeroPool (
+  IN UINTN  AllocationSize
+  )
+{
+  return AllocateZeroPool (AllocationSize);
+}
+
+/**
+  Allocate a pool buffer holding a copy of a buffer.
+
+  @param  AllocationSize  The size of the buffer.
+  @param  Buffer          The buffer to copy.
+
+  @return The copy, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateCopyPool (
+  IN UINTN       AllocationSize,
+  IN CONST VOID  *Buffer
+  )
+{
+  VOID  *Memory;
+
+  ASSERT (Buffer != NULL);
+
+  Memory = AllocatePool (AllocationSize);
+  if (Memory != NULL) {
+    CopyMem (Memory, Buffer, AllocationSize);
+  }
+
+  return Memory;
+}
+
+/**
+  Allocate a runtime pool buffer holding a copy of a buffer.
+
+  @param  AllocationSize  The size of the buffer.
+  @param  Buffer          The buffer to copy.
+
+  @return The copy, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateRuntimeCopyPool (
+  IN UINTN       AllocationSize,
+  IN CONST VOID  *Buffer
+  )
+{
+  return AllocateCopyPool (AllocationSize, Buffer);
+}
+
+/**
+  Allocate a reserved pool buffer holding a copy of a buffer.
+
+  @param  AllocationSize  The size of the buffer.
+  @param  Buffer          The buffer to copy.
+
+  @return The copy, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+AllocateReservedCopyPool (
+  IN UINTN       AllocationSize,
+  IN CONST VOID  *Buffer
+  )
+{
+  return AllocateCopyPool (AllocationSize, Buffer);
+}
+
+/**
+  Reallocate a pool buffer.
+
+  @param  OldSize     The size of OldBuffer.
+  @param  NewSize     The size of the new buffer.
+  @param  OldBuffer   The buffer to reallocate, or NULL.
+
+  @return The new buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+ReallocatePool (
+  IN UINTN  OldSize,
+  IN UINTN  NewSize,
+  IN VOID   *OldBuffer  OPTIONAL
+  )
+{
+  VOID  *NewBuffer;
+
+  NewBuffer = AllocateZeroPool (NewSize);
+  if ((NewBuffer != NULL) && (OldBuffer != NULL)) {
+    CopyMem (NewBuffer, OldBuffer, MIN (OldSize, NewSize));
+    FreePool (OldBuffer);
+  }
+
+  return NewBuffer;
+}
+
+/**
+  Reallocate a runtime pool buffer.
+
+  @param  OldSize     The size of OldBuffer.
+  @param  NewSize     The size of the new buffer.
+  @param  OldBuffer   The buffer to reallocate, or NULL.
+
+  @return The new buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+ReallocateRuntimePool (
+  IN UINTN  OldSize,
+  IN UINTN  NewSize,
+  IN VOID   *OldBuffer  OPTIONAL
+  )
+{
+  return ReallocatePool (OldSize, NewSize, OldBuffer);
+}
+
+/**
+  Reallocate a reserved pool buffer.
+
+  @param  OldSize     The size of OldBuffer.
+  @param  NewSize     The size of the new buffer.
+  @param  OldBuffer   The buffer to reallocate, or NULL.
+
+  @return The new buffer, or NULL if it could not be allocated.
+
+**/
+VOID *
+EFIAPI
+ReallocateReservedPool (
+  IN UINTN  OldSize,
+  IN UINTN  NewSize,
+  IN VOID   *OldBuffer  OPTIONAL
+  )
+{
+  return ReallocatePool (OldSize, NewSize, OldBuffer);
+}
+
+/**
+  Free a pool buffer.
+
+  @param  Buffer      The buffer.
+
+**/
+VOID
+EFIAPI
+FreePool (
+  IN VOID  *Buffer
+  )
+{
+  EFI_STATUS  Status;
+
+  Status = gBS->FreePool (Buffer);
+  ASSERT_EFI_ERROR (Status);
+}
+
+/**
+  Return the performance counter, the host clock plus the time advanced by
+  FakeAdvanceTimers(), in nanoseconds.
+
+  @return The performance counter.
+
+**/
+UINT64
+EFIAPI
+GetPerformanceCounter (
+  VOID
+  )
+{
+  struct timespec  Now;
+
+  timespec_get (&Now, TIME_UTC);
+  return (UINT64)Now.tv_sec * 1000000000ULL + (UINT64)Now.tv_nsec + FakeGetTimerNow () * 100;
+}
+
+/**
+  Return the properties of the performance counter.
+
+  @param  StartValue  Receives the first value of the counter.
+  @param  EndValue    Receives the last value of the counter.
+
+  @return The frequency of the counter, 1 GHz.
+
+**/
+UINT64
+EFIAPI
+GetPerformanceCounterProperties (
+  OUT UINT64  *StartValue  OPTIONAL,
+  OUT UINT64  *EndValue    OPTIONAL
+  )
+{
+  if (StartValue != NULL) {
+    *StartValue = 0;
+  }
+
+  if (EndValue != NULL) {
+    *EndValue = MAX_UINT64;
+  }
+
+  return 1000000000ULL;
+}
+
+/**
+  Convert performance counter ticks to nanoseconds.
+
+  @param  Ticks       The ticks.
+
+  @return The time in nanoseconds.
+
+**/
+UINT64
+EFIAPI
+GetTimeInNanoSecond (
+  IN UINT64  Ticks
+  )
+{
+  return Ticks;
+}
+
+/**
+  Delay, which the fake does not need to.
+
+  @param  MicroSeconds  The delay.
+
+  @return MicroSeconds.
+
+**/
+UINTN
+EFIAPI
+MicroSecondDelay (
+  IN UINTN  MicroSeconds
+  )
+{
+  return MicroSeconds;
+}
+
+/**
+  Delay, which the fake does not need to.
+
+  @param  NanoSeconds   The delay.
+
+  @return NanoSeconds.
+
+**/
+UINTN
+EFIAPI
+NanoSecondDelay (
+  IN UINTN  NanoSeconds
+  )
+{
+  return NanoSeconds;
+}
+
+/**
+  Install the driver binding and component name protocols of a driver.
+
+  @param  ImageHandle         The image handle of the driver.
+  @param  SystemTable         The system table.
+  @param  DriverBinding       The driver binding protocol.
+  @param  DriverBindingHandle The handle to install on, NULL for a new one.
+  @param  ComponentName       The component name protocol.
+  @param  ComponentName2      The component name 2 protocol.
+
+  @retval EFI_SUCCESS         The protocols were installed.
+  @retval Others              The protocols could not be installed.
+
+**/
+EFI_STATUS
+EFIAPI
+EfiLibInstallDriverBindingComponentName2 (
+  IN CONST EFI_HANDLE                    ImageHandle,
+  IN CONST EFI_SYSTEM_TABLE              *SystemTable,
+  IN EFI_DRIVER_BINDING_PROTOCOL         *DriverBinding,
+  IN EFI_HANDLE                          DriverBindingHandle,
+  IN CONST EFI_COMPONENT_NAME_PROTOCOL   *ComponentName   OPTIONAL,
+  IN CONST EFI_COMPONENT_NAME2_PROTOCOL  *ComponentName2  OPTIONAL
+  )
+{
+  EFI_STATUS  Status;
+
+  DriverBinding->ImageHandle         = ImageHandle;
+  DriverBinding->DriverBindingHandle = DriverBindingHandle;
+
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &DriverBinding->DriverBindingHandle,
+                  &gEfiDriverBindingProtocolGuid,
+                  DriverBinding,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (ComponentName != NULL) {
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    &DriverBinding->DriverBindingHandle,
+                    &gEfiComponentNameProtocolGuid,
+                    (VOID *)ComponentName,
+                    NULL
+                    );
+  }
+
+  if (!EFI_ERROR (Status) && (ComponentName2 != NULL)) {
+    Status = gBS->InstallMultipleProtocolInterfaces (
+                    &DriverBinding->DriverBindingHandle,
+                    &gEfiComponentName2ProtocolGuid,
+                    (VOID *)ComponentName2,
+                    NULL
+                    );
+  }
+
+  return Status;
+}
+
+/**
+  Add a string to a Unicode string table.
+
+  The language is stored as given; the fake does not check it against
+  SupportedLanguages.
+
+  @param  Language            The language of the string.
+  @param  SupportedLanguages  The supported languages.
+  @param  UnicodeStringTable  The table, grown by one entry.
+  @param  UnicodeString       The string.
+  @param  Iso639Language      TRUE for ISO 639-2 language codes.
+
+  @retval EFI_SUCCESS             The string was added.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_OUT_OF_RESOURCES    The table could not be grown.
+
+**/
+EFI_STATUS
+EFIAPI
+AddUnicodeString2 (
+  IN     CONST CHAR8               *Language,
+  IN     CONST CHAR8               *SupportedLanguages,
+  IN OUT EFI_UNICODE_STRING_TABLE  **UnicodeStringTable,
+  IN     CONST CHAR16              *UnicodeString,
+  IN     BOOLEAN                   Iso639Language
+  )
+{
+  UINTN                     Count;
+  EFI_UNICODE_STRING_TABLE  *Table;
+
+  if ((Language == NULL) || (UnicodeStringTable == NULL) || (UnicodeString == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Count = 0;
+  if (*UnicodeStringTable != NULL) {
+    while ((*UnicodeStringTable)[Count].Language != NULL) {
+      Count++;
+    }
+  }
+
+  Table = ReallocatePool (
+            Count * sizeof (EFI_UNICODE_STRING_TABLE),
+            (Count + 2) * sizeof (EFI_UNICODE_STRING_TABLE),
+            *UnicodeStringTable
+            );
+  if (Table == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  *UnicodeStringTable = Table;
+
+  Table[Count].Language      = AllocateCopyPool (AsciiStrSize (Language), Language);
+  Table[Count].UnicodeString = AllocateCopyPool (StrSize (UnicodeString), UnicodeString);
+  if ((Table[Count].Language == NULL) || (Table[Count].UnicodeString == NULL)) {
+    if (Table[Count].Language != NULL) {
+      FreePool (Table[Count].Language);
+      Table[Count].Language = NULL;
+    }
+
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Look up a string in a Unicode string table.
+
+  @param  Language            The language of the string.
+  @param  SupportedLanguages  The supported languages.
+  @param  UnicodeStringTable  The table.
+  @param  UnicodeString       Receives the string.
+  @param  Iso639Language      TRUE for ISO 639-2 language codes.
+
+  @retval EFI_SUCCESS             The string was found.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_UNSUPPORTED         The table has no string for Language.
+
+**/
+EFI_STATUS
+EFIAPI
+LookupUnicodeString2 (
+  IN CONST CHAR8                     *Language,
+  IN CONST CHAR8                     *SupportedLanguages,
+  IN CONST EFI_UNICODE_STRING_TABLE  *UnicodeStringTable,
+  OUT CHAR16                         **UnicodeString,
+  IN BOOLEAN                         Iso639Language
+  )
+{
+  if ((Language == NULL) || (UnicodeString == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (UnicodeStringTable == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  for ( ; UnicodeStringTable->Language != NULL; UnicodeStringTable++) {
+    if (AsciiStrCmp (UnicodeStringTable->Language, Language) == 0) {
+      *UnicodeString = UnicodeStringTable->UnicodeString;
+      return EFI_SUCCESS;
+    }
+  }
+
+  return EFI_UNSUPPORTED;
+}
+
+/**
+  Free a Unicode string table and its strings.
+
+  @param  UnicodeStringTable  The table.
+
+  @retval EFI_SUCCESS         The table was freed.
+
+**/
+EFI_STATUS
+EFIAPI
+FreeUnicodeStringTable (
+  IN EFI_UNICODE_STRING_TABLE  *UnicodeStringTable
+  )
+{
+  UINTN  Index;
+
+  if (UnicodeStringTable == NULL) {
+    return EFI_SUCCESS;
+  }
+
+  for (Index = 0; UnicodeStringTable[Index].Language != NULL; Index++) {
+    FreePool (UnicodeStringTable[Index].Language);
+    FreePool (UnicodeStringTable[Index].UnicodeString);
+  }
+
+  FreePool (UnicodeStringTable);
+  return EFI_SUCCESS;
+}
+
+/**
+  Print to the debug output, since the fake has no console.
+
+  @param  Format      The format string.
+  @param  ...         The arguments of Format.
+
+  @return The number of characters printed.
+
+**/
+UINTN
+EFIAPI
+Print (
+  IN CONST CHAR16  *Format,
+  ...
+  )
+{
+  VA_LIST  Marker;
+  CHAR16   Buffer[256];
+  UINTN    Length;
+
+  VA_START (Marker, Format);
+  Length = UnicodeVSPrint (Buffer, sizeof (Buffer), Format, Marker);
+  VA_END (Marker);
+
+  DEBUG ((DEBUG_INFO, "%s", Buffer));
+  return Length;
+}
+
+/**
+  Register packages with the HII database as one package list.
+
+  Each package is preceded by its length as a UINT32 that includes the length
+  itself, as in the binaries built by the EDK II tools.
+
+  @param  PackageListGuid   The GUID of the package list.
+  @param  DeviceHandle      The handle of the device.
+  @param  ...               The packages, terminated by NULL.
+
+  @return The HII handle of the package list, or NULL if there is no HII
+          database or the packages could not be added.
+
+**/
+EFI_HII_HANDLE
+EFIAPI
+HiiAddPackages (
+  IN CONST EFI_GUID    *PackageListGuid,
+  IN       EFI_HANDLE  DeviceHandle  OPTIONAL,
+  ...
+  )
+{
+  STATIC CONST EFI_HII_PACKAGE_HEADER  EndOfPackageList = { sizeof (EFI_HII_PACKAGE_HEADER), EFI_HII_PACKAGE_END };
+  EFI_HII_DATABASE_PROTOCOL            *HiiDatabase;
+  EFI_HII_PACKAGE_LIST_HEADER          *PackageListHeader;
+  EFI_HII_HANDLE                       HiiHandle;
+  VA_LIST                              Args;
+  UINT32                               *Package;
+  UINT32                               Length;
+  UINT8                                *Data;
+  EFI_STATUS                           Status;
+
+  Status = gBS->LocateProtocol (&gEfiHiiDatabaseProtocolGuid, NULL, (VOID **)&HiiDatabase);
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  Length = sizeof (EFI_HII_PACKAGE_LIST_HEADER) + sizeof (EFI_HII_PACKAGE_HEADER);
+  VA_START (Args, DeviceHandle);
+  for (Package = VA_ARG (Args, UINT32 *); Package != NULL; Package = VA_ARG (Args, UINT32 *)) {
+    Length += ReadUnaligned32 (Package) - sizeof (UINT32);
+  }
+
+  VA_END (Args);
+
+  PackageListHeader = AllocateZeroPool (Length);
+  if (PackageListHeader == NULL) {
+    return NULL;
+  }
+
+  CopyGuid (&PackageListHeader->PackageListGuid, PackageListGuid);
+  PackageListHeader->PackageLength = Length;
+
+  Data = (UINT8 *)(PackageListHeader + 1);
+  VA_START (Args, DeviceHandle);
+  for (Package = VA_ARG (Args, UINT32 *); Package != NULL; Package = VA_ARG (Args, UINT32 *)) {
+    CopyMem (Data, Package + 1, ReadUnaligned32 (Package) - sizeof (UINT32));
+    Data += ReadUnaligned32 (Package) - sizeof (UINT32);
+  }
+
+  VA_END (Args);
+  CopyMem (Data, &EndOfPackageList, sizeof (EndOfPackageList));
+
+  Status = HiiDatabase->NewPackageList (HiiDatabase, PackageListHeader, DeviceHandle, &HiiHandle);
+  FreePool (PackageListHeader);
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  return HiiHandle;
+}
+
+/**
+  Read the configuration of a USB device.
+
+  @param  UsbIo               The USB I/O protocol.
+  @param  ConfigurationValue  Receives the configuration.
+  @param  Status              Receives the USB transfer status.
+
+  @return The status of the control transfer.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbGetConfiguration (
+  IN  EFI_USB_IO_PROTOCOL  *UsbIo,
+  OUT UINT16               *ConfigurationValue,
+  OUT UINT32               *Status
+  )
+{
+  EFI_USB_DEVICE_REQUEST  DevReq;
+
+  ZeroMem (&DevReq, sizeof (DevReq));
+  DevReq.RequestType = USB_DEV_GET_CONFIGURATION_REQ_TYPE;
+  DevReq.Request     = USB_REQ_GET_CONFIG;
+  DevReq.Length      = 1;
+
+  *ConfigurationValue = 0;
+  return UsbIo->UsbControlTransfer (UsbIo, &DevReq, EfiUsbDataIn, FAKE_USB_TRANSFER_TIMEOUT, ConfigurationValue, 1, Status);
+}
+
+/**
+  Set the configuration of a USB device.
+
+  @param  UsbIo               The USB I/O protocol.
+  @param  ConfigurationValue  The configuration.
+  @param  Status              Receives the USB transfer status.
+
+  @return The status of the control transfer.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbSetConfiguration (
+  IN  EFI_USB_IO_PROTOCOL  *UsbIo,
+  IN  UINT16               ConfigurationValue,
+  OUT UINT32               *Status
+  )
+{
+  EFI_USB_DEVICE_REQUEST  DevReq;
+
+  ZeroMem (&DevReq, sizeof (DevReq));
+  DevReq.RequestType = USB_DEV_SET_CONFIGURATION_REQ_TYPE;
+  DevReq.Request     = USB_REQ_SET_CONFIG;
+  DevReq.Value       = ConfigurationValue;
+
+  return UsbIo->UsbControlTransfer (UsbIo, &DevReq, EfiUsbNoData, FAKE_USB_TRANSFER_TIMEOUT, NULL, 0, Status);
+}
+
+/**
+  Clear the halt of an endpoint.
+
+  @param  UsbIo       The USB I/O protocol.
+  @param  Endpoint    The endpoint address.
+  @param  Status      Receives the USB transfer status.
+
+  @return The status of the control transfer.
+
+**/
+EFI_STATUS
+EFIAPI
+UsbClearEndpointHalt (
+  IN  EFI_USB_IO_PROTOCOL  *UsbIo,
+  IN  UINT8                Endpoint,
+  OUT UINT32               *Status
+  )
+{
+  EFI_USB_DEVICE_REQUEST  DevReq;
+
+  ZeroMem (&DevReq, sizeof (DevReq));
+  DevReq.RequestType = USB_ENDPOINT_CLEAR_FEATURE_REQ_TYPE;
+  DevReq.Request     = USB_REQ_CLEAR_FEATURE;
+  DevReq.Value       = USB_FEATURE_ENDPOINT_HALT;
+  DevReq.Index       = Endpoint;
+
+  return UsbIo->UsbControlTransfer (UsbIo, &DevReq, EfiUsbNoData, FAKE_USB_TRANSFER_TIMEOUT, NULL, 0, Status);
+}
@@ -0,0 +1,246 @@
+/** @file
+  Fake runtime services for the host-based tests: an in-memory variable store
+  and a ResetSystem() that only counts.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "FakeUefiServicesLibInternal.h"
+
+typedef struct {
+  LIST_ENTRY    Link;
+  EFI_GUID      VendorGuid;
+  CHAR16        *Name;
+  UINT32        Attributes;
+  UINTN         DataSize;
+  UINT8         *Data;
+} FAKE_VARIABLE;
+
+STATIC LIST_ENTRY            mVariables = INITIALIZE_LIST_HEAD_VARIABLE (mVariables);
+STATIC EFI_RUNTIME_SERVICES  mRuntimeServices;
+
+EFI_RUNTIME_SERVICES  *gRT = &mRuntimeServices;
+
+/**
+  Find a variable.
+
+  @param  VariableName  The name of the variable.
+  @param  VendorGuid    The vendor GUID of the variable.
+
+  @return The variable, or NULL if it does not exist.
+
+**/
+STATIC
+FAKE_VARIABLE *
+FakeFindVariable (
+  IN CONST CHAR16    *VariableName,
+  IN CONST EFI_GUID  *VendorGuid
+  )
+{
+  LIST_ENTRY     *Link;
+  FAKE_VARIABLE  *Variable;
+
+  for (Link = GetFirstNode (&mVariables); !IsNull (&mVariables, Link); Link = GetNextNode (&mVariables, Link)) {
+    Variable = BASE_CR (Link, FAKE_VARIABLE, Link);
+    if (CompareGuid (&Variable->VendorGuid, VendorGuid) && (StrCmp (Variable->Name, VariableName) == 0)) {
+      return Variable;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Free a variable.
+
+  @param  Variable      The variable, already unlinked.
+
+**/
+STATIC
+VOID
+FakeFreeVariable (
+  IN FAKE_VARIABLE  *Variable
+  )
+{
+  free (Variable->Name);
+  free (Variable->Data);
+  free (Variable);
+}
+
+/**
+  Read a variable.
+
+  @param  VariableName  The name of the variable.
+  @param  VendorGuid    The vendor GUID of the variable.
+  @param  Attributes    Receives the attributes.
+  @param  DataSize      On input the size of Data, on output the size of the variable.
+  @param  Data          Receives the data.
+
+  @retval EFI_SUCCESS             The variable was read.
+  @retval EFI_NOT_FOUND           The variable does not exist.
+  @retval EFI_BUFFER_TOO_SMALL    Data is too small, DataSize has the size needed.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeGetVariable (
+  IN     CHAR16    *VariableName,
+  IN     EFI_GUID  *VendorGuid,
+  OUT    UINT32    *Attributes  OPTIONAL,
+  IN OUT UINTN     *DataSize,
+  OUT    VOID      *Data        OPTIONAL
+  )
+{
+  FAKE_VARIABLE  *Variable;
+
+  if ((VariableName == NULL) || (VendorGuid == NULL) || (DataSize == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = FakeFindVariable (VariableName, VendorGuid);
+  if (Variable == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (*DataSize < Variable->DataSize) {
+    *DataSize = Variable->DataSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  if (Data == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CopyMem (Data, Variable->Data, Variable->DataSize);
+  *DataSize = Variable->DataSize;
+  if (Attributes != NULL) {
+    *Attributes = Variable->Attributes;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Write or delete a variable.
+
+  @param  VariableName  The name of the variable.
+  @param  VendorGuid    The vendor GUID of the variable.
+  @param  Attributes    The attributes.
+  @param  DataSize      The size of Data, 0 to delete the variable.
+  @param  Data          The data.
+
+  @retval EFI_SUCCESS             The variable was written or deleted.
+  @retval EFI_NOT_FOUND           The variable to delete does not exist.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+  @retval EFI_OUT_OF_RESOURCES    The variable could not be stored.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeSetVariable (
+  IN CHAR16    *VariableName,
+  IN EFI_GUID  *VendorGuid,
+  IN UINT32    Attributes,
+  IN UINTN     DataSize,
+  IN VOID      *Data
+  )
+{
+  FAKE_VARIABLE  *Variable;
+  UINT8          *NewData;
+
+  if ((VariableName == NULL) || (VariableName[0] == L'\0') || (VendorGuid == NULL) ||
+      ((DataSize != 0) && (Data == NULL)))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Variable = FakeFindVariable (VariableName, VendorGuid);
+  if ((DataSize == 0) || (Attributes == 0)) {
+    if (Variable == NULL) {
+      return EFI_NOT_FOUND;
+    }
+
+    RemoveEntryList (&Variable->Link);
+    FakeFreeVariable (Variable);
+    return EFI_SUCCESS;
+  }
+
+  NewData = malloc (DataSize);
+  if (NewData == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  CopyMem (NewData, Data, DataSize);
+
+  if (Variable == NULL) {
+    Variable = calloc (1, sizeof (FAKE_VARIABLE));
+    if (Variable != NULL) {
+      Variable->Name = malloc (StrSize (VariableName));
+    }
+
+    if ((Variable == NULL) || (Variable->Name == NULL)) {
+      free (Variable);
+      free (NewData);
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    CopyMem (Variable->Name, VariableName, StrSize (VariableName));
+    CopyGuid (&Variable->VendorGuid, VendorGuid);
+    InsertTailList (&mVariables, &Variable->Link);
+  }
+
+  free (Variable->Data);
+  Variable->Data       = NewData;
+  Variable->DataSize   = DataSize;
+  Variable->Attributes = Attributes;
+  return EFI_SUCCESS;
+}
+
+/**
+  Reset the system, which the fake ignores.
+
+  @param  ResetType     The type of reset.
+  @param  ResetStatus   The status of the reset.
+  @param  DataSize      The size of ResetData.
+  @param  ResetData     The reset data.
+
+**/
+STATIC
+VOID
+EFIAPI
+FakeResetSystem (
+  IN EFI_RESET_TYPE  ResetType,
+  IN EFI_STATUS      ResetStatus,
+  IN UINTN           DataSize,
+  IN VOID            *ResetData OPTIONAL
+  )
+{
+  DEBUG ((DEBUG_INFO, "FakeResetSystem: type %d ignored\n", ResetType));
+}
+
+/**
+  Drop every variable.
+
+**/
+VOID
+FakeResetVariables (
+  VOID
+  )
+{
+  FAKE_VARIABLE  *Variable;
+
+  while (!IsListEmpty (&mVariables)) {
+    Variable = BASE_CR (GetFirstNode (&mVariables), FAKE_VARIABLE, Link);
+    RemoveEntryList (&Variable->Link);
+    FakeFreeVariable (Variable);
+  }
+
+  mRuntimeServices.GetVariable = FakeGetVariable;
+  mRuntimeServices.SetVariable = FakeSetVariable;
+  mRuntimeServices.ResetSystem = FakeResetSystem;
+}
@@ -0,0 +1,83 @@
+/** @file
+  Internal declarations of the fake UEFI services.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _FAKE_UEFI_SERVICES_LIB_INTERNAL_H_
+#define _FAKE_UEFI_SERVICES_LIB_INTERNAL_H_
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <Uefi.h>
+
+#include <Protocol/UsbIo.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/HiiDatabase.h>
+
+#include <Guid/EventGroup.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+#include <Library/UefiLib.h>
+#include <Library/HiiLib.h>
+#include <Library/UefiUsbLib.h>
+#include <Library/TimerLib.h>
+#include <Library/FakeUefiServicesLib.h>
+
+/**
+  Drop every variable.
+
+**/
+VOID
+FakeResetVariables (
+  VOID
+  );
+
+/**
+  Drop every fake USB device.
+
+**/
+VOID
+FakeResetUsbDevices (
+  VOID
+  );
+
+/**
+  Return the time advanced by FakeAdvanceTimers().
+
+  @return The time, in 100 ns units.
+
+**/
+UINT64
+FakeGetTimerNow (
+  VOID
+  );
+
+/**
+  Drop every keyboard layout of the HII database.
+
+**/
+VOID
+FakeResetHiiDatabase (
+  VOID
+  );
+
+/**
+  Preemption point of the driver under test, declared by the driver in EfiKey.h.
+
+**/
+VOID
+UsbKbTestPreemptionPoint (
+  VOID
+  );
+
+#endif
@@ -0,0 +1,483 @@
+/** @file
+  Fake USB devices for the host-based tests.
+
+  Each device has a USB I/O protocol with one interface, an interrupt IN and an
+  interrupt OUT endpoint, and a USB device path. Control and synchronous
+  transfers succeed without data; the asynchronous interrupt transfer is
+  completed by FakeUsbSendReport().
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "FakeUefiServicesLibInternal.h"
+
+#define FAKE_USB_DEVICE_SIGNATURE  SIGNATURE_32 ('f', 'u', 's', 'b')
+
+#pragma pack(1)
+typedef struct {
+  USB_DEVICE_PATH             Usb;
+  EFI_DEVICE_PATH_PROTOCOL    End;
+} FAKE_USB_DEVICE_PATH;
+#pragma pack()
+
+typedef struct {
+  UINT32                             Signature;
+  LIST_ENTRY                         Link;
+  EFI_HANDLE                         Handle;
+  EFI_USB_IO_PROTOCOL                UsbIo;
+  FAKE_USB_DEVICE_PATH               DevicePath;
+  EFI_USB_DEVICE_DESCRIPTOR          DeviceDescriptor;
+  EFI_USB_INTERFACE_DESCRIPTOR       InterfaceDescriptor;
+  EFI_USB_ENDPOINT_DESCRIPTOR        Endpoints[2];
+  UINTN                              ControlTransfers;
+  BOOLEAN                            AsyncActive;
+  EFI_ASYNC_USB_TRANSFER_CALLBACK    AsyncCallBack;
+  VOID                               *AsyncContext;
+} FAKE_USB_DEVICE;
+
+#define FAKE_USB_DEVICE_FROM_USB_IO(a)  CR (a, FAKE_USB_DEVICE, UsbIo, FAKE_USB_DEVICE_SIGNATURE)
+
+STATIC LIST_ENTRY  mUsbDevices = INITIALIZE_LIST_HEAD_VARIABLE (mUsbDevices);
+
+/**
+  Find the fake device of a handle.
+
+  @param  Controller    The handle.
+
+  @return The device, or NULL if Controller is not a fake USB device.
+
+**/
+STATIC
+FAKE_USB_DEVICE *
+FakeFindUsbDevice (
+  IN EFI_HANDLE  Controller
+  )
+{
+  LIST_ENTRY       *Link;
+  FAKE_USB_DEVICE  *Device;
+
+  for (Link = GetFirstNode (&mUsbDevices); !IsNull (&mUsbDevices, Link); Link = GetNextNode (&mUsbDevices, Link)) {
+    Device = BASE_CR (Link, FAKE_USB_DEVICE, Link);
+    if (Device->Handle == Controller) {
+      return Device;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Run a control transfer, which returns zeroed data.
+
+  @param  This          The USB I/O protocol.
+  @param  Request       The device request.
+  @param  Direction     The data direction.
+  @param  Timeout       The timeout in milliseconds.
+  @param  Data          The data buffer.
+  @param  DataLength    The size of Data.
+  @param  Status        Receives the USB transfer status.
+
+  @retval EFI_SUCCESS   The transfer completed.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbControlTransfer (
+  IN     EFI_USB_IO_PROTOCOL     *This,
+  IN     EFI_USB_DEVICE_REQUEST  *Request,
+  IN     EFI_USB_DATA_DIRECTION  Direction,
+  IN     UINT32                  Timeout,
+  IN OUT VOID                    *Data       OPTIONAL,
+  IN     UINTN                   DataLength  OPTIONAL,
+  OUT    UINT32                  *Status
+  )
+{
+  FAKE_USB_DEVICE_FROM_USB_IO (This)->ControlTransfers++;
+  if ((Direction == EfiUsbDataIn) && (Data != NULL)) {
+    ZeroMem (Data, DataLength);
+  }
+
+  *Status = EFI_USB_NOERROR;
+  return EFI_SUCCESS;
+}
+
+/**
+  Start or stop the asynchronous interrupt transfer.
+
+  @param  This              The USB I/O protocol.
+  @param  DeviceEndpoint    The endpoint address.
+  @param  IsNewTransfer     TRUE to start the transfer, FALSE to stop it.
+  @param  PollingInterval   The polling interval.
+  @param  DataLength        The size of each report.
+  @param  InterruptCallBack The callback of each report.
+  @param  Context           The context of InterruptCallBack.
+
+  @retval EFI_SUCCESS             The transfer was started or stopped.
+  @retval EFI_INVALID_PARAMETER   A parameter is invalid.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbAsyncInterruptTransfer (
+  IN EFI_USB_IO_PROTOCOL              *This,
+  IN UINT8                            DeviceEndpoint,
+  IN BOOLEAN                          IsNewTransfer,
+  IN UINTN                            PollingInterval    OPTIONAL,
+  IN UINTN                            DataLength         OPTIONAL,
+  IN EFI_ASYNC_USB_TRANSFER_CALLBACK  InterruptCallBack  OPTIONAL,
+  IN VOID                             *Context           OPTIONAL
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+
+  Device = FAKE_USB_DEVICE_FROM_USB_IO (This);
+  if (!IsNewTransfer) {
+    Device->AsyncActive   = FALSE;
+    Device->AsyncCallBack = NULL;
+    Device->AsyncContext  = NULL;
+    return EFI_SUCCESS;
+  }
+
+  if ((InterruptCallBack == NULL) || (DataLength == 0) || (PollingInterval == 0) || (PollingInterval > 255)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Device->AsyncActive   = TRUE;
+  Device->AsyncCallBack = InterruptCallBack;
+  Device->AsyncContext  = Context;
+  return EFI_SUCCESS;
+}
+
+/**
+  Run a synchronous interrupt transfer, which moves no data.
+
+  @param  This            The USB I/O protocol.
+  @param  DeviceEndpoint  The endpoint address.
+  @param  Data            The data buffer.
+  @param  DataLength      On input the size of Data, on output the bytes moved.
+  @param  Timeout         The timeout in milliseconds.
+  @param  Status          Receives the USB transfer status.
+
+  @retval EFI_SUCCESS   The transfer completed.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbSyncInterruptTransfer (
+  IN     EFI_USB_IO_PROTOCOL  *This,
+  IN     UINT8                DeviceEndpoint,
+  IN OUT VOID                 *Data,
+  IN OUT UINTN                *DataLength,
+  IN     UINTN                Timeout,
+  OUT    UINT32               *Status
+  )
+{
+  if ((DeviceEndpoint & USB_ENDPOINT_DIR_IN) != 0) {
+    *DataLength = 0;
+  }
+
+  *Status = EFI_USB_NOERROR;
+  return EFI_SUCCESS;
+}
+
+/**
+  Return the device descriptor.
+
+  @param  This              The USB I/O protocol.
+  @param  DeviceDescriptor  Receives the descriptor.
+
+  @retval EFI_SUCCESS   The descriptor was returned.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbGetDeviceDescriptor (
+  IN  EFI_USB_IO_PROTOCOL        *This,
+  OUT EFI_USB_DEVICE_DESCRIPTOR  *DeviceDescriptor
+  )
+{
+  CopyMem (DeviceDescriptor, &FAKE_USB_DEVICE_FROM_USB_IO (This)->DeviceDescriptor, sizeof (*DeviceDescriptor));
+  return EFI_SUCCESS;
+}
+
+/**
+  Return the interface descriptor.
+
+  @param  This                The USB I/O protocol.
+  @param  InterfaceDescriptor Receives the descriptor.
+
+  @retval EFI_SUCCESS   The descriptor was returned.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbGetInterfaceDescriptor (
+  IN  EFI_USB_IO_PROTOCOL           *This,
+  OUT EFI_USB_INTERFACE_DESCRIPTOR  *InterfaceDescriptor
+  )
+{
+  CopyMem (InterfaceDescriptor, &FAKE_USB_DEVICE_FROM_USB_IO (This)->InterfaceDescriptor, sizeof (*InterfaceDescriptor));
+  return EFI_SUCCESS;
+}
+
+/**
+  Return an endpoint descriptor.
+
+  @param  This                The USB I/O protocol.
+  @param  EndpointIndex       The index of the endpoint.
+  @param  EndpointDescriptor  Receives the descriptor.
+
+  @retval EFI_SUCCESS           The descriptor was returned.
+  @retval EFI_NOT_FOUND         The endpoint does not exist.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+FakeUsbGetEndpointDescriptor (
+  IN  EFI_USB_IO_PROTOCOL          *This,
+  IN  UINT8                        EndpointIndex,
+  OUT EFI_USB_ENDPOINT_DESCRIPTOR  *EndpointDescriptor
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+
+  Device = FAKE_USB_DEVICE_FROM_USB_IO (This);
+  if (EndpointIndex >= ARRAY_SIZE (Device->Endpoints)) {
+    return EFI_NOT_FOUND;
+  }
+
+  CopyMem (EndpointDescriptor, &Device->Endpoints[EndpointIndex], sizeof (*EndpointDescriptor));
+  return EFI_SUCCESS;
+}
+
+/**
+  Create a handle with a fake USB I/O and device path protocol.
+
+  @param  VendorId          The vendor ID of the device descriptor.
+  @param  ProductId         The product ID of the device descriptor.
+  @param  InterfaceClass    The class of the interface descriptor.
+  @param  InterfaceSubClass The subclass of the interface descriptor.
+  @param  InterfaceProtocol The protocol of the interface descriptor.
+  @param  Port              The port number in the device path.
+  @param  Controller        Receives the handle.
+
+  @retval EFI_SUCCESS           The device was created.
+  @retval EFI_OUT_OF_RESOURCES  The device could not be allocated.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbCreateDevice (
+  IN  UINT16      VendorId,
+  IN  UINT16      ProductId,
+  IN  UINT8       InterfaceClass,
+  IN  UINT8       InterfaceSubClass,
+  IN  UINT8       InterfaceProtocol,
+  IN  UINT8       Port,
+  OUT EFI_HANDLE  *Controller
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+  EFI_STATUS       Status;
+  UINTN            Index;
+
+  Device = calloc (1, sizeof (FAKE_USB_DEVICE));
+  if (Device == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Device->Signature                       = FAKE_USB_DEVICE_SIGNATURE;
+  Device->UsbIo.UsbControlTransfer        = FakeUsbControlTransfer;
+  Device->UsbIo.UsbAsyncInterruptTransfer = FakeUsbAsyncInterruptTransfer;
+  Device->UsbIo.UsbSyncInterruptTransfer  = FakeUsbSyncInterruptTransfer;
+  Device->UsbIo.UsbGetDeviceDescriptor    = FakeUsbGetDeviceDescriptor;
+  Device->UsbIo.UsbGetInterfaceDescriptor = FakeUsbGetInterfaceDescriptor;
+  Device->UsbIo.UsbGetEndpointDescriptor  = FakeUsbGetEndpointDescriptor;
+
+  Device->DeviceDescriptor.Length            = sizeof (EFI_USB_DEVICE_DESCRIPTOR);
+  Device->DeviceDescriptor.DescriptorType    = USB_DESC_TYPE_DEVICE;
+  Device->DeviceDescriptor.IdVendor          = VendorId;
+  Device->DeviceDescriptor.IdProduct         = ProductId;
+  Device->DeviceDescriptor.NumConfigurations = 1;
+
+  Device->InterfaceDescriptor.Length            = sizeof (EFI_USB_INTERFACE_DESCRIPTOR);
+  Device->InterfaceDescriptor.DescriptorType    = USB_DESC_TYPE_INTERFACE;
+  Device->InterfaceDescriptor.NumEndpoints      = (UINT8)ARRAY_SIZE (Device->Endpoints);
+  Device->InterfaceDescriptor.InterfaceClass    = InterfaceClass;
+  Device->InterfaceDescriptor.InterfaceSubClass = InterfaceSubClass;
+  Device->InterfaceDescriptor.InterfaceProtocol = InterfaceProtocol;
+
+  for (Index = 0; Index < ARRAY_SIZE (Device->Endpoints); Index++) {
+    Device->Endpoints[Index].Length         = sizeof (EFI_USB_ENDPOINT_DESCRIPTOR);
+    Device->Endpoints[Index].DescriptorType = USB_DESC_TYPE_ENDPOINT;
+    Device->Endpoints[Index].Attributes     = USB_ENDPOINT_INTERRUPT;
+    Device->Endpoints[Index].MaxPacketSize  = 32;
+    Device->Endpoints[Index].Interval       = 4;
+  }
+
+  Device->Endpoints[0].EndpointAddress = USB_ENDPOINT_DIR_IN | 1;
+  Device->Endpoints[1].EndpointAddress = 1;
+
+  Device->DevicePath.Usb.Header.Type      = MESSAGING_DEVICE_PATH;
+  Device->DevicePath.Usb.Header.SubType   = MSG_USB_DP;
+  Device->DevicePath.Usb.Header.Length[0] = (UINT8)sizeof (USB_DEVICE_PATH);
+  Device->DevicePath.Usb.ParentPortNumber = Port;
+  Device->DevicePath.End.Type             = END_DEVICE_PATH_TYPE;
+  Device->DevicePath.End.SubType          = END_ENTIRE_DEVICE_PATH_SUBTYPE;
+  Device->DevicePath.End.Length[0]        = (UINT8)sizeof (EFI_DEVICE_PATH_PROTOCOL);
+
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &Device->Handle,
+                  &gEfiUsbIoProtocolGuid,
+                  &Device->UsbIo,
+                  &gEfiDevicePathProtocolGuid,
+                  &Device->DevicePath,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    free (Device);
+    return Status;
+  }
+
+  InsertTailList (&mUsbDevices, &Device->Link);
+  *Controller = Device->Handle;
+  return EFI_SUCCESS;
+}
+
+/**
+  Remove a handle created by FakeUsbCreateDevice().
+
+  @param  Controller        The handle of the device.
+
+  @retval EFI_SUCCESS       The device was removed.
+  @retval EFI_ACCESS_DENIED The USB I/O protocol is still opened by a driver.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbDestroyDevice (
+  IN EFI_HANDLE  Controller
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+  EFI_STATUS       Status;
+
+  Device = FakeFindUsbDevice (Controller);
+  if (Device == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = gBS->UninstallMultipleProtocolInterfaces (
+                  Controller,
+                  &gEfiUsbIoProtocolGuid,
+                  &Device->UsbIo,
+                  &gEfiDevicePathProtocolGuid,
+                  &Device->DevicePath,
+                  NULL
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  RemoveEntryList (&Device->Link);
+  Device->Signature = 0;
+  free (Device);
+  return EFI_SUCCESS;
+}
+
+/**
+  Complete the asynchronous interrupt transfer of a fake device with a report.
+
+  @param  Controller        The handle of the device.
+  @param  Report            The report data.
+  @param  Length            The length of Report.
+
+  @retval EFI_SUCCESS       The report was delivered.
+  @retval EFI_NOT_READY     No asynchronous interrupt transfer is active.
+  @retval EFI_NOT_FOUND     Controller is not a fake USB device.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbSendReport (
+  IN EFI_HANDLE  Controller,
+  IN VOID        *Report,
+  IN UINTN       Length
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+  EFI_TPL          OldTpl;
+
+  Device = FakeFindUsbDevice (Controller);
+  if (Device == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (!Device->AsyncActive) {
+    return EFI_NOT_READY;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Device->AsyncCallBack (Report, Length, Device->AsyncContext, EFI_USB_NOERROR);
+  gBS->RestoreTPL (OldTpl);
+  return EFI_SUCCESS;
+}
+
+/**
+  Count the transfers a fake device has seen.
+
+  @param  Controller        The handle of the device.
+  @param  ControlTransfers  Receives the number of control transfers.
+  @param  ActiveAsync       Receives TRUE if an asynchronous interrupt transfer is active.
+
+  @retval EFI_SUCCESS       The counters were returned.
+  @retval EFI_NOT_FOUND     Controller is not a fake USB device.
+
+**/
+EFI_STATUS
+EFIAPI
+FakeUsbGetTransferStats (
+  IN  EFI_HANDLE  Controller,
+  OUT UINTN       *ControlTransfers,
+  OUT BOOLEAN     *ActiveAsync
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+
+  Device = FakeFindUsbDevice (Controller);
+  if (Device == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  *ControlTransfers = Device->ControlTransfers;
+  *ActiveAsync      = Device->AsyncActive;
+  return EFI_SUCCESS;
+}
+
+/**
+  Drop every fake USB device.
+
+  The handles are already gone, FakeUefiServicesReset() drops them first.
+
+**/
+VOID
+FakeResetUsbDevices (
+  VOID
+  )
+{
+  FAKE_USB_DEVICE  *Device;
+
+  while (!IsListEmpty (&mUsbDevices)) {
+    Device = BASE_CR (GetFirstNode (&mUsbDevices), FAKE_USB_DEVICE, Link);
+    RemoveEntryList (&Device->Link);
+    free (Device);
+  }
+}
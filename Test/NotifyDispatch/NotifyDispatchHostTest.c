@@ -0,0 +1,480 @@
+/** @file
+  Host-based benchmark of the key notification dispatch.
+
+  For 1, 10, 100 and 1000 registrations, spread over 64 keys with a mix of
+  wildcard and exact shift and toggle states, it times RegisterKeyNotify(),
+  UnregisterKeyNotify() and SignalKeyNotify() for a stream of keys of which
+  about half were never registered. Every notification function a key
+  matches must be called exactly once.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "../Common/TestDevice.h"
+
+#include <Library/UnitTestLib.h>
+
+#define UNIT_TEST_NAME     "USB Xbox 360 key notification dispatch host test"
+#define UNIT_TEST_VERSION  "1.0"
+
+#define NOTIFY_MAX_REGISTRATIONS  1000
+#define NOTIFY_REGISTERED_KEYS    64
+#define NOTIFY_OTHER_KEYS         54
+#define NOTIFY_STREAM_KEYS        16384
+
+//
+// Every time is measured in this many passes and the fastest pass is
+// reported, which filters out host scheduling noise.
+//
+#define NOTIFY_PASSES  5
+
+//
+// Keys signaled per TPL_NOTIFY section; the notify queue holds
+// MAX_EFI_KEY_ALLOWED keys until KeyNotifyProcessHandler() runs.
+//
+#define NOTIFY_BATCH_KEYS  32
+
+//
+// Registrations made and removed per size, to time the short lists.
+//
+#define NOTIFY_REGISTRATION_CALLS  8192
+
+STATIC CONST UINTN  mRegistrationCounts[] = { 1, 10, 100, NOTIFY_MAX_REGISTRATIONS };
+
+STATIC EFI_KEY_DATA  mRegistrations[NOTIFY_MAX_REGISTRATIONS];
+STATIC VOID          *mNotifyHandles[NOTIFY_MAX_REGISTRATIONS];
+STATIC EFI_KEY_DATA  mStream[NOTIFY_STREAM_KEYS];
+STATIC UINT64        mNotifyCount;
+
+/**
+  Key notification function counting its calls.
+
+  @param  KeyData       The keystroke.
+
+  @retval EFI_SUCCESS   Always.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+NotifyCounter (
+  IN EFI_KEY_DATA  *KeyData
+  )
+{
+  mNotifyCount++;
+  return EFI_SUCCESS;
+}
+
+/**
+  Return one of the keys registrations are made for.
+
+  @param  Index         The index of the key, below NOTIFY_REGISTERED_KEYS.
+  @param  Key           Receives the key.
+
+**/
+STATIC
+VOID
+NotifyRegisteredKey (
+  IN  UINTN          Index,
+  OUT EFI_INPUT_KEY  *Key
+  )
+{
+  Key->ScanCode    = SCAN_NULL;
+  Key->UnicodeChar = CHAR_NULL;
+  if (Index < 26) {
+    Key->UnicodeChar = (CHAR16)(L'a' + Index);
+  } else if (Index < 52) {
+    Key->UnicodeChar = (CHAR16)(L'A' + Index - 26);
+  } else if (Index < 62) {
+    Key->UnicodeChar = (CHAR16)(L'0' + Index - 52);
+  } else {
+    Key->ScanCode = (UINT16)(SCAN_F1 + Index - 62);
+  }
+}
+
+/**
+  Return one of the keys nobody registers: punctuation, and the scan codes up
+  to SCAN_ESC other than F1 and F2.
+
+  @param  Index         The index of the key, below NOTIFY_OTHER_KEYS.
+  @param  Key           Receives the key.
+
+**/
+STATIC
+VOID
+NotifyOtherKey (
+  IN  UINTN          Index,
+  OUT EFI_INPUT_KEY  *Key
+  )
+{
+  STATIC CONST CHAR8  Punctuation[] = " !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+
+  Key->ScanCode    = SCAN_NULL;
+  Key->UnicodeChar = CHAR_NULL;
+  if (Index < sizeof (Punctuation) - 1) {
+    Key->UnicodeChar = (CHAR16)Punctuation[Index];
+  } else {
+    Key->ScanCode = (UINT16)(SCAN_UP + Index - (sizeof (Punctuation) - 1));
+    if (Key->ScanCode >= SCAN_F1) {
+      Key->ScanCode += 2;
+    }
+  }
+}
+
+/**
+  Build the registrations.
+
+  Registration Index is for key Index % NOTIFY_REGISTERED_KEYS in round
+  Index / NOTIFY_REGISTERED_KEYS. In the first round, every other key has a
+  wildcard shift state and an exact toggle state, and the others an exact
+  shift state and a wildcard toggle state. Later rounds use a different exact
+  shift state per round, so no registration repeats an earlier one.
+
+**/
+STATIC
+VOID
+NotifyBuildRegistrations (
+  VOID
+  )
+{
+  UINTN  Index;
+  UINTN  Round;
+
+  ZeroMem (mRegistrations, sizeof (mRegistrations));
+  for (Index = 0; Index < NOTIFY_MAX_REGISTRATIONS; Index++) {
+    Round = Index / NOTIFY_REGISTERED_KEYS;
+    NotifyRegisteredKey (Index % NOTIFY_REGISTERED_KEYS, &mRegistrations[Index].Key);
+    if ((Round == 0) && ((Index % 2) != 0)) {
+      mRegistrations[Index].KeyState.KeyToggleState = EFI_TOGGLE_STATE_VALID | EFI_KEY_STATE_EXPOSED;
+    } else {
+      mRegistrations[Index].KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID | (UINT32)(Round + 1);
+    }
+  }
+}
+
+/**
+  Build the stream of keys to signal.
+
+  Half of the keys come from the registered keys and half from the keys
+  nobody registers. The shift state takes the same values as the registrations.
+  Every key goes through PackKeyData() and UnpackKeyData(), so it is the
+  keystroke KeyNotifyProcessHandler() matches.
+
+  @param  UsbKeyboardDevice   The USB_KB_DEV instance.
+
+**/
+STATIC
+VOID
+NotifyBuildStream (
+  IN USB_KB_DEV  *UsbKeyboardDevice
+  )
+{
+  EFI_KEY_DATA  KeyData;
+  UINT32        Random;
+  UINT32        Pick;
+  UINTN         Index;
+
+  Random = 0x6B43A9B5;
+  for (Index = 0; Index < NOTIFY_STREAM_KEYS; Index++) {
+    ZeroMem (&KeyData, sizeof (KeyData));
+    Pick = TestRandom (&Random) % (2 * NOTIFY_REGISTERED_KEYS);
+    if (Pick < NOTIFY_REGISTERED_KEYS) {
+      NotifyRegisteredKey (Pick, &KeyData.Key);
+    } else {
+      NotifyOtherKey ((Pick - NOTIFY_REGISTERED_KEYS) % NOTIFY_OTHER_KEYS, &KeyData.Key);
+    }
+
+    KeyData.KeyState.KeyShiftState = EFI_SHIFT_STATE_VALID | (TestRandom (&Random) % 17);
+    UnpackKeyData (PackKeyData (&KeyData), &mStream[Index]);
+  }
+}
+
+/**
+  Register the first Count registrations.
+
+  @param  UsbKeyboardDevice   The USB_KB_DEV instance.
+  @param  Count               The number of registrations.
+
+  @retval EFI_SUCCESS   All were registered.
+  @retval Others        A registration failed.
+
+**/
+STATIC
+EFI_STATUS
+NotifyRegister (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINTN       Count
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+
+  for (Index = 0; Index < Count; Index++) {
+    Status = UsbKeyboardDevice->SimpleInputEx.RegisterKeyNotify (
+                                                &UsbKeyboardDevice->SimpleInputEx,
+                                                &mRegistrations[Index],
+                                                NotifyCounter,
+                                                &mNotifyHandles[Index]
+                                                );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Unregister the first Count registrations, last one first.
+
+  @param  UsbKeyboardDevice   The USB_KB_DEV instance.
+  @param  Count               The number of registrations.
+
+  @retval EFI_SUCCESS   All were unregistered.
+  @retval Others        An unregistration failed.
+
+**/
+STATIC
+EFI_STATUS
+NotifyUnregister (
+  IN USB_KB_DEV  *UsbKeyboardDevice,
+  IN UINTN       Count
+  )
+{
+  EFI_STATUS  Status;
+  UINTN       Index;
+
+  for (Index = Count; Index > 0; Index--) {
+    Status = UsbKeyboardDevice->SimpleInputEx.UnregisterKeyNotify (
+                                                &UsbKeyboardDevice->SimpleInputEx,
+                                                mNotifyHandles[Index - 1]
+                                                );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Format a time in picoseconds per operation as nanoseconds with one decimal.
+
+  @param  Buffer        Receives the text.
+  @param  BufferSize    The size of Buffer in bytes.
+  @param  Picoseconds   The time per operation, in picoseconds.
+
+  @return Buffer.
+
+**/
+STATIC
+CHAR8 *
+NotifyFormatTime (
+  OUT CHAR8   *Buffer,
+  IN  UINTN   BufferSize,
+  IN  UINT64  Picoseconds
+  )
+{
+  Picoseconds = DivU64x32 (Picoseconds + 50, 100);
+  AsciiSPrint (Buffer, BufferSize, "%lu.%lu ns", DivU64x32 (Picoseconds, 10), ModU64x32 (Picoseconds, 10));
+  return Buffer;
+}
+
+/**
+  Time registration, unregistration and dispatch for each number of
+  registrations, and check that every matching notification is delivered.
+
+  @param  Context       Not used.
+
+  @retval UNIT_TEST_PASSED              Every matching notification was delivered once.
+  @retval UNIT_TEST_ERROR_TEST_FAILED   A call failed or a notification was lost or repeated.
+
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DispatchScalesWithRegistrations (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  EFI_HANDLE  Controller;
+  USB_KB_DEV  *UsbKeyboardDevice;
+  EFI_TPL     OldTpl;
+  UINTN       SizeIndex;
+  UINTN       Count;
+  UINTN       Rounds;
+  UINTN       Round;
+  UINTN       Pass;
+  UINTN       Index;
+  UINTN       Key;
+  UINTN       Matches;
+  UINT64      Expected;
+  UINT64      Hits;
+  UINT64      Begin;
+  UINT64      RegisterTime;
+  UINT64      UnregisterTime;
+  UINT64      DispatchTime;
+  UINT64      PassRegister;
+  UINT64      PassUnregister;
+  UINT64      PassDispatch;
+  CHAR8       DispatchText[32];
+  CHAR8       RegisterText[32];
+  CHAR8       UnregisterText[32];
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStart (1, &Controller, &UsbKeyboardDevice));
+
+  NotifyBuildRegistrations ();
+  NotifyBuildStream (UsbKeyboardDevice);
+
+  for (SizeIndex = 0; SizeIndex < ARRAY_SIZE (mRegistrationCounts); SizeIndex++) {
+    Count = mRegistrationCounts[SizeIndex];
+
+    //
+    // Expected notifications, by matching every key against every
+    // registration.
+    //
+    Expected = 0;
+    Hits     = 0;
+    for (Key = 0; Key < NOTIFY_STREAM_KEYS; Key++) {
+      Matches = 0;
+      for (Index = 0; Index < Count; Index++) {
+        if (IsKeyRegistered (&mRegistrations[Index], &mStream[Key])) {
+          Matches++;
+        }
+      }
+
+      Expected += Matches;
+      if (Matches != 0) {
+        Hits++;
+      }
+    }
+
+    Rounds         = MAX (NOTIFY_REGISTRATION_CALLS / Count, 1);
+    RegisterTime   = MAX_UINT64;
+    UnregisterTime = MAX_UINT64;
+    for (Pass = 0; Pass < NOTIFY_PASSES; Pass++) {
+      PassRegister   = 0;
+      PassUnregister = 0;
+      for (Round = 0; Round < Rounds; Round++) {
+        Begin = GetPerformanceCounter ();
+        UT_ASSERT_NOT_EFI_ERROR (NotifyRegister (UsbKeyboardDevice, Count));
+        PassRegister += GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+
+        Begin = GetPerformanceCounter ();
+        UT_ASSERT_NOT_EFI_ERROR (NotifyUnregister (UsbKeyboardDevice, Count));
+        PassUnregister += GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+      }
+
+      RegisterTime   = MIN (RegisterTime, PassRegister);
+      UnregisterTime = MIN (UnregisterTime, PassUnregister);
+    }
+
+    //
+    // SignalKeyNotify() runs at TPL_NOTIFY from the timer handler; the
+    // notification functions run when the TPL drops to TPL_CALLBACK, outside
+    // the timed section.
+    //
+    UT_ASSERT_NOT_EFI_ERROR (NotifyRegister (UsbKeyboardDevice, Count));
+    mNotifyCount = 0;
+    DispatchTime = MAX_UINT64;
+    for (Pass = 0; Pass < NOTIFY_PASSES; Pass++) {
+      PassDispatch = 0;
+      for (Key = 0; Key < NOTIFY_STREAM_KEYS; Key += NOTIFY_BATCH_KEYS) {
+        OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+        Begin  = GetPerformanceCounter ();
+        for (Index = Key; Index < Key + NOTIFY_BATCH_KEYS; Index++) {
+          SignalKeyNotify (UsbKeyboardDevice, &mStream[Index]);
+        }
+
+        PassDispatch += GetTimeInNanoSecond (GetPerformanceCounter () - Begin);
+        gBS->RestoreTPL (OldTpl);
+      }
+
+      DispatchTime = MIN (DispatchTime, PassDispatch);
+    }
+
+    UT_ASSERT_NOT_EFI_ERROR (NotifyUnregister (UsbKeyboardDevice, Count));
+
+    UT_LOG_INFO (
+      "%4lu registrations: SignalKeyNotify %a/key, RegisterKeyNotify %a, UnregisterKeyNotify %a; %lu of %lu keys matched, %lu notifications per pass\n",
+      (UINT64)Count,
+      NotifyFormatTime (DispatchText, sizeof (DispatchText), DivU64x32 (MultU64x32 (DispatchTime, 1000), NOTIFY_STREAM_KEYS)),
+      NotifyFormatTime (RegisterText, sizeof (RegisterText), DivU64x32 (MultU64x32 (RegisterTime, 1000), (UINT32)(Rounds * Count))),
+      NotifyFormatTime (UnregisterText, sizeof (UnregisterText), DivU64x32 (MultU64x32 (UnregisterTime, 1000), (UINT32)(Rounds * Count))),
+      Hits,
+      (UINT64)NOTIFY_STREAM_KEYS,
+      DivU64x32 (mNotifyCount, NOTIFY_PASSES)
+      );
+
+    UT_ASSERT_EQUAL (mNotifyCount, MultU64x32 (Expected, NOTIFY_PASSES));
+  }
+
+  UT_ASSERT_NOT_EFI_ERROR (TestDeviceStop (Controller));
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Initialize the unit test framework, suite, and unit tests for the key
+  notification dispatch and run them.
+
+  @retval  EFI_SUCCESS           All test cases were dispatched.
+  @retval  EFI_OUT_OF_RESOURCES  There are not enough resources available to
+                                 initialize the unit tests.
+**/
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      NotifySuite;
+
+  Framework = NULL;
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+  Status = TestDriverLoad ();
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&NotifySuite, Framework, "Key Notification Dispatch Tests", "UsbXbox360.NotifyDispatch", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in CreateUnitTestSuite for the notify suite\n"));
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (NotifySuite, "Dispatch cost for 1 to 1000 registrations", "DispatchScalesWithRegistrations", DispatchScalesWithRegistrations, NULL, NULL, NULL);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+/**
+  Standard POSIX C entry point for host based unit test execution.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UefiTestMain ();
+}
@@ -0,0 +1,160 @@
+/** @file
+  Trace ring for the USB Xbox 360 controller driver.
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "EfiKey.h"
+
+typedef struct {
+  UINT32         Category;
+  CONST CHAR8    *Format;
+  UINT64         Arg[3];
+} USBKBD_TRACE_ENTRY;
+
+UINT32  gUsbKbdTraceMask = USBKBD_TRACE_COMPILE_MASK;
+
+STATIC USBKBD_TRACE_ENTRY  mTraceRing[USBKBD_TRACE_RING_SIZE];
+STATIC UINTN               mTraceHead;
+STATIC UINTN               mTraceTail;
+STATIC UINTN               mTraceDropped;
+STATIC EFI_EVENT           mTraceDrainEvent;
+
+/**
+  Print the recorded trace points through DEBUG().
+
+  @param  Event             The drain event.
+  @param  Context           Not used.
+
+**/
+STATIC
+VOID
+EFIAPI
+UsbKbdTraceDrain (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  USBKBD_TRACE_ENTRY  Entry;
+  UINTN               Dropped;
+  EFI_TPL             OldTpl;
+
+  for ( ; ;) {
+    //
+    // Trace points are recorded at TPL_NOTIFY, copy one entry out under the same TPL.
+    //
+    OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+    if (mTraceHead == mTraceTail) {
+      Dropped       = mTraceDropped;
+      mTraceDropped = 0;
+      gBS->RestoreTPL (OldTpl);
+      break;
+    }
+
+    CopyMem (&Entry, &mTraceRing[mTraceHead], sizeof (Entry));
+    mTraceHead = (mTraceHead + 1) % USBKBD_TRACE_RING_SIZE;
+    gBS->RestoreTPL (OldTpl);
+
+    DEBUG ((DEBUG_INFO, Entry.Format, Entry.Arg[0], Entry.Arg[1], Entry.Arg[2]));
+  }
+
+  if (Dropped != 0) {
+    DEBUG ((DEBUG_INFO, "UsbXbox360: %u trace entries dropped\n", (UINT32)Dropped));
+  }
+}
+
+/**
+  Create the event which drains the trace ring.
+
+  @retval EFI_SUCCESS       The trace ring is ready, or tracing is compiled out.
+  @retval Others            The drain event cannot be created.
+
+**/
+EFI_STATUS
+UsbKbdTraceInit (
+  VOID
+  )
+{
+  if (USBKBD_TRACE_COMPILE_MASK == 0) {
+    return EFI_SUCCESS;
+  }
+
+  return gBS->CreateEvent (
+                EVT_NOTIFY_SIGNAL,
+                TPL_CALLBACK,
+                UsbKbdTraceDrain,
+                NULL,
+                &mTraceDrainEvent
+                );
+}
+
+/**
+  Select the trace categories recorded at runtime.
+
+  @param  Mask          The categories to record, USBKBD_TRACE_*. Categories
+                        which are not compiled in are ignored.
+
+  @return The categories recorded so far.
+
+**/
+UINT32
+UsbKbdTraceSetMask (
+  IN UINT32  Mask
+  )
+{
+  UINT32  OldMask;
+
+  OldMask          = gUsbKbdTraceMask;
+  gUsbKbdTraceMask = Mask & USBKBD_TRACE_COMPILE_MASK;
+  return OldMask;
+}
+
+/**
+  Record a trace point into the trace ring.
+
+  If the ring is full, the trace point is dropped and counted.
+
+  @param  Category          The trace category.
+  @param  Format            The DEBUG() format string.
+  @param  Arg0              The first argument of Format.
+  @param  Arg1              The second argument of Format.
+  @param  Arg2              The third argument of Format.
+
+**/
+VOID
+UsbKbdTraceRecord (
+  IN UINT32       Category,
+  IN CONST CHAR8  *Format,
+  IN UINT64       Arg0,
+  IN UINT64       Arg1,
+  IN UINT64       Arg2
+  )
+{
+  USBKBD_TRACE_ENTRY  *Entry;
+  UINTN               NextTail;
+  EFI_TPL             OldTpl;
+
+  if (mTraceDrainEvent == NULL) {
+    return;
+  }
+
+  OldTpl   = gBS->RaiseTPL (TPL_NOTIFY);
+  NextTail = (mTraceTail + 1) % USBKBD_TRACE_RING_SIZE;
+  if (NextTail == mTraceHead) {
+    mTraceDropped++;
+  } else {
+    Entry           = &mTraceRing[mTraceTail];
+    Entry->Category = Category;
+    Entry->Format   = Format;
+    Entry->Arg[0]   = Arg0;
+    Entry->Arg[1]   = Arg1;
+    Entry->Arg[2]   = Arg2;
+    mTraceTail      = NextTail;
+  }
+
+  gBS->RestoreTPL (OldTpl);
+
+  gBS->SignalEvent (mTraceDrainEvent);
+}
@@ -0,0 +1,115 @@
+/** @file
+  Categorized trace points for the USB Xbox 360 controller driver.
+
+  Trace points are recorded into an in-memory ring and printed through DEBUG()
+  from a TPL_CALLBACK event, so they never write to the debug port from
+  KeyboardHandler() or the timer handler.
+
+  A category is compiled in only if it is set in PcdUsbXbox360TraceCompileMask,
+  and recorded only if it is also set in gUsbKbdTraceMask at runtime, which
+  SetTraceMask() of the USB Xbox 360 protocol changes. With the default compile
+  mask of 0 the compiler drops every USBKBD_TRACE().
+
+Copyright (c) 2025, Chenx Dust. All rights reserved.<BR>
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _USB_KB_TRACE_H_
+#define _USB_KB_TRACE_H_
+
+#include <Uefi.h>
+
+#include <Protocol/UsbXbox360.h>
+
+#include <Library/PcdLib.h>
+
+//
+// Trace categories
+//
+#define USBKBD_TRACE_REPORT     USB_XBOX360_TRACE_REPORT     // Raw interrupt reports
+#define USBKBD_TRACE_DIFF       USB_XBOX360_TRACE_DIFF       // Button transitions found in a report
+#define USBKBD_TRACE_QUEUE      USB_XBOX360_TRACE_QUEUE      // Key queue overflow and drops
+#define USBKBD_TRACE_TRANSLATE  USB_XBOX360_TRACE_TRANSLATE  // USB keycode to EFI_INPUT_KEY translation
+#define USBKBD_TRACE_NOTIFY     USB_XBOX360_TRACE_NOTIFY     // Key notify dispatch
+#define USBKBD_TRACE_LAYOUT     USB_XBOX360_TRACE_LAYOUT     // Keyboard layout changes
+#define USBKBD_TRACE_RECOVERY   USB_XBOX360_TRACE_RECOVERY   // Transfer errors and recovery
+#define USBKBD_TRACE_ALL        0x7F
+
+#define USBKBD_TRACE_COMPILE_MASK  (FixedPcdGet32 (PcdUsbXbox360TraceCompileMask) & USBKBD_TRACE_ALL)
+
+#define USBKBD_TRACE_RING_SIZE  64
+
+///
+/// Categories recorded at runtime, a subset of USBKBD_TRACE_COMPILE_MASK.
+///
+extern UINT32  gUsbKbdTraceMask;
+
+//
+// Format is a DEBUG() format string which must stay valid for the lifetime of the
+// driver, normally a string literal. Three arguments are always recorded; each is
+// widened to UINT64, so print them with %lx or %lu. Pass 0 for unused arguments.
+//
+#define USBKBD_TRACE(Category, Format, Arg0, Arg1, Arg2)        \
+  do {                                                          \
+    if ((((Category) & (USBKBD_TRACE_COMPILE_MASK)) != 0) &&    \
+        (((Category) & gUsbKbdTraceMask) != 0))                 \
+    {                                                           \
+      UsbKbdTraceRecord (                                       \
+        (Category),                                             \
+        (Format),                                               \
+        (UINT64)(Arg0),                                         \
+        (UINT64)(Arg1),                                         \
+        (UINT64)(Arg2)                                          \
+        );                                                      \
+    }                                                           \
+  } while (FALSE)
+
+/**
+  Create the event which drains the trace ring.
+
+  @retval EFI_SUCCESS       The trace ring is ready, or tracing is compiled out.
+  @retval Others            The drain event cannot be created.
+
+**/
+EFI_STATUS
+UsbKbdTraceInit (
+  VOID
+  );
+
+/**
+  Select the trace categories recorded at runtime.
+
+  @param  Mask          The categories to record, USBKBD_TRACE_*. Categories
+                        which are not compiled in are ignored.
+
+  @return The categories recorded so far.
+
+**/
+UINT32
+UsbKbdTraceSetMask (
+  IN UINT32  Mask
+  );
+
+/**
+  Record a trace point into the trace ring.
+
+  If the ring is full, the trace point is dropped and counted.
+
+  @param  Category          The trace category.
+  @param  Format            The DEBUG() format string.
+  @param  Arg0              The first argument of Format.
+  @param  Arg1              The second argument of Format.
+  @param  Arg2              The third argument of Format.
+
+**/
+VOID
+UsbKbdTraceRecord (
+  IN UINT32       Category,
+  IN CONST CHAR8  *Format,
+  IN UINT64       Arg0,
+  IN UINT64       Arg1,
+  IN UINT64       Arg2
+  );
+
+#endif